@@ -0,0 +1,446 @@
+//
+// Created by ysh on 24-6-27.
+//
+// $(( )) 整数算术，64 位有符号整数，运算符和优先级与 bash 相同。
+// 递归下降求值，&& || ?: 不会执行的一侧只做语法检查，不赋值也不报除以 0。
+//
+
+#include "arith.h"
+#include "vars.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#define MAX_ARITH_DEPTH 64 // 变量的值也是表达式，防止互相引用时无限递归
+
+typedef struct ArithParser {
+    const char *expr; // 完整的表达式，用于错误信息
+    const char *p;
+    int skip;         // 大于 0 时只解析不求值
+    int depth;
+    jmp_buf error;
+} ArithParser;
+
+static long long parse_comma(ArithParser *ap);
+static long long parse_assign(ArithParser *ap);
+
+static void arith_error(ArithParser *ap, const char *message) {
+    if (*ap->p != '\0') {
+        fprintf(stderr, "lsh: %s: %s (错误的记号是 \"%s\")\n", ap->expr, message, ap->p);
+    } else {
+        fprintf(stderr, "lsh: %s: %s\n", ap->expr, message);
+    }
+    longjmp(ap->error, 1);
+}
+
+static void skip_space(ArithParser *ap) {
+    while (isspace((unsigned char) *ap->p)) {
+        ap->p++;
+    }
+}
+
+// 当前位置是否为运算符 op，是则跳过
+static bool accept(ArithParser *ap, const char *op) {
+    skip_space(ap);
+    size_t len = strlen(op);
+    if (strncmp(ap->p, op, len) != 0) {
+        return false;
+    }
+    // 复合赋值 (+= <<= ...) 以及 && || << >> ** 不能拆开
+    char next = ap->p[len];
+    if ((op[len - 1] != '=' && next == '=') || (len == 1 && strchr("&|<>*", op[0]) != NULL && next == op[0])) {
+        return false;
+    }
+    ap->p += len;
+    return true;
+}
+
+// 按补码回绕的加减乘，避免有符号溢出的未定义行为
+static long long wrap_add(long long a, long long b) {
+    return (long long) ((unsigned long long) a + (unsigned long long) b);
+}
+
+static long long wrap_sub(long long a, long long b) {
+    return (long long) ((unsigned long long) a - (unsigned long long) b);
+}
+
+static long long wrap_mul(long long a, long long b) {
+    return (long long) ((unsigned long long) a * (unsigned long long) b);
+}
+
+static long long binary_op(ArithParser *ap, const char *op, long long a, long long b) {
+    if (ap->skip > 0) {
+        return 0;
+    }
+    switch (op[0]) {
+        case '+':
+            return wrap_add(a, b);
+        case '-':
+            return wrap_sub(a, b);
+        case '*':
+            if (op[1] == '*') {
+                if (b < 0) {
+                    arith_error(ap, "指数小于 0");
+                }
+                long long result = 1;
+                while (b-- > 0) {
+                    result = wrap_mul(result, a);
+                }
+                return result;
+            }
+            return wrap_mul(a, b);
+        case '/':
+        case '%':
+            if (b == 0) {
+                arith_error(ap, "除以 0");
+            }
+            if (a == INT64_MIN && b == -1) {
+                return op[0] == '/' ? a : 0;
+            }
+            return op[0] == '/' ? a / b : a % b;
+        case '<':
+            return (long long) ((unsigned long long) a << (b & 63));
+        case '>':
+            return a >> (b & 63);
+        case '&':
+            return a & b;
+        case '^':
+            return a ^ b;
+        case '|':
+            return a | b;
+        default:
+            return 0;
+    }
+}
+
+// 把字符串解析成数字：十进制、0x 十六进制、0 开头八进制、base#digits
+static bool parse_number(const char *s, const char **end, long long *value) {
+    const char *p = s;
+    int base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (p[0] == '0') {
+        base = 8;
+    } else {
+        const char *hash = p;
+        while (isdigit((unsigned char) *hash)) {
+            hash++;
+        }
+        if (*hash == '#' && hash > p) {
+            base = atoi(p);
+            if (base < 2 || base > 36) {
+                return false;
+            }
+            p = hash + 1;
+        }
+    }
+    unsigned long long result = 0;
+    const char *digits = p;
+    for (;; p++) {
+        int d;
+        if (isdigit((unsigned char) *p)) {
+            d = *p - '0';
+        } else if (isalpha((unsigned char) *p)) {
+            d = tolower((unsigned char) *p) - 'a' + 10;
+        } else {
+            break;
+        }
+        if (d >= base) {
+            return false;
+        }
+        result = result * base + d;
+    }
+    if (p == digits && base != 8) {
+        return false;
+    }
+    *end = p;
+    *value = (long long) result;
+    return true;
+}
+
+// 变量的值：未设置或为空时是 0，否则把值当作表达式计算
+static long long variable_value(ArithParser *ap, const char *name) {
+    const char *value = var_get(name);
+    if (value == NULL || value[0] == '\0') {
+        return 0;
+    }
+    const char *end;
+    long long number;
+    if (parse_number(value, &end, &number) && *end == '\0') {
+        return number;
+    }
+    if (ap->depth >= MAX_ARITH_DEPTH) {
+        arith_error(ap, "表达式递归层数过多");
+    }
+    ArithParser sub = {.expr = value, .p = value, .depth = ap->depth + 1};
+    if (setjmp(sub.error) != 0) {
+        longjmp(ap->error, 1);
+    }
+    long long result = parse_comma(&sub);
+    skip_space(&sub);
+    if (*sub.p != '\0') {
+        arith_error(&sub, "算术表达式语法错误");
+    }
+    return result;
+}
+
+static void assign_variable(ArithParser *ap, const char *name, long long value) {
+    if (ap->skip > 0) {
+        return;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%lld", value);
+    var_set(name, text);
+}
+
+// 读取变量名，返回 malloc 出来的名字，不是变量名时返回 NULL
+static char *read_name(ArithParser *ap) {
+    skip_space(ap);
+    size_t len = 0;
+    while (is_var_name(ap->p, len + 1)) {
+        len++;
+    }
+    if (len == 0) {
+        return NULL;
+    }
+    char *name = strndup(ap->p, len);
+    ap->p += len;
+    return name;
+}
+
+static long long parse_unary(ArithParser *ap);
+
+// 数字、变量、括号，以及变量的后缀 ++ --
+static long long parse_primary(ArithParser *ap) {
+    skip_space(ap);
+    if (*ap->p == '(') {
+        ap->p++;
+        long long value = parse_comma(ap);
+        skip_space(ap);
+        if (*ap->p != ')') {
+            arith_error(ap, "缺少 \")\"");
+        }
+        ap->p++;
+        return value;
+    }
+    if (isdigit((unsigned char) *ap->p)) {
+        long long value;
+        const char *end;
+        if (!parse_number(ap->p, &end, &value) || is_var_name(end, 1)) {
+            arith_error(ap, "数值无效");
+        }
+        ap->p = end;
+        return value;
+    }
+    char *name = read_name(ap);
+    if (name == NULL) {
+        arith_error(ap, *ap->p ? "算术表达式语法错误" : "需要操作数");
+    }
+    long long value = ap->skip > 0 ? 0 : variable_value(ap, name);
+    skip_space(ap);
+    if (strncmp(ap->p, "++", 2) == 0 || strncmp(ap->p, "--", 2) == 0) {
+        assign_variable(ap, name, *ap->p == '+' ? wrap_add(value, 1) : wrap_sub(value, 1));
+        ap->p += 2;
+    }
+    free(name);
+    return value;
+}
+
+static long long parse_unary(ArithParser *ap) {
+    skip_space(ap);
+    if (strncmp(ap->p, "++", 2) == 0 || strncmp(ap->p, "--", 2) == 0) {
+        bool inc = *ap->p == '+';
+        ap->p += 2;
+        char *name = read_name(ap);
+        if (name == NULL) {
+            arith_error(ap, "++ 和 -- 需要变量");
+        }
+        long long value = ap->skip > 0 ? 0 : variable_value(ap, name);
+        value = inc ? wrap_add(value, 1) : wrap_sub(value, 1);
+        assign_variable(ap, name, value);
+        free(name);
+        return value;
+    }
+    if (*ap->p == '!' && ap->p[1] != '=') {
+        ap->p++;
+        return !parse_unary(ap);
+    }
+    if (*ap->p == '~') {
+        ap->p++;
+        return ~parse_unary(ap);
+    }
+    if (*ap->p == '-') {
+        ap->p++;
+        return wrap_sub(0, parse_unary(ap));
+    }
+    if (*ap->p == '+') {
+        ap->p++;
+        return parse_unary(ap);
+    }
+    return parse_primary(ap);
+}
+
+// ** 右结合
+static long long parse_power(ArithParser *ap) {
+    long long base = parse_unary(ap);
+    skip_space(ap);
+    if (strncmp(ap->p, "**", 2) == 0 && ap->p[2] != '=') {
+        ap->p += 2;
+        return binary_op(ap, "**", base, parse_power(ap));
+    }
+    return base;
+}
+
+// 从乘除到按位或的左结合二元运算，level 越大优先级越高
+static const char *binary_levels[][5] = {
+        {"|"},
+        {"^"},
+        {"&"},
+        {"==", "!="},
+        {"<=", ">=", "<", ">"},
+        {"<<", ">>"},
+        {"+", "-"},
+        {"*", "/", "%"},
+};
+
+#define NUM_BINARY_LEVELS (int) (sizeof(binary_levels) / sizeof(binary_levels[0]))
+
+static long long parse_binary(ArithParser *ap, int level) {
+    if (level == NUM_BINARY_LEVELS) {
+        return parse_power(ap);
+    }
+    long long left = parse_binary(ap, level + 1);
+    for (;;) {
+        const char *op = NULL;
+        for (int i = 0; i < 5 && binary_levels[level][i] != NULL; i++) {
+            if (accept(ap, binary_levels[level][i])) {
+                op = binary_levels[level][i];
+                break;
+            }
+        }
+        if (op == NULL) {
+            return left;
+        }
+        long long right = parse_binary(ap, level + 1);
+        if (strcmp(op, "==") == 0) {
+            left = left == right;
+        } else if (strcmp(op, "!=") == 0) {
+            left = left != right;
+        } else if (strcmp(op, "<=") == 0) {
+            left = left <= right;
+        } else if (strcmp(op, ">=") == 0) {
+            left = left >= right;
+        } else if (strcmp(op, "<") == 0) {
+            left = left < right;
+        } else if (strcmp(op, ">") == 0) {
+            left = left > right;
+        } else if (strcmp(op, "<<") == 0) {
+            left = binary_op(ap, "<", left, right);
+        } else if (strcmp(op, ">>") == 0) {
+            left = binary_op(ap, ">", left, right);
+        } else {
+            left = binary_op(ap, op, left, right);
+        }
+    }
+}
+
+static long long parse_logical_and(ArithParser *ap) {
+    long long left = parse_binary(ap, 0);
+    while (accept(ap, "&&")) {
+        bool skip = !left;
+        ap->skip += skip;
+        long long right = parse_binary(ap, 0);
+        ap->skip -= skip;
+        left = left && right;
+    }
+    return left;
+}
+
+static long long parse_logical_or(ArithParser *ap) {
+    long long left = parse_logical_and(ap);
+    while (accept(ap, "||")) {
+        bool skip = left != 0;
+        ap->skip += skip;
+        long long right = parse_logical_and(ap);
+        ap->skip -= skip;
+        left = left || right;
+    }
+    return left;
+}
+
+static long long parse_conditional(ArithParser *ap) {
+    long long cond = parse_logical_or(ap);
+    if (!accept(ap, "?")) {
+        return cond;
+    }
+    ap->skip += !cond;
+    long long yes = parse_comma(ap);
+    ap->skip -= !cond;
+    if (!accept(ap, ":")) {
+        arith_error(ap, "条件表达式缺少 \":\"");
+    }
+    ap->skip += cond != 0;
+    long long no = parse_conditional(ap);
+    ap->skip -= cond != 0;
+    return cond ? yes : no;
+}
+
+// 赋值右结合：NAME op= 表达式
+static long long parse_assign(ArithParser *ap) {
+    static const char *assign_ops[] = {"=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=", NULL};
+    skip_space(ap);
+    const char *start = ap->p;
+    char *name = read_name(ap);
+    if (name != NULL) {
+        skip_space(ap);
+        for (int i = 0; assign_ops[i] != NULL; i++) {
+            size_t len = strlen(assign_ops[i]);
+            if (strncmp(ap->p, assign_ops[i], len) == 0 && ap->p[len] != '=') {
+                ap->p += len;
+                long long value = parse_assign(ap);
+                if (i > 0) {
+                    char op[2] = {assign_ops[i][0], '\0'}; // <<= >>= 对应 binary_op 中的 < >
+                    long long current = ap->skip > 0 ? 0 : variable_value(ap, name);
+                    value = binary_op(ap, op, current, value);
+                }
+                assign_variable(ap, name, value);
+                free(name);
+                return value;
+            }
+        }
+        free(name);
+        ap->p = start;
+    }
+    return parse_conditional(ap);
+}
+
+static long long parse_comma(ArithParser *ap) {
+    long long value = parse_assign(ap);
+    while (accept(ap, ",")) {
+        value = parse_assign(ap);
+    }
+    return value;
+}
+
+bool arith_eval(const char *expr, long long *value) {
+    ArithParser ap = {.expr = expr, .p = expr};
+    if (setjmp(ap.error) != 0) {
+        lsh_last_status = 1;
+        return false;
+    }
+    skip_space(&ap);
+    if (*ap.p == '\0') {
+        *value = 0; // $(( )) 为 0
+        return true;
+    }
+    *value = parse_comma(&ap);
+    skip_space(&ap);
+    if (*ap.p != '\0') {
+        arith_error(&ap, "算术表达式语法错误");
+    }
+    return true;
+}
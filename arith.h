@@ -0,0 +1,13 @@
+//
+// Created by ysh on 24-6-27.
+//
+
+#ifndef OS_C_ARITH_H
+#define OS_C_ARITH_H
+
+#include <stdbool.h>
+
+// 计算 $(( )) 中的整数表达式。出错时输出错误信息并返回 false
+bool arith_eval(const char *expr, long long *value);
+
+#endif //OS_C_ARITH_H
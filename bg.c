@@ -4,6 +4,7 @@
 #include "main.h"
 #include "lsh_builtins.h"
 #include "bg.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,14 +13,36 @@
 #include <signal.h>
 
 
+#define MAX_BACKGROUND_PIDS 1024
+
 volatile sig_atomic_t background_counter = 0; // 记录后台任务的序号
 volatile sig_atomic_t child_done = 0; //记录有多少个子进程完成
 BackgroundTask *completed_tasks = NULL;
+static volatile pid_t background_pids[MAX_BACKGROUND_PIDS]; // 正在运行的后台子进程，0 表示空位
+
+// 登记一个后台子进程并返回任务序号
+// SIGCHLD 处理函数只回收登记过的进程，前台命令和进程替换由各自的调用者等待
+int background_add(pid_t pid) {
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    for (int i = 0; i < MAX_BACKGROUND_PIDS; i++) {
+        if (background_pids[i] == 0) {
+            background_pids[i] = pid;
+            break;
+        }
+    }
+    int task_number = ++background_counter;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return task_number;
+}
 
-void add_completed_task(int task_number, pid_t pid){
+void add_completed_task(int task_number, pid_t pid, const char *command){
     BackgroundTask *task = (BackgroundTask *)malloc(sizeof(BackgroundTask));
     task->task_number = task_number;
     task->pid = pid;
+    task->command = command;
     task->next = completed_tasks;
     completed_tasks = task;
 }
@@ -27,7 +50,11 @@ void add_completed_task(int task_number, pid_t pid){
 void print_completed_tasks(){
     BackgroundTask *task = completed_tasks;
     while(task != NULL){
-        printf("[%d]+ 已完成 %d\n", task->task_number, task->pid);
+        if (task->command != NULL) {
+            printf("[%d]+ 已完成 %s\n", task->task_number, task->command);
+        } else {
+            printf("[%d]+ 已完成 %d\n", task->task_number, task->pid);
+        }
         BackgroundTask *temp = task;
         task = task->next;
         free(temp);
@@ -35,14 +62,36 @@ void print_completed_tasks(){
     completed_tasks = NULL;
 }
 
+// 记录一个结束的后台任务，下次显示提示符前输出完成通知
+void background_task_done(pid_t pid) {
+    background_counter--; // 后台任务完成，减少计数器
+    STAT_INC(bg_reaped);
+    add_completed_task(background_counter + 1, pid, NULL);
+    child_done++;
+}
+
+// 线程池中的后台内置命令完成
+void background_builtin_done(const char *command) {
+    background_counter--;
+    add_completed_task(background_counter + 1, 0, command);
+    child_done++;
+}
+
 void sigchld_handler(int sig) {
     int saved_errno = errno;
-    pid_t pid;
 
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        background_counter--; // 后台任务完成，减少计数器
-        add_completed_task(background_counter + 1, pid);
-        child_done++;
+    for (int i = 0; i < MAX_BACKGROUND_PIDS; i++) {
+        pid_t pid = background_pids[i];
+        if (pid <= 0) {
+            continue;
+        }
+        pid_t result = waitpid(pid, NULL, WNOHANG);
+        if (result == pid) {
+            background_pids[i] = 0;
+            background_task_done(pid);
+        } else if (result == -1 && errno == ECHILD) {
+            background_pids[i] = 0; // 不是本进程的子进程（由 spawn 辅助进程启动）
+        }
     }
     errno = saved_errno;
 }
@@ -8,17 +8,20 @@
 #ifndef OS_C_BG_H
 #define OS_C_BG_H
 
-#endif //OS_C_BG_H
-
-
 typedef struct BackgroundTask{
     int task_number;
     pid_t pid;
+    const char *command; // 在线程池中运行的内置命令名，进程任务为 NULL
     struct BackgroundTask *next;
 } BackgroundTask;
 
-void add_completed_task(int task_number, pid_t pid);
+void add_completed_task(int task_number, pid_t pid, const char *command);
+int background_add(pid_t pid);
+void background_task_done(pid_t pid);
+void background_builtin_done(const char *command);
 
 void print_completed_tasks();
 void sigchld_handler(int sig) ;
 void setup_signal_handlers();
+
+#endif //OS_C_BG_H
@@ -0,0 +1,381 @@
+//
+// Created by ysh on 24-7-7.
+//
+// sum 内置命令用的校验和算法：crc32c、xxh64 和 sha256。
+// x86 上运行时用 cpuid 检测，支持时 crc32c 用 SSE4.2 的 crc32 指令，sha256 用 SHA 扩展指令，
+// 否则退回到可移植的实现（crc32c 查表一次处理 8 个字节）。xxh64 本身就很快，只有可移植的实现。
+//
+
+#include "checksum.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+static uint32_t load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t load32_be(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/*
+  crc32c
+*/
+
+static uint32_t crc_table[8][256];
+
+static void crc_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const unsigned char *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v = load64(p) ^ crc;
+        crc = crc_table[7][v & 0xFF] ^ crc_table[6][(v >> 8) & 0xFF] ^ crc_table[5][(v >> 16) & 0xFF] ^
+              crc_table[4][(v >> 24) & 0xFF] ^ crc_table[3][(v >> 32) & 0xFF] ^ crc_table[2][(v >> 40) & 0xFF] ^
+              crc_table[1][(v >> 48) & 0xFF] ^ crc_table[0][v >> 56];
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if CHECKSUM_X86 && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        c = _mm_crc32_u64(c, load64(p));
+    }
+    crc = (uint32_t) c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/*
+  xxh64
+*/
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t acc) {
+    h ^= xxh_round(0, acc);
+    return h * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// 一次处理若干个 32 字节的条带，返回处理的字节数
+static size_t xxh_stripes(uint64_t acc[4], const unsigned char *p, size_t len) {
+    uint64_t v1 = acc[0], v2 = acc[1], v3 = acc[2], v4 = acc[3];
+    size_t done = 0;
+    for (; len - done >= 32; done += 32) {
+        v1 = xxh_round(v1, load64(p + done));
+        v2 = xxh_round(v2, load64(p + done + 8));
+        v3 = xxh_round(v3, load64(p + done + 16));
+        v4 = xxh_round(v4, load64(p + done + 24));
+    }
+    acc[0] = v1;
+    acc[1] = v2;
+    acc[2] = v3;
+    acc[3] = v4;
+    return done;
+}
+
+static uint64_t xxh_final(const Checksum *c) {
+    uint64_t h;
+    if (c->total >= 32) {
+        h = rotl64(c->acc[0], 1) + rotl64(c->acc[1], 7) + rotl64(c->acc[2], 12) + rotl64(c->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh_merge(h, c->acc[i]);
+        }
+    } else {
+        h = XXH_PRIME5; // 种子为 0
+    }
+    h += c->total;
+    const unsigned char *p = c->buf;
+    size_t len = c->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh_round(0, load64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t) load32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        h ^= *p++ * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+  sha256
+*/
+
+static const uint32_t sha_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_portable(uint32_t state[8], const unsigned char *p, size_t blocks) {
+    for (; blocks > 0; blocks--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load32_be(p + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if CHECKSUM_X86
+// SHA 扩展指令每次做 4 轮，状态按指令的要求排成 ABEF 和 CDGH 两个寄存器
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani(uint32_t state[8], const unsigned char *p, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);   // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                      // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                           // CDGH
+
+    for (; blocks > 0; blocks--, p += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[16];
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), mask);
+            } else {
+                // w[t] = σ1(w[t-2]) + w[t-7] + σ0(w[t-15]) + w[t-16]，一次算 4 个
+                __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w[i - 4], w[i - 3]), _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+                w[i] = _mm_sha256msg2_epu32(t, w[i - 1]);
+            }
+            __m128i msg = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i *) &sha_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);                               // DCHG
+    _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+    _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8));    // HGFE
+}
+#endif
+
+/*
+  运行时选择实现
+*/
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t) = crc32c_portable;
+static void (*sha256_impl)(uint32_t *, const unsigned char *, size_t) = sha256_portable;
+static const char *crc32c_name = "portable";
+static const char *sha256_name = "portable";
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void select_impl() {
+    crc_init_table();
+#if CHECKSUM_X86
+    unsigned int a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        bool ssse3 = c & bit_SSSE3, sse41 = c & bit_SSE4_1;
+#ifdef __x86_64__
+        if (c & bit_SSE4_2) {
+            crc32c_impl = crc32c_sse42;
+            crc32c_name = "sse4.2";
+        }
+#endif
+        if (ssse3 && sse41 && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA)) {
+            sha256_impl = sha256_shani;
+            sha256_name = "sha-ni";
+        }
+    }
+#endif
+}
+
+/*
+  接口
+*/
+
+void checksum_init(Checksum *c, ChecksumKind kind) {
+    pthread_once(&impl_once, select_impl);
+    static const uint32_t sha_init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    c->kind = kind;
+    c->total = 0;
+    c->buf_len = 0;
+    c->crc = 0xFFFFFFFF;
+    c->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    c->acc[1] = XXH_PRIME2;
+    c->acc[2] = 0;
+    c->acc[3] = -XXH_PRIME1;
+    memcpy(c->state, sha_init, sizeof(sha_init));
+}
+
+void checksum_update(Checksum *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->total += len;
+    if (c->kind == CHECKSUM_CRC32C) {
+        c->crc = crc32c_impl(c->crc, p, len);
+        return;
+    }
+    size_t block = c->kind == CHECKSUM_XXH64 ? 32 : 64;
+    if (c->buf_len > 0) {
+        size_t n = block - c->buf_len < len ? block - c->buf_len : len;
+        memcpy(c->buf + c->buf_len, p, n);
+        c->buf_len += n;
+        p += n;
+        len -= n;
+        if (c->buf_len < block) {
+            return;
+        }
+        if (c->kind == CHECKSUM_XXH64) {
+            xxh_stripes(c->acc, c->buf, block);
+        } else {
+            sha256_impl(c->state, c->buf, 1);
+        }
+        c->buf_len = 0;
+    }
+    size_t whole = len - len % block;
+    if (c->kind == CHECKSUM_XXH64) {
+        xxh_stripes(c->acc, p, whole);
+    } else {
+        sha256_impl(c->state, p, whole / 64);
+    }
+    memcpy(c->buf, p + whole, len - whole);
+    c->buf_len = len - whole;
+}
+
+size_t checksum_final(Checksum *c, char hex[CHECKSUM_MAX_HEX + 1]) {
+    switch (c->kind) {
+        case CHECKSUM_CRC32C:
+            return snprintf(hex, CHECKSUM_MAX_HEX + 1, "%08x", c->crc ^ 0xFFFFFFFF);
+        case CHECKSUM_XXH64:
+            return snprintf(hex, CHECKSUM_MAX_HEX + 1, "%016llx", (unsigned long long) xxh_final(c));
+        case CHECKSUM_SHA256: {
+            // 补一个 0x80，再补 0 到 56 字节，最后 8 个字节是以位为单位的长度（大端）
+            unsigned char pad[128] = {0x80};
+            uint64_t bits = c->total * 8;
+            size_t pad_len = (c->buf_len < 56 ? 56 : 120) - c->buf_len;
+            for (int i = 0; i < 8; i++) {
+                pad[pad_len + i] = (unsigned char) (bits >> (56 - 8 * i));
+            }
+            checksum_update(c, pad, pad_len + 8);
+            for (int i = 0; i < 8; i++) {
+                snprintf(hex + 8 * i, 9, "%08x", c->state[i]);
+            }
+            return 64;
+        }
+    }
+    hex[0] = '\0';
+    return 0;
+}
+
+bool checksum_parse_kind(const char *name, ChecksumKind *kind) {
+    for (int k = CHECKSUM_CRC32C; k <= CHECKSUM_SHA256; k++) {
+        if (strcmp(name, checksum_kind_name(k)) == 0) {
+            *kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *checksum_kind_name(ChecksumKind kind) {
+    return kind == CHECKSUM_CRC32C ? "crc32c" : kind == CHECKSUM_XXH64 ? "xxh64" : "sha256";
+}
+
+size_t checksum_hex_len(ChecksumKind kind) {
+    return kind == CHECKSUM_CRC32C ? 8 : kind == CHECKSUM_XXH64 ? 16 : 64;
+}
+
+const char *checksum_impl_name(ChecksumKind kind) {
+    pthread_once(&impl_once, select_impl);
+    return kind == CHECKSUM_CRC32C ? crc32c_name : kind == CHECKSUM_SHA256 ? sha256_name : "portable";
+}
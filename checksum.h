@@ -0,0 +1,44 @@
+//
+// Created by ysh on 24-7-7.
+//
+
+#ifndef OS_C_CHECKSUM_H
+#define OS_C_CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    CHECKSUM_CRC32C,
+    CHECKSUM_XXH64,
+    CHECKSUM_SHA256,
+} ChecksumKind;
+
+// 十六进制结果的最大长度（sha256），不含结尾的 '\0'
+#define CHECKSUM_MAX_HEX 64
+
+// 流式计算校验和：init 之后多次 update，最后 final
+typedef struct Checksum {
+    ChecksumKind kind;
+    uint64_t total;
+    uint32_t crc;
+    uint64_t acc[4];            // xxh64
+    uint32_t state[8];          // sha256
+    unsigned char buf[64];      // 不足一块（xxh64 32 字节，sha256 64 字节）的输入
+    size_t buf_len;
+} Checksum;
+
+void checksum_init(Checksum *c, ChecksumKind kind);
+void checksum_update(Checksum *c, const void *data, size_t len);
+// 写出十六进制结果，返回长度
+size_t checksum_final(Checksum *c, char hex[CHECKSUM_MAX_HEX + 1]);
+
+bool checksum_parse_kind(const char *name, ChecksumKind *kind);
+const char *checksum_kind_name(ChecksumKind kind);
+// 各算法十六进制结果的长度，--check 用它从清单推断算法
+size_t checksum_hex_len(ChecksumKind kind);
+// 当前 CPU 上用的实现，例如 "sse4.2"、"sha-ni"、"portable"
+const char *checksum_impl_name(ChecksumKind kind);
+
+#endif //OS_C_CHECKSUM_H
@@ -0,0 +1,989 @@
+//
+// Created by ysh on 24-6-25.
+//
+// 把一段源代码编译成字节码：先分出单词和操作符，再用递归下降的方式生成指令。
+// 简单命令（可以带管道、重定向和 &）保存为单词列表，执行时只做展开，不再分词；
+// here-document 在编译时读出正文，转换成 <<< 加上引起来的正文，空的正文转换成 < /dev/null。
+//
+
+#include "script.h"
+#include "main.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#define MAX_LOOP_DEPTH 64
+
+typedef enum TokenType {
+    TOK_WORD,
+    TOK_NEWLINE,
+    TOK_SEMI,     // ;
+    TOK_DSEMI,    // ;;
+    TOK_AMP,      // &
+    TOK_AND,      // &&
+    TOK_PIPE,     // |
+    TOK_OR,       // ||
+    TOK_LPAREN,   // (
+    TOK_RPAREN,   // )
+    TOK_EOF,
+} TokenType;
+
+typedef struct Token {
+    TokenType type;
+    char *text;
+} Token;
+
+// 正在编译的循环，break 的跳转在循环结束时回填
+typedef struct LoopInfo {
+    uint32_t continue_target;
+    uint32_t *breaks;
+    int num_breaks;
+    bool is_for;
+} LoopInfo;
+
+// 还没有读到正文的 here-document
+typedef struct PendingHeredoc {
+    int op_token;   // "<<" 记号的位置，正文读完后改为 "<<<"
+    char *delim;
+    bool strip_tabs;
+    bool quoted;    // 分隔符被引用时正文不做展开
+} PendingHeredoc;
+
+typedef enum ParseResult {
+    PARSE_OK,
+    PARSE_ERROR,
+    PARSE_INCOMPLETE, // 源代码在结构中间结束，还需要更多输入
+} ParseResult;
+
+typedef struct Parser {
+    Token *tokens;
+    int num_tokens;
+    int cap_tokens;
+    int pos;
+    bool can_read_more;
+
+    Program *prog;
+    uint32_t cap_code, cap_cmds, cap_words, cap_strings;
+
+    LoopInfo loops[MAX_LOOP_DEPTH];
+    int loop_depth;
+    jmp_buf error;
+} Parser;
+
+/*
+  程序构造
+*/
+
+static void *grow(void *ptr, uint32_t *cap, uint32_t need, size_t elem_size) {
+    if (need <= *cap) {
+        return ptr;
+    }
+    while (*cap < need) {
+        *cap = *cap ? *cap * 2 : 64;
+    }
+    ptr = realloc(ptr, *cap * elem_size);
+    if (ptr == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static uint32_t emit(Parser *p, OpCode op, uint32_t a, uint32_t b) {
+    Program *prog = p->prog;
+    prog->code = grow(prog->code, &p->cap_code, prog->code_len + 1, sizeof(Instr));
+    prog->code[prog->code_len] = (Instr) {.op = op, .a = a, .b = b};
+    return prog->code_len++;
+}
+
+static uint32_t here(Parser *p) {
+    return p->prog->code_len;
+}
+
+static uint32_t add_string(Parser *p, const char *s) {
+    Program *prog = p->prog;
+    uint32_t len = strlen(s) + 1;
+    prog->strings = grow(prog->strings, &p->cap_strings, prog->strings_len + len, 1);
+    memcpy(prog->strings + prog->strings_len, s, len);
+    prog->strings_len += len;
+    return prog->strings_len - len;
+}
+
+static uint32_t add_command(Parser *p, char **words, int count) {
+    Program *prog = p->prog;
+    prog->words = grow(prog->words, &p->cap_words, prog->num_words + count, sizeof(uint32_t));
+    uint32_t first = prog->num_words;
+    for (int i = 0; i < count; i++) {
+        prog->words[prog->num_words++] = add_string(p, words[i]);
+    }
+    prog->cmds = grow(prog->cmds, &p->cap_cmds, prog->num_cmds + 1, sizeof(CommandRef));
+    prog->cmds[prog->num_cmds] = (CommandRef) {.first = first, .count = count};
+    return prog->num_cmds++;
+}
+
+void program_retain(Program *prog) {
+    prog->refs++;
+}
+
+void program_release(Program *prog) {
+    if (prog == NULL || --prog->refs > 0) {
+        return;
+    }
+    if (prog->mapping == NULL) {
+        free(prog->code);
+        free(prog->cmds);
+        free(prog->words);
+        free(prog->strings);
+    } else {
+        munmap(prog->mapping, prog->mapping_len);
+    }
+    free(prog);
+}
+
+/*
+  分词
+*/
+
+static void parse_error(Parser *p, const char *near) {
+    if (near == NULL) {
+        fprintf(stderr, "lsh: 语法错误：未预期的文件结尾\n");
+    } else {
+        fprintf(stderr, "lsh: 未预期的记号 \"%s\" 附近有语法错误\n", near);
+    }
+    longjmp(p->error, PARSE_ERROR);
+}
+
+static void incomplete(Parser *p) {
+    if (!p->can_read_more) {
+        parse_error(p, NULL);
+    }
+    longjmp(p->error, PARSE_INCOMPLETE);
+}
+
+static void push_token(Parser *p, TokenType type, char *text) {
+    if (p->num_tokens >= p->cap_tokens) {
+        p->cap_tokens = p->cap_tokens ? p->cap_tokens * 2 : 64;
+        p->tokens = realloc(p->tokens, p->cap_tokens * sizeof(Token));
+    }
+    p->tokens[p->num_tokens++] = (Token) {.type = type, .text = text};
+}
+
+// 去掉 here-document 分隔符中的引号
+static char *unquote_delim(const char *raw, bool *quoted) {
+    char *delim = malloc(strlen(raw) + 1);
+    char *out = delim;
+    *quoted = false;
+    for (const char *s = raw; *s; s++) {
+        if (*s == '\'' || *s == '"' || *s == '\\') {
+            *quoted = true;
+            if (*s == '\\' && s[1]) {
+                s++;
+            } else {
+                continue;
+            }
+        }
+        *out++ = *s;
+    }
+    *out = '\0';
+    return delim;
+}
+
+// 把正文引起来作为 <<< 的单词：分隔符被引用时用单引号，不做任何展开；
+// 否则用双引号，和 here-document 一样展开 $ 和 `，引号本身按字面处理
+static char *quote_heredoc_body(const char *body, size_t len, bool quoted) {
+    char *word = malloc(len * 4 + 3);
+    char *out = word;
+    *out++ = quoted ? '\'' : '"';
+    for (size_t i = 0; i < len; i++) {
+        if (quoted && body[i] == '\'') {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+            continue;
+        }
+        if (!quoted && body[i] == '"') {
+            *out++ = '\\';
+        }
+        *out++ = body[i];
+    }
+    *out++ = quoted ? '\'' : '"';
+    *out = '\0';
+    return word;
+}
+
+// 从 s 开始读取 here-document 的正文，返回正文之后的位置
+static const char *read_heredoc_body(Parser *p, const char *s, PendingHeredoc *doc) {
+    size_t cap = 256, len = 0;
+    char *body = malloc(cap);
+    bool found = false;
+    while (*s) {
+        const char *end = strchr(s, '\n');
+        size_t line_len = end ? (size_t) (end - s) : strlen(s);
+        const char *text = s;
+        if (doc->strip_tabs) {
+            while (text < s + line_len && *text == '\t') {
+                text++;
+            }
+        }
+        size_t text_len = s + line_len - text;
+        s += line_len + (end ? 1 : 0);
+        if (text_len == strlen(doc->delim) && strncmp(text, doc->delim, text_len) == 0) {
+            found = true;
+            break;
+        }
+        if (len + text_len + 1 > cap) {
+            while (len + text_len + 1 > cap) {
+                cap *= 2;
+            }
+            body = realloc(body, cap);
+        }
+        memcpy(body + len, text, text_len);
+        len += text_len;
+        body[len++] = '\n';
+    }
+    if (!found) {
+        if (p->can_read_more) {
+            free(body);
+            incomplete(p);
+        }
+        fprintf(stderr, "lsh: 警告：立即文档遇到了文件结束符 (需要 \"%s\")\n", doc->delim);
+    }
+
+    free(p->tokens[doc->op_token].text);
+    free(p->tokens[doc->op_token + 1].text);
+    if (len == 0) {
+        // <<< 总会补上一个换行，空的正文改为从 /dev/null 读
+        p->tokens[doc->op_token].text = strdup("<");
+        p->tokens[doc->op_token + 1].text = strdup("/dev/null");
+    } else {
+        // 去掉最后的换行，由 <<< 补上
+        p->tokens[doc->op_token].text = strdup("<<<");
+        p->tokens[doc->op_token + 1].text = quote_heredoc_body(body, len - 1, doc->quoted);
+    }
+    free(body);
+    return s;
+}
+
+// 记录 here-document，attached 为分隔符紧跟在 << 后面的情况，拆成两个记号
+static void note_heredoc(Parser *p, PendingHeredoc *docs, int *num_docs, char *word) {
+    bool strip_tabs = word[2] == '-';
+    const char *rest = word + (strip_tabs ? 3 : 2);
+    if (*num_docs >= MAX_LOOP_DEPTH) {
+        parse_error(p, word);
+    }
+    PendingHeredoc *doc = &docs[(*num_docs)++];
+    doc->strip_tabs = strip_tabs;
+    doc->op_token = p->num_tokens;
+    doc->delim = NULL;
+    if (*rest) {
+        doc->delim = unquote_delim(rest, &doc->quoted);
+        push_token(p, TOK_WORD, strndup(word, rest - word));
+        push_token(p, TOK_WORD, strdup(rest));
+        free(word);
+    } else {
+        push_token(p, TOK_WORD, word);
+    }
+}
+
+static void tokenize(Parser *p, const char *s) {
+    PendingHeredoc docs[MAX_LOOP_DEPTH];
+    int num_docs = 0;
+
+    while (*s) {
+        if (*s == ' ' || *s == '\t' || *s == '\r') {
+            s++;
+        } else if (*s == '\\' && s[1] == '\n') {
+            s += 2; // 续行
+        } else if (*s == '#') {
+            s += strcspn(s, "\n");
+        } else if (*s == '\n') {
+            push_token(p, TOK_NEWLINE, NULL);
+            s++;
+            for (int i = 0; i < num_docs; i++) {
+                s = read_heredoc_body(p, s, &docs[i]);
+                free(docs[i].delim);
+            }
+            num_docs = 0;
+        } else if (*s == ';') {
+            push_token(p, s[1] == ';' ? TOK_DSEMI : TOK_SEMI, NULL);
+            s += (s[1] == ';') ? 2 : 1;
+        } else if (*s == '&') {
+            push_token(p, s[1] == '&' ? TOK_AND : TOK_AMP, NULL);
+            s += (s[1] == '&') ? 2 : 1;
+        } else if (*s == '|') {
+            push_token(p, s[1] == '|' ? TOK_OR : TOK_PIPE, NULL);
+            s += (s[1] == '|') ? 2 : 1;
+        } else if (*s == '(' || *s == ')') {
+            push_token(p, *s == '(' ? TOK_LPAREN : TOK_RPAREN, NULL);
+            s++;
+        } else {
+            const char *end = lsh_skip_word(s, true);
+            char *word = strndup(s, end - s);
+            s = end;
+            if (num_docs > 0 && p->num_tokens > 0 && p->tokens[p->num_tokens - 1].type == TOK_WORD
+                && docs[num_docs - 1].delim == NULL && docs[num_docs - 1].op_token == p->num_tokens - 1) {
+                // << 后面单独的分隔符
+                docs[num_docs - 1].delim = unquote_delim(word, &docs[num_docs - 1].quoted);
+                push_token(p, TOK_WORD, word);
+            } else if (strncmp(word, "<<", 2) == 0 && word[2] != '<') {
+                note_heredoc(p, docs, &num_docs, word);
+            } else {
+                push_token(p, TOK_WORD, word);
+            }
+        }
+    }
+    for (int i = 0; i < num_docs; i++) {
+        if (docs[i].delim == NULL) {
+            parse_error(p, "newline");
+        }
+        // 源代码在 here-document 正文之前就结束了
+        read_heredoc_body(p, s, &docs[i]);
+        free(docs[i].delim);
+    }
+    push_token(p, TOK_EOF, NULL);
+}
+
+/*
+  语法分析和代码生成
+*/
+
+static Token *peek(Parser *p) {
+    return &p->tokens[p->pos];
+}
+
+static bool is_word(Parser *p, const char *text) {
+    Token *tok = peek(p);
+    return tok->type == TOK_WORD && strcmp(tok->text, text) == 0;
+}
+
+static const char *token_text(Token *tok) {
+    static const char *names[] = {NULL, "newline", ";", ";;", "&", "&&", "|", "||", "(", ")", NULL};
+    return tok->type == TOK_WORD ? tok->text : names[tok->type];
+}
+
+static void unexpected(Parser *p) {
+    Token *tok = peek(p);
+    if (tok->type == TOK_EOF) {
+        incomplete(p);
+    }
+    parse_error(p, token_text(tok));
+}
+
+static void expect_word(Parser *p, const char *text) {
+    if (!is_word(p, text)) {
+        unexpected(p);
+    }
+    p->pos++;
+}
+
+static void skip_newlines(Parser *p) {
+    while (peek(p)->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+}
+
+// 在命令的位置上结束一个命令列表的保留字
+static bool at_list_end(Parser *p) {
+    static const char *terminators[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+    Token *tok = peek(p);
+    if (tok->type == TOK_EOF || tok->type == TOK_RPAREN || tok->type == TOK_DSEMI) {
+        return true;
+    }
+    if (tok->type != TOK_WORD) {
+        return false;
+    }
+    for (int i = 0; terminators[i] != NULL; i++) {
+        if (strcmp(tok->text, terminators[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 保留字，出现在命令的位置上时不是普通的命令名或函数名
+static bool is_reserved_word(Token *tok) {
+    static const char *reserved[] = {"if", "then", "elif", "else", "fi", "while", "until", "for", "do", "done",
+                                     "case", "esac", "in", "function", "{", "}", "!", NULL};
+    for (int i = 0; tok->type == TOK_WORD && reserved[i] != NULL; i++) {
+        if (strcmp(tok->text, reserved[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void parse_list(Parser *p);
+static void parse_command(Parser *p);
+
+static void push_loop(Parser *p, uint32_t continue_target, bool is_for) {
+    if (p->loop_depth >= MAX_LOOP_DEPTH) {
+        parse_error(p, is_for ? "for" : "while");
+    }
+    p->loops[p->loop_depth++] = (LoopInfo) {.continue_target = continue_target, .is_for = is_for};
+}
+
+// 结束最内层循环，把其中的 break 跳转回填到 target
+static void pop_loop(Parser *p, uint32_t target) {
+    LoopInfo *loop = &p->loops[--p->loop_depth];
+    for (int i = 0; i < loop->num_breaks; i++) {
+        p->prog->code[loop->breaks[i]].a = target;
+    }
+    free(loop->breaks);
+}
+
+// break n / continue n：先结束跨过的内层 for 循环，再跳到目标循环的结尾或下一轮
+static void parse_break(Parser *p, bool is_break) {
+    const char *keyword = peek(p)->text;
+    p->pos++;
+    int levels = 1;
+    if (peek(p)->type == TOK_WORD) {
+        levels = atoi(peek(p)->text);
+        p->pos++;
+    }
+    if (p->loop_depth == 0 || levels < 1) {
+        fprintf(stderr, "lsh: %s: 只在 for、while 或 until 循环中有意义\n", keyword);
+        return;
+    }
+    if (levels > p->loop_depth) {
+        levels = p->loop_depth;
+    }
+    for (int i = 0; i < levels - 1; i++) {
+        if (p->loops[p->loop_depth - 1 - i].is_for) {
+            emit(p, OP_FOR_POP, 0, 0);
+        }
+    }
+    LoopInfo *target = &p->loops[p->loop_depth - levels];
+    if (is_break) {
+        target->breaks = realloc(target->breaks, (target->num_breaks + 1) * sizeof(uint32_t));
+        target->breaks[target->num_breaks++] = emit(p, OP_JUMP, NO_OPERAND, 0);
+    } else {
+        emit(p, OP_JUMP, target->continue_target, 0);
+    }
+}
+
+static void parse_if(Parser *p) {
+    uint32_t ends[MAX_LOOP_DEPTH];
+    int num_ends = 0;
+    p->pos++;
+    for (;;) {
+        parse_list(p);
+        expect_word(p, "then");
+        uint32_t skip = emit(p, OP_JUMP_IF_FALSE, NO_OPERAND, 0);
+        parse_list(p);
+        if (num_ends >= MAX_LOOP_DEPTH) {
+            parse_error(p, "elif");
+        }
+        ends[num_ends++] = emit(p, OP_JUMP, NO_OPERAND, 0);
+        p->prog->code[skip].a = here(p);
+        if (is_word(p, "elif")) {
+            p->pos++;
+            continue;
+        }
+        if (is_word(p, "else")) {
+            p->pos++;
+            parse_list(p);
+        } else {
+            emit(p, OP_SET_STATUS, 0, 0); // 没有分支被执行时状态为 0
+        }
+        expect_word(p, "fi");
+        break;
+    }
+    for (int i = 0; i < num_ends; i++) {
+        p->prog->code[ends[i]].a = here(p);
+    }
+}
+
+static void parse_while(Parser *p) {
+    bool until = is_word(p, "until");
+    p->pos++;
+    uint32_t top = here(p);
+    parse_list(p);
+    expect_word(p, "do");
+    uint32_t exit_jump = emit(p, until ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, NO_OPERAND, 0);
+    push_loop(p, top, false);
+    parse_list(p);
+    expect_word(p, "done");
+    emit(p, OP_JUMP, top, 0);
+    p->prog->code[exit_jump].a = here(p);
+    pop_loop(p, here(p));
+    emit(p, OP_SET_STATUS, 0, 0);
+}
+
+static void parse_for(Parser *p) {
+    p->pos++;
+    Token *name = peek(p);
+    if (name->type != TOK_WORD || !is_var_name(name->text, strlen(name->text))) {
+        unexpected(p);
+    }
+    uint32_t name_str = add_string(p, name->text);
+    p->pos++;
+    skip_newlines(p);
+
+    if (is_word(p, "in")) {
+        p->pos++;
+        int start = p->pos;
+        while (peek(p)->type == TOK_WORD) {
+            p->pos++;
+        }
+        char **words = malloc((p->pos - start + 1) * sizeof(char *));
+        for (int i = start; i < p->pos; i++) {
+            words[i - start] = p->tokens[i].text;
+        }
+        emit(p, OP_FOR_INIT, add_command(p, words, p->pos - start), 0);
+        free(words);
+    } else {
+        emit(p, OP_FOR_INIT, NO_OPERAND, 1); // 没有 in 时遍历位置参数
+    }
+    if (peek(p)->type == TOK_SEMI) {
+        p->pos++;
+    }
+    skip_newlines(p);
+    expect_word(p, "do");
+
+    uint32_t next = emit(p, OP_FOR_NEXT, name_str, NO_OPERAND);
+    push_loop(p, next, true);
+    parse_list(p);
+    expect_word(p, "done");
+    emit(p, OP_JUMP, next, 0);
+    uint32_t done = emit(p, OP_FOR_POP, 0, 0);
+    p->prog->code[next].b = done;
+    pop_loop(p, done);
+    emit(p, OP_SET_STATUS, 0, 0);
+}
+
+static void parse_case(Parser *p) {
+    p->pos++;
+    if (peek(p)->type != TOK_WORD) {
+        unexpected(p);
+    }
+    emit(p, OP_CASE_WORD, add_string(p, peek(p)->text), 0);
+    p->pos++;
+    skip_newlines(p);
+    expect_word(p, "in");
+    skip_newlines(p);
+
+    uint32_t *ends = NULL;
+    int num_ends = 0;
+    while (!is_word(p, "esac")) {
+        if (peek(p)->type == TOK_LPAREN) {
+            p->pos++;
+        }
+        uint32_t matches[MAX_LOOP_DEPTH];
+        int num_matches = 0;
+        for (;;) {
+            if (peek(p)->type != TOK_WORD || num_matches >= MAX_LOOP_DEPTH) {
+                free(ends);
+                unexpected(p);
+            }
+            matches[num_matches++] = emit(p, OP_CASE_MATCH, add_string(p, peek(p)->text), NO_OPERAND);
+            p->pos++;
+            if (peek(p)->type != TOK_PIPE) {
+                break;
+            }
+            p->pos++;
+        }
+        if (peek(p)->type != TOK_RPAREN) {
+            free(ends);
+            unexpected(p);
+        }
+        p->pos++;
+
+        uint32_t next_item = emit(p, OP_JUMP, NO_OPERAND, 0);
+        for (int i = 0; i < num_matches; i++) {
+            p->prog->code[matches[i]].b = here(p);
+        }
+        parse_list(p);
+        ends = realloc(ends, (num_ends + 1) * sizeof(uint32_t));
+        ends[num_ends++] = emit(p, OP_JUMP, NO_OPERAND, 0);
+        p->prog->code[next_item].a = here(p);
+
+        if (peek(p)->type == TOK_DSEMI) {
+            p->pos++;
+        } else if (!is_word(p, "esac")) {
+            free(ends);
+            unexpected(p);
+        }
+        skip_newlines(p);
+    }
+    p->pos++;
+    emit(p, OP_SET_STATUS, 0, 0); // 没有匹配的分支
+    for (int i = 0; i < num_ends; i++) {
+        p->prog->code[ends[i]].a = here(p);
+    }
+    free(ends);
+}
+
+// 函数体编译在定义处，定义时跳过函数体，调用时从入口开始执行到 OP_END
+static void parse_function(Parser *p, const char *name) {
+    uint32_t define = emit(p, OP_DEFUN, add_string(p, name), NO_OPERAND);
+    uint32_t skip = emit(p, OP_JUMP, NO_OPERAND, 0);
+    p->prog->code[define].b = here(p);
+
+    int saved_depth = p->loop_depth; // 函数体内的 break 不能跳出函数
+    p->loop_depth = 0;
+    skip_newlines(p);
+    parse_command(p);
+    p->loop_depth = saved_depth;
+
+    emit(p, OP_END, 0, 0);
+    p->prog->code[skip].a = here(p);
+}
+
+// return [n]、for 的单词列表等：收集到命令结束的单词
+static uint32_t parse_words(Parser *p) {
+    int start = p->pos;
+    while (peek(p)->type == TOK_WORD) {
+        p->pos++;
+    }
+    char **words = malloc((p->pos - start + 1) * sizeof(char *));
+    for (int i = start; i < p->pos; i++) {
+        words[i - start] = p->tokens[i].text;
+    }
+    uint32_t cmd = add_command(p, words, p->pos - start);
+    free(words);
+    return cmd;
+}
+
+static bool is_redirection(const char *word) {
+    return word[0] == '<' || word[0] == '>';
+}
+
+static bool starts_compound(Token *tok) {
+    static const char *keywords[] = {"if", "while", "until", "for", "case", "{", NULL};
+    if (tok->type == TOK_LPAREN) {
+        return true;
+    }
+    for (int i = 0; tok->type == TOK_WORD && keywords[i] != NULL; i++) {
+        if (strcmp(tok->text, keywords[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 管道符之后是否为复合命令
+static bool pipe_to_compound(Parser *p) {
+    int i = p->pos + 1;
+    while (p->tokens[i].type == TOK_NEWLINE) {
+        i++;
+    }
+    return starts_compound(&p->tokens[i]);
+}
+
+// 简单命令：单词和管道，遇到 & 时把它作为最后一个单词。
+// 管道的下一个阶段是复合命令时停在管道符前，由 parse_pipeline 处理
+static void parse_simple(Parser *p) {
+    int cap = 16, count = 0;
+    char **words = malloc(cap * sizeof(char *));
+    for (;;) {
+        Token *tok = peek(p);
+        char *word;
+        if (tok->type == TOK_WORD) {
+            word = tok->text;
+        } else if (tok->type == TOK_PIPE && count > 0 && !pipe_to_compound(p)) {
+            word = "|";
+        } else if (tok->type == TOK_AMP && count > 0) {
+            word = "&";
+        } else {
+            break;
+        }
+        if (count + 1 >= cap) {
+            cap *= 2;
+            words = realloc(words, cap * sizeof(char *));
+        }
+        words[count++] = word;
+        p->pos++;
+        if (tok->type == TOK_PIPE) {
+            skip_newlines(p);
+            if (peek(p)->type != TOK_WORD) {
+                free(words);
+                unexpected(p);
+            }
+        } else if (tok->type == TOK_AMP) {
+            break;
+        }
+    }
+    if (count == 0) {
+        free(words);
+        unexpected(p);
+    }
+    emit(p, OP_EXEC, add_command(p, words, count), 0);
+    free(words);
+}
+
+static void parse_command(Parser *p) {
+    Token *tok = peek(p);
+    if (tok->type == TOK_WORD) {
+        if (strcmp(tok->text, "break") == 0 || strcmp(tok->text, "continue") == 0) {
+            parse_break(p, tok->text[0] == 'b');
+            return;
+        }
+        if (strcmp(tok->text, "return") == 0) {
+            p->pos++;
+            emit(p, OP_RETURN, parse_words(p), 0);
+            return;
+        }
+        if (strcmp(tok->text, "function") == 0) {
+            p->pos++;
+            if (peek(p)->type != TOK_WORD) {
+                unexpected(p);
+            }
+            const char *name = peek(p)->text;
+            p->pos++;
+            if (peek(p)->type == TOK_LPAREN) {
+                p->pos++;
+                if (peek(p)->type != TOK_RPAREN) {
+                    unexpected(p);
+                }
+                p->pos++;
+            }
+            parse_function(p, name);
+            return;
+        }
+        // name () 定义函数，if (...)、{ (...) } 这样保留字后面的括号是子 shell
+        if (p->tokens[p->pos + 1].type == TOK_LPAREN && !is_reserved_word(tok)) {
+            if (p->tokens[p->pos + 2].type != TOK_RPAREN) {
+                p->pos += 2;
+                unexpected(p);
+            }
+            p->pos += 3;
+            parse_function(p, tok->text);
+            return;
+        }
+    }
+
+    if (!starts_compound(tok)) {
+        parse_simple(p);
+        return;
+    }
+
+    // 复合命令后面可以跟重定向，先占一个位置，有重定向时改成 OP_REDIRECT
+    uint32_t slot = emit(p, OP_JUMP, here(p) + 1, 0);
+    if (is_word(p, "if")) {
+        parse_if(p);
+    } else if (is_word(p, "while") || is_word(p, "until")) {
+        parse_while(p);
+    } else if (is_word(p, "for")) {
+        parse_for(p);
+    } else if (is_word(p, "case")) {
+        parse_case(p);
+    } else if (is_word(p, "{")) {
+        p->pos++;
+        parse_list(p);
+        expect_word(p, "}");
+    } else {
+        // ( list ) 在子进程中执行，里面的 break 不能跳出子 shell
+        p->pos++;
+        uint32_t fork_at = emit(p, OP_SUBSHELL, NO_OPERAND, 0);
+        int saved_depth = p->loop_depth;
+        p->loop_depth = 0;
+        parse_list(p);
+        p->loop_depth = saved_depth;
+        if (peek(p)->type != TOK_RPAREN) {
+            unexpected(p);
+        }
+        p->pos++;
+        emit(p, OP_EXIT, 0, 0);
+        p->prog->code[fork_at].a = here(p);
+    }
+
+    int start = p->pos;
+    while (peek(p)->type == TOK_WORD && is_redirection(peek(p)->text)) {
+        const char *op = peek(p)->text;
+        p->pos++;
+        bool needs_target = strcmp(op, "<") == 0 || strcmp(op, ">") == 0 || strcmp(op, ">>") == 0
+                            || strcmp(op, "<<<") == 0;
+        if (needs_target) {
+            if (peek(p)->type != TOK_WORD) {
+                unexpected(p);
+            }
+            p->pos++;
+        }
+    }
+    if (p->pos > start) {
+        char **words = malloc((p->pos - start + 1) * sizeof(char *));
+        for (int i = start; i < p->pos; i++) {
+            words[i - start] = p->tokens[i].text;
+        }
+        uint32_t cmd = add_command(p, words, p->pos - start);
+        free(words);
+        emit(p, OP_UNREDIRECT, 0, 0);
+        p->prog->code[slot] = (Instr) {.op = OP_REDIRECT, .a = cmd, .b = here(p)};
+    }
+}
+
+// 在 at 处插入一条指令，之后的跳转目标都向后移一位
+static void insert_instr(Parser *p, uint32_t at, Instr instr) {
+    emit(p, OP_END, 0, 0);
+    Program *prog = p->prog;
+    memmove(&prog->code[at + 1], &prog->code[at], (prog->code_len - 1 - at) * sizeof(Instr));
+    prog->code[at] = instr;
+    for (uint32_t i = at + 1; i < prog->code_len; i++) {
+        Instr *ins = &prog->code[i];
+        uint32_t *target = NULL;
+        switch (ins->op) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_SUBSHELL:
+            case OP_PIPE_STAGE:
+            case OP_BACKGROUND:
+                target = &ins->a;
+                break;
+            case OP_FOR_NEXT:
+            case OP_CASE_MATCH:
+            case OP_DEFUN:
+            case OP_REDIRECT:
+                target = &ins->b;
+                break;
+            default:
+                break;
+        }
+        if (target != NULL && *target != NO_OPERAND && *target >= at) {
+            (*target)++;
+        }
+    }
+    for (int i = 0; i < p->loop_depth; i++) {
+        for (int j = 0; j < p->loops[i].num_breaks; j++) {
+            if (p->loops[i].breaks[j] >= at) {
+                p->loops[i].breaks[j]++;
+            }
+        }
+        if (p->loops[i].continue_target >= at) {
+            p->loops[i].continue_target++;
+        }
+    }
+}
+
+// ! pipeline。只由简单命令组成的管道整体是一条 OP_EXEC，由 lsh_execute 执行；
+// 含有复合命令时每个阶段编译成一段在子进程中执行的代码
+static void parse_pipeline(Parser *p) {
+    bool negate = is_word(p, "!");
+    if (negate) {
+        p->pos++;
+    }
+    uint32_t start = here(p);
+    parse_command(p);
+
+    if (peek(p)->type == TOK_PIPE) {
+        insert_instr(p, start, (Instr) {.op = OP_PIPE_STAGE, .a = NO_OPERAND, .b = 0});
+        emit(p, OP_EXIT, 0, 0);
+        p->prog->code[start].a = here(p);
+        uint32_t last = start;
+        int saved_depth = p->loop_depth; // 子进程中的 break 不能跳出管道
+        p->loop_depth = 0;
+        while (peek(p)->type == TOK_PIPE) {
+            p->pos++;
+            skip_newlines(p);
+            last = emit(p, OP_PIPE_STAGE, NO_OPERAND, 0);
+            parse_command(p);
+            emit(p, OP_EXIT, 0, 0);
+            p->prog->code[last].a = here(p);
+        }
+        p->loop_depth = saved_depth;
+        p->prog->code[last].b = 1;
+        emit(p, OP_PIPE_WAIT, 0, 0);
+    }
+    if (negate) {
+        emit(p, OP_NOT, 0, 0);
+    }
+}
+
+// pipeline ((&& | ||) pipeline)*
+static void parse_and_or(Parser *p) {
+    parse_pipeline(p);
+    while (peek(p)->type == TOK_AND || peek(p)->type == TOK_OR) {
+        OpCode op = (peek(p)->type == TOK_AND) ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE;
+        p->pos++;
+        skip_newlines(p);
+        uint32_t skip = emit(p, op, NO_OPERAND, 0);
+        parse_pipeline(p);
+        p->prog->code[skip].a = here(p);
+    }
+}
+
+// 以换行、; 或 & 分隔的命令，遇到结束保留字时返回。
+// 简单命令的 & 由 parse_simple 作为单词交给 lsh_execute，剩下的 & 跟在复合命令后面，整体放到子进程中执行
+static void parse_list(Parser *p) {
+    for (;;) {
+        while (peek(p)->type == TOK_NEWLINE || peek(p)->type == TOK_SEMI || peek(p)->type == TOK_AMP) {
+            p->pos++;
+        }
+        if (at_list_end(p)) {
+            return;
+        }
+        uint32_t start = here(p);
+        parse_and_or(p);
+        if (peek(p)->type == TOK_AMP) {
+            insert_instr(p, start, (Instr) {.op = OP_BACKGROUND, .a = NO_OPERAND, .b = 0});
+            emit(p, OP_EXIT, 0, 0);
+            p->prog->code[start].a = here(p);
+        }
+    }
+}
+
+static void free_parser(Parser *p, bool keep_program) {
+    for (int i = 0; i < p->num_tokens; i++) {
+        free(p->tokens[i].text);
+    }
+    free(p->tokens);
+    for (int i = 0; i < p->loop_depth; i++) {
+        free(p->loops[i].breaks);
+    }
+    if (!keep_program) {
+        program_release(p->prog);
+    }
+}
+
+// 编译一段源代码。源代码在结构中间结束时用 read_more 读取后续的行，
+// read_more 为 NULL 或没有更多输入时视为语法错误。出错时返回 NULL
+Program *compile_source(const char *source, LineReader read_more) {
+    size_t len = strlen(source);
+    char *text = malloc(len + 2);
+    memcpy(text, source, len);
+    text[len++] = '\n';
+    text[len] = '\0';
+
+    for (;;) {
+        Parser parser = {0};
+        Parser *p = &parser;
+        p->can_read_more = read_more != NULL;
+        p->prog = calloc(1, sizeof(Program));
+        p->prog->refs = 1;
+
+        int result = setjmp(p->error);
+        if (result == PARSE_OK) {
+            tokenize(p, text);
+            parse_list(p);
+            if (peek(p)->type != TOK_EOF) {
+                parse_error(p, token_text(peek(p)));
+            }
+            emit(p, OP_END, 0, 0);
+            STAT_INC(vm_compiles);
+            free_parser(p, true);
+            free(text);
+            return parser.prog;
+        }
+
+        free_parser(p, false);
+        char *line = (result == PARSE_INCOMPLETE) ? read_more() : NULL;
+        if (line == NULL) {
+            if (result == PARSE_INCOMPLETE) {
+                fprintf(stderr, "lsh: 语法错误：未预期的文件结尾\n");
+            }
+            free(text);
+            return NULL;
+        }
+        // 读到更多的行后从头重新编译
+        size_t line_len = strlen(line);
+        text = realloc(text, len + line_len + 2);
+        memcpy(text + len, line, line_len);
+        len += line_len;
+        text[len++] = '\n';
+        text[len] = '\0';
+        free(line);
+    }
+}
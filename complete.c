@@ -0,0 +1,403 @@
+//
+// Created by ysh on 24-6-22.
+//
+// Tab 补全。
+// 命令名从内存中按字典序排好的索引里二分查找前缀，索引包含 $PATH 中的可执行文件和内置命令，
+// 别名在补全时单独检查。文件名补全使用按目录缓存的目录项。
+// 所有缓存的目录都用 inotify 监视，目录发生变化时只让对应的缓存失效，而不是每次补全都重新扫描。
+//
+
+#include "complete.h"
+#include "lsh_builtins.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <readline/readline.h>
+
+#define MAX_DIR_CACHES 64
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+extern char *builtin_str[];
+extern Alias aliases[MAX_ALIASES];
+extern int num_aliases;
+
+// 一个目录的目录项缓存，names 按字典序排序
+typedef struct DirCache {
+    char *path;
+    dev_t dev;          // 文件名补全的缓存按目录的 dev/ino 查找，cd 之后同一个相对路径对应别的目录
+    ino_t ino;
+    int wd;             // inotify 监视描述符，-1 表示没有监视
+    bool valid;
+    bool exec_only;     // 只记录可执行文件（$PATH 目录）
+    char **names;       // 目录以 '/' 结尾
+    int num_names;
+    unsigned long last_used;
+} DirCache;
+
+static int inotify_fd = -1;
+static DirCache *path_dirs = NULL;  // $PATH 中每个目录一项
+static int num_path_dirs = 0;
+static char *indexed_path = NULL;   // 建立索引时的 $PATH
+static DirCache file_dirs[MAX_DIR_CACHES];
+static int num_file_dirs = 0;
+static unsigned long use_clock = 0;
+
+// 命令索引：所有 $PATH 目录和内置命令合并、排序、去重后的结果
+static char **command_index = NULL;
+static int command_index_size = 0;
+static bool command_index_valid = false;
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void clear_dir_cache(DirCache *cache) {
+    for (int i = 0; i < cache->num_names; i++) {
+        free(cache->names[i]);
+    }
+    free(cache->names);
+    cache->names = NULL;
+    cache->num_names = 0;
+    cache->valid = false;
+}
+
+static void release_dir_cache(DirCache *cache) {
+    clear_dir_cache(cache);
+    if (cache->wd != -1 && inotify_fd != -1) {
+        inotify_rm_watch(inotify_fd, cache->wd);
+    }
+    free(cache->path);
+    cache->path = NULL;
+    cache->wd = -1;
+}
+
+// 读取一次目录内容，之后直到 inotify 通知变化前都使用缓存
+static void load_dir_cache(DirCache *cache) {
+    clear_dir_cache(cache);
+    if (cache->wd == -1 && inotify_fd != -1) {
+        cache->wd = inotify_add_watch(inotify_fd, cache->path, WATCH_MASK | IN_ONLYDIR);
+    }
+
+    DIR *dir = opendir(cache->path);
+    cache->valid = true;
+    if (dir == NULL) {
+        return;
+    }
+    int dir_fd = dirfd(dir);
+    int cap = 64;
+    cache->names = malloc(cap * sizeof(char *));
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = fstatat(dir_fd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (cache->exec_only && (is_dir || faccessat(dir_fd, entry->d_name, X_OK, 0) != 0)) {
+            continue;
+        }
+
+        if (cache->num_names >= cap) {
+            cap *= 2;
+            cache->names = realloc(cache->names, cap * sizeof(char *));
+        }
+        size_t len = strlen(entry->d_name);
+        char *name = malloc(len + 2);
+        memcpy(name, entry->d_name, len);
+        name[len] = is_dir ? '/' : '\0';
+        name[len + 1] = '\0';
+        cache->names[cache->num_names++] = name;
+    }
+    closedir(dir);
+    qsort(cache->names, cache->num_names, sizeof(char *), compare_names);
+}
+
+// 事件队列溢出时丢失了哪些目录的变化无从得知，所有缓存都失效
+static void invalidate_all() {
+    for (int i = 0; i < num_path_dirs; i++) {
+        path_dirs[i].valid = false;
+    }
+    for (int i = 0; i < num_file_dirs; i++) {
+        file_dirs[i].valid = false;
+    }
+    command_index_valid = false;
+}
+
+// 处理所有积压的 inotify 事件，让对应目录的缓存失效。
+// 监视被移除（IN_IGNORED，目录已删除或所在文件系统已卸载）时，$PATH 目录下次重新添加监视，文件名缓存直接删除
+static void drain_inotify() {
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while (inotify_fd != -1 && (len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                invalidate_all();
+                continue;
+            }
+            bool ignored = event->mask & IN_IGNORED;
+            for (int i = 0; i < num_path_dirs; i++) {
+                if (path_dirs[i].wd == event->wd) {
+                    path_dirs[i].valid = false;
+                    command_index_valid = false;
+                    if (ignored) {
+                        path_dirs[i].wd = -1;
+                    }
+                }
+            }
+            for (int i = 0; i < num_file_dirs; i++) {
+                if (file_dirs[i].wd != event->wd) {
+                    continue;
+                }
+                file_dirs[i].valid = false;
+                if (ignored) {
+                    file_dirs[i].wd = -1;
+                    release_dir_cache(&file_dirs[i]);
+                    file_dirs[i--] = file_dirs[--num_file_dirs];
+                }
+            }
+        }
+    }
+}
+
+// $PATH 变化时重新建立目录列表
+static void refresh_path_dirs() {
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (indexed_path != NULL && strcmp(indexed_path, path) == 0) {
+        return;
+    }
+
+    for (int i = 0; i < num_path_dirs; i++) {
+        release_dir_cache(&path_dirs[i]);
+    }
+    free(path_dirs);
+    free(indexed_path);
+    indexed_path = strdup(path);
+    num_path_dirs = 0;
+    path_dirs = NULL;
+    command_index_valid = false;
+
+    int cap = 0;
+    const char *dir = path;
+    while (*dir) {
+        size_t len = strcspn(dir, ":");
+        if (num_path_dirs >= cap) {
+            cap = cap ? cap * 2 : 16;
+            path_dirs = realloc(path_dirs, cap * sizeof(DirCache));
+        }
+        path_dirs[num_path_dirs++] = (DirCache) {.path = len ? strndup(dir, len) : strdup("."),
+                                                 .wd = -1, .exec_only = true};
+        dir += len;
+        if (*dir == ':') {
+            dir++;
+        }
+    }
+}
+
+// 只重新读取发生变化的 $PATH 目录，再合并成排序去重的命令索引
+static void rebuild_command_index() {
+    refresh_path_dirs();
+    if (command_index_valid) {
+        return;
+    }
+
+    int total = lsh_num_builtins();
+    for (int i = 0; i < num_path_dirs; i++) {
+        if (!path_dirs[i].valid) {
+            load_dir_cache(&path_dirs[i]);
+        }
+        total += path_dirs[i].num_names;
+    }
+
+    free(command_index);
+    command_index = malloc((total > 0 ? total : 1) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < lsh_num_builtins(); i++) {
+        command_index[n++] = builtin_str[i];
+    }
+    for (int i = 0; i < num_path_dirs; i++) {
+        memcpy(&command_index[n], path_dirs[i].names, path_dirs[i].num_names * sizeof(char *));
+        n += path_dirs[i].num_names;
+    }
+    qsort(command_index, n, sizeof(char *), compare_names);
+
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(command_index[unique - 1], command_index[i]) != 0) {
+            command_index[unique++] = command_index[i];
+        }
+    }
+    command_index_size = unique;
+    command_index_valid = true;
+}
+
+// 在排好序的数组中找到第一个不小于 prefix 的位置
+static int lower_bound(char **names, int n, const char *prefix) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(names[mid], prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static DirCache *get_file_dir(const char *path) {
+    static DirCache missing = {.wd = -1, .valid = true};
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return &missing;
+    }
+    for (int i = 0; i < num_file_dirs; i++) {
+        if (file_dirs[i].dev == st.st_dev && file_dirs[i].ino == st.st_ino) {
+            file_dirs[i].last_used = ++use_clock;
+            if (!file_dirs[i].valid) {
+                // 用现在的路径重新读取，之前记录的相对路径在 cd 之后可能指向别的目录
+                free(file_dirs[i].path);
+                file_dirs[i].path = strdup(path);
+                load_dir_cache(&file_dirs[i]);
+            }
+            return &file_dirs[i];
+        }
+    }
+
+    // 缓存已满时淘汰最久未使用的目录
+    DirCache *cache = &file_dirs[num_file_dirs];
+    if (num_file_dirs >= MAX_DIR_CACHES) {
+        cache = &file_dirs[0];
+        for (int i = 1; i < num_file_dirs; i++) {
+            if (file_dirs[i].last_used < cache->last_used) {
+                cache = &file_dirs[i];
+            }
+        }
+        release_dir_cache(cache);
+    } else {
+        num_file_dirs++;
+    }
+    *cache = (DirCache) {.path = strdup(path), .dev = st.st_dev, .ino = st.st_ino, .wd = -1,
+                         .last_used = ++use_clock};
+    load_dir_cache(cache);
+    return cache;
+}
+
+/*
+  readline 补全生成函数，state 为 0 时开始新的一轮
+*/
+static int match_pos;
+static int match_end;
+static size_t match_len;
+static int alias_pos;
+
+static char *command_generator(const char *text, int state) {
+    if (state == 0) {
+        rebuild_command_index();
+        match_len = strlen(text);
+        match_pos = lower_bound(command_index, command_index_size, text);
+        alias_pos = 0;
+    }
+    if (match_pos < command_index_size && strncmp(command_index[match_pos], text, match_len) == 0) {
+        return strdup(command_index[match_pos++]);
+    }
+    while (alias_pos < num_aliases) {
+        char *name = aliases[alias_pos++].name;
+        if (strncmp(name, text, match_len) == 0) {
+            return strdup(name);
+        }
+    }
+    return NULL;
+}
+
+static DirCache *file_cache;
+static char *file_dir_part;
+
+static char *filename_generator(const char *text, int state) {
+    if (state == 0) {
+        const char *slash = strrchr(text, '/');
+        const char *base = slash ? slash + 1 : text;
+        free(file_dir_part);
+        file_dir_part = strndup(text, base - text);
+
+        char dir_path[PATH_MAX];
+        if (slash == NULL) {
+            strcpy(dir_path, ".");
+        } else if (slash == text) {
+            strcpy(dir_path, "/");
+        } else {
+            snprintf(dir_path, sizeof(dir_path), "%.*s", (int) (slash - text), text);
+        }
+        file_cache = get_file_dir(dir_path);
+        match_len = strlen(base);
+        match_pos = lower_bound(file_cache->names, file_cache->num_names, base);
+        match_end = file_cache->num_names;
+    }
+
+    const char *base = text + strlen(file_dir_part);
+    while (match_pos < match_end && strncmp(file_cache->names[match_pos], base, match_len) == 0) {
+        char *name = file_cache->names[match_pos++];
+        if (name[0] == '.' && base[0] != '.') {
+            continue; // 隐藏文件只在前缀以 '.' 开头时补全
+        }
+        size_t dir_len = strlen(file_dir_part);
+        char *result = malloc(dir_len + strlen(name) + 1);
+        memcpy(result, file_dir_part, dir_len);
+        strcpy(result + dir_len, name);
+        return result;
+    }
+    return NULL;
+}
+
+// 行首的单词补全命令，其余位置补全文件名
+static char **lsh_completion(const char *text, int start, int end) {
+    drain_inotify();
+    rl_attempted_completion_over = 1; // 不使用 readline 默认的文件名补全
+
+    int word_start = 0;
+    while (word_start < start && (rl_line_buffer[word_start] == ' ' || rl_line_buffer[word_start] == '\t')) {
+        word_start++;
+    }
+    bool first_word = word_start == start;
+    // 管道符号后面也是命令
+    for (int i = start - 1; i >= 0 && !first_word; i--) {
+        if (rl_line_buffer[i] == '|') {
+            first_word = true;
+        } else if (rl_line_buffer[i] != ' ' && rl_line_buffer[i] != '\t') {
+            break;
+        }
+    }
+
+    char **matches;
+    if (first_word && strchr(text, '/') == NULL) {
+        matches = rl_completion_matches(text, command_generator);
+    } else {
+        matches = rl_completion_matches(text, filename_generator);
+    }
+    // 唯一匹配是目录时不追加空格，方便继续补全
+    if (matches != NULL && matches[1] == NULL) {
+        size_t len = strlen(matches[0]);
+        rl_completion_suppress_append = len > 0 && matches[0][len - 1] == '/';
+    }
+    return matches;
+}
+
+void completion_init() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    rl_attempted_completion_function = lsh_completion;
+}
@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-6-22.
+//
+
+#ifndef OS_C_COMPLETE_H
+#define OS_C_COMPLETE_H
+
+void completion_init();
+
+#endif //OS_C_COMPLETE_H
@@ -0,0 +1,551 @@
+//
+// Created by ysh on 24-7-1.
+//
+// count 内置命令：一遍读完输入，统计每个键出现的次数，代替 sort | uniq -c | sort -rn。
+// 键放在开放寻址的哈希表里，槽中同时存哈希值的高 32 位和条目下标，探测时不用访问条目；
+// 键的内容复制到按块分配的内存区中。--approx=M 使用 Space-Saving 算法，只保留 M 个计数器，
+// 计数器按次数组成最小堆，新键替换次数最少的那个，输出的次数是上界。
+// --top N 用大小为 N 的最小堆选出次数最多的键，不对全部键排序。
+//
+
+#define _GNU_SOURCE
+#include "count.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COUNT_ARENA_BLOCK (1 << 20)
+#define COUNT_READ_SIZE (1 << 20)
+#define COUNT_INITIAL_SLOTS 1024
+
+typedef struct CountOptions {
+    int field;            // 0 表示整行
+    int separator;        // -1 表示以连续的空白分隔
+    size_t top;           // 0 表示输出全部
+    size_t approx;        // Space-Saving 的计数器个数，0 表示精确统计
+} CountOptions;
+
+typedef struct CountEntry {
+    char *key;
+    size_t len;
+    uint64_t hash;
+    unsigned long long count;
+    size_t heap_pos;      // 近似模式下在最小堆中的位置
+} CountEntry;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct CountTable {
+    uint64_t *slots;      // 高 32 位是哈希值的高 32 位，低 32 位是条目下标加一，0 表示空槽
+    size_t mask;
+    CountEntry *entries;
+    size_t num_entries;
+    size_t cap_entries;
+    ArenaBlock *arena;
+    size_t *heap;         // 近似模式：按次数排列的条目下标
+    size_t max_entries;
+} CountTable;
+
+/*
+  哈希表
+*/
+
+// 每次取 8 个字节做乘法混合，最后用 murmur3 的 fmix64 打散
+static uint64_t hash_key(const char *p, size_t n) {
+    const uint64_t m = 0xff51afd7ed558ccdULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (n * m);
+    uint64_t w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    if (n > 0) {
+        w = 0;
+        memcpy(&w, p, n);
+        h = (h ^ w) * m;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static char *arena_copy(CountTable *t, const char *key, size_t len) {
+    ArenaBlock *b = t->arena;
+    if (b == NULL || b->size - b->used < len) {
+        size_t size = len > COUNT_ARENA_BLOCK ? len : COUNT_ARENA_BLOCK;
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->next = t->arena;
+        b->used = 0;
+        b->size = size;
+        t->arena = b;
+    }
+    char *p = b->data + b->used;
+    memcpy(p, key, len);
+    b->used += len;
+    return p;
+}
+
+static uint64_t make_slot(uint64_t hash, size_t index) {
+    return (hash & 0xFFFFFFFF00000000ULL) | (uint64_t) (index + 1);
+}
+
+static void grow_slots(CountTable *t) {
+    size_t size = (t->mask + 1) * 2;
+    uint64_t *slots = calloc(size, sizeof(uint64_t));
+    for (size_t i = 0; i < t->num_entries; i++) {
+        size_t pos = t->entries[i].hash & (size - 1);
+        while (slots[pos] != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        slots[pos] = make_slot(t->entries[i].hash, i);
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask = size - 1;
+}
+
+// 找到键所在的槽，或者应该插入的空槽
+static size_t find_slot(const CountTable *t, const char *key, size_t len, uint64_t hash) {
+    uint64_t tag = hash & 0xFFFFFFFF00000000ULL;
+    size_t pos = hash & t->mask;
+    for (;;) {
+        uint64_t slot = t->slots[pos];
+        if (slot == 0) {
+            return pos;
+        }
+        if ((slot & 0xFFFFFFFF00000000ULL) == tag) {
+            const CountEntry *e = &t->entries[(slot & 0xFFFFFFFF) - 1];
+            if (e->len == len && memcmp(e->key, key, len) == 0) {
+                return pos;
+            }
+        }
+        pos = (pos + 1) & t->mask;
+    }
+}
+
+// 线性探测的删除：把后面本该靠前的槽依次移过来填补空位
+static void remove_slot(CountTable *t, size_t pos) {
+    size_t next = (pos + 1) & t->mask;
+    while (t->slots[next] != 0) {
+        size_t home = t->entries[(t->slots[next] & 0xFFFFFFFF) - 1].hash & t->mask;
+        // home 不在 (pos, next] 之间时，这个槽可以移到 pos
+        if (((next - home) & t->mask) >= ((next - pos) & t->mask)) {
+            t->slots[pos] = t->slots[next];
+            pos = next;
+        }
+        next = (next + 1) & t->mask;
+    }
+    t->slots[pos] = 0;
+}
+
+/*
+  Space-Saving：按次数排列的最小堆
+*/
+
+static void heap_swap(CountTable *t, size_t a, size_t b) {
+    size_t tmp = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->entries[t->heap[a]].heap_pos = a;
+    t->entries[t->heap[b]].heap_pos = b;
+}
+
+// 次数只会增加，所以只需要向下调整
+static void heap_sift_down(CountTable *t, size_t pos) {
+    size_t n = t->num_entries;
+    for (;;) {
+        size_t smallest = pos, left = 2 * pos + 1, right = left + 1;
+        if (left < n && t->entries[t->heap[left]].count < t->entries[t->heap[smallest]].count) {
+            smallest = left;
+        }
+        if (right < n && t->entries[t->heap[right]].count < t->entries[t->heap[smallest]].count) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        heap_swap(t, pos, smallest);
+        pos = smallest;
+    }
+}
+
+// 计数器用完时替换次数最少的键：新键的次数记为被替换的次数加一
+static void replace_min(CountTable *t, const char *key, size_t len, uint64_t hash) {
+    size_t index = t->heap[0];
+    CountEntry *e = &t->entries[index];
+    remove_slot(t, find_slot(t, e->key, e->len, e->hash));
+    free(e->key);
+    e->key = malloc(len > 0 ? len : 1);
+    memcpy(e->key, key, len);
+    e->len = len;
+    e->hash = hash;
+    e->count++;
+    t->slots[find_slot(t, key, len, hash)] = make_slot(hash, index);
+    heap_sift_down(t, 0);
+}
+
+static void count_key(CountTable *t, const char *key, size_t len) {
+    uint64_t hash = hash_key(key, len);
+    size_t pos = find_slot(t, key, len, hash);
+    if (t->slots[pos] != 0) {
+        CountEntry *e = &t->entries[(t->slots[pos] & 0xFFFFFFFF) - 1];
+        e->count++;
+        if (t->heap != NULL) {
+            heap_sift_down(t, e->heap_pos);
+        }
+        return;
+    }
+    if (t->heap != NULL && t->num_entries == t->max_entries) {
+        replace_min(t, key, len, hash);
+        return;
+    }
+    if (t->num_entries == t->cap_entries) {
+        t->cap_entries *= 2;
+        t->entries = realloc(t->entries, t->cap_entries * sizeof(CountEntry));
+    }
+    size_t index = t->num_entries++;
+    CountEntry *e = &t->entries[index];
+    // 近似模式的键会被替换，单独分配；精确模式放在内存区中，最后一起释放
+    if (t->heap != NULL) {
+        e->key = malloc(len > 0 ? len : 1);
+        memcpy(e->key, key, len);
+    } else {
+        e->key = arena_copy(t, key, len);
+    }
+    e->len = len;
+    e->hash = hash;
+    e->count = 1;
+    t->slots[pos] = make_slot(hash, index);
+    if (t->heap != NULL) {
+        // 新计数器的次数是 1，不会比任何计数器大，从末尾一直上移到堆顶附近
+        t->heap[index] = index;
+        e->heap_pos = index;
+        for (size_t p = index; p > 0 && t->entries[t->heap[(p - 1) / 2]].count > 1; p = (p - 1) / 2) {
+            heap_swap(t, p, (p - 1) / 2);
+        }
+    }
+    // 负载超过 1/2 时扩容
+    if (t->num_entries * 2 > t->mask + 1) {
+        grow_slots(t);
+    }
+}
+
+static void table_init(CountTable *t, const CountOptions *o) {
+    memset(t, 0, sizeof(*t));
+    size_t slots = COUNT_INITIAL_SLOTS;
+    t->cap_entries = COUNT_INITIAL_SLOTS / 2;
+    if (o->approx > 0) {
+        while (slots < o->approx * 2 + 2) {
+            slots *= 2;
+        }
+        t->max_entries = o->approx;
+        t->cap_entries = o->approx;
+        t->heap = malloc(o->approx * sizeof(size_t));
+    }
+    t->slots = calloc(slots, sizeof(uint64_t));
+    t->mask = slots - 1;
+    t->entries = malloc(t->cap_entries * sizeof(CountEntry));
+}
+
+static void table_free(CountTable *t) {
+    if (t->heap != NULL) {
+        for (size_t i = 0; i < t->num_entries; i++) {
+            free(t->entries[i].key);
+        }
+    }
+    for (ArenaBlock *b = t->arena, *next; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(t->slots);
+    free(t->entries);
+    free(t->heap);
+}
+
+/*
+  读取输入
+*/
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// 取出一行中的第 field 个字段；字段不存在时键为空串
+static void extract_key(const char *line, size_t len, const CountOptions *o, const char **key, size_t *key_len) {
+    if (o->field == 0) {
+        *key = line;
+        *key_len = len;
+        return;
+    }
+    const char *p = line, *end = line + len;
+    if (o->separator >= 0) {
+        for (int f = 1; f < o->field; f++) {
+            const char *sep = memchr(p, o->separator, end - p);
+            if (sep == NULL) {
+                *key = end;
+                *key_len = 0;
+                return;
+            }
+            p = sep + 1;
+        }
+        const char *sep = memchr(p, o->separator, end - p);
+        *key = p;
+        *key_len = (sep != NULL ? sep : end) - p;
+        return;
+    }
+    // 默认和 awk 一样：跳过开头的空白，以连续的空白分隔
+    for (int f = 1;; f++) {
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+        const char *start = p;
+        while (p < end && !is_blank(*p)) {
+            p++;
+        }
+        if (f == o->field || p == end) {
+            *key = f == o->field ? start : end;
+            *key_len = f == o->field ? (size_t) (p - start) : 0;
+            return;
+        }
+    }
+}
+
+// 统计一段完整的行，返回处理的行数；最后一行没有换行结尾时由 final 决定是否计入
+static size_t count_lines(CountTable *t, const char *data, size_t len, const CountOptions *o, bool final,
+                          size_t *consumed) {
+    const char *p = data, *end = data + len, *nl;
+    size_t lines = 0;
+    while ((nl = memchr(p, '\n', end - p)) != NULL || (final && p < end)) {
+        const char *line_end = nl != NULL ? nl : end;
+        const char *key;
+        size_t key_len;
+        extract_key(p, line_end - p, o, &key, &key_len);
+        count_key(t, key, key_len);
+        lines++;
+        p = nl != NULL ? nl + 1 : end;
+    }
+    *consumed = p - data;
+    return lines;
+}
+
+// 普通文件映射进来整体统计，其他输入按块读取，不完整的最后一行留到下一块
+static bool count_input(CountTable *t, FILE *in, const CountOptions *o, unsigned long long *lines) {
+    struct stat sb;
+    int fd = fileno(in);
+    off_t pos = ftello(in);
+    size_t consumed;
+    if (fd >= 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && pos >= 0 && sb.st_size > pos
+        && lseek(fd, 0, SEEK_CUR) == pos) {
+        char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, sb.st_size, MADV_SEQUENTIAL);
+            *lines += count_lines(t, map + pos, sb.st_size - pos, o, true, &consumed);
+            munmap(map, sb.st_size);
+            fseeko(in, 0, SEEK_END);
+            return true;
+        }
+    }
+    size_t cap = COUNT_READ_SIZE, len = 0, n;
+    char *buf = malloc(cap);
+    while ((n = fread(buf + len, 1, cap - len, in)) > 0) {
+        len += n;
+        *lines += count_lines(t, buf, len, o, false, &consumed);
+        memmove(buf, buf + consumed, len - consumed);
+        len -= consumed;
+        if (len == cap) {
+            cap *= 2; // 一行比缓冲区还长
+            buf = realloc(buf, cap);
+        }
+    }
+    *lines += count_lines(t, buf, len, o, true, &consumed);
+    free(buf);
+    return !ferror(in);
+}
+
+/*
+  输出
+*/
+
+// 次数多的在前，次数相同时按键的字节序
+static int compare_entries(const CountEntry *a, const CountEntry *b) {
+    if (a->count != b->count) {
+        return a->count > b->count ? -1 : 1;
+    }
+    size_t n = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->key, b->key, n);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+static int compare_entry_ptrs(const void *a, const void *b) {
+    return compare_entries(*(const CountEntry *const *) a, *(const CountEntry *const *) b);
+}
+
+// 大小为 top 的堆，堆顶是目前入选的键中排在最后的
+static void top_sift_down(const CountEntry **heap, size_t n, size_t pos) {
+    for (;;) {
+        size_t worst = pos, left = 2 * pos + 1, right = left + 1;
+        if (left < n && compare_entries(heap[left], heap[worst]) > 0) {
+            worst = left;
+        }
+        if (right < n && compare_entries(heap[right], heap[worst]) > 0) {
+            worst = right;
+        }
+        if (worst == pos) {
+            return;
+        }
+        const CountEntry *tmp = heap[pos];
+        heap[pos] = heap[worst];
+        heap[worst] = tmp;
+        pos = worst;
+    }
+}
+
+static size_t select_entries(const CountTable *t, size_t top, const CountEntry **out) {
+    if (top == 0 || top >= t->num_entries) {
+        for (size_t i = 0; i < t->num_entries; i++) {
+            out[i] = &t->entries[i];
+        }
+        return t->num_entries;
+    }
+    for (size_t i = 0; i < top; i++) {
+        out[i] = &t->entries[i];
+    }
+    for (size_t i = top / 2; i-- > 0;) {
+        top_sift_down(out, top, i);
+    }
+    for (size_t i = top; i < t->num_entries; i++) {
+        if (compare_entries(&t->entries[i], out[0]) < 0) {
+            out[0] = &t->entries[i];
+            top_sift_down(out, top, 0);
+        }
+    }
+    return top;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: count [-k 字段] [-t 分隔符] [--top N] [--approx=计数器个数] [文件...]\n");
+}
+
+static bool parse_number(const char *s, size_t *value) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    *value = v;
+    return s[0] >= '0' && s[0] <= '9' && *end == '\0' && errno == 0;
+}
+
+static bool parse_options(char **args, CountOptions *o, int *first_file) {
+    int i = 1;
+    size_t value;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(arg, "--top") == 0 || strncmp(arg, "--top=", 6) == 0) {
+            const char *v = arg[5] == '=' ? arg + 6 : args[++i];
+            if (v == NULL || !parse_number(v, &o->top)) {
+                fprintf(stderr, "count: 无效的个数 %s\n", v ? v : "");
+                return false;
+            }
+        } else if (strncmp(arg, "--approx=", 9) == 0) {
+            if (!parse_number(arg + 9, &o->approx) || o->approx == 0 || o->approx >= 0xFFFFFFFF) {
+                fprintf(stderr, "count: 无效的计数器个数 %s\n", arg + 9);
+                return false;
+            }
+        } else if (arg[1] == 'k' || arg[1] == 't') {
+            const char *v = arg[2] != '\0' ? arg + 2 : args[++i];
+            if (v == NULL) {
+                usage();
+                return false;
+            }
+            if (arg[1] == 't') {
+                if (strlen(v) != 1) {
+                    fprintf(stderr, "count: 分隔符必须是单个字符\n");
+                    return false;
+                }
+                o->separator = (unsigned char) v[0];
+            } else if (!parse_number(v, &value) || value == 0 || value > 1000000) {
+                fprintf(stderr, "count: 无效的字段 %s\n", v);
+                return false;
+            } else {
+                o->field = (int) value;
+            }
+        } else {
+            fprintf(stderr, "count: 无效的选项 %s\n", arg);
+            usage();
+            return false;
+        }
+    }
+    *first_file = i;
+    return true;
+}
+
+// count [-k 字段] [-t 分隔符] [--top N] [--approx=M] [文件...]
+// 输出格式和 uniq -c 一样，次数从多到少
+int lsh_count(char **args) {
+    CountOptions o = {.separator = -1};
+    int first_file;
+    if (!parse_options(args, &o, &first_file)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    CountTable table;
+    table_init(&table, &o);
+    unsigned long long lines = 0;
+    bool failed = false;
+    int num_files = 0;
+    while (args[first_file + num_files] != NULL) {
+        num_files++;
+    }
+    for (int i = 0; i < (num_files == 0 ? 1 : num_files); i++) {
+        const char *name = num_files == 0 || strcmp(args[first_file + i], "-") == 0 ? NULL : args[first_file + i];
+        FILE *in = name == NULL ? LSH_IN : fopen(name, "re");
+        if (in == NULL) {
+            fprintf(stderr, "count: 无法打开 %s: %s\n", name, strerror(errno));
+            failed = true;
+            continue;
+        }
+        if (!count_input(&table, in, &o, &lines)) {
+            fprintf(stderr, "count: 读取 %s 出错: %s\n", name ? name : "标准输入", strerror(errno));
+            failed = true;
+        }
+        if (name != NULL) {
+            fclose(in);
+        }
+    }
+    STAT_ADD(count_lines, lines);
+
+    const CountEntry **selected = malloc((table.num_entries > 0 ? table.num_entries : 1) * sizeof(CountEntry *));
+    size_t n = select_entries(&table, o.top, selected);
+    qsort(selected, n, sizeof(CountEntry *), compare_entry_ptrs);
+    FILE *out = LSH_OUT;
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "%7llu ", selected[i]->count);
+        fwrite(selected[i]->key, 1, selected[i]->len, out);
+        fputc('\n', out);
+    }
+    free(selected);
+    table_free(&table);
+    lsh_last_status = failed ? 1 : 0;
+    return 1;
+}
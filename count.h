@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-1.
+//
+
+#ifndef OS_C_COUNT_H
+#define OS_C_COUNT_H
+
+int lsh_count(char **args);
+
+#endif //OS_C_COUNT_H
@@ -0,0 +1,523 @@
+//
+// Created by ysh on 24-7-5.
+//
+// cp 内置命令。每个文件先尝试 FICLONE 共享数据块（btrfs、xfs 上几乎不花时间），
+// 不支持时用 copy_file_range 在内核里复制，跨文件系统等情况再退回到 1MiB 缓冲区的 pread/pwrite。
+// 有空洞的文件用 SEEK_DATA/SEEK_HOLE 只复制有数据的部分，目标文件保持稀疏。
+// -r 时由调用线程按顺序遍历源目录、创建目标目录并打开文件，复制数据的工作交给线程池；
+// 任务队列有上限，打开的 fd 数不会无限增长。目录的权限和 -p 的时间在所有文件复制完后从内向外设置。
+//
+
+#define _GNU_SOURCE
+#include "cp.h"
+#include "walk.h"
+#include "dir_reader.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define COPY_BUF_SIZE (1024 * 1024)
+#define COPY_QUEUE_SIZE 64
+#define MAX_COPY_THREADS 32
+
+typedef struct CopyJob {
+    int src_fd;
+    int dst_fd;
+    struct stat st;
+    char *src;
+    char *dst;
+} CopyJob;
+
+// 所有文件复制完后再设置的目录属性
+typedef struct DirFixup {
+    char *path;
+    struct stat st;
+} DirFixup;
+
+typedef struct CpContext {
+    bool recursive;
+    bool preserve;
+    atomic_bool failed;
+
+    // 线程池，num_threads 为 0 时在调用线程中直接复制
+    pthread_t threads[MAX_COPY_THREADS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    CopyJob jobs[COPY_QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+    bool closing;
+
+    DirFixup *fixups;
+    size_t num_fixups;
+    size_t cap_fixups;
+    dev_t top_dev;                  // 正在复制到的顶层目标目录，遍历到它时跳过，避免把目录复制到自身里无限循环
+    ino_t top_ino;
+} CpContext;
+
+// 错误立即输出，所有文件处理完后由 lsh_cp 设置退出状态
+static void copy_error(CpContext *c, const char *what, const char *path, int err) {
+    fprintf(stderr, "cp: %s %s: %s\n", what, path, strerror(err));
+    atomic_store(&c->failed, true);
+}
+
+/*
+  复制文件数据
+*/
+
+static bool pread_copy(int in, int out, off_t off, off_t len) {
+    char *buf = malloc(COPY_BUF_SIZE);
+    bool ok = buf != NULL;
+    while (ok && len > 0) {
+        ssize_t n = pread(in, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, off);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (ssize_t done = 0; ok && done < n;) {
+            ssize_t w = pwrite(out, buf + done, n - done, off + done);
+            if (w < 0) {
+                ok = errno == EINTR;
+            } else {
+                done += w;
+            }
+        }
+        off += n;
+        len -= n;
+    }
+    free(buf);
+    return ok;
+}
+
+// 复制 [off, off + len)，copy_file_range 不支持时退回到 pread/pwrite
+static bool copy_range(int in, int out, off_t off, off_t len) {
+    loff_t in_off = off, out_off = off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, len < (1 << 30) ? len : (1 << 30), 0);
+        if (n > 0) {
+            len -= n;
+        } else if (n == 0) {
+            return true; // 源文件变短了
+        } else if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADF) {
+            return pread_copy(in, out, in_off, len);
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 大小未知的文件（比如 /proc 下的文件）读到末尾为止
+static bool stream_copy(int in, int out) {
+    char *buf = malloc(COPY_BUF_SIZE);
+    bool ok = buf != NULL;
+    while (ok) {
+        ssize_t n = read(in, buf, COPY_BUF_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (ssize_t done = 0; ok && done < n;) {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w < 0) {
+                ok = errno == EINTR;
+            } else {
+                done += w;
+            }
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+static bool copy_sparse(int in, int out, off_t size) {
+    off_t off = 0;
+    while (off < size) {
+        off_t data = lseek(in, off, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break; // 后面都是空洞
+            }
+            return copy_range(in, out, off, size - off);
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) {
+            hole = size;
+        }
+        if (!copy_range(in, out, data, hole - data)) {
+            return false;
+        }
+        off = hole;
+    }
+    return ftruncate(out, size) == 0;
+}
+
+static bool copy_data(int in, int out, const struct stat *st) {
+    if (st->st_size == 0) {
+        return stream_copy(in, out);
+    }
+    if (ioctl(out, FICLONE, in) == 0) {
+        STAT_INC(cp_clones);
+        STAT_ADD(cp_bytes, st->st_size);
+        return true;
+    }
+    bool ok = (off_t) st->st_blocks * 512 < st->st_size ? copy_sparse(in, out, st->st_size) : copy_range(in, out, 0, st->st_size);
+    if (ok) {
+        STAT_ADD(cp_bytes, st->st_size);
+    }
+    return ok;
+}
+
+static void preserve_attrs(int fd, const struct stat *st) {
+    // 不是 root 时改不了属主，和 GNU cp 一样不报错
+    if (fchown(fd, st->st_uid, st->st_gid) != 0) {
+        fchown(fd, -1, st->st_gid);
+    }
+    fchmod(fd, st->st_mode & 07777);
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    futimens(fd, times);
+}
+
+static void run_job(CpContext *c, CopyJob *job) {
+    if (!copy_data(job->src_fd, job->dst_fd, &job->st)) {
+        fprintf(stderr, "cp: 复制 %s 到 %s 失败: %s\n", job->src, job->dst, strerror(errno));
+        atomic_store(&c->failed, true);
+    } else if (c->preserve) {
+        preserve_attrs(job->dst_fd, &job->st);
+    }
+    close(job->src_fd);
+    if (close(job->dst_fd) != 0) {
+        copy_error(c, "无法写入", job->dst, errno);
+    }
+    free(job->src);
+    free(job->dst);
+}
+
+/*
+  线程池
+*/
+
+static void *copy_worker(void *arg) {
+    CpContext *c = arg;
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->head == c->tail && !c->closing) {
+            pthread_cond_wait(&c->not_empty, &c->lock);
+        }
+        if (c->head == c->tail) {
+            break;
+        }
+        CopyJob job = c->jobs[c->head++ % COPY_QUEUE_SIZE];
+        pthread_cond_signal(&c->not_full);
+        pthread_mutex_unlock(&c->lock);
+        run_job(c, &job);
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+static void start_pool(CpContext *c, int threads) {
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->not_empty, NULL);
+    pthread_cond_init(&c->not_full, NULL);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < threads && i < MAX_COPY_THREADS; i++) {
+        if (pthread_create(&c->threads[c->num_threads], NULL, copy_worker, c) == 0) {
+            c->num_threads++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_pool(CpContext *c) {
+    if (c->num_threads == 0) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->closing = true;
+    pthread_cond_broadcast(&c->not_empty);
+    pthread_mutex_unlock(&c->lock);
+    for (int i = 0; i < c->num_threads; i++) {
+        pthread_join(c->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->not_empty);
+    pthread_cond_destroy(&c->not_full);
+}
+
+static void submit_job(CpContext *c, CopyJob *job) {
+    if (c->num_threads == 0) {
+        run_job(c, job);
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    while (c->tail - c->head == COPY_QUEUE_SIZE) {
+        pthread_cond_wait(&c->not_full, &c->lock);
+    }
+    c->jobs[c->tail++ % COPY_QUEUE_SIZE] = *job;
+    pthread_cond_signal(&c->not_empty);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+  遍历源文件
+*/
+
+static char *join(const char *dir, const char *name) {
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+    sprintf(path, len > 0 && dir[len - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+static void copy_entry(CpContext *c, int src_at, const char *src_name, const char *src,
+                       int dst_at, const char *dst_name, const char *dst, bool top);
+
+static void copy_dir(CpContext *c, int src_at, const char *src_name, const char *src,
+                     int dst_at, const char *dst_name, const char *dst, const struct stat *st, bool top) {
+    DirReader reader;
+    if (!dir_reader_open(&reader, src_at, src_name)) {
+        copy_error(c, "无法打开目录", src, errno);
+        return;
+    }
+    // 先保证自己能在里面创建文件，原来的权限最后再设置
+    if (mkdirat(dst_at, dst_name, (st->st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) {
+        copy_error(c, "无法创建目录", dst, errno);
+        dir_reader_close(&reader);
+        return;
+    }
+    int dst_fd = openat(dst_at, dst_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat dst_st;
+    if (dst_fd == -1 || fstat(dst_fd, &dst_st) != 0) {
+        copy_error(c, "无法打开目录", dst, errno);
+        dir_reader_close(&reader);
+        return;
+    }
+    if (top) {
+        c->top_dev = dst_st.st_dev;
+        c->top_ino = dst_st.st_ino;
+    }
+    DirEntry e;
+    while (dir_reader_next(&reader, &e)) {
+        struct stat child;
+        if (e.ino == c->top_ino && fstatat(reader.fd, e.name, &child, AT_SYMLINK_NOFOLLOW) == 0 &&
+            child.st_dev == c->top_dev && child.st_ino == c->top_ino) {
+            fprintf(stderr, "cp: 不能把目录 %s 复制到它自身 %s 中\n", src, dst);
+            atomic_store(&c->failed, true);
+            continue;
+        }
+        char *child_src = join(src, e.name);
+        char *child_dst = join(dst, e.name);
+        copy_entry(c, reader.fd, e.name, child_src, dst_fd, e.name, child_dst, false);
+        free(child_src);
+        free(child_dst);
+    }
+    dir_reader_close(&reader);
+    close(dst_fd);
+    if (c->preserve || (st->st_mode & S_IRWXU) != S_IRWXU) {
+        if (c->num_fixups == c->cap_fixups) {
+            c->cap_fixups = c->cap_fixups == 0 ? 64 : c->cap_fixups * 2;
+            c->fixups = realloc(c->fixups, c->cap_fixups * sizeof(DirFixup));
+        }
+        c->fixups[c->num_fixups++] = (DirFixup) {strdup(dst), *st};
+    }
+}
+
+static void copy_symlink(CpContext *c, int src_at, const char *src_name, const char *src,
+                         int dst_at, const char *dst_name, const char *dst, const struct stat *st) {
+    char *target = malloc(st->st_size + 1);
+    ssize_t n = readlinkat(src_at, src_name, target, st->st_size + 1);
+    if (n < 0 || n > st->st_size) {
+        copy_error(c, "无法读取符号链接", src, n < 0 ? errno : ENAMETOOLONG);
+        free(target);
+        return;
+    }
+    target[n] = '\0';
+    // 目标已经存在时和 GNU cp 一样替换掉
+    if (symlinkat(target, dst_at, dst_name) != 0 &&
+        (errno != EEXIST || unlinkat(dst_at, dst_name, 0) != 0 || symlinkat(target, dst_at, dst_name) != 0)) {
+        copy_error(c, "无法创建符号链接", dst, errno);
+    } else if (c->preserve) {
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        utimensat(dst_at, dst_name, times, AT_SYMLINK_NOFOLLOW);
+    }
+    free(target);
+}
+
+static void copy_file(CpContext *c, int src_at, const char *src_name, const char *src,
+                      int dst_at, const char *dst_name, const char *dst, const struct stat *st) {
+    CopyJob job = {.st = *st};
+    job.src_fd = openat(src_at, src_name, O_RDONLY | O_CLOEXEC | (c->recursive ? O_NOFOLLOW : 0));
+    if (job.src_fd == -1) {
+        copy_error(c, "无法打开", src, errno);
+        return;
+    }
+    // 先不截断，确认不是同一个文件后再截断
+    job.dst_fd = openat(dst_at, dst_name, O_WRONLY | O_CREAT | O_CLOEXEC, st->st_mode & 0777);
+    struct stat dst_st;
+    if (job.dst_fd == -1 || fstat(job.dst_fd, &dst_st) != 0) {
+        copy_error(c, "无法创建", dst, errno);
+        close(job.src_fd);
+        return;
+    }
+    if (dst_st.st_dev == st->st_dev && dst_st.st_ino == st->st_ino) {
+        fprintf(stderr, "cp: %s 和 %s 是同一个文件\n", src, dst);
+        atomic_store(&c->failed, true);
+        close(job.src_fd);
+        close(job.dst_fd);
+        return;
+    }
+    if (dst_st.st_size > 0 && ftruncate(job.dst_fd, 0) != 0) {
+        copy_error(c, "无法截断", dst, errno);
+        close(job.src_fd);
+        close(job.dst_fd);
+        return;
+    }
+    job.src = strdup(src);
+    job.dst = strdup(dst);
+    submit_job(c, &job);
+}
+
+// 复制一项。-r 时不跟随符号链接（包括命令行上的），否则复制链接指向的文件
+static void copy_entry(CpContext *c, int src_at, const char *src_name, const char *src,
+                       int dst_at, const char *dst_name, const char *dst, bool top) {
+    struct stat st;
+    if (fstatat(src_at, src_name, &st, c->recursive ? AT_SYMLINK_NOFOLLOW : 0) != 0) {
+        copy_error(c, "无法访问", src, errno);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (!c->recursive) {
+            fprintf(stderr, "cp: 未指定 -r，略过目录 %s\n", src);
+            atomic_store(&c->failed, true);
+        } else {
+            copy_dir(c, src_at, src_name, src, dst_at, dst_name, dst, &st, top);
+        }
+    } else if (S_ISREG(st.st_mode) || !c->recursive) {
+        copy_file(c, src_at, src_name, src, dst_at, dst_name, dst, &st);
+    } else if (S_ISLNK(st.st_mode)) {
+        copy_symlink(c, src_at, src_name, src, dst_at, dst_name, dst, &st);
+    } else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+        if (mknodat(dst_at, dst_name, st.st_mode, st.st_rdev) != 0 && errno != EEXIST) {
+            copy_error(c, "无法创建", dst, errno);
+        } else if (c->preserve) {
+            if (fchownat(dst_at, dst_name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0) {
+                fchownat(dst_at, dst_name, -1, st.st_gid, AT_SYMLINK_NOFOLLOW);
+            }
+            fchmodat(dst_at, dst_name, st.st_mode & 07777, 0);
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            utimensat(dst_at, dst_name, times, AT_SYMLINK_NOFOLLOW);
+        }
+    } else {
+        fprintf(stderr, "cp: 略过不支持的文件类型 %s\n", src);
+        atomic_store(&c->failed, true);
+    }
+}
+
+static const char *base_name(const char *path, char *buf, size_t size) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    snprintf(buf, size, "%.*s", (int) (end - start), path + start);
+    return buf;
+}
+
+// cp [-r] [-p] 源文件 目标 或者 cp [-r] [-p] 源文件... 目录
+int lsh_cp(char **args) {
+    CpContext c = {0};
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *opt = args[i] + 1; *opt != '\0'; opt++) {
+            if (*opt == 'r' || *opt == 'R') {
+                c.recursive = true;
+            } else if (*opt == 'p') {
+                c.preserve = true;
+            } else {
+                fprintf(stderr, "cp: 无效的选项 -%c\n", *opt);
+                fprintf(stderr, "Usage: cp [-r] [-p] 源文件... 目标\n");
+                lsh_last_status = 1;
+                return 1;
+            }
+        }
+    }
+    int num_args = 0;
+    while (args[i + num_args] != NULL) {
+        num_args++;
+    }
+    if (num_args < 2) {
+        fprintf(stderr, "Usage: cp [-r] [-p] 源文件... 目标\n");
+        lsh_last_status = 1;
+        return 1;
+    }
+    const char *target = args[i + num_args - 1];
+    struct stat st;
+    bool target_is_dir = stat(target, &st) == 0 && S_ISDIR(st.st_mode);
+    if (num_args > 2 && !target_is_dir) {
+        fprintf(stderr, "cp: 目标 %s 不是目录\n", target);
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    // 只复制一个普通文件时不需要线程池
+    if (c.recursive || num_args > 2) {
+        start_pool(&c, walk_default_threads());
+    }
+    for (int k = 0; k < num_args - 1; k++) {
+        const char *src = args[i + k];
+        char name[4096];
+        char *dst = target_is_dir ? join(target, base_name(src, name, sizeof(name))) : strdup(target);
+        copy_entry(&c, AT_FDCWD, src, src, AT_FDCWD, dst, dst, true);
+        free(dst);
+    }
+    stop_pool(&c);
+    // 从内向外设置目录的权限和时间，里面的文件都已经写完，不会再改变目录的修改时间
+    for (size_t k = c.num_fixups; k-- > 0;) {
+        DirFixup *f = &c.fixups[k];
+        if (c.preserve) {
+            if (chown(f->path, f->st.st_uid, f->st.st_gid) != 0) {
+                chown(f->path, -1, f->st.st_gid);
+            }
+        }
+        chmod(f->path, f->st.st_mode & 07777);
+        if (c.preserve) {
+            struct timespec times[2] = {f->st.st_atim, f->st.st_mtim};
+            utimensat(AT_FDCWD, f->path, times, 0);
+        }
+        free(f->path);
+    }
+    free(c.fixups);
+    lsh_last_status = atomic_load(&c.failed) ? 1 : 0;
+    return 1;
+}
@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-5.
+//
+
+#ifndef OS_C_CP_H
+#define OS_C_CP_H
+
+int lsh_cp(char **args);
+
+#endif //OS_C_CP_H
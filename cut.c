@@ -0,0 +1,355 @@
+//
+// Created by ysh on 24-7-2.
+//
+// cut 和 fields 内置命令。输入按块读取（lsh_reader_lines 交出的总是完整的行），
+// 用 SSE2 一次比较 16 个字节找出分隔符和换行的位置，字段直接从输入块复制到批量输出缓冲区，
+// 不为字段分配内存。cut -f 和 GNU cut 一样按字段在行中的顺序输出；
+// fields 按列表给出的顺序输出，可以调换和重复列，默认和 awk 一样以连续的空白分隔。
+//
+
+#define _GNU_SOURCE
+#include "cut.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAX_FIELD_RANGES 64
+
+// 字段范围，从 1 开始，包含两端；hi 为 SIZE_MAX 表示到行尾
+typedef struct FieldRange {
+    size_t lo;
+    size_t hi;
+} FieldRange;
+
+typedef struct FieldSpan {
+    const char *start;
+    size_t len;
+} FieldSpan;
+
+typedef struct CutContext {
+    FieldRange ranges[MAX_FIELD_RANGES];
+    int num_ranges;
+    bool reorder;          // fields：按列表的顺序输出
+    bool blanks;           // 以连续的空格和制表符分隔，忽略空字段
+    char delim;
+    const char *out_delim;
+    size_t out_delim_len;
+    bool only_delimited;   // -s：跳过没有分隔符的行
+
+    // cut：字段是否被选中
+    bool *selected;
+    size_t max_selected;
+    size_t open_from;      // 从这个字段开始全部选中，SIZE_MAX 表示没有
+
+    // 当前行的状态
+    const char *field_start;
+    size_t field_no;
+    bool emitted;
+    FieldSpan *fields;     // fields：当前行各字段的位置
+    size_t cap_fields;
+
+    LshWriter out;
+} CutContext;
+
+static bool is_selected(const CutContext *c, size_t field) {
+    return field <= c->max_selected ? c->selected[field] : field >= c->open_from;
+}
+
+static void put_field(CutContext *c, const char *start, size_t len) {
+    if (c->emitted) {
+        lsh_writer_put(&c->out, c->out_delim, c->out_delim_len);
+    }
+    lsh_writer_put(&c->out, start, len);
+    c->emitted = true;
+}
+
+static void finish_line(CutContext *c) {
+    if (c->reorder) {
+        size_t n = c->field_no;
+        if (!(c->only_delimited && n == 1 && !c->blanks)) {
+            for (int i = 0; i < c->num_ranges; i++) {
+                size_t hi = c->ranges[i].hi < n ? c->ranges[i].hi : n;
+                for (size_t f = c->ranges[i].lo; f <= hi; f++) {
+                    put_field(c, c->fields[f - 1].start, c->fields[f - 1].len);
+                }
+            }
+            lsh_writer_putc(&c->out, '\n');
+        }
+    } else {
+        lsh_writer_putc(&c->out, '\n');
+    }
+    c->field_no = 0;
+    c->emitted = false;
+}
+
+// 一个字段在 end 处结束；line_end 表示它是这一行的最后一个字段
+static inline void end_field(CutContext *c, const char *end, bool line_end) {
+    const char *start = c->field_start;
+    c->field_start = end + 1;
+    if (c->blanks && start == end) {
+        if (line_end) {
+            finish_line(c);
+        }
+        return;
+    }
+    size_t f = ++c->field_no;
+    if (c->reorder) {
+        if (f > c->cap_fields) {
+            c->cap_fields *= 2;
+            c->fields = realloc(c->fields, c->cap_fields * sizeof(FieldSpan));
+        }
+        c->fields[f - 1] = (FieldSpan) {start, end - start};
+    } else if (line_end && f == 1) {
+        // 没有分隔符的行原样输出，-s 时跳过
+        if (!c->only_delimited) {
+            lsh_writer_put(&c->out, start, end - start);
+            lsh_writer_putc(&c->out, '\n');
+        }
+        c->field_no = 0;
+        return;
+    } else if (is_selected(c, f)) {
+        put_field(c, start, end - start);
+    }
+    if (line_end) {
+        finish_line(c);
+    }
+}
+
+// 处理一块完整的行：依次找出每个分隔符和换行
+static void cut_block(CutContext *c, const char *data, size_t len) {
+    char d1 = c->blanks ? ' ' : c->delim;
+    char d2 = c->blanks ? '\t' : c->delim;
+    size_t i = 0;
+    c->field_start = data;
+#ifdef __SSE2__
+    const __m128i v1 = _mm_set1_epi8(d1), v2 = _mm_set1_epi8(d2), newline = _mm_set1_epi8('\n');
+    for (; len - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+        unsigned mask = _mm_movemask_epi8(hits);
+        while (mask != 0) {
+            const char *p = data + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            end_field(c, p, *p == '\n');
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        char ch = data[i];
+        if (ch == '\n' || ch == d1 || ch == d2) {
+            end_field(c, data + i, ch == '\n');
+        }
+    }
+    // 输入的最后一行没有换行结尾，输出时补上
+    if (len > 0 && data[len - 1] != '\n') {
+        end_field(c, data + len, true);
+    }
+}
+
+/*
+  选项
+*/
+
+static bool parse_number(const char **s, size_t *value) {
+    if (**s < '0' || **s > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(*s, &end, 10);
+    *s = end;
+    *value = v;
+    return errno == 0 && v > 0;
+}
+
+// 字段列表：N、N-M、N-、-M，用逗号分隔
+static bool parse_list(CutContext *c, const char *list) {
+    const char *p = list;
+    while (*p != '\0') {
+        if (c->num_ranges >= MAX_FIELD_RANGES) {
+            return false;
+        }
+        FieldRange *r = &c->ranges[c->num_ranges++];
+        r->lo = 1;
+        if (*p != '-' && !parse_number(&p, &r->lo)) {
+            return false;
+        }
+        r->hi = r->lo;
+        if (*p == '-') {
+            p++;
+            r->hi = SIZE_MAX;
+            if (*p != ',' && *p != '\0' && !parse_number(&p, &r->hi)) {
+                return false;
+            }
+        }
+        if (r->hi < r->lo || (*p != ',' && *p != '\0')) {
+            return false;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return c->num_ranges > 0;
+}
+
+// cut 按字段编号选择，把列表展开成数组，最后一个开放的范围单独记下
+static void build_selection(CutContext *c) {
+    c->open_from = SIZE_MAX;
+    c->max_selected = 0;
+    for (int i = 0; i < c->num_ranges; i++) {
+        if (c->ranges[i].hi == SIZE_MAX) {
+            c->open_from = c->ranges[i].lo < c->open_from ? c->ranges[i].lo : c->open_from;
+            if (c->ranges[i].lo > c->max_selected) {
+                c->max_selected = c->ranges[i].lo;
+            }
+        } else if (c->ranges[i].hi > c->max_selected) {
+            c->max_selected = c->ranges[i].hi;
+        }
+    }
+    c->selected = calloc(c->max_selected + 1, sizeof(bool));
+    for (int i = 0; i < c->num_ranges; i++) {
+        size_t hi = c->ranges[i].hi < c->max_selected ? c->ranges[i].hi : c->max_selected;
+        for (size_t f = c->ranges[i].lo; f <= hi; f++) {
+            c->selected[f] = true;
+        }
+    }
+    for (size_t f = c->open_from; f <= c->max_selected; f++) {
+        c->selected[f] = true;
+    }
+}
+
+static void usage(const char *cmd) {
+    if (strcmp(cmd, "cut") == 0) {
+        fprintf(stderr, "Usage: cut -f 列表 [-d 分隔符] [-s] [--output-delimiter=字符串] [文件...]\n");
+    } else {
+        fprintf(stderr, "Usage: fields [-d 分隔符] [-s] [--output-delimiter=字符串] 列表 [文件...]\n");
+    }
+}
+
+static bool parse_options(const char *cmd, char **args, CutContext *c, int *first_file) {
+    const char *list = NULL;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        } else if (strncmp(arg, "--output-delimiter=", 19) == 0) {
+            c->out_delim = arg + 19;
+        } else if (strcmp(arg, "-s") == 0) {
+            c->only_delimited = true;
+        } else if (arg[1] == 'd' || arg[1] == 'f') {
+            const char *value = arg[2] != '\0' ? arg + 2 : args[++i];
+            if (value == NULL) {
+                usage(cmd);
+                return false;
+            }
+            if (arg[1] == 'f') {
+                list = value;
+            } else if (strlen(value) != 1) {
+                fprintf(stderr, "%s: 分隔符必须是单个字符\n", cmd);
+                return false;
+            } else {
+                c->delim = value[0];
+                c->blanks = false;
+            }
+        } else {
+            fprintf(stderr, "%s: 无效的选项 %s\n", cmd, arg);
+            usage(cmd);
+            return false;
+        }
+    }
+    // fields 的列表可以直接作为第一个参数
+    if (list == NULL && c->reorder && args[i] != NULL) {
+        list = args[i++];
+    }
+    if (list == NULL) {
+        fprintf(stderr, "%s: 需要指定字段列表\n", cmd);
+        usage(cmd);
+        return false;
+    }
+    if (!parse_list(c, list)) {
+        fprintf(stderr, "%s: 无效的字段列表 %s\n", cmd, list);
+        return false;
+    }
+    *first_file = i;
+    return true;
+}
+
+static int run_cut(const char *cmd, char **args, bool reorder) {
+    CutContext c = {.reorder = reorder, .blanks = reorder, .delim = '\t'};
+    int first_file;
+    if (!parse_options(cmd, args, &c, &first_file)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    char delim_str[2] = {c.blanks ? ' ' : c.delim, '\0'};
+    if (c.out_delim == NULL) {
+        c.out_delim = delim_str;
+    }
+    c.out_delim_len = strlen(c.out_delim);
+    if (reorder) {
+        c.cap_fields = 16;
+        c.fields = malloc(c.cap_fields * sizeof(FieldSpan));
+    } else {
+        build_selection(&c);
+    }
+
+    int num_files = 0;
+    while (args[first_file + num_files] != NULL) {
+        num_files++;
+    }
+    lsh_writer_init(&c.out, LSH_OUT);
+    bool failed = false;
+    unsigned long bytes = 0;
+    for (int i = 0; i < (num_files == 0 ? 1 : num_files); i++) {
+        const char *name = num_files == 0 || strcmp(args[first_file + i], "-") == 0 ? NULL : args[first_file + i];
+        FILE *in = name == NULL ? LSH_IN : fopen(name, "re");
+        if (in == NULL) {
+            fprintf(stderr, "%s: 无法打开 %s: %s\n", cmd, name, strerror(errno));
+            failed = true;
+            continue;
+        }
+        LshReader reader;
+        lsh_reader_init(&reader, in);
+        const char *data;
+        size_t len;
+        while (lsh_reader_lines(&reader, &data, &len)) {
+            cut_block(&c, data, len);
+            bytes += len;
+        }
+        if (reader.error) {
+            fprintf(stderr, "%s: 读取 %s 出错: %s\n", cmd, name ? name : "标准输入", strerror(errno));
+            failed = true;
+        }
+        lsh_reader_free(&reader);
+        if (name != NULL) {
+            fclose(in);
+        }
+    }
+    lsh_writer_free(&c.out);
+    STAT_ADD(cut_bytes, bytes);
+    free(c.selected);
+    free(c.fields);
+    lsh_last_status = failed ? 1 : 0;
+    return 1;
+}
+
+// cut -f 列表 [-d 分隔符] [-s] [--output-delimiter=字符串] [文件...]
+int lsh_cut(char **args) {
+    return run_cut("cut", args, false);
+}
+
+// fields [-d 分隔符] [-s] [--output-delimiter=字符串] 列表 [文件...]，例如 fields 3,1
+int lsh_fields(char **args) {
+    return run_cut("fields", args, true);
+}
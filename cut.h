@@ -0,0 +1,11 @@
+//
+// Created by ysh on 24-7-2.
+//
+
+#ifndef OS_C_CUT_H
+#define OS_C_CUT_H
+
+int lsh_cut(char **args);
+int lsh_fields(char **args);
+
+#endif //OS_C_CUT_H
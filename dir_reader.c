@@ -0,0 +1,72 @@
+//
+// Created by ysh on 24-6-23.
+//
+
+#define _GNU_SOURCE
+#include "dir_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#define DIR_BUF_SIZE (128 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// 打开相对于 at_fd 的目录，at_fd 为 AT_FDCWD 时相对于当前目录
+bool dir_reader_open(DirReader *reader, int at_fd, const char *path) {
+    reader->fd = openat(at_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    reader->buf = NULL;
+    reader->pos = 0;
+    reader->len = 0;
+    if (reader->fd == -1) {
+        return false;
+    }
+    reader->buf = malloc(DIR_BUF_SIZE);
+    if (reader->buf == NULL) {
+        close(reader->fd);
+        reader->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// 读取下一个目录项，跳过 "." 和 ".."，读完或出错时返回 false
+bool dir_reader_next(DirReader *reader, DirEntry *entry) {
+    while (1) {
+        if (reader->pos >= reader->len) {
+            long n = syscall(SYS_getdents64, reader->fd, reader->buf, DIR_BUF_SIZE);
+            if (n <= 0) {
+                return false;
+            }
+            reader->len = n;
+            reader->pos = 0;
+        }
+        struct linux_dirent64 *d = (struct linux_dirent64 *) (reader->buf + reader->pos);
+        reader->pos += d->d_reclen;
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+            continue;
+        }
+        entry->ino = d->d_ino;
+        entry->type = d->d_type;
+        entry->name = d->d_name;
+        return true;
+    }
+}
+
+void dir_reader_close(DirReader *reader) {
+    if (reader->fd != -1) {
+        close(reader->fd);
+    }
+    free(reader->buf);
+    reader->fd = -1;
+    reader->buf = NULL;
+}
@@ -0,0 +1,30 @@
+//
+// Created by ysh on 24-6-23.
+//
+
+#ifndef OS_C_DIR_READER_H
+#define OS_C_DIR_READER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 直接用 getdents64 批量读取目录项，一次系统调用读取尽可能多的目录项
+typedef struct DirReader {
+    int fd;
+    char *buf;
+    size_t pos;
+    size_t len;
+} DirReader;
+
+typedef struct DirEntry {
+    uint64_t ino;
+    unsigned char type;     // DT_DIR、DT_REG 等，文件系统不支持时为 DT_UNKNOWN
+    const char *name;
+} DirEntry;
+
+bool dir_reader_open(DirReader *reader, int at_fd, const char *path);
+bool dir_reader_next(DirReader *reader, DirEntry *entry);
+void dir_reader_close(DirReader *reader);
+
+#endif //OS_C_DIR_READER_H
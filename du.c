@@ -0,0 +1,253 @@
+//
+// Created by ysh on 24-7-4.
+//
+// du 内置命令，用 walk.c 的多线程遍历，每个目录项调用一次 statx，只取块数、链接数和 inode。
+// 链接数大于 1 的文件（有多个起点时是所有文件和目录）记在按 (dev, ino) 分片加锁的哈希集合里，同一个文件只统计一次。
+// 目录的大小由遍历自底向上汇总，目录完成时它的子目录一定都已完成，
+// 所以直接按完成的顺序输出也能保证子目录在父目录之前，只是同级目录之间的顺序不固定。
+//
+
+#define _GNU_SOURCE
+#include "du.h"
+#include "walk.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define INODE_SHARDS 64
+
+typedef struct InodeKey {
+    uint64_t dev;
+    uint64_t ino;                   // 为 0 表示空位，inode 号不会是 0
+} InodeKey;
+
+typedef struct InodeShard {
+    pthread_mutex_t lock;
+    InodeKey *keys;
+    size_t count;
+    size_t cap;
+} InodeShard;
+
+typedef struct DuContext {
+    int max_depth;                  // -1 表示不限，-s 相当于 0
+    bool human;
+    bool hash_all;                  // 多个起点时和 GNU du 一样记下所有文件和目录，重叠的部分只统计一次
+    int threads;
+    InodeShard shards[INODE_SHARDS];
+    pthread_mutex_t out_lock;
+    LshWriter out;
+    bool failed;
+} DuContext;
+
+/*
+  已经统计过的文件
+*/
+
+static uint64_t hash_inode(uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t probe(const InodeKey *keys, size_t cap, uint64_t hash, uint64_t dev, uint64_t ino) {
+    size_t pos = hash & (cap - 1);
+    while (keys[pos].ino != 0 && (keys[pos].ino != ino || keys[pos].dev != dev)) {
+        pos = (pos + 1) & (cap - 1);
+    }
+    return pos;
+}
+
+// 第一次见到这个文件时记下并返回 true。高 6 位选分片，低位在分片内线性探测
+static bool inode_insert(DuContext *c, uint64_t dev, uint64_t ino) {
+    uint64_t hash = hash_inode(dev, ino);
+    InodeShard *s = &c->shards[hash >> 58];
+    pthread_mutex_lock(&s->lock);
+    if ((s->count + 1) * 2 > s->cap) {
+        size_t cap = s->cap == 0 ? 64 : s->cap * 2;
+        InodeKey *keys = calloc(cap, sizeof(InodeKey));
+        for (size_t i = 0; i < s->cap; i++) {
+            if (s->keys[i].ino != 0) {
+                keys[probe(keys, cap, hash_inode(s->keys[i].dev, s->keys[i].ino), s->keys[i].dev, s->keys[i].ino)] = s->keys[i];
+            }
+        }
+        free(s->keys);
+        s->keys = keys;
+        s->cap = cap;
+    }
+    size_t pos = probe(s->keys, s->cap, hash, dev, ino);
+    bool inserted = s->keys[pos].ino == 0;
+    if (inserted) {
+        s->keys[pos] = (InodeKey) {dev, ino};
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return inserted;
+}
+
+/*
+  遍历回调
+*/
+
+static bool du_visit(void *ctx, int worker, WalkEntry *e) {
+    DuContext *c = ctx;
+    struct statx stx;
+    STAT_INC(walk_statx);
+    if (statx(e->dir_fd, e->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_BLOCKS | STATX_NLINK | STATX_INO, &stx) != 0) {
+        fprintf(stderr, "du: %s: %s\n", e->path, strerror(errno));
+        c->failed = true;
+        return false;
+    }
+    if ((c->hash_all || (e->type != DT_DIR && stx.stx_nlink > 1)) &&
+        !inode_insert(c, makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino)) {
+        STAT_INC(du_hardlinks);
+        return false;
+    }
+    e->value = stx.stx_blocks * 512;
+    return true;
+}
+
+// 和 GNU du -h 一样向上取整：小于 10 时保留一位小数，例如 4.0K、1.5M、12G
+static void format_human(char *buf, size_t size, unsigned long long bytes) {
+    static const char units[] = "KMGTPE";
+    if (bytes < 1024) {
+        snprintf(buf, size, "%llu", bytes);
+        return;
+    }
+    unsigned long long base = 1024;
+    int u = 0;
+    while (u < 5 && bytes >= base * 1024) {
+        base *= 1024;
+        u++;
+    }
+    unsigned long long tenths = (bytes * 10 + base - 1) / base;
+    if (tenths < 100) {
+        snprintf(buf, size, "%llu.%llu%c", tenths / 10, tenths % 10, units[u]);
+        return;
+    }
+    unsigned long long whole = (bytes + base - 1) / base;
+    if (whole >= 1024 && u < 5) {
+        snprintf(buf, size, "1.0%c", units[u + 1]);
+    } else {
+        snprintf(buf, size, "%llu%c", whole, units[u]);
+    }
+}
+
+static void du_dir_done(void *ctx, int worker, const WalkEntry *dir, unsigned long long total) {
+    DuContext *c = ctx;
+    if (c->max_depth >= 0 && dir->depth > c->max_depth) {
+        return;
+    }
+    char size[32];
+    if (c->human) {
+        format_human(size, sizeof(size), total);
+    } else {
+        snprintf(size, sizeof(size), "%llu", (total + 1023) / 1024);
+    }
+    pthread_mutex_lock(&c->out_lock);
+    lsh_writer_put(&c->out, size, strlen(size));
+    lsh_writer_putc(&c->out, '\t');
+    lsh_writer_put(&c->out, dir->path, strlen(dir->path));
+    lsh_writer_putc(&c->out, '\n');
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+static void du_error(void *ctx, const char *path, int err) {
+    DuContext *c = ctx;
+    fprintf(stderr, "du: %s: %s\n", path, strerror(err));
+    c->failed = true;
+}
+
+/*
+  选项
+*/
+
+static void usage() {
+    fprintf(stderr, "Usage: du [-s] [-h] [-d N] [--parallel=N] [路径...]\n");
+}
+
+static bool parse_options(char **args, DuContext *c, int *first_path) {
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(args[i], "--parallel=", 11) == 0) {
+            c->threads = atoi(args[i] + 11);
+            if (c->threads < 1) {
+                fprintf(stderr, "du: 无效的线程数 %s\n", args[i] + 11);
+                return false;
+            }
+            continue;
+        }
+        for (const char *opt = args[i] + 1; *opt != '\0'; opt++) {
+            if (*opt == 's') {
+                c->max_depth = 0;
+            } else if (*opt == 'h') {
+                c->human = true;
+            } else if (*opt == 'd') {
+                const char *value = opt[1] != '\0' ? opt + 1 : args[i + 1] != NULL ? args[++i] : NULL;
+                char *end;
+                long n = value != NULL ? strtol(value, &end, 10) : -1;
+                if (value == NULL || end == value || *end != '\0' || n < 0) {
+                    fprintf(stderr, "du: -d 需要一个非负整数\n");
+                    return false;
+                }
+                c->max_depth = (int) n;
+                break;
+            } else {
+                fprintf(stderr, "du: 无效的选项 -%c\n", *opt);
+                usage();
+                return false;
+            }
+        }
+    }
+    *first_path = i;
+    return true;
+}
+
+// du [-s] [-h] [-d N] [--parallel=N] [路径...]，大小以 1K 块为单位，没有路径时统计当前目录
+int lsh_du(char **args) {
+    DuContext c = {.max_depth = -1, .threads = walk_default_threads()};
+    int first_path;
+    if (!parse_options(args, &c, &first_path)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    char *dot[] = {".", NULL};
+    int num_paths = 0;
+    while (args[first_path + num_paths] != NULL) {
+        num_paths++;
+    }
+    c.hash_all = num_paths > 1;
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        pthread_mutex_init(&c.shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&c.out_lock, NULL);
+    lsh_writer_init(&c.out, LSH_OUT);
+    WalkOps ops = {.ctx = &c, .threads = c.threads, .visit = du_visit, .dir_done = du_dir_done, .error = du_error};
+    walk_tree(num_paths > 0 ? args + first_path : dot, num_paths > 0 ? num_paths : 1, &ops);
+    lsh_writer_free(&c.out);
+    pthread_mutex_destroy(&c.out_lock);
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        pthread_mutex_destroy(&c.shards[i].lock);
+        free(c.shards[i].keys);
+    }
+    lsh_last_status = c.failed ? 1 : 0;
+    return 1;
+}
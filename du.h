@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-4.
+//
+
+#ifndef OS_C_DU_H
+#define OS_C_DU_H
+
+int lsh_du(char **args);
+
+#endif //OS_C_DU_H
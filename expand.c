@@ -0,0 +1,1016 @@
+//
+// Created by ysh on 24-6-23.
+//
+// 单词展开：进程替换 <(cmd) >(cmd)、变量展开 $VAR ${VAR} $?、命令替换 $(cmd) `cmd`、
+// 花括号展开 {a,b}、路径名展开 * ? [...] **、引号去除。
+// 分词阶段保留了引号，这里先把单词转换成"模式形式"：引号去掉，被引用的特殊字符用反斜杠转义，
+// 含有未转义通配符的单词才去匹配文件，其余的直接去掉转义。
+//
+
+#define _GNU_SOURCE
+#include "expand.h"
+#include "dir_reader.h"
+#include "main.h"
+#include "spawn_helper.h"
+#include "stats.h"
+#include "lsh_builtins.h"
+#include "lsh_io.h"
+#include "job_pool.h"
+#include "vars.h"
+#include "arith.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+
+extern Alias aliases[MAX_ALIASES];
+extern int num_aliases;
+
+typedef struct WordList {
+    char **items;
+    int count;
+    int cap;
+} WordList;
+
+static void word_list_push(WordList *list, char *word) {
+    if (list->count + 1 >= list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(char *));
+        if (list->items == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->items[list->count++] = word;
+}
+
+/*
+  进程替换
+*/
+
+// 当前命令创建的进程替换：shell 保留的管道一端和子进程，命令结束后关闭并回收
+typedef struct ProcSubst {
+    int fd;
+    pid_t pid;
+} ProcSubst;
+
+static ProcSubst *substs = NULL;
+static int num_substs = 0;
+static int cap_substs = 0;
+
+// 整个单词是否为 <(...) 或 >(...)
+static bool is_proc_subst(const char *raw) {
+    size_t len = strlen(raw);
+    return len >= 3 && (raw[0] == '<' || raw[0] == '>') && raw[1] == '(' && raw[len - 1] == ')';
+}
+
+// fork 一个子 shell 执行一整行命令
+static pid_t spawn_subshell(const char *command, int in_fd, int out_fd) {
+    fflush(stdout); // 否则子 shell 会把继承来的缓冲输出再写一遍
+    pid_t pid = fork();
+    STAT_INC(forks);
+    if (pid == 0) {
+        // 子 shell 不能持有其他进程替换的管道端，否则 >(cmd) 永远读不到 EOF
+        for (int i = 0; i < num_substs; i++) {
+            close(substs[i].fd);
+        }
+        num_substs = 0;
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        if (in_fd != 0) {
+            dup2(in_fd, 0);
+            close(in_fd);
+        }
+        if (out_fd != 1) {
+            dup2(out_fd, 1);
+            close(out_fd);
+        }
+        char *line = strdup(command);
+        lsh_run_line(line);
+        fflush(stdout);
+        exit(lsh_last_status);
+    } else if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+// <(cmd) 把 cmd 的标准输出接到管道上，>(cmd) 把管道接到 cmd 的标准输入，
+// 替换为 /dev/fd/N，N 是 shell 保留的另一端，由执行的命令继承
+static char *proc_subst(const char *raw) {
+    bool is_input = raw[0] == '<';
+    char *command = strndup(raw + 2, strlen(raw) - 3);
+    int fd[2];
+    if (pipe(fd) == -1) {
+        perror("pipe");
+        free(command);
+        return strdup(raw);
+    }
+
+    int keep = is_input ? fd[0] : fd[1];
+    int give = is_input ? fd[1] : fd[0];
+    if (num_substs >= cap_substs) {
+        cap_substs = cap_substs ? cap_substs * 2 : 4;
+        substs = realloc(substs, cap_substs * sizeof(ProcSubst));
+    }
+    substs[num_substs] = (ProcSubst) {.fd = keep, .pid = -1};
+    num_substs++; // 先登记，子 shell 中会关闭它
+
+    pid_t pid = spawn_subshell(command, is_input ? 0 : give, is_input ? give : 1);
+    close(give);
+    free(command);
+    if (pid < 0) {
+        close(keep);
+        num_substs--;
+        return strdup(raw);
+    }
+    substs[num_substs - 1].pid = pid;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+    return strdup(path);
+}
+
+// 当前命令是否用到了进程替换。/dev/fd/N 只在 shell 的子进程中有效，这时不能交给 spawn 辅助进程启动
+bool lsh_expand_has_proc_subst() {
+    return num_substs > 0;
+}
+
+// 命令执行完后关闭进程替换的管道并回收子进程，和管道的各个阶段一样等待它们结束
+void lsh_expand_cleanup() {
+    for (int i = 0; i < num_substs; i++) {
+        close(substs[i].fd);
+    }
+    for (int i = 0; i < num_substs; i++) {
+        lsh_waitpid(substs[i].pid, NULL, 0);
+    }
+    num_substs = 0;
+}
+
+/*
+  命令替换
+*/
+
+typedef struct StrBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+static void buf_reserve(StrBuf *buf, size_t extra) {
+    if (buf->len + extra + 1 > buf->cap) {
+        while (buf->len + extra + 1 > buf->cap) {
+            buf->cap = buf->cap ? buf->cap * 2 : 64;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+        if (buf->data == NULL) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void buf_append(StrBuf *buf, const char *s, size_t n) {
+    buf_reserve(buf, n);
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+}
+
+static void buf_putc(StrBuf *buf, char c) {
+    buf_append(buf, &c, 1);
+}
+
+static bool is_alias(const char *name) {
+    for (int i = 0; i < num_aliases; i++) {
+        if (strcmp(name, aliases[i].name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 展开结果中未被引用的操作符都指向这张表里的字符串。引号去除或变量展开得到的同样文字
+// 是新分配的普通单词，lsh_execute 和 parse_redirection 只按指针认出真正的操作符
+static const char *const operators[] = {"|", "&", "<", ">", ">>", "<<<", NULL};
+
+static const char *find_operator(const char *raw) {
+    for (int i = 0; operators[i] != NULL; i++) {
+        if (strcmp(raw, operators[i]) == 0) {
+            return operators[i];
+        }
+    }
+    return NULL;
+}
+
+// word 是否为 lsh_expand 保留下来的操作符 op，op 为 NULL 时可以是任意操作符
+bool lsh_is_operator(const char *word, const char *op) {
+    for (int i = 0; operators[i] != NULL; i++) {
+        if (word == operators[i]) {
+            return op == NULL || strcmp(word, op) == 0;
+        }
+    }
+    return false;
+}
+
+// 展开后的单词中是否有管道、后台或重定向操作符
+bool lsh_has_operator(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (lsh_is_operator(words[i], NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 分好词、还没展开的单词是否只是一条简单命令：没有管道、后台和重定向
+bool lsh_is_simple_command(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strcmp(words[i], "|") == 0 || strcmp(words[i], "&") == 0
+            || strncmp(words[i], "<", 1) == 0 || strncmp(words[i], ">", 1) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 一次读完管道中的全部输出，用大块缓冲区减少 read 次数
+static void read_all(int fd, StrBuf *out) {
+    buf_reserve(out, 64 * 1024);
+    for (;;) {
+        if (out->cap - out->len - 1 < 16 * 1024) {
+            buf_reserve(out, out->cap);
+        }
+        ssize_t n = read(fd, out->data + out->len, out->cap - out->len - 1);
+        if (n > 0) {
+            out->len += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    out->data[out->len] = '\0';
+}
+
+// 启动外部命令 args 或子 shell 执行 command，通过一个管道读回全部输出
+static void capture_output(char **args, const char *command, StrBuf *out) {
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return;
+    }
+    fcntl(fd[1], F_SETPIPE_SZ, 1024 * 1024); // 加大管道容量，失败时保持默认大小
+    pid_t pid = (args != NULL) ? lsh_spawn(args, 0, fd[1]) : spawn_subshell(command, 0, fd[1]);
+    close(fd[1]);
+    if (pid > 0) {
+        read_all(fd[0], out);
+        lsh_waitpid(pid, NULL, 0);
+    }
+    close(fd[0]);
+}
+
+// 执行命令替换，把命令的标准输出追加到 out。
+// 不改变 shell 状态的内置命令直接在进程内执行，输出写入内存流，不需要 fork；
+// 简单的外部命令直接启动，其余命令交给子 shell，输出都通过一个管道读回
+static void command_subst(const char *command, StrBuf *out) {
+    STAT_INC(command_substs);
+    char *line = strdup(command);
+    char **tokens = lsh_split_line(line);
+    if (!lsh_is_simple_command(tokens)) {
+        // 复杂命令整行交给子 shell，由子 shell 自己展开
+        free(tokens);
+        free(line);
+        capture_output(NULL, command, out);
+        return;
+    }
+    char **words = lsh_expand(tokens);
+    free(tokens);
+
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+    char **args = malloc((count + 1) * sizeof(char *));
+    memcpy(args, words, (count + 1) * sizeof(char *));
+
+    if (count == 0) {
+        // 空命令没有输出
+    } else if (job_pool_accepts(words[0]) && !is_alias(words[0]) && !lsh_has_operator(words)) {
+        char *data = NULL;
+        size_t size = 0;
+        FILE *saved_out = lsh_out_stream;
+        lsh_out_stream = open_memstream(&data, &size);
+        lsh_execute(args);
+        fclose(lsh_out_stream);
+        lsh_out_stream = saved_out;
+        buf_append(out, data, size);
+        free(data);
+        STAT_INC(subst_inproc);
+    } else if (!is_builtin(words[0]) && !is_alias(words[0])) {
+        capture_output(args, NULL, out);
+    } else {
+        capture_output(NULL, command, out);
+    }
+
+    free(args);
+    lsh_free_words(words);
+    free(line);
+}
+
+// 把替换结果追加到正在构造的单词中，结果中的字符按字面意义处理。
+// 双引号内整体追加；引号外按空白拆分成多个单词，通配符仍然保留，和 bash 一样参与路径名展开。
+// split 为 false 时（赋值语句的值）不拆分，空白和通配符也按字面处理
+static void append_subst_result(const char *text, char quote, bool split, StrBuf *word, bool *has_word,
+                                WordList *out) {
+    for (const char *p = text; *p; p++) {
+        if (quote == 0 && split && strchr(" \t\n", *p) != NULL) {
+            if (*has_word) {
+                word_list_push(out, strdup(word->data));
+                word->len = 0;
+                word->data[0] = '\0';
+                *has_word = false;
+            }
+            continue;
+        }
+        const char *special = (quote == '"') ? "$`\"\\" : (split ? "\\'\"$`{}," : "\\'\"$`{}, \t\n*?[]");
+        if (strchr(special, *p) != NULL) {
+            buf_putc(word, '\\');
+        }
+        buf_putc(word, *p);
+        *has_word = true;
+    }
+}
+
+// 位置参数 $N ${N}，全部由数字组成的名字
+static bool append_positional(const char *name, size_t len, StrBuf *result) {
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9') {
+            return false;
+        }
+    }
+    const char *value = var_arg(atoi(name));
+    if (value != NULL) {
+        buf_append(result, value, strlen(value));
+    }
+    return true;
+}
+
+// 展开 p 处的 $NAME ${NAME} $N $? $$ $# $@ $*，值写入 result，返回展开式之后的位置；
+// 不是变量引用时返回 NULL
+static const char *expand_param(const char *p, StrBuf *result) {
+    char number[32];
+    const char *name = p + 1;
+    size_t len;
+    const char *next;
+
+    if (p[1] == '?' || p[1] == '$' || p[1] == '#') {
+        int value = (p[1] == '?') ? lsh_last_status : (p[1] == '$') ? (int) getpid() : var_arg_count();
+        snprintf(number, sizeof(number), "%d", value);
+        buf_append(result, number, strlen(number));
+        return p + 2;
+    } else if (p[1] == '@' || p[1] == '*') {
+        for (int i = 1; i <= var_arg_count(); i++) {
+            if (i > 1) {
+                buf_putc(result, ' ');
+            }
+            buf_append(result, var_arg(i), strlen(var_arg(i)));
+        }
+        return p + 2;
+    } else if (p[1] >= '0' && p[1] <= '9') {
+        append_positional(p + 1, 1, result);
+        return p + 2;
+    } else if (p[1] == '{') {
+        name = p + 2;
+        const char *close = strchr(name, '}');
+        if (close != NULL && close > name && append_positional(name, close - name, result)) {
+            return close + 1;
+        }
+        if (close == NULL || !is_var_name(name, close - name)) {
+            return NULL;
+        }
+        len = close - name;
+        next = close + 1;
+    } else {
+        len = 0;
+        while (is_var_name(name, len + 1)) {
+            len++;
+        }
+        if (len == 0) {
+            return NULL;
+        }
+        next = name + len;
+    }
+
+    char *key = strndup(name, len);
+    const char *value = var_get(key);
+    free(key);
+    if (value != NULL) {
+        buf_append(result, value, strlen(value));
+    }
+    return next;
+}
+
+// 展开过程中出现了错误（目前只有算术表达式），这条命令不应该执行
+static __thread bool expand_failed = false;
+
+// 返回并清除展开错误标志
+bool lsh_expand_take_error() {
+    bool failed = expand_failed;
+    expand_failed = false;
+    return failed;
+}
+
+// 进行变量展开和命令替换，得到的原始单词（可能为零个或多个）追加到 out 中，
+// 仍保留引号供后续阶段处理
+static void substitute(const char *raw, bool split, WordList *out) {
+    StrBuf word = {0};
+    StrBuf result = {0};
+    bool has_word = false;
+    bool empty_args = false; // 出现过没有位置参数的 "$@"
+    char quote = 0;
+    buf_reserve(&word, strlen(raw));
+    word.data[0] = '\0';
+
+    for (const char *p = raw; *p;) {
+        const char *start = NULL, *end = NULL;
+        if (*p == '$' && p[1] == '(' && p[2] == '(' && quote != '\'') {
+            const char *close = lsh_skip_group(p + 1);
+            if (close - p >= 5 && close[-1] == ')' && close[-2] == ')') {
+                // $(( 表达式 ))：先展开其中的变量和命令替换，再按整数算术求值
+                char *raw_expr = strndup(p + 3, close - 2 - (p + 3));
+                char *expr = lsh_expand_word(raw_expr);
+                long long value;
+                if (arith_eval(expr, &value)) {
+                    char number[32];
+                    snprintf(number, sizeof(number), "%lld", value);
+                    append_subst_result(number, quote, split, &word, &has_word, out);
+                } else {
+                    expand_failed = true;
+                }
+                has_word = true;
+                free(expr);
+                free(raw_expr);
+                p = close;
+                continue;
+            }
+        }
+        if (*p == '$' && p[1] == '(' && quote != '\'') {
+            start = p + 2;
+            end = lsh_skip_group(p + 1);
+            if (end[-1] != ')') {
+                end = NULL; // 没有配对的括号，按普通字符处理
+            } else {
+                end--;
+            }
+        } else if (*p == '`' && quote != '\'') {
+            start = p + 1;
+            end = start;
+            while (*end && *end != '`') {
+                end += (*end == '\\' && end[1]) ? 2 : 1;
+            }
+            if (*end == '\0') {
+                end = NULL;
+            }
+        } else if (*p == '$' && p[1] == '@' && quote == '"') {
+            // "$@" 中每个位置参数都是单独的一个单词
+            for (int i = 1; i <= var_arg_count(); i++) {
+                if (i > 1) {
+                    buf_putc(&word, '"');
+                    word_list_push(out, strdup(word.data));
+                    word.len = 0;
+                    buf_putc(&word, '"');
+                }
+                append_subst_result(var_arg(i), quote, split, &word, &has_word, out);
+            }
+            empty_args = empty_args || var_arg_count() == 0;
+            has_word = true;
+            p += 2;
+            continue;
+        } else if (*p == '$' && quote != '\'') {
+            result.len = 0;
+            buf_reserve(&result, 0);
+            const char *next = expand_param(p, &result);
+            if (next != NULL) {
+                result.data[result.len] = '\0';
+                append_subst_result(result.data, quote, split, &word, &has_word, out);
+                if (quote != 0) {
+                    has_word = true; // "$EMPTY" 仍然是一个空单词
+                }
+                p = next;
+                continue;
+            }
+        }
+
+        if (end != NULL) {
+            char *command = strndup(start, end - start);
+            result.len = 0;
+            command_subst(command, &result);
+            free(command);
+            // 去掉末尾的换行
+            while (result.len > 0 && result.data[result.len - 1] == '\n') {
+                result.len--;
+            }
+            if (result.len > 0) {
+                result.data[result.len] = '\0';
+                append_subst_result(result.data, quote, split, &word, &has_word, out);
+            }
+            p = end + 1;
+            continue;
+        }
+
+        if (quote == 0 && (*p == '\'' || *p == '"')) {
+            quote = *p;
+        } else if (*p == quote) {
+            quote = 0;
+        } else if (*p == '\\' && quote != '\'' && p[1]) {
+            buf_putc(&word, *p++);
+        }
+        buf_putc(&word, *p++);
+        has_word = true;
+    }
+    // 没有位置参数时单独的 "$@" 展开成零个单词，而不是一个空单词
+    if (has_word && !(empty_args && strcmp(word.data, "\"\"") == 0)) {
+        word_list_push(out, strdup(word.data));
+    }
+    free(word.data);
+    free(result.data);
+}
+
+/*
+  花括号展开
+*/
+
+// 跳过 raw[i] 开始的引号或转义，返回下一个需要检查的位置
+static size_t skip_quoted(const char *raw, size_t i) {
+    if (raw[i] == '\\') {
+        return raw[i + 1] ? i + 2 : i + 1;
+    }
+    if (raw[i] == '\'' || raw[i] == '"') {
+        char quote = raw[i++];
+        while (raw[i] && raw[i] != quote) {
+            if (quote == '"' && raw[i] == '\\' && raw[i + 1]) {
+                i++;
+            }
+            i++;
+        }
+        return raw[i] ? i + 1 : i;
+    }
+    return i + 1;
+}
+
+// 从 open 处的 '{' 开始找到配对的 '}'，记录第一层的逗号位置，没有配对时返回 0
+static size_t match_brace(const char *raw, size_t open, size_t *commas, int *num_commas, int max_commas) {
+    int depth = 0;
+    *num_commas = 0;
+    for (size_t i = open; raw[i];) {
+        char c = raw[i];
+        if (c == '\\' || c == '\'' || c == '"') {
+            i = skip_quoted(raw, i);
+            continue;
+        }
+        if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth == 0) {
+                return i;
+            }
+        } else if (c == ',' && depth == 1 && *num_commas < max_commas) {
+            commas[(*num_commas)++] = i;
+        }
+        i++;
+    }
+    return 0;
+}
+
+#define MAX_BRACE_ITEMS 256
+
+static void brace_expand(const char *raw, WordList *out) {
+    for (size_t i = 0; raw[i];) {
+        char c = raw[i];
+        if (c == '\\' || c == '\'' || c == '"') {
+            i = skip_quoted(raw, i);
+            continue;
+        }
+        // ${VAR} 不是花括号展开
+        if (c == '{' && (i == 0 || raw[i - 1] != '$')) {
+            size_t commas[MAX_BRACE_ITEMS];
+            int num_commas;
+            size_t close = match_brace(raw, i, commas, &num_commas, MAX_BRACE_ITEMS);
+            if (close != 0 && num_commas > 0) {
+                size_t prefix_len = i;
+                const char *suffix = raw + close + 1;
+                size_t suffix_len = strlen(suffix);
+                size_t start = i + 1;
+                for (int k = 0; k <= num_commas; k++) {
+                    size_t end = (k < num_commas) ? commas[k] : close;
+                    char *word = malloc(prefix_len + (end - start) + suffix_len + 1);
+                    memcpy(word, raw, prefix_len);
+                    memcpy(word + prefix_len, raw + start, end - start);
+                    memcpy(word + prefix_len + (end - start), suffix, suffix_len + 1);
+                    brace_expand(word, out); // 前缀、后缀或选项中可能还有花括号
+                    free(word);
+                    start = end + 1;
+                }
+                return;
+            }
+        }
+        i++;
+    }
+    word_list_push(out, strdup(raw));
+}
+
+/*
+  引号处理
+*/
+
+static bool is_glob_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == ']' || c == '\\';
+}
+
+// 把原始单词转换成模式形式：去掉引号，被引用的特殊字符转义
+static char *to_pattern(const char *raw) {
+    char *pattern = malloc(strlen(raw) * 2 + 1);
+    char *out = pattern;
+    char quote = 0;
+
+    for (const char *p = raw; *p; p++) {
+        if (quote == 0) {
+            if (*p == '\'' || *p == '"') {
+                quote = *p;
+            } else if (*p == '\\') {
+                if (p[1]) {
+                    *out++ = '\\';
+                    *out++ = *++p;
+                } else {
+                    *out++ = '\\';
+                    *out++ = '\\';
+                }
+            } else {
+                *out++ = *p;
+            }
+        } else if (*p == quote) {
+            quote = 0;
+        } else {
+            if (quote == '"' && *p == '\\' && p[1] && strchr("$`\"\\", p[1]) != NULL) {
+                p++;
+            }
+            if (is_glob_special(*p)) {
+                *out++ = '\\';
+            }
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return pattern;
+}
+
+// 去掉模式形式中的转义
+static char *unescape(const char *pattern) {
+    char *word = malloc(strlen(pattern) + 1);
+    char *out = word;
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        *out++ = *p;
+    }
+    *out = '\0';
+    return word;
+}
+
+// 是否含有未转义的通配符，'[' 只有后面有配对的 ']' 时才算
+static bool has_meta(const char *pattern, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (pattern[i] == '\\') {
+            i++;
+        } else if (pattern[i] == '*' || pattern[i] == '?') {
+            return true;
+        } else if (pattern[i] == '[') {
+            for (size_t j = i + 1; j < len; j++) {
+                if (pattern[j] == '\\') {
+                    j++;
+                } else if (pattern[j] == ']' && j > i + 1) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/*
+  通配符匹配
+*/
+
+// 匹配 [...] 字符类，成功时 *pp 指向 ']' 之后
+static bool match_class(const char **pp, char c, bool *valid) {
+    const char *p = *pp + 1;
+    bool negate = false, matched = false;
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        p++;
+    }
+    const char *first = p;
+    while (*p && (*p != ']' || p == first)) {
+        char lo = *p;
+        if (lo == '\\' && p[1]) {
+            lo = *++p;
+        }
+        char hi = lo;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            p += 2;
+            hi = *p;
+            if (hi == '\\' && p[1]) {
+                hi = *++p;
+            }
+        }
+        if ((unsigned char) lo <= (unsigned char) c && (unsigned char) c <= (unsigned char) hi) {
+            matched = true;
+        }
+        p++;
+    }
+    *valid = *p == ']';
+    if (*valid) {
+        *pp = p + 1;
+    }
+    return matched != negate;
+}
+
+// 用模式形式的 pattern 匹配 name，支持 * ? [...] 和反斜杠转义
+bool glob_match(const char *pattern, const char *name) {
+    const char *star_p = NULL, *star_n = NULL;
+    const char *p = pattern, *n = name;
+
+    while (*n) {
+        if (*p == '*') {
+            star_p = ++p;
+            star_n = n;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            n++;
+            continue;
+        }
+        if (*p == '[') {
+            const char *q = p;
+            bool valid;
+            bool matched = match_class(&q, *n, &valid);
+            if (valid) {
+                if (matched) {
+                    p = q;
+                    n++;
+                    continue;
+                }
+            } else if (*n == '[') { // 没有配对的 ']'，按普通字符处理
+                p++;
+                n++;
+                continue;
+            }
+        } else {
+            char c = *p;
+            const char *next = p + 1;
+            if (c == '\\' && p[1]) {
+                c = p[1];
+                next = p + 2;
+            }
+            if (c != '\0' && c == *n) {
+                p = next;
+                n++;
+                continue;
+            }
+        }
+        // 不匹配时回溯到上一个 '*'
+        if (star_p == NULL) {
+            return false;
+        }
+        p = star_p;
+        n = ++star_n;
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/*
+  路径名展开
+*/
+
+// follow 为 false 时指向目录的符号链接不算目录。** 和 bash 的 globstar 一样不进入符号链接，
+// 否则 ln -s . a 这样的链接会让遍历无限（指数级）递归下去
+static bool entry_is_dir(const char *path, DirEntry *entry, bool follow) {
+    if (entry->type == DT_DIR) {
+        return true;
+    }
+    if (entry->type != DT_UNKNOWN && (entry->type != DT_LNK || !follow)) {
+        return false;
+    }
+    struct stat st;
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+// path[0..len) 是已经匹配好的前缀（以 '/' 结尾或为空），继续匹配第 ci 个组件
+static void glob_walk(char *path, size_t len, char **comps, int ci, int nc, WordList *out) {
+    const char *comp = comps[ci];
+    bool last = ci == nc - 1;
+    size_t comp_len = strlen(comp);
+
+    // 字面组件不需要列出目录，直接拼接到路径上
+    if (!has_meta(comp, comp_len) && strcmp(comp, "**") != 0) {
+        char *literal = unescape(comp);
+        size_t lit_len = strlen(literal);
+        if (len + lit_len + 2 < PATH_MAX) {
+            memcpy(path + len, literal, lit_len);
+            size_t new_len = len + lit_len;
+            if (last) {
+                path[new_len] = '\0';
+                struct stat st;
+                if (lstat(path, &st) == 0) {
+                    word_list_push(out, strdup(path));
+                }
+            } else {
+                path[new_len++] = '/';
+                glob_walk(path, new_len, comps, ci + 1, nc, out);
+            }
+        }
+        free(literal);
+        return;
+    }
+
+    bool recursive = strcmp(comp, "**") == 0;
+    if (recursive && !last) {
+        glob_walk(path, len, comps, ci + 1, nc, out); // ** 匹配零层目录
+    }
+
+    path[len] = '\0';
+    DirReader reader;
+    if (!dir_reader_open(&reader, AT_FDCWD, len ? path : ".")) {
+        return;
+    }
+    bool show_hidden = comp[0] == '.' || (comp[0] == '\\' && comp[1] == '.');
+    DirEntry entry;
+    while (dir_reader_next(&reader, &entry)) {
+        if (entry.name[0] == '.' && !show_hidden) {
+            continue;
+        }
+        if (!recursive && !glob_match(comp, entry.name)) {
+            continue;
+        }
+        size_t name_len = strlen(entry.name);
+        if (len + name_len + 2 >= PATH_MAX) {
+            continue;
+        }
+        memcpy(path + len, entry.name, name_len + 1);
+        size_t new_len = len + name_len;
+
+        if (recursive && last) {
+            // 末尾的 ** 匹配所有层级下的所有文件和目录
+            word_list_push(out, strdup(path));
+            if (entry_is_dir(path, &entry, false)) {
+                path[new_len++] = '/';
+                glob_walk(path, new_len, comps, ci, nc, out);
+            }
+        } else if (last) {
+            word_list_push(out, strdup(path));
+        } else if (entry_is_dir(path, &entry, !recursive)) {
+            path[new_len++] = '/';
+            glob_walk(path, new_len, comps, recursive ? ci : ci + 1, nc, out);
+        }
+    }
+    dir_reader_close(&reader);
+}
+
+static int compare_words(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void glob_expand(const char *pattern, WordList *out) {
+    char *copy = strdup(pattern);
+    int nc = 1;
+    for (char *p = copy; *p; p++) {
+        if (*p == '/') {
+            nc++;
+        }
+    }
+    char **comps = malloc(nc * sizeof(char *));
+    nc = 0;
+    for (char *p = copy, *start = copy;; p++) {
+        if (*p == '/' || *p == '\0') {
+            bool end = *p == '\0';
+            *p = '\0';
+            comps[nc++] = start;
+            start = p + 1;
+            if (end) {
+                break;
+            }
+        }
+    }
+
+    char path[PATH_MAX];
+    size_t len = 0;
+    int first = 0;
+    if (pattern[0] == '/') {
+        path[len++] = '/';
+        first = 1;
+    }
+
+    int start = out->count;
+    glob_walk(path, len, comps, first, nc, out);
+    if (out->count == start) {
+        word_list_push(out, unescape(pattern)); // 没有匹配时保留原样
+    } else if (out->count - start > 1) {
+        qsort(&out->items[start], out->count - start, sizeof(char *), compare_words);
+    }
+
+    free(comps);
+    free(copy);
+}
+
+// 展开一行命令的所有单词，返回新分配的单词数组，用 lsh_free_words 释放。
+// 未被引用的操作符不展开，直接放入 operators 表中的字符串
+char **lsh_expand(char **tokens) {
+    WordList words = {0};
+    WordList substituted = {0};
+    WordList braces = {0};
+    bool assigning = true;
+
+    for (int i = 0; tokens[i] != NULL; i++) {
+        // 命令开头的 NAME=value 赋值语句，值不做单词拆分
+        assigning = assigning && assignment_name_len(tokens[i]) > 0;
+        const char *op = find_operator(tokens[i]);
+        if (op != NULL) {
+            word_list_push(&words, (char *) op);
+            continue;
+        }
+        if (is_proc_subst(tokens[i])) {
+            word_list_push(&words, proc_subst(tokens[i]));
+            continue;
+        }
+        braces.count = 0;
+        if (strchr(tokens[i], '$') == NULL && strchr(tokens[i], '`') == NULL) {
+            brace_expand(tokens[i], &braces);
+        } else {
+            substituted.count = 0;
+            substitute(tokens[i], !assigning, &substituted);
+            for (int j = 0; j < substituted.count; j++) {
+                brace_expand(substituted.items[j], &braces);
+                free(substituted.items[j]);
+            }
+        }
+        for (int j = 0; j < braces.count; j++) {
+            char *pattern = to_pattern(braces.items[j]);
+            if (has_meta(pattern, strlen(pattern))) {
+                glob_expand(pattern, &words);
+            } else {
+                word_list_push(&words, unescape(pattern));
+            }
+            free(pattern);
+            free(braces.items[j]);
+        }
+    }
+    free(braces.items);
+    free(substituted.items);
+
+    word_list_push(&words, NULL);
+    return words.items;
+}
+
+// 展开单个单词得到模式形式，不做单词拆分和路径名展开，用于 case 的模式
+char *lsh_expand_pattern(const char *raw) {
+    if (strchr(raw, '$') == NULL && strchr(raw, '`') == NULL) {
+        return to_pattern(raw);
+    }
+    WordList list = {0};
+    substitute(raw, false, &list);
+    char *pattern = to_pattern(list.count > 0 ? list.items[0] : "");
+    for (int i = 0; i < list.count; i++) {
+        free(list.items[i]);
+    }
+    free(list.items);
+    return pattern;
+}
+
+// 展开单个单词，不做单词拆分和路径名展开，用于 case 的匹配对象
+char *lsh_expand_word(const char *raw) {
+    char *pattern = lsh_expand_pattern(raw);
+    char *word = unescape(pattern);
+    free(pattern);
+    return word;
+}
+
+void lsh_free_words(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        if (!lsh_is_operator(words[i], NULL)) {
+            free(words[i]);
+        }
+    }
+    free(words);
+}
@@ -0,0 +1,22 @@
+//
+// Created by ysh on 24-6-23.
+//
+
+#ifndef OS_C_EXPAND_H
+#define OS_C_EXPAND_H
+
+#include <stdbool.h>
+
+char **lsh_expand(char **tokens);
+void lsh_free_words(char **words);
+void lsh_expand_cleanup();
+bool lsh_expand_has_proc_subst();
+bool glob_match(const char *pattern, const char *name);
+bool lsh_is_operator(const char *word, const char *op);
+bool lsh_has_operator(char **words);
+bool lsh_is_simple_command(char **words);
+char *lsh_expand_pattern(const char *raw);
+char *lsh_expand_word(const char *raw);
+bool lsh_expand_take_error();
+
+#endif //OS_C_EXPAND_H
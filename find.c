@@ -0,0 +1,360 @@
+//
+// Created by ysh on 24-7-3.
+//
+// find 内置命令，用 walk.c 的多线程遍历。条件之间是“并且”的关系，可以用 ! 取反；
+// -name、-type 只看目录项本身，只有 -size、-mtime、-newer 才对目录项调用 statx，而且只取需要的字段。
+// -print 和 -print0 只决定每行的结尾，不像 GNU find 那样是按位置求值的动作。
+// 每个线程把结果写到自己的缓冲区，攒满一块再加锁交给输出，所以各行之间的顺序不固定。
+//
+
+#define _GNU_SOURCE
+#include "find.h"
+#include "walk.h"
+#include "expand.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAX_FIND_PREDICATES 64
+#define FIND_OUT_BUF (64 * 1024)
+
+typedef enum {
+    PRED_NAME,
+    PRED_TYPE,
+    PRED_SIZE,
+    PRED_MTIME,
+    PRED_NEWER,
+} PredKind;
+
+typedef struct Predicate {
+    PredKind kind;
+    bool negate;
+    const char *pattern;            // -name
+    unsigned char type;             // -type
+    int cmp;                        // -size、-mtime：+N 为 1，-N 为 -1，N 为 0
+    long long n;
+    unsigned long long unit;        // -size 的单位
+    struct statx_timestamp ref;     // -newer
+} Predicate;
+
+typedef struct FindOutput {
+    char *buf;
+    size_t len;
+} FindOutput;
+
+typedef struct FindContext {
+    Predicate preds[MAX_FIND_PREDICATES];
+    int num_preds;
+    unsigned int statx_mask;        // 条件需要的 statx 字段，为 0 时不调用 statx
+    char terminator;
+    int min_depth;
+    int max_depth;                  // -1 表示不限
+    int threads;
+    time_t now;
+
+    FindOutput *outputs;            // 每个线程一个
+    pthread_mutex_t out_lock;
+    LshWriter out;
+    bool failed;
+} FindContext;
+
+static const char *base_name(const char *path, size_t *len) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (start == end && end > 0) {
+        start = end - 1; // 路径就是 "/"
+    }
+    *len = end - start;
+    return path + start;
+}
+
+// 起点的 -name 和 GNU find 一样按最后一个路径部分匹配，忽略末尾的 /
+static bool match_name(const char *pattern, const WalkEntry *e) {
+    if (e->depth > 0) {
+        return glob_match(pattern, e->name);
+    }
+    size_t len;
+    const char *base = base_name(e->path, &len);
+    char *name = strndup(base, len);
+    bool matched = glob_match(pattern, name);
+    free(name);
+    return matched;
+}
+
+static bool compare(int cmp, long long value, long long n) {
+    return cmp > 0 ? value > n : cmp < 0 ? value < n : value == n;
+}
+
+static bool test_predicate(const FindContext *c, const Predicate *p, const WalkEntry *e, const struct statx *stx) {
+    switch (p->kind) {
+        case PRED_NAME:
+            return match_name(p->pattern, e);
+        case PRED_TYPE:
+            return e->type == p->type;
+        case PRED_SIZE: {
+            // 和 GNU find 一样按单位向上取整后比较
+            unsigned long long units = (stx->stx_size + p->unit - 1) / p->unit;
+            return compare(p->cmp, (long long) units, p->n);
+        }
+        case PRED_MTIME: {
+            long long days = ((long long) c->now - stx->stx_mtime.tv_sec) / 86400;
+            if ((long long) c->now < stx->stx_mtime.tv_sec) {
+                days = -1; // 修改时间在将来
+            }
+            return compare(p->cmp, days, p->n);
+        }
+        case PRED_NEWER:
+            return stx->stx_mtime.tv_sec > p->ref.tv_sec ||
+                   (stx->stx_mtime.tv_sec == p->ref.tv_sec && stx->stx_mtime.tv_nsec > p->ref.tv_nsec);
+    }
+    return false;
+}
+
+static bool matches(const FindContext *c, const WalkEntry *e) {
+    struct statx stx;
+    bool have_stat = false;
+    // 不需要元数据的条件先算，不满足时就不必 statx
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < c->num_preds; i++) {
+            const Predicate *p = &c->preds[i];
+            bool needs_stat = p->kind == PRED_SIZE || p->kind == PRED_MTIME || p->kind == PRED_NEWER;
+            if (needs_stat != (pass == 1)) {
+                continue;
+            }
+            if (needs_stat && !have_stat) {
+                STAT_INC(walk_statx);
+                if (statx(e->dir_fd, e->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, c->statx_mask, &stx) != 0) {
+                    return false;
+                }
+                have_stat = true;
+            }
+            if (test_predicate(c, p, e, &stx) == p->negate) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void flush_output(FindContext *c, FindOutput *o) {
+    pthread_mutex_lock(&c->out_lock);
+    lsh_writer_write(&c->out, o->buf, o->len);
+    pthread_mutex_unlock(&c->out_lock);
+    o->len = 0;
+}
+
+static bool find_visit(void *ctx, int worker, WalkEntry *e) {
+    FindContext *c = ctx;
+    if (e->depth >= c->min_depth && matches(c, e)) {
+        FindOutput *o = &c->outputs[worker];
+        size_t len = strlen(e->path);
+        if (o->len + len + 1 > FIND_OUT_BUF) {
+            flush_output(c, o);
+        }
+        if (len + 1 > FIND_OUT_BUF) {
+            pthread_mutex_lock(&c->out_lock);
+            lsh_writer_write(&c->out, e->path, len);
+            lsh_writer_write(&c->out, &c->terminator, 1);
+            pthread_mutex_unlock(&c->out_lock);
+        } else {
+            memcpy(o->buf + o->len, e->path, len);
+            o->buf[o->len + len] = c->terminator;
+            o->len += len + 1;
+        }
+    }
+    return c->max_depth < 0 || e->depth < c->max_depth;
+}
+
+static void find_error(void *ctx, const char *path, int err) {
+    FindContext *c = ctx;
+    fprintf(stderr, "find: %s: %s\n", path, strerror(err));
+    c->failed = true;
+}
+
+/*
+  选项
+*/
+
+// [+-]N，后面剩下的部分放在 end 中
+static bool parse_number(const char *arg, Predicate *p, char **end) {
+    if (*arg == '+' || *arg == '-') {
+        p->cmp = *arg++ == '+' ? 1 : -1;
+    }
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    errno = 0;
+    p->n = strtoll(arg, end, 10);
+    return errno == 0;
+}
+
+static bool parse_size(const char *arg, Predicate *p) {
+    char *end;
+    if (!parse_number(arg, p, &end)) {
+        return false;
+    }
+    p->unit = 512;
+    switch (*end) {
+        case '\0': return true;
+        case 'c': p->unit = 1; break;
+        case 'w': p->unit = 2; break;
+        case 'b': p->unit = 512; break;
+        case 'k': p->unit = 1024; break;
+        case 'M': p->unit = 1024 * 1024; break;
+        case 'G': p->unit = 1024 * 1024 * 1024; break;
+        default: return false;
+    }
+    return end[1] == '\0';
+}
+
+static bool parse_type(const char *arg, Predicate *p) {
+    static const char letters[] = "fdlpsbc";
+    static const unsigned char types[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR};
+    const char *hit = arg[0] != '\0' && arg[1] == '\0' ? strchr(letters, arg[0]) : NULL;
+    if (hit == NULL) {
+        return false;
+    }
+    p->type = types[hit - letters];
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: find [--parallel=N] [路径...] [-maxdepth N] [-mindepth N] [!] [-name 模式] [-type c] "
+                    "[-size [+-]N[cwbkMG]] [-mtime [+-]N] [-newer 文件] [-print | -print0]\n");
+}
+
+static bool parse_depth(const char *arg, int *value) {
+    char *end;
+    long n = arg != NULL ? strtol(arg, &end, 10) : -1;
+    if (arg == NULL || end == arg || *end != '\0' || n < 0) {
+        return false;
+    }
+    *value = (int) n;
+    return true;
+}
+
+static bool parse_expression(char **args, FindContext *c) {
+    bool negate = false;
+    for (int i = 0; args[i] != NULL; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "!") == 0 || strcmp(arg, "-not") == 0) {
+            negate = !negate;
+            continue;
+        }
+        if (strcmp(arg, "-print") == 0 || strcmp(arg, "-print0") == 0) {
+            c->terminator = arg[6] == '0' ? '\0' : '\n';
+            continue;
+        }
+        const char *value = args[i + 1];
+        if (strcmp(arg, "-maxdepth") == 0 || strcmp(arg, "-mindepth") == 0) {
+            if (!parse_depth(value, arg[2] == 'a' ? &c->max_depth : &c->min_depth)) {
+                fprintf(stderr, "find: %s 需要一个非负整数\n", arg);
+                return false;
+            }
+            i++;
+            continue;
+        }
+        if (c->num_preds >= MAX_FIND_PREDICATES) {
+            fprintf(stderr, "find: 条件太多\n");
+            return false;
+        }
+        Predicate *p = &c->preds[c->num_preds];
+        *p = (Predicate) {.negate = negate};
+        if (strcmp(arg, "-name") == 0) {
+            p->kind = PRED_NAME;
+            p->pattern = value;
+        } else if (strcmp(arg, "-type") == 0) {
+            p->kind = PRED_TYPE;
+            if (value == NULL || !parse_type(value, p)) {
+                fprintf(stderr, "find: 未知的文件类型 %s\n", value ? value : "");
+                return false;
+            }
+        } else if (strcmp(arg, "-size") == 0 || strcmp(arg, "-mtime") == 0) {
+            bool size = arg[1] == 's';
+            p->kind = size ? PRED_SIZE : PRED_MTIME;
+            c->statx_mask |= size ? STATX_SIZE : STATX_MTIME;
+            char *end;
+            bool ok = value != NULL && (size ? parse_size(value, p) : parse_number(value, p, &end) && *end == '\0');
+            if (!ok) {
+                fprintf(stderr, "find: %s 的参数无效: %s\n", arg, value ? value : "");
+                return false;
+            }
+        } else if (strcmp(arg, "-newer") == 0) {
+            p->kind = PRED_NEWER;
+            c->statx_mask |= STATX_MTIME;
+            struct statx stx;
+            if (value == NULL || statx(AT_FDCWD, value, AT_SYMLINK_NOFOLLOW, STATX_MTIME, &stx) != 0) {
+                fprintf(stderr, "find: %s: %s\n", value ? value : "-newer", value ? strerror(errno) : "缺少参数");
+                return false;
+            }
+            p->ref = stx.stx_mtime;
+        } else {
+            fprintf(stderr, "find: 未知的条件 %s\n", arg);
+            usage();
+            return false;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "find: %s 缺少参数\n", arg);
+            return false;
+        }
+        c->num_preds++;
+        negate = false;
+        i++;
+    }
+    return true;
+}
+
+// find [--parallel=N] [路径...] [条件...]，没有路径时从当前目录开始
+int lsh_find(char **args) {
+    FindContext c = {.terminator = '\n', .max_depth = -1, .threads = walk_default_threads()};
+    int i = 1;
+    if (args[i] != NULL && strncmp(args[i], "--parallel=", 11) == 0) {
+        c.threads = atoi(args[i++] + 11);
+    }
+    int first_root = i;
+    while (args[i] != NULL && args[i][0] != '-' && strcmp(args[i], "!") != 0) {
+        i++;
+    }
+    if (c.threads < 1 || !parse_expression(args + i, &c)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    char *dot[] = {".", NULL};
+    char **roots = i > first_root ? args + first_root : dot;
+    int num_roots = i > first_root ? i - first_root : 1;
+    c.now = time(NULL);
+
+    c.outputs = calloc(c.threads, sizeof(FindOutput));
+    for (int t = 0; t < c.threads; t++) {
+        c.outputs[t].buf = malloc(FIND_OUT_BUF);
+    }
+    pthread_mutex_init(&c.out_lock, NULL);
+    lsh_writer_init(&c.out, LSH_OUT);
+    WalkOps ops = {.ctx = &c, .threads = c.threads, .visit = find_visit, .error = find_error};
+    walk_tree(roots, num_roots, &ops);
+    for (int t = 0; t < c.threads; t++) {
+        flush_output(&c, &c.outputs[t]);
+        free(c.outputs[t].buf);
+    }
+    lsh_writer_free(&c.out);
+    pthread_mutex_destroy(&c.out_lock);
+    free(c.outputs);
+    lsh_last_status = c.failed ? 1 : 0;
+    return 1;
+}
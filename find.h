@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-3.
+//
+
+#ifndef OS_C_FIND_H
+#define OS_C_FIND_H
+
+int lsh_find(char **args);
+
+#endif //OS_C_FIND_H
@@ -0,0 +1,624 @@
+//
+// Created by ysh on 24-6-30.
+//
+// head 和 tail 内置命令。head 读够行数就停下并关闭文件；普通文件多读的部分用 fseeko 退回，
+// 这样 { head -n 1; cat; } < 文件 能接着读。tail 对普通文件从末尾按块向前扫描换行，
+// 不读前面的内容；管道只保留最后若干块。tail -f 用 inotify 等待文件变化，
+// 同时监视所在目录，文件被改名或删除后重新打开同名的新文件，被截断时从头读起。
+//
+
+#define _GNU_SOURCE
+#include "head_tail.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define HT_BLOCK_SIZE 65536
+
+typedef struct CountOptions {
+    unsigned long long count; // 行数或字节数
+    bool bytes;               // -c：按字节计数
+    bool from_start;          // tail +N：从第 N 行（字节）开始输出
+    bool follow;              // tail -f
+} CountOptions;
+
+// 带参数的选项：参数可以紧跟在选项后面，也可以是下一个参数
+static const char *option_arg(char **args, int *i, const char *rest) {
+    if (*rest != '\0') {
+        return rest;
+    }
+    if (args[*i + 1] == NULL) {
+        return NULL;
+    }
+    return args[++*i];
+}
+
+static bool parse_count(const char *s, CountOptions *o, bool allow_plus) {
+    if (allow_plus && *s == '+') {
+        o->from_start = true;
+        s++;
+    } else if (*s == '-') {
+        s++;
+    }
+    char *end;
+    errno = 0;
+    o->count = strtoull(s, &end, 10);
+    return end != s && *end == '\0' && errno == 0 && *s != '-';
+}
+
+// 解析 head 和 tail 共用的选项，-NUM 相当于 -n NUM
+static bool parse_options(const char *cmd, char **args, CountOptions *o, int *first_file) {
+    bool is_tail = strcmp(cmd, "tail") == 0;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (args[i][1] >= '0' && args[i][1] <= '9') {
+            if (!parse_count(args[i] + 1, o, false)) {
+                fprintf(stderr, "%s: 无效的行数 %s\n", cmd, args[i] + 1);
+                return false;
+            }
+            o->bytes = false;
+            continue;
+        }
+        for (const char *opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'f' && is_tail) {
+                o->follow = true;
+                continue;
+            } else if (*opt != 'n' && *opt != 'c') {
+                fprintf(stderr, "%s: 无效的选项 -%c\n", cmd, *opt);
+                fprintf(stderr, is_tail ? "Usage: tail [-f] [-n [+]行数 | -c [+]字节数] [文件...]\n"
+                                        : "Usage: head [-n 行数 | -c 字节数] [文件...]\n");
+                return false;
+            }
+            o->bytes = *opt == 'c';
+            const char *value = option_arg(args, &i, opt + 1);
+            if (value == NULL || !parse_count(value, o, is_tail)) {
+                fprintf(stderr, "%s: 无效的%s %s\n", cmd, o->bytes ? "字节数" : "行数", value ? value : "");
+                return false;
+            }
+            break;
+        }
+    }
+    *first_file = i;
+    return true;
+}
+
+// 多个文件时每个文件前输出 ==> 文件名 <==，文件之间空一行
+static void print_header(FILE *out, const char *name, bool *first) {
+    fprintf(out, "%s==> %s <==\n", *first ? "" : "\n", name != NULL ? name : "标准输入");
+    *first = false;
+}
+
+/*
+  head
+*/
+
+static bool is_seekable_regular(FILE *in) {
+    struct stat sb;
+    int fd = fileno(in);
+    return fd >= 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode);
+}
+
+static bool head_input(FILE *in, FILE *out, unsigned long long count) {
+    char buf[HT_BLOCK_SIZE];
+    size_t n;
+    if (is_seekable_regular(in)) {
+        // 普通文件整块读取，用 memchr 找换行，读多的部分退回去
+        while (count > 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            const char *p = buf, *end = buf + n, *nl;
+            while (count > 0 && (nl = memchr(p, '\n', end - p)) != NULL) {
+                p = nl + 1;
+                count--;
+            }
+            size_t used = count == 0 ? (size_t) (p - buf) : n;
+            fwrite(buf, 1, used, out);
+            if (used < n) {
+                fseeko(in, -(off_t) (n - used), SEEK_CUR);
+            }
+        }
+        return !ferror(in);
+    }
+    // 管道按行读取：fread 会等到缓冲区读满，而前几行可能早就到了
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (count > 0 && (len = getline(&line, &cap, in)) > 0) {
+        fwrite(line, 1, len, out);
+        count--;
+    }
+    free(line);
+    return !ferror(in);
+}
+
+static bool head_bytes(FILE *in, FILE *out, unsigned long long count) {
+    char buf[HT_BLOCK_SIZE];
+    size_t n;
+    while (count > 0 && (n = fread(buf, 1, count < sizeof(buf) ? count : sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+        count -= n;
+    }
+    return !ferror(in);
+}
+
+// head [-n 行数 | -c 字节数] [文件...]：默认输出前 10 行
+int lsh_head(char **args) {
+    CountOptions o = {.count = 10};
+    int first_file;
+    if (!parse_options("head", args, &o, &first_file)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    int num_files = 0;
+    while (args[first_file + num_files] != NULL) {
+        num_files++;
+    }
+    FILE *out = LSH_OUT;
+    bool first = true, failed = false;
+    for (int i = 0; i < (num_files == 0 ? 1 : num_files); i++) {
+        const char *name = num_files == 0 || strcmp(args[first_file + i], "-") == 0 ? NULL : args[first_file + i];
+        FILE *in = name == NULL ? LSH_IN : fopen(name, "re");
+        if (in == NULL) {
+            fprintf(stderr, "head: 无法打开 %s: %s\n", name, strerror(errno));
+            failed = true;
+            continue;
+        }
+        if (num_files > 1) {
+            print_header(out, name, &first);
+        }
+        bool ok = o.bytes ? head_bytes(in, out, o.count) : head_input(in, out, o.count);
+        if (!ok) {
+            fprintf(stderr, "head: 读取 %s 出错: %s\n", name != NULL ? name : "标准输入", strerror(errno));
+            failed = true;
+        }
+        // 读够了就立即关闭，不再读剩下的部分
+        if (name != NULL) {
+            fclose(in);
+        }
+    }
+    lsh_last_status = failed ? 1 : 0;
+    return 1;
+}
+
+/*
+  tail：普通文件
+*/
+
+// 把 [from, to) 这段文件内容写到输出
+static bool copy_range(int fd, off_t from, off_t to, FILE *out) {
+    char buf[HT_BLOCK_SIZE];
+    while (from < to) {
+        size_t want = to - from < (off_t) sizeof(buf) ? (size_t) (to - from) : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+        fwrite(buf, 1, n, out);
+        from += n;
+    }
+    return true;
+}
+
+// 从 size 向前按块读取，返回最后 count 行的起点；末尾的换行不算一行的开始
+static off_t find_last_lines(int fd, off_t start, off_t size, unsigned long long count) {
+    char buf[HT_BLOCK_SIZE];
+    off_t pos = size;
+    bool at_end = true;
+    if (count == 0) {
+        return size;
+    }
+    while (pos > start) {
+        size_t len = pos - start < (off_t) sizeof(buf) ? (size_t) (pos - start) : sizeof(buf);
+        pos -= len;
+        if (pread(fd, buf, len, pos) != (ssize_t) len) {
+            return -1;
+        }
+        size_t i = len;
+        if (at_end && buf[len - 1] == '\n') {
+            i--;
+        }
+        at_end = false;
+        const char *nl;
+        while (i > 0 && (nl = memrchr(buf, '\n', i)) != NULL) {
+            if (--count == 0) {
+                STAT_ADD(tail_unread, pos - start);
+                return pos + (nl - buf) + 1;
+            }
+            i = nl - buf;
+        }
+    }
+    return start;
+}
+
+// tail +N：向前扫描，跳过前 count - 1 行
+static off_t skip_lines(int fd, off_t start, off_t size, unsigned long long count) {
+    char buf[HT_BLOCK_SIZE];
+    off_t pos = start;
+    while (count > 1 && pos < size) {
+        ssize_t n = pread(fd, buf, sizeof(buf), pos);
+        if (n <= 0) {
+            return n == 0 ? size : -1;
+        }
+        const char *p = buf, *end = buf + n, *nl;
+        while (count > 1 && (nl = memchr(p, '\n', end - p)) != NULL) {
+            p = nl + 1;
+            count--;
+        }
+        pos += count > 1 ? n : p - buf;
+    }
+    return pos;
+}
+
+// 输出普通文件 [start, size) 中要求的部分，不经过 FILE 缓冲
+static bool tail_regular(int fd, off_t start, off_t size, FILE *out, const CountOptions *o) {
+    off_t from;
+    if (o->from_start && o->bytes) {
+        unsigned long long skip = o->count > 0 ? o->count - 1 : 0;
+        from = skip < (unsigned long long) (size - start) ? start + (off_t) skip : size;
+    } else if (o->from_start) {
+        from = skip_lines(fd, start, size, o->count);
+    } else if (o->bytes) {
+        from = o->count < (unsigned long long) (size - start) ? size - (off_t) o->count : start;
+        STAT_ADD(tail_unread, from - start);
+    } else {
+        from = find_last_lines(fd, start, size, o->count);
+    }
+    return from >= 0 && copy_range(fd, from, size, out);
+}
+
+/*
+  tail：管道
+*/
+
+typedef struct TailBlock {
+    struct TailBlock *next;
+    size_t len;
+    size_t lines;
+    char data[HT_BLOCK_SIZE];
+} TailBlock;
+
+static size_t count_newlines(const char *p, size_t len) {
+    size_t lines = 0;
+    for (const char *end = p + len; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        lines++;
+    }
+    return lines;
+}
+
+// tail +N：跳过开头的部分，其余照抄
+static bool tail_stream_from(FILE *in, FILE *out, const CountOptions *o) {
+    char buf[HT_BLOCK_SIZE];
+    unsigned long long skip = o->count > 0 ? o->count - 1 : 0;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        const char *p = buf, *end = buf + n;
+        if (o->bytes) {
+            size_t drop = skip < n ? skip : n;
+            p += drop;
+            skip -= drop;
+        } else {
+            const char *nl;
+            while (skip > 0 && (nl = memchr(p, '\n', end - p)) != NULL) {
+                p = nl + 1;
+                skip--;
+            }
+            if (skip > 0) {
+                p = end;
+            }
+        }
+        fwrite(p, 1, end - p, out);
+    }
+    return !ferror(in);
+}
+
+// 不能定位的输入只能读到结尾。按块保存，足够覆盖最后 count 行（字节）之后丢掉最前面的块
+static bool tail_stream(FILE *in, FILE *out, const CountOptions *o) {
+    if (o->from_start) {
+        return tail_stream_from(in, out, o);
+    }
+    TailBlock *head = NULL, *tail = NULL;
+    unsigned long long total_lines = 0, total_bytes = 0;
+    for (;;) {
+        TailBlock *b = malloc(sizeof(TailBlock));
+        b->next = NULL;
+        b->len = fread(b->data, 1, sizeof(b->data), in);
+        if (b->len == 0) {
+            free(b);
+            break;
+        }
+        b->lines = count_newlines(b->data, b->len);
+        total_lines += b->lines;
+        total_bytes += b->len;
+        if (tail != NULL) {
+            tail->next = b;
+        } else {
+            head = b;
+        }
+        tail = b;
+        // 剩下的块里换行数多于 count 时，起点一定不在第一块中
+        while (head != tail && (o->bytes ? total_bytes - head->len >= o->count : total_lines - head->lines > o->count)) {
+            TailBlock *drop = head;
+            head = head->next;
+            total_lines -= drop->lines;
+            total_bytes -= drop->len;
+            free(drop);
+        }
+    }
+    bool ok = !ferror(in);
+
+    // 要跳过的行数：最后一行没有换行结尾时也算一行
+    unsigned long long skip;
+    if (o->bytes) {
+        skip = total_bytes > o->count ? total_bytes - o->count : 0;
+    } else {
+        unsigned long long lines = total_lines + (tail != NULL && tail->data[tail->len - 1] != '\n');
+        skip = lines > o->count ? lines - o->count : 0;
+    }
+    for (TailBlock *b = head, *next; b != NULL; b = next) {
+        const char *p = b->data, *end = b->data + b->len;
+        if (o->bytes) {
+            size_t drop = skip < b->len ? skip : b->len;
+            p += drop;
+            skip -= drop;
+        } else {
+            const char *nl;
+            while (skip > 0 && (nl = memchr(p, '\n', end - p)) != NULL) {
+                p = nl + 1;
+                skip--;
+            }
+            if (skip > 0) {
+                p = end;
+            }
+        }
+        fwrite(p, 1, end - p, out);
+        next = b->next;
+        free(b);
+    }
+    return ok;
+}
+
+/*
+  tail -f
+*/
+
+typedef struct Follow {
+    const char *name;
+    const char *base; // 文件名中最后一个 / 之后的部分，用来匹配目录事件
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;     // 已经输出到的位置
+    int wd;           // 文件本身的监视，文件不存在时为 -1
+    int dir_wd;       // 所在目录的监视，用来发现同名的新文件
+    bool changed;
+    bool replaced;    // 原来的文件被改名或删除了
+} Follow;
+
+static volatile sig_atomic_t follow_interrupted = 0;
+
+static void follow_sigint(int sig) {
+    (void) sig;
+    follow_interrupted = 1;
+}
+
+static void watch_file(int ifd, Follow *f) {
+    f->wd = inotify_add_watch(ifd, f->name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    char *dir = strdup(f->name);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        slash[slash == dir] = '\0'; // "/name" 的目录是 "/"
+    }
+    f->dir_wd = inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+}
+
+// 输出文件新增的内容；文件变短说明被截断了，从头开始
+static void follow_read(Follow *f, FILE *out, int *last_shown, int index, bool headers) {
+    struct stat sb;
+    if (f->fd < 0 || fstat(f->fd, &sb) != 0) {
+        return;
+    }
+    if (sb.st_size < f->offset) {
+        fprintf(stderr, "tail: %s: 文件被截断\n", f->name);
+        f->offset = 0;
+    }
+    if (sb.st_size == f->offset) {
+        return;
+    }
+    if (headers && *last_shown != index) {
+        bool first = false;
+        print_header(out, f->name, &first);
+        *last_shown = index;
+    }
+    copy_range(f->fd, f->offset, sb.st_size, out);
+    f->offset = sb.st_size;
+}
+
+// 文件被轮转后重新打开同名文件，从头跟随
+static void follow_reopen(int ifd, Follow *f) {
+    int fd = open(f->name, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (f->wd >= 0) {
+            fprintf(stderr, "tail: %s 已不可访问\n", f->name);
+            inotify_rm_watch(ifd, f->wd);
+            f->wd = -1;
+        }
+        return;
+    }
+    if (f->fd >= 0 && sb.st_dev == f->dev && sb.st_ino == f->ino) {
+        close(fd); // 还是原来的文件
+        return;
+    }
+    fprintf(stderr, "tail: %s 已被替换，跟随新文件\n", f->name);
+    if (f->fd >= 0) {
+        close(f->fd);
+    }
+    if (f->wd >= 0) {
+        inotify_rm_watch(ifd, f->wd);
+    }
+    f->fd = fd;
+    f->dev = sb.st_dev;
+    f->ino = sb.st_ino;
+    f->offset = 0;
+    f->wd = inotify_add_watch(ifd, f->name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    f->changed = true;
+}
+
+// 等待 inotify 事件并输出新内容，直到收到 SIGINT 或输出出错
+static void follow_files(Follow *files, int num_files, FILE *out, bool headers) {
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) {
+        perror("tail: inotify_init1");
+        return;
+    }
+    for (int i = 0; i < num_files; i++) {
+        watch_file(ifd, &files[i]);
+    }
+    struct sigaction sa = {0}, old_sa;
+    sa.sa_handler = follow_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_sa); // 不设 SA_RESTART，让 poll 被打断
+    follow_interrupted = 0;
+
+    int last_shown = num_files - 1;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!follow_interrupted && fflush(out) == 0 && !ferror(out)) {
+        struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        ssize_t len = read(ifd, events, sizeof(events));
+        if (len <= 0) {
+            continue;
+        }
+        for (char *p = events; p < events + len;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            for (int i = 0; i < num_files; i++) {
+                Follow *f = &files[i];
+                if (ev->wd == f->wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+                    f->replaced = true;
+                } else if (ev->wd == f->wd) {
+                    f->changed = true;
+                } else if (ev->wd == f->dir_wd && ev->len > 0 && strcmp(ev->name, f->base) == 0) {
+                    f->replaced = true;
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        for (int i = 0; i < num_files; i++) {
+            Follow *f = &files[i];
+            if (f->changed || f->replaced) {
+                // 先把旧文件剩下的内容输出完，再换到新文件
+                follow_read(f, out, &last_shown, i, headers);
+            }
+            if (f->replaced) {
+                follow_reopen(ifd, f);
+                if (f->changed) {
+                    follow_read(f, out, &last_shown, i, headers);
+                }
+            }
+            f->changed = f->replaced = false;
+        }
+        STAT_INC(tail_wakes);
+    }
+    sigaction(SIGINT, &old_sa, NULL);
+    close(ifd);
+}
+
+// tail [-f] [-n [+]行数 | -c [+]字节数] [文件...]：默认输出最后 10 行
+int lsh_tail(char **args) {
+    CountOptions o = {.count = 10};
+    int first_file;
+    if (!parse_options("tail", args, &o, &first_file)) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    if (o.count == 0 && !o.from_start && !o.follow) {
+        return 1; // 和 GNU tail 一样，连文件头都不输出
+    }
+    int num_files = 0;
+    while (args[first_file + num_files] != NULL) {
+        num_files++;
+    }
+    FILE *out = LSH_OUT;
+    bool first = true, failed = false;
+    Follow *follows = calloc(num_files > 0 ? num_files : 1, sizeof(Follow));
+    int num_follows = 0;
+    for (int i = 0; i < (num_files == 0 ? 1 : num_files); i++) {
+        const char *name = num_files == 0 || strcmp(args[first_file + i], "-") == 0 ? NULL : args[first_file + i];
+        int fd = name == NULL ? fileno(LSH_IN) : open(name, O_RDONLY | O_CLOEXEC);
+        if (name != NULL && fd < 0) {
+            fprintf(stderr, "tail: 无法打开 %s: %s\n", name, strerror(errno));
+            failed = true;
+            continue;
+        }
+        if (num_files > 1) {
+            print_header(out, name, &first);
+        }
+        struct stat sb;
+        off_t start = name == NULL ? ftello(LSH_IN) : 0;
+        bool regular = fd >= 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && start >= 0 && start <= sb.st_size
+                && lseek(fd, 0, SEEK_CUR) == start; // 标准输入的 FILE 里还有缓冲数据时不能绕过它
+        bool ok;
+        if (regular) {
+            ok = tail_regular(fd, start, sb.st_size, out, &o);
+            if (name == NULL) {
+                fseeko(LSH_IN, sb.st_size, SEEK_SET);
+            }
+        } else {
+            FILE *in = name == NULL ? LSH_IN : fdopen(fd, "r");
+            ok = tail_stream(in, out, &o);
+            if (name != NULL) {
+                fclose(in);
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "tail: 读取 %s 出错: %s\n", name != NULL ? name : "标准输入", strerror(errno));
+            failed = true;
+        }
+        // 只跟随有名字的普通文件，管道读到结尾就结束了
+        if (regular && name != NULL && o.follow) {
+            const char *slash = strrchr(name, '/');
+            follows[num_follows++] = (Follow) {.name = name, .base = slash ? slash + 1 : name, .fd = fd,
+                    .dev = sb.st_dev, .ino = sb.st_ino, .offset = sb.st_size};
+        } else if (regular && name != NULL) {
+            close(fd);
+        }
+    }
+    if (num_follows > 0) {
+        follow_files(follows, num_follows, out, num_files > 1);
+        for (int i = 0; i < num_follows; i++) {
+            if (follows[i].fd >= 0) {
+                close(follows[i].fd);
+            }
+        }
+    }
+    free(follows);
+    lsh_last_status = failed ? 1 : 0;
+    return 1;
+}
@@ -0,0 +1,11 @@
+//
+// Created by ysh on 24-6-30.
+//
+
+#ifndef OS_C_HEAD_TAIL_H
+#define OS_C_HEAD_TAIL_H
+
+int lsh_head(char **args);
+int lsh_tail(char **args);
+
+#endif //OS_C_HEAD_TAIL_H
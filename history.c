@@ -6,6 +6,8 @@
 #include "main.h"
 #include "lsh_builtins.h"
 #include "bg.h"
+#include "stats.h"
+#include <string.h>
 #include <readline/history.h>
 
 void init_history(const char *history_file) {
@@ -15,5 +17,10 @@ void init_history(const char *history_file) {
 }
 
 void save_history(const char *history_file) {
-    write_history(history_file);
+    if (write_history(history_file) == 0) {
+        HIST_ENTRY **entries = history_list();
+        for (int i = 0; entries != NULL && entries[i] != NULL; i++) {
+            STAT_ADD(history_bytes, strlen(entries[i]->line) + 1);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,251 @@
+//
+// Created by ysh on 24-6-21.
+//
+// 后台内置命令的工作线程池。
+// `grep pattern bigfile &` 之类的后台内置命令不再 fork 整个 shell，
+// 而是交给工作线程执行，每个任务带着自己的输入输出流（见 lsh_io.h）。
+// 工作线程用 unshare(CLONE_FS) 拥有独立的当前目录，执行任务前切换到提交任务时 shell 的目录，
+// 任务中的相对路径和 fork 出的子进程一样按提交时的目录解析，不受之后的 cd 影响。
+//
+
+#define _GNU_SOURCE
+#include "job_pool.h"
+#include "lsh_builtins.h"
+#include "lsh_io.h"
+#include "bg.h"
+#include "stats.h"
+#include "vars.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define JOB_POOL_THREADS 4
+
+extern char *builtin_str[];
+extern int (*builtin_func[]) (char **);
+extern volatile sig_atomic_t background_counter;
+
+typedef struct PoolJob {
+    int builtin_index;
+    char **args;        // 复制出来的参数，命令行缓冲区在任务结束前就会被释放
+    int in_fd;
+    int out_fd;
+    int cwd_fd;         // 提交时的工作目录 (O_PATH)
+    char *tmp_dir;      // 提交时的 TMPDIR，工作线程不能读 environ
+    struct PoolJob *next;
+} PoolJob;
+
+// 只有不修改 shell 状态、不依赖进程级全局变量的内置命令才能在线程中运行
+static const char *pool_builtins[] = {
+        "cat",
+        "grep",
+        "echo",
+        "ls",
+        "help",
+        "stats",
+        "test",
+        "[",
+        "true",
+        "false",
+        "printf",
+        "sort",
+        "wc",
+        "head",
+        "count",
+        "cut",
+        "fields",
+        "find",
+        "du",
+        // 会修改文件系统，依赖任务按提交时的工作目录运行（见 run_job），cd 之后也不会操作别的目录
+        "cp",
+        "rm",
+        "sum",
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static PoolJob *queue_head = NULL;
+static PoolJob *queue_tail = NULL;
+static PoolJob *done_jobs = NULL;
+static bool pool_started = false;
+static int pool_threads = 0;        // 已经创建的工作线程数
+static int pool_ready = 0;          // 已经完成 unshare 的工作线程数
+static bool pool_private_cwd = true; // 所有工作线程都有独立的当前目录
+
+bool job_pool_accepts(const char *command) {
+    for (size_t i = 0; i < sizeof(pool_builtins) / sizeof(pool_builtins[0]); i++) {
+        if (strcmp(command, pool_builtins[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_job(PoolJob *job) {
+    if (fchdir(job->cwd_fd) == -1) {
+        perror("lsh: fchdir");
+        close(job->in_fd);
+        close(job->out_fd);
+        close(job->cwd_fd);
+        return;
+    }
+    close(job->cwd_fd);
+    lsh_tmp_dir = job->tmp_dir;
+    lsh_in_stream = fdopen(job->in_fd, "r");
+    lsh_out_stream = fdopen(job->out_fd, "w");
+    if (lsh_in_stream != NULL && lsh_out_stream != NULL) {
+        STAT_INC(builtin_runs);
+        (*builtin_func[job->builtin_index])(job->args);
+    }
+
+    if (lsh_in_stream != NULL) {
+        fclose(lsh_in_stream);
+    } else {
+        close(job->in_fd);
+    }
+    if (lsh_out_stream != NULL) {
+        fclose(lsh_out_stream);
+    } else {
+        close(job->out_fd);
+    }
+    lsh_in_stream = NULL;
+    lsh_out_stream = NULL;
+    lsh_tmp_dir = NULL;
+}
+
+static void *pool_worker(void *arg) {
+    // 不再和主线程共享当前目录，shell 的 cd 不影响正在运行的任务
+    bool unshared = unshare(CLONE_FS) == 0;
+    pthread_mutex_lock(&pool_lock);
+    pool_private_cwd &= unshared;
+    pool_ready++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        PoolJob *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&pool_lock);
+        job->next = done_jobs;
+        done_jobs = job;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+static void start_pool() {
+    // 工作线程屏蔽所有信号，SIGCHLD 等信号只由主线程处理
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < JOB_POOL_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL) == 0) {
+            pthread_detach(thread);
+            pool_threads++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pool_started = true;
+
+    // 等待工作线程确认有了独立的当前目录
+    pthread_mutex_lock(&pool_lock);
+    while (pool_ready < pool_threads) {
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// 提交一个后台内置命令，接管 in_fd/out_fd，返回任务序号。
+// 线程池不能使用（工作线程无法拥有独立的当前目录，或者当前目录打不开）时返回 -1，不接管描述符
+int job_pool_submit(int builtin_index, char **args, int in_fd, int out_fd) {
+    if (!pool_started) {
+        start_pool();
+    }
+    if (!pool_private_cwd || pool_threads == 0) {
+        return -1;
+    }
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd == -1) {
+        return -1;
+    }
+
+    PoolJob *job = malloc(sizeof(PoolJob));
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    job->args = malloc((argc + 1) * sizeof(char *));
+    for (int i = 0; i < argc; i++) {
+        job->args[i] = strdup(args[i]);
+    }
+    job->args[argc] = NULL;
+    job->builtin_index = builtin_index;
+
+    // 后台任务不从终端读取输入，没有重定向时使用 /dev/null
+    // 任务自己的 fd 都设置 close-on-exec，避免被之后 fork 的子进程继承
+    job->in_fd = (in_fd != 0) ? in_fd : open("/dev/null", O_RDONLY);
+    job->out_fd = (out_fd != 1) ? out_fd : dup(STDOUT_FILENO);
+    fcntl(job->in_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(job->out_fd, F_SETFD, FD_CLOEXEC);
+    job->cwd_fd = cwd_fd;
+    job->tmp_dir = strdup(var_tmp_dir());
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    return ++background_counter;
+}
+
+// 主线程调用，把已完成的线程任务登记为完成的后台任务
+void job_pool_collect() {
+    pthread_mutex_lock(&pool_lock);
+    PoolJob *job = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (job == NULL) {
+        return;
+    }
+
+    // 与 SIGCHLD 处理函数共享任务列表，处理期间屏蔽 SIGCHLD
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    while (job != NULL) {
+        PoolJob *next = job->next;
+        background_builtin_done(builtin_str[job->builtin_index]);
+        for (int i = 0; job->args[i] != NULL; i++) {
+            free(job->args[i]);
+        }
+        free(job->args);
+        free(job->tmp_dir);
+        free(job);
+        job = next;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
@@ -0,0 +1,14 @@
+//
+// Created by ysh on 24-6-21.
+//
+
+#ifndef OS_C_JOB_POOL_H
+#define OS_C_JOB_POOL_H
+
+#include <stdbool.h>
+
+bool job_pool_accepts(const char *command);
+int job_pool_submit(int builtin_index, char **args, int in_fd, int out_fd);
+void job_pool_collect();
+
+#endif //OS_C_JOB_POOL_H
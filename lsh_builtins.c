@@ -1,4 +1,22 @@
+#define _GNU_SOURCE
 #include "lsh_builtins.h"
+#include "stats.h"
+#include "path_cache.h"
+#include "parallel.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "script.h"
+#include "script_builtins.h"
+#include "sort.h"
+#include "wc.h"
+#include "head_tail.h"
+#include "count.h"
+#include "cut.h"
+#include "find.h"
+#include "du.h"
+#include "cp.h"
+#include "rm.h"
+#include "sum.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +43,31 @@ char *builtin_str[] = {
         "echo",
         "type",
         "alias",
+        "stats",
+        "parallel",
+        "batch",
+        "export",
+        "unset",
+        "source",
+        ".",
+        "test",
+        "[",
+        "true",
+        "false",
+        "printf",
+        "read",
+        "sort",
+        "wc",
+        "head",
+        "tail",
+        "count",
+        "cut",
+        "fields",
+        "find",
+        "du",
+        "cp",
+        "rm",
+        "sum",
 };
 
 int (*builtin_func[]) (char **) = {
@@ -38,6 +81,31 @@ int (*builtin_func[]) (char **) = {
         &lsh_echo,
         &lsh_type,
         &lsh_alias,
+        &lsh_stats_cmd,
+        &lsh_parallel,
+        &lsh_batch,
+        &lsh_export,
+        &lsh_unset,
+        &lsh_source,
+        &lsh_source,
+        &lsh_test,
+        &lsh_test,
+        &lsh_true,
+        &lsh_false,
+        &lsh_printf,
+        &lsh_read,
+        &lsh_sort,
+        &lsh_wc,
+        &lsh_head,
+        &lsh_tail,
+        &lsh_count,
+        &lsh_cut,
+        &lsh_fields,
+        &lsh_find,
+        &lsh_du,
+        &lsh_cp,
+        &lsh_rm,
+        &lsh_sum,
 };
 
 int lsh_num_builtins() {
@@ -72,10 +140,11 @@ int lsh_cd(char **args) {
     char cwd[PATH_MAX];
     if (args[1] == NULL) {
         getcwd(cwd, sizeof(cwd));
-        printf("%s\n", cwd);
+        fprintf(LSH_OUT, "%s\n", cwd);
     } else {
         if (chdir(args[1]) != 0) {
-            printf("系统找不到指定的路径。\n");
+            fprintf(LSH_OUT, "系统找不到指定的路径。\n");
+            lsh_last_status = 1;
         }
     }
     return 1;
@@ -83,15 +152,15 @@ int lsh_cd(char **args) {
 
 int lsh_help(char **args) {
     int i;
-    printf("21013139's LSH\n");
-    printf("Type program names and arguments, and hit enter.\n");
-    printf("The following are built in:\n");
+    fprintf(LSH_OUT, "21013139's LSH\n");
+    fprintf(LSH_OUT, "Type program names and arguments, and hit enter.\n");
+    fprintf(LSH_OUT, "The following are built in:\n");
 
     for (i = 0; i < lsh_num_builtins(); i++) {
-        printf("  %s\n", builtin_str[i]);
+        fprintf(LSH_OUT, "  %s\n", builtin_str[i]);
     }
 
-    printf("Use the man command for information on other programs.\n");
+    fprintf(LSH_OUT, "Use the man command for information on other programs.\n");
     return 1;
 }
 
@@ -111,7 +180,7 @@ int lsh_ls(char **args) {
         while ((entry = readdir(dir)) != NULL) {
             // 过滤掉以 . 开头的目录项
             if (entry->d_name[0] != '.') {
-                printf("%s\n", entry->d_name);
+                fprintf(LSH_OUT, "%s\n", entry->d_name);
             }
         }
 
@@ -128,26 +197,32 @@ int lsh_ls(char **args) {
         while((entry = readdir(dir)) != NULL) {
             if(stat(entry->d_name, &file_stat) == -1) {
                 perror("stat");
+                closedir(dir);
                 return 1;
             }
 
-            printf((S_ISDIR(file_stat.st_mode)) ? "d" : "-");
-            printf((file_stat.st_mode & S_IRUSR) ? "r" : "-");
-            printf((file_stat.st_mode & S_IWUSR) ? "w" : "-");
-            printf((file_stat.st_mode & S_IXUSR) ? "x" : "-");
-            printf((file_stat.st_mode & S_IRGRP) ? "r" : "-");
-            printf((file_stat.st_mode & S_IWGRP) ? "w" : "-");
-            printf((file_stat.st_mode & S_IXGRP) ? "x" : "-");
-            printf((file_stat.st_mode & S_IROTH) ? "r" : "-");
-            printf((file_stat.st_mode & S_IWOTH) ? "w" : "-");
-            printf((file_stat.st_mode & S_IXOTH) ? "x" : "-");
-            printf(" %ld", file_stat.st_nlink);
-            printf(" %s", getpwuid(file_stat.st_uid)->pw_name);
-            printf(" %s", getgrgid(file_stat.st_gid)->gr_name);
-            printf(" %lld", file_stat.st_size);
-            printf(" %s", strtok(ctime(&file_stat.st_mtime), "\n"));
-            printf(" %s\n", entry->d_name);
+            fprintf(LSH_OUT, (S_ISDIR(file_stat.st_mode)) ? "d" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IRUSR) ? "r" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IWUSR) ? "w" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IXUSR) ? "x" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IRGRP) ? "r" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IWGRP) ? "w" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IXGRP) ? "x" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IROTH) ? "r" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IWOTH) ? "w" : "-");
+            fprintf(LSH_OUT, (file_stat.st_mode & S_IXOTH) ? "x" : "-");
+            fprintf(LSH_OUT, " %ld", file_stat.st_nlink);
+            fprintf(LSH_OUT, " %s", getpwuid(file_stat.st_uid)->pw_name);
+            fprintf(LSH_OUT, " %s", getgrgid(file_stat.st_gid)->gr_name);
+            fprintf(LSH_OUT, " %lld", file_stat.st_size);
+            char time_buf[32];
+            ctime_r(&file_stat.st_mtime, time_buf);
+            time_buf[strcspn(time_buf, "\n")] = '\0';
+            fprintf(LSH_OUT, " %s", time_buf);
+            fprintf(LSH_OUT, " %s\n", entry->d_name);
         }
+
+        closedir(dir);
     }
 
     // 如果有参数"-a"，显示所有文件，包括隐藏文件
@@ -159,14 +234,14 @@ int lsh_ls(char **args) {
         }
 
         while((entry = readdir(dir)) != NULL){
-            printf("%s\n", entry->d_name);
+            fprintf(LSH_OUT, "%s\n", entry->d_name);
         }
 
         closedir(dir);
     }
 
     else{
-        printf("'%s'为未知的参数\n",args[1]);
+        fprintf(LSH_OUT, "'%s'为未知的参数\n",args[1]);
         return 1;
     }
 
@@ -175,17 +250,33 @@ int lsh_ls(char **args) {
 
 int lsh_cat(char **args) {
     char *filename = args[1];
-    FILE *file = fopen(filename,"r");
+    // 没有给出文件名时读取标准输入，例如 here-document
+    FILE *file = (filename == NULL) ? LSH_IN : fopen(filename,"r");
     if(file == NULL) {
         fprintf(stderr,"cat:无法打开文件 %s\n", filename);
+        lsh_last_status = 1;
         return 1;
     }
-    int c;
-    while((c = fgetc(file)) != EOF) {
-        putchar(c);
+    // 按块搬运，普通文件整个映射后一次写出
+    LshReader reader;
+    LshWriter out;
+    lsh_reader_init(&reader, file);
+    lsh_writer_init(&out, LSH_OUT);
+    const char *data;
+    size_t len;
+    unsigned long bytes = 0;
+    while (lsh_reader_block(&reader, &data, &len)) {
+        lsh_writer_put(&out, data, len);
+        lsh_writer_flush(&out); // 管道中读到多少就写出多少，不等攒满
+        bytes += len;
+    }
+    lsh_writer_free(&out);
+    lsh_reader_free(&reader);
+    STAT_ADD(cat_bytes, bytes);
+    if (filename != NULL) {
+        fclose(file);
+        fprintf(LSH_OUT, "\n");
     }
-    fclose(file);
-    printf("\n");
     return 1;
 }
 
@@ -193,19 +284,19 @@ int lsh_history(char **args) {
     if(args[1] == NULL) {
         HIST_ENTRY **my_history_list = history_list();
         if(history_list == NULL) {
-            printf("No history available\n");
+            fprintf(LSH_OUT, "No history available\n");
             return 1;
         }
         int i = 0;
         while(my_history_list[i] != NULL) {
-            printf("%d\t%s\n", i + history_base, my_history_list[i]->line);
+            fprintf(LSH_OUT, "%d\t%s\n", i + history_base, my_history_list[i]->line);
             i++;
         }
         return 1;
     }
 
     else {
-        printf("'%s'为未知的参数\n",args[1]);
+        fprintf(LSH_OUT, "'%s'为未知的参数\n",args[1]);
         return 1;
     }
 }
@@ -218,30 +309,46 @@ int lsh_grep(char **args){
 
     char *pattern = args[1];
     char *filename = NULL;
-    FILE *file = stdin; // 默认从标准输入读取
+    FILE *file = LSH_IN; // 默认从标准输入读取
 
     if (args[2] != NULL){
         filename = args[2];
         file = fopen(filename, "r");
         if (file == NULL){
             perror("fopen");
+            lsh_last_status = 2;
             return 1;
         }
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-
-    // 从文件或标准输入中读取每一行数据
-    while ((read = getline(&line, &len, file)) != -1){
-        if (strstr(line, pattern) != NULL){
-            printf("%s", line);
+    // 在整块数据中查找模式，找到之后再确定所在行的范围，不必逐行调用 strstr
+    LshReader reader;
+    LshWriter out;
+    lsh_reader_init(&reader, file);
+    lsh_writer_init(&out, LSH_OUT);
+    size_t pattern_len = strlen(pattern);
+    const char *data;
+    size_t len;
+    unsigned long bytes = 0;
+    bool matched = false;
+    while (lsh_reader_lines(&reader, &data, &len)) {
+        bytes += len;
+        const char *p = data, *end = data + len, *hit;
+        while (p < end && (hit = memmem(p, end - p, pattern, pattern_len)) != NULL) {
+            const char *line = memrchr(p, '\n', hit - p);
+            line = (line != NULL) ? line + 1 : p;
+            const char *nl = memchr(hit, '\n', end - hit);
+            p = (nl != NULL) ? nl + 1 : end;
+            lsh_writer_put(&out, line, p - line);
+            matched = true;
         }
     }
+    lsh_writer_free(&out);
+    lsh_reader_free(&reader);
+    STAT_ADD(grep_bytes, bytes);
+    lsh_last_status = matched ? 0 : 1; // 和 grep 一样，没有匹配时退出状态为 1
 
-    free(line);
-    if (file != stdin){
+    if (file != LSH_IN){
         fclose(file); // 关闭文件，不关闭 stdin
     }
 
@@ -261,13 +368,13 @@ int lsh_echo(char **args){
     // 输出所有参数
     for (; args[i] != NULL; i++){
         if (i > 1){
-            printf(" ");
+            fprintf(LSH_OUT, " ");
         }
-        printf("%s", args[i]);
+        fprintf(LSH_OUT, "%s", args[i]);
     }
 
     if (newline){
-        printf("\n");
+        fprintf(LSH_OUT, "\n");
     }
 
     return 1;
@@ -283,46 +390,32 @@ int lsh_type(char **args) {
 
     // 检查是否是内置命令
     if (is_builtin(command)) {
-        printf("%s 是一个内置命令\n", command);
+        fprintf(LSH_OUT, "%s 是一个内置命令\n", command);
         return 1;
     }
 
     // 检查是否是别名
     for (int i = 0; i < num_aliases; i++) {
         if (strcmp(command, aliases[i].name) == 0) {
-            printf("%s 是一个别名: %s\n", command, aliases[i].cmd);
+            fprintf(LSH_OUT, "%s 是一个别名: %s\n", command, aliases[i].cmd);
             return 1;
         }
     }
 
     // 检查是否是外部命令
-    char *path = getenv("PATH");
-    if (path == NULL) {
+    if (getenv("PATH") == NULL) {
         fprintf(stderr, "lsh: PATH 环境变量未设置\n");
         return 1;
     }
 
-    char *path_copy = strdup(path);
-    if (path_copy == NULL) {
-        perror("strdup");
+    const char *cmd_path = path_cache_lookup(command);
+    if (cmd_path != NULL) {
+        fprintf(LSH_OUT, "%s 是一个外部命令: %s\n", command, cmd_path);
         return 1;
     }
 
-    char *dir = strtok(path_copy, ":");
-    while (dir != NULL) {
-        char cmd_path[PATH_MAX];
-        snprintf(cmd_path, sizeof(cmd_path), "%s/%s", dir, command);
-        if (access(cmd_path, X_OK) == 0) {
-            printf("%s 是一个外部命令: %s\n", command, cmd_path);
-            free(path_copy);
-            return 1;
-        }
-        dir = strtok(NULL, ":");
-    }
-
-    free(path_copy);
-
-    printf("%s: 未找到命令\n", command);
+    fprintf(LSH_OUT, "%s: 未找到命令\n", command);
+    lsh_last_status = 1;
     return 1;
 }
 
@@ -331,14 +424,14 @@ int lsh_alias(char **args){
     if (args[1] == NULL){
         // 如果没有提供参数，则显示所有别名
         for (int i = 0; i < num_aliases; i++){
-            printf("%s='%s'\n", aliases[i].name, aliases[i].cmd);
+            fprintf(LSH_OUT, "%s='%s'\n", aliases[i].name, aliases[i].cmd);
         }
         return 1;
     } else if (args[2] == NULL){
         // 如果只提供了别名名称，则显示对应的命令
         for (int i = 0; i <= num_aliases; i++){
             if (strcmp(args[1], aliases[i].name) == 0){
-                printf("%s='%s'\n", aliases[i].name, aliases[i].cmd);
+                fprintf(LSH_OUT, "%s='%s'\n", aliases[i].name, aliases[i].cmd);
                 return 1;
             }
         }
@@ -369,6 +462,80 @@ int lsh_alias(char **args){
     }
 }
 
+// 显示 shell 内部计数器，-j 输出 JSON，-r 清零
+int lsh_stats_cmd(char **args) {
+    if (args[1] == NULL) {
+        stats_print(LSH_OUT, false);
+    } else if (strcmp(args[1], "-j") == 0 || strcmp(args[1], "--json") == 0) {
+        stats_print(LSH_OUT, true);
+    } else if (strcmp(args[1], "-r") == 0) {
+        stats_reset();
+    } else {
+        fprintf(stderr, "stats: '%s'为未知的参数\n", args[1]);
+    }
+    return 1;
+}
+
+// export NAME[=value]...，没有参数时列出所有导出的变量
+int lsh_export(char **args) {
+    if (args[1] == NULL) {
+        vars_print_exported(LSH_OUT);
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t) (eq - args[i]) : strlen(args[i]);
+        if (!is_var_name(args[i], len)) {
+            fprintf(stderr, "export: '%s' 不是有效的标识符\n", args[i]);
+            lsh_last_status = 1;
+            continue;
+        }
+        char *name = strndup(args[i], len);
+        if (eq != NULL) {
+            var_set(name, eq + 1);
+        }
+        var_set_exported(name, true);
+        free(name);
+    }
+    return 1;
+}
+
+int lsh_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        if (!is_var_name(args[i], strlen(args[i]))) {
+            fprintf(stderr, "unset: '%s' 不是有效的标识符\n", args[i]);
+            lsh_last_status = 1;
+            continue;
+        }
+        var_unset(args[i]);
+    }
+    return 1;
+}
+
+// source 文件 [参数...]：在当前 shell 中执行脚本，额外的参数作为位置参数。
+// 编译结果缓存在 ~/.cache/lsh，脚本没有变化时不再重新解析
+int lsh_source(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "%s: 需要文件名参数\n", args[0]);
+        lsh_last_status = 2;
+        return 1;
+    }
+    Program *prog = script_load(args[1]);
+    if (prog == NULL) {
+        lsh_last_status = 1;
+        return 1;
+    }
+    if (args[2] != NULL) {
+        vars_push_args(args + 2);
+    }
+    int result = vm_run_sourced(prog);
+    if (args[2] != NULL) {
+        vars_pop_args();
+    }
+    program_release(prog);
+    return result;
+}
+
 int lsh_exit(char **args) {
     return 0;
 }
\ No newline at end of file
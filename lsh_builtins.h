@@ -27,4 +27,8 @@ int lsh_history(char **args);
 int lsh_grep(char **args);
 int lsh_echo(char **args);
 int lsh_type(char **args);
-int lsh_alias(char **args);
\ No newline at end of file
+int lsh_alias(char **args);
+int lsh_stats_cmd(char **args);
+int lsh_export(char **args);
+int lsh_unset(char **args);
+int lsh_source(char **args);
\ No newline at end of file
@@ -0,0 +1,183 @@
+//
+// Created by ysh on 24-6-21.
+//
+
+#define _GNU_SOURCE
+#include "lsh_io.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LSH_READ_SIZE (1 << 20)
+#define LSH_WRITE_SIZE (256 << 10)
+
+__thread FILE *lsh_in_stream = NULL;
+__thread FILE *lsh_out_stream = NULL;
+
+void lsh_reader_init(LshReader *r, FILE *file) {
+    *r = (LshReader) {.file = file, .fd = fileno(file)};
+    struct stat sb;
+    off_t pos = ftello(file);
+    if (r->fd >= 0 && fstat(r->fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        // 可以定位的文件只有在 FILE 里没有缓冲数据时才能绕过它
+        if (pos < 0 || lseek(r->fd, 0, SEEK_CUR) != pos) {
+            r->fd = -1;
+        } else if (sb.st_size > pos) {
+            char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, sb.st_size, MADV_SEQUENTIAL);
+                r->map = map;
+                r->map_len = sb.st_size;
+                r->map_off = pos;
+                fseeko(file, 0, SEEK_END);
+            }
+        }
+    }
+}
+
+static ssize_t read_some(LshReader *r, char *buf, size_t len) {
+    if (r->fd < 0) {
+        size_t n = fread(buf, 1, len, r->file);
+        return n > 0 ? (ssize_t) n : ferror(r->file) ? -1 : 0;
+    }
+    for (;;) {
+        ssize_t n = read(r->fd, buf, len);
+        if (n >= 0 || errno != EINTR) {
+            return n;
+        }
+    }
+}
+
+// 把上次交出去的部分丢掉，再往缓冲区后面读一次，返回新读到的字节数
+static ssize_t fill(LshReader *r) {
+    if (r->buf == NULL) {
+        r->cap = LSH_READ_SIZE;
+        r->buf = malloc(r->cap);
+    }
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    if (r->len == r->cap) {
+        r->cap *= 2; // 一行比缓冲区还长
+        r->buf = realloc(r->buf, r->cap);
+    }
+    ssize_t n = read_some(r, r->buf + r->len, r->cap - r->len);
+    if (n <= 0) {
+        r->eof = true;
+        r->error = n < 0;
+        return 0;
+    }
+    r->len += n;
+    return n;
+}
+
+static bool take_map(LshReader *r, const char **data, size_t *len) {
+    if (r->map_off >= r->map_len) {
+        return false;
+    }
+    *data = r->map + r->map_off;
+    *len = r->map_len - r->map_off;
+    r->map_off = r->map_len;
+    return true;
+}
+
+bool lsh_reader_lines(LshReader *r, const char **data, size_t *len) {
+    if (r->map != NULL) {
+        return take_map(r, data, len);
+    }
+    for (;;) {
+        size_t old_len = r->len - r->pos;
+        ssize_t n = r->eof ? 0 : fill(r);
+        if (n == 0 && r->eof) {
+            // 最后一行没有换行结尾
+            if (r->len == r->pos) {
+                return false;
+            }
+            *data = r->buf + r->pos;
+            *len = r->len - r->pos;
+            r->pos = r->len;
+            return true;
+        }
+        // 只需要在新读到的部分里找最后一个换行
+        const char *nl = memrchr(r->buf + old_len, '\n', n);
+        if (nl != NULL) {
+            *data = r->buf;
+            *len = nl + 1 - r->buf;
+            r->pos = *len;
+            return true;
+        }
+    }
+}
+
+bool lsh_reader_block(LshReader *r, const char **data, size_t *len) {
+    if (r->map != NULL) {
+        return take_map(r, data, len);
+    }
+    r->pos = r->len; // 上一块已经用完
+    if (r->eof || fill(r) == 0) {
+        return false;
+    }
+    *data = r->buf;
+    *len = r->len;
+    return true;
+}
+
+void lsh_reader_free(LshReader *r) {
+    if (r->map != NULL) {
+        munmap(r->map, r->map_len);
+    }
+    free(r->buf);
+}
+
+void lsh_writer_init(LshWriter *w, FILE *file) {
+    *w = (LshWriter) {.file = file, .cap = LSH_WRITE_SIZE};
+    w->buf = malloc(w->cap);
+}
+
+static void write_out(LshWriter *w, const char *data, size_t len) {
+    if (w->error || len == 0) {
+        return;
+    }
+    int fd = fileno(w->file);
+    if (fd < 0) {
+        w->error = fwrite(data, 1, len, w->file) != len;
+        return;
+    }
+    fflush(w->file); // 保持和之前通过流写出的内容的顺序
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            w->error = true;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void lsh_writer_flush(LshWriter *w) {
+    write_out(w, w->buf, w->len);
+    w->len = 0;
+}
+
+// lsh_writer_put 的慢速路径：缓冲区放不下时先刷新，大块数据直接写出
+void lsh_writer_write(LshWriter *w, const char *data, size_t len) {
+    lsh_writer_flush(w);
+    if (len >= w->cap / 2) {
+        write_out(w, data, len);
+    } else {
+        memcpy(w->buf, data, len);
+        w->len = len;
+    }
+}
+
+bool lsh_writer_free(LshWriter *w) {
+    lsh_writer_flush(w);
+    free(w->buf);
+    return !w->error;
+}
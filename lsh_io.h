@@ -0,0 +1,78 @@
+//
+// Created by ysh on 24-6-21.
+//
+
+#ifndef OS_C_LSH_IO_H
+#define OS_C_LSH_IO_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+// 内置命令的输入输出流。每个线程有自己的一份，
+// 在线程池中运行的后台内置命令通过它们使用各自的文件描述符，未设置时使用 stdin/stdout
+extern __thread FILE *lsh_in_stream;
+extern __thread FILE *lsh_out_stream;
+
+#define LSH_IN (lsh_in_stream != NULL ? lsh_in_stream : stdin)
+#define LSH_OUT (lsh_out_stream != NULL ? lsh_out_stream : stdout)
+
+/*
+  按块读写
+*/
+
+// 按块读取输入。普通文件整个映射进来作为一块；其他输入直接 read 描述符，
+// 有多少数据就交出多少，不会像 fread 那样等缓冲区读满
+typedef struct LshReader {
+    FILE *file;
+    int fd;          // -1 时通过 file 读取（比如 open_memstream 的流）
+    char *buf;
+    size_t cap;
+    size_t len;      // 缓冲区中的数据
+    size_t pos;      // 已经交出去的部分
+    char *map;
+    size_t map_len;
+    size_t map_off;
+    bool eof;
+    bool error;
+} LshReader;
+
+void lsh_reader_init(LshReader *r, FILE *file);
+// 交出以换行结尾的若干完整行，只有输入的最后一行可能没有换行；读完时返回 false
+bool lsh_reader_lines(LshReader *r, const char **data, size_t *len);
+// 交出目前能读到的任意一块数据
+bool lsh_reader_block(LshReader *r, const char **data, size_t *len);
+void lsh_reader_free(LshReader *r);
+
+// 攒够一大块再写出。刷新时先 fflush 流本身，再直接写描述符，避免再复制一遍到 stdio 缓冲区
+typedef struct LshWriter {
+    FILE *file;
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool error;
+} LshWriter;
+
+void lsh_writer_init(LshWriter *w, FILE *file);
+void lsh_writer_write(LshWriter *w, const char *data, size_t len);
+void lsh_writer_flush(LshWriter *w);
+// 刷新并释放缓冲区，返回是否全部写出
+bool lsh_writer_free(LshWriter *w);
+
+static inline void lsh_writer_put(LshWriter *w, const char *data, size_t len) {
+    if (w->cap - w->len >= len) {
+        memcpy(w->buf + w->len, data, len);
+        w->len += len;
+    } else {
+        lsh_writer_write(w, data, len);
+    }
+}
+
+static inline void lsh_writer_putc(LshWriter *w, char c) {
+    if (w->len == w->cap) {
+        lsh_writer_flush(w);
+    }
+    w->buf[w->len++] = c;
+}
+
+#endif //OS_C_LSH_IO_H
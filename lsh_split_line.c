@@ -8,11 +8,65 @@
 
 #define LSH_TOK_BUFSIZE 256
 #define LSH_TOK_DELIM " \t\r\n\a"
+
+// p 指向 '('，返回配对的 ')' 之后的位置，括号内的引号和嵌套括号都会被跳过
+const char *lsh_skip_group(const char *p) {
+    int depth = 0;
+    char quote = 0;
+    for (; *p; p++) {
+        if (quote) {
+            if (quote != '\'' && *p == '\\' && p[1]) {
+                p++;
+            } else if (*p == quote) {
+                quote = 0;
+            }
+        } else if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            quote = *p;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return p;
+}
+
+// 找到从 p 开始的单词的结尾：未被引号括起来、也没有被反斜杠转义的分隔符
+// 引号原样保留在单词中，由展开阶段负责去除；<(...) >(...) $(...) 作为一个整体，
+// 反引号和引号一样处理。stop_at_ops 为 true 时 ; & | ( ) 也结束单词（脚本编译时使用）
+const char *lsh_skip_word(const char *p, bool stop_at_ops) {
+    char quote = 0;
+    while (*p && (quote || strchr(LSH_TOK_DELIM, *p) == NULL)) {
+        if (quote != '\'' && quote != '`' && p[1] == '('
+            && (*p == '$' || (!quote && (*p == '<' || *p == '>')))) {
+            p = lsh_skip_group(p + 1);
+            continue;
+        }
+        if (quote) {
+            if (quote != '\'' && *p == '\\' && p[1]) {
+                p++;
+            } else if (*p == quote) {
+                quote = 0;
+            }
+        } else if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            quote = *p;
+        } else if (stop_at_ops && strchr(";&|()", *p) != NULL) {
+            break;
+        }
+        p++;
+    }
+    return p;
+}
+
 char **lsh_split_line(char *line)
 {
     int bufsize = LSH_TOK_BUFSIZE, position = 0;
     char **tokens = malloc(bufsize * sizeof(char*)); // 用于存储分割后的子字符串的字符串数组
-    char *token;
+    char *p = line;
 
     // 检查内存分配是否成功
     if (!tokens) {
@@ -20,10 +74,13 @@ char **lsh_split_line(char *line)
         exit(EXIT_FAILURE);
     }
 
-    // 使用 strtok 函数分割输入的字符串，并存储分割后的子字符串到 tokens 数组中
-    token = strtok(line, LSH_TOK_DELIM);
-    while (token != NULL) {
-        tokens[position] = token; // 存储子字符串到 tokens 数组
+    // 逐个找出单词，在原字符串中把单词后面的分隔符改成 '\0'
+    while (p != NULL && *p) {
+        p += strspn(p, LSH_TOK_DELIM); // 跳过分隔符
+        if (*p == '\0') {
+            break;
+        }
+        tokens[position] = p; // 存储子字符串到 tokens 数组
         position++; // 更新位置
 
         // 如果超出了 buffer 的大小，则重新分配
@@ -36,8 +93,11 @@ char **lsh_split_line(char *line)
             }
         }
 
-        token = strtok(NULL, LSH_TOK_DELIM); // 继续获取下一个子字符串
+        p = (char *) lsh_skip_word(p, false); // 继续获取下一个子字符串
+        if (*p) {
+            *p++ = '\0';
+        }
     }
     tokens[position] = NULL; // 在末尾添加空指针，表示分割结束
     return tokens;
-}
\ No newline at end of file
+}
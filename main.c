@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
 #include "main.h"
 #include "lsh_builtins.h"
 #include "bg.h"
 #include "history.h"
+#include "stats.h"
+#include "path_cache.h"
+#include "spawn_helper.h"
+#include "job_pool.h"
+#include "lsh_io.h"
+#include "complete.h"
+#include "expand.h"
+#include "vars.h"
+#include "script.h"
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,8 +24,8 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <fcntl.h>
-
-#define PIPE_BUF_SIZE 128
+#include <errno.h>
+#include <sys/mman.h>
 
 extern char *builtin_str[];
 extern int (*builtin_func[]) (char **);
@@ -23,109 +34,323 @@ extern volatile sig_atomic_t child_done; //记录有多少个子进程完成
 extern BackgroundTask *completed_tasks;
 extern Alias aliases[MAX_ALIASES];
 extern int num_aliases;
+extern char **environ;
+
+// 一次括号粘贴 (bracketed paste) 中尚未执行的行
+static char **paste_lines = NULL;
+static int paste_count = 0;
+static int paste_pos = 0;
+static int unsaved_history = 0; // 已加入历史但还没写入历史文件的条数
+
+// 把一次粘贴的多行文本拆成行放入待执行队列。空行也保留，
+// here-document 的正文可能包含空行，作为命令执行时空行本身什么也不做
+static void queue_paste(const char *block) {
+    for (int i = paste_pos; i < paste_count; i++) {
+        free(paste_lines[i]);
+    }
+    paste_count = 0;
+    paste_pos = 0;
+
+    int cap = 16;
+    paste_lines = realloc(paste_lines, cap * sizeof(char *));
+    const char *start = block;
+    while (*start) {
+        size_t len = strcspn(start, "\n");
+        if (paste_count >= cap) {
+            cap *= 2;
+            paste_lines = realloc(paste_lines, cap * sizeof(char *));
+        }
+        paste_lines[paste_count++] = strndup(start, len);
+        start += len;
+        if (*start == '\n') {
+            start++;
+        }
+    }
+}
+
+static void flush_history(const char *history_file) {
+    if (unsaved_history == 0) {
+        return;
+    }
+    if (append_history(unsaved_history, history_file) == 0) { // 实时保存到历史文件，可有可无
+        for (int i = 0; i < unsaved_history; i++) {
+            HIST_ENTRY *entry = history_get(history_base + history_length - 1 - i);
+            if (entry != NULL) {
+                STAT_ADD(history_bytes, strlen(entry->line) + 1);
+            }
+        }
+    }
+    unsaved_history = 0;
+}
+
+// 读取下一条命令。粘贴队列中还有行时直接返回，不重新显示提示符；
+// readline 一次返回了包含多行的粘贴内容时，拆开放入队列逐条执行
+static char *lsh_read_line(const char *history_file) {
+    if (paste_pos < paste_count) {
+        return paste_lines[paste_pos++];
+    }
+    flush_history(history_file);
 
-void lsh_loop(const char *history_file) {
     char cwd[PATH_MAX];
+    getcwd(cwd, sizeof(cwd)); // 获取当前工作目录
+    char* prompt = malloc(PATH_MAX + 3);
+    if (prompt != NULL) {
+        snprintf(prompt, PATH_MAX + 3, "%s> ", cwd); // 将当前工作目录格式化到提示符中
+    }
+    char *line = readline(prompt);
+    free(prompt);
+
+    if (line != NULL && strchr(line, '\n') != NULL) {
+        queue_paste(line);
+        free(line);
+        line = (paste_pos < paste_count) ? paste_lines[paste_pos++] : strdup("");
+    }
+    return line;
+}
+
+static char *lsh_read_continuation(void);
+
+void lsh_loop(const char *history_file) {
     char *line;
-    char **args;
     int status;
 
     setup_signal_handlers(); // 设置信号处理函数
 
     init_history(history_file);
-    HIST_ENTRY *last_history_entry = history_get(history_length);
-    char *last_command = (last_history_entry != NULL) ? last_history_entry->line : NULL;
+    // 粘贴的多行文本作为一个整体插入，由 lsh_read_line 拆分
+    rl_variable_bind("enable-bracketed-paste", "on");
+    completion_init();
+    HIST_ENTRY *last_history_entry = history_get(history_base + history_length - 1);
+    char *last_command = (last_history_entry != NULL) ? strdup(last_history_entry->line) : NULL;
 
     do {
-        dup2(0, STDOUT_FILENO);
-        dup2(1, STDIN_FILENO);
-
+        spawn_helper_poll();
+        job_pool_collect();
         if (child_done > 0) {
             print_completed_tasks();
             child_done = 0;
         }
 
-        getcwd(cwd, sizeof(cwd)); // 获取当前工作目录
-        char* prompt = malloc(PATH_MAX + 3);
-        if (prompt != NULL) {
-            snprintf(prompt, PATH_MAX + 3, "%s> ", cwd); // 将当前工作目录格式化到提示符中
+        line = lsh_read_line(history_file);
+        if (line == NULL) { // 读到 EOF (Ctrl-D)
+            break;
         }
-        line = readline(prompt);
-        free(prompt);
-        if (line != NULL && *line) { // 检查用户输入是否为空
+        if (*line) { // 检查用户输入是否为空
             if (last_command == NULL || strcmp(line, last_command) != 0) {
                 add_history(line);
-                append_history(1, history_file); // 实时保存到历史文件，可有可无
+                unsaved_history++;
                 free(last_command); // 释放上一个命令的内存
                 last_command = strdup(line); //更新最后一条命令
             }
         }
 
-        args = lsh_split_line(line);
-        status = lsh_execute(args);
-
+        status = lsh_run_source(line, lsh_read_continuation);
         free(line);
-        free(args);
     } while (status);
+    flush_history(history_file);
     save_history(history_file);
 
     free(last_command);
+    stats_dump_at_exit();
+}
+
+// 读取未完成的结构或 here-document 正文的下一行：优先取粘贴队列中剩余的行，否则用续行提示符读取
+static char *lsh_read_continuation(void) {
+    if (paste_pos < paste_count) {
+        return paste_lines[paste_pos++];
+    }
+    char *line = readline("> ");
+    if (line != NULL && strchr(line, '\n') != NULL) {
+        queue_paste(line);
+        free(line);
+        line = (paste_pos < paste_count) ? paste_lines[paste_pos++] : strdup("");
+    }
+    return line;
 }
 
-// 解析命令中的重定向
+// 把输入内容写入 memfd 并加上封印，返回定位到开头的只读输入描述符。
+// 内容一次写入内存文件，子进程可以直接读取或 mmap，不经过磁盘临时文件，
+// 也不会因为管道容量不足而需要 shell 边写边等
+static int make_input_memfd(const char *data, size_t len) {
+    int fd = memfd_create("lsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("lsh: memfd_create");
+        return -1;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n == -1) {
+            perror("lsh: write");
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    // 封印后内容不可再修改，读到的就是 shell 写入的全部内容
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// 从参数数组中删除 args[i] 起的 n 个参数
+static void remove_args(char **args, int i, int n) {
+    int j = i;
+    do {
+        args[j] = args[j + n];
+    } while (args[j++] != NULL);
+}
+
+// 替换已有的重定向描述符，同一方向出现多次重定向时以最后一个为准
+static void replace_fd(int *fd, int new_fd, int std_fd) {
+    if (*fd != std_fd) {
+        close(*fd);
+    }
+    *fd = new_fd;
+}
+
+// 关闭 shell 这一侧的重定向描述符
+static void close_redirection(int in_fd, int out_fd) {
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    if (out_fd != 1) {
+        close(out_fd);
+    }
+}
+
+// 解析命令中的重定向，只认 lsh_expand 保留下来的未引用操作符
 int parse_redirection(char **args, int *in_fd, int *out_fd) {
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], ">") == 0) {
-            if (args[i + 1] == NULL) {
-                fprintf(stderr, "lsh: 未预期的记号 \"newline\" 附近有语法错误\n");
-                return -1;
-            }
-            *out_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (*out_fd == -1) {
-                perror("lsh");
-                return -1;
-            }
-            args[i] = NULL;
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j + 2];
-            }
-        } else if (strcmp(args[i], ">>") == 0) {
-            if (args[i + 1] == NULL) {
-                fprintf(stderr, "lsh: 未预期的记号 \"newline\" 附近有语法错误\n");
-                return -1;
-            }
-            *out_fd = open(args[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (*out_fd == -1) {
-                perror("lsh");
-                return -1;
-            }
-            args[i] = NULL;
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j + 2];
-            }
-        } else if (strcmp(args[i], "<") == 0) {
-            if (args[i + 1] == NULL) {
-                fprintf(stderr, "lsh: 未预期的记号 \"newline\" 附近有语法错误\n");
-                return -1;
-            }
-            *in_fd = open(args[i + 1], O_RDONLY);
-            if (*in_fd == -1) {
+        const char *op = args[i];
+        int fd;
+        if (!lsh_is_operator(op, ">") && !lsh_is_operator(op, ">>") && !lsh_is_operator(op, "<")
+            && !lsh_is_operator(op, "<<<")) {
+            continue;
+        }
+        if (args[i + 1] == NULL) {
+            fprintf(stderr, "lsh: 未预期的记号 \"newline\" 附近有语法错误\n");
+            return -1;
+        }
+
+        if (strcmp(op, ">") == 0) {
+            fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        } else if (strcmp(op, ">>") == 0) {
+            fd = open(args[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
+        } else if (strcmp(op, "<") == 0) {
+            fd = open(args[i + 1], O_RDONLY);
+        } else {
+            // here-string：单词本身加一个换行作为输入
+            size_t n = strlen(args[i + 1]);
+            char *data = malloc(n + 1);
+            memcpy(data, args[i + 1], n);
+            data[n] = '\n';
+            fd = make_input_memfd(data, n + 1);
+            free(data);
+        }
+        if (fd == -1) {
+            if (op[0] != '<' || op[1] == '\0') {
                 perror("lsh");
-                return -1;
-            }
-            args[i] = NULL;
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j + 2];
             }
+            return -1;
         }
+
+        if (op[0] == '>') {
+            replace_fd(out_fd, fd, 1);
+        } else {
+            replace_fd(in_fd, fd, 0);
+        }
+        remove_args(args, i, 2);
+        i--;
     }
     return 0;
 }
 
+// 执行一条分好词的简单命令：展开、执行并清理，函数在当前进程中调用
+int lsh_run_tokens(char **tokens) {
+    lsh_expand_take_error();
+    char **words = lsh_expand(tokens);
+    if (lsh_expand_take_error()) {
+        // 和 bash 一样，展开失败的命令不执行
+        lsh_expand_cleanup();
+        lsh_free_words(words);
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    // lsh_execute 会改动参数数组，传入一份浅拷贝，展开出来的单词在这里统一释放
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+    char **args = malloc((count + 1) * sizeof(char *));
+    memcpy(args, words, (count + 1) * sizeof(char *));
+    int status;
+    if (count > 0 && vm_is_function(args[0]) && !lsh_has_operator(args)) {
+        status = vm_call_function(args);
+    } else {
+        status = lsh_execute(args);
+    }
+    lsh_expand_cleanup();
+
+    free(args);
+    lsh_free_words(words);
+    return status;
+}
+
+// 把一段源代码编译成字节码再执行，read_more 用于读取未完成结构的后续行
+int lsh_run_source(const char *source, LineReader read_more) {
+    Program *prog = compile_source(source, read_more);
+    if (prog == NULL) {
+        lsh_last_status = 2;
+        return 1;
+    }
+    int status = vm_run(prog);
+    program_release(prog);
+    return status;
+}
+
+// 执行一行命令，不完整的结构视为语法错误
+int lsh_run_line(char *line) {
+    return lsh_run_source(line, NULL);
+}
+
+// 在子进程中执行外部命令，优先使用父进程查好的 PATH 缓存路径。
+// exec 失败时把 errno 写入 err_fd，父进程据此判断 exec 是否成功
+static void exec_external(char **args, const char *path, int err_fd) {
+    if (path != NULL) {
+        execve(path, args, var_envp());
+    }
+    if (execvpe(args[0], args, var_envp()) == -1) {
+        int err = errno;
+        perror("execvp");
+        if (err_fd != -1) {
+            write(err_fd, &err, sizeof(err));
+        }
+        exit(127);
+    }
+}
+
+// 读取子进程 exec 的结果：写端在 exec 成功时因 O_CLOEXEC 被关闭，读到文件结束就是成功
+static bool exec_succeeded(int err_fd) {
+    int err;
+    ssize_t n;
+    while ((n = read(err_fd, &err, sizeof(err))) == -1 && errno == EINTR) {
+    }
+    close(err_fd);
+    return n == 0;
+}
+
 // 执行内部命令
 int execute_internal_command(int i, char **args, int in_fd, int out_fd, bool is_background) {
-    if (is_background) {
+    int job;
+    if (is_background && job_pool_accepts(args[0]) && (job = job_pool_submit(i, args, in_fd, out_fd)) > 0) {
+        // 交给工作线程执行，不需要 fork
+        printf("[%d] %s\n", job, args[0]);
+        return 1;
+    } else if (is_background) {
         pid_t pid = fork();
+        STAT_INC(forks);
         if (pid == 0) {
             // 子进程执行内置命令
             if (in_fd != 0) {
@@ -136,36 +361,89 @@ int execute_internal_command(int i, char **args, int in_fd, int out_fd, bool is_
                 dup2(out_fd, 1);
                 close(out_fd);
             }
-            exit((*builtin_func[i])(args));
+            lsh_last_status = 0;
+            (*builtin_func[i])(args);
+            fflush(stdout);
+            exit(lsh_last_status);
         } else if (pid < 0) {
             perror("fork");
             return 1;
         } else {
-            // 父进程
-            printf("[%d] %d\n", ++background_counter, pid);
+            // 父进程，重定向描述符已经交给子进程
+            printf("[%d] %d\n", background_add(pid), pid);
+            close_redirection(in_fd, out_fd);
             return 1;
         }
     } else {
+        // 重定向只作用于这次内置命令的输入输出流，不改动 shell 自己的标准输入输出；
+        // 命令替换时外层设置的输出流在这里保留，结束后恢复
+        FILE *saved_in = lsh_in_stream, *saved_out = lsh_out_stream;
         if (in_fd != 0) {
-            dup2(in_fd, 0);
-            close(in_fd);
+            lsh_in_stream = fdopen(in_fd, "r");
         }
         if (out_fd != 1) {
-            dup2(out_fd, 1);
-            close(out_fd);
+            lsh_out_stream = fdopen(out_fd, "w");
+        }
+        STAT_INC(builtin_runs);
+        lsh_last_status = 0; // 内置命令失败时自己设置退出状态
+        int result = (*builtin_func[i])(args);
+        if (in_fd != 0 && lsh_in_stream != NULL) {
+            fclose(lsh_in_stream);
         }
-        return (*builtin_func[i])(args);
+        if (out_fd != 1 && lsh_out_stream != NULL) {
+            fclose(lsh_out_stream);
+        }
+        lsh_in_stream = saved_in;
+        lsh_out_stream = saved_out;
+        return result;
     }
 }
 
-// 执行单个命令
-int lsh_launch_single(char **args, int in_fd, int out_fd, bool is_background) {
-    pid_t pid;
-    int status;
+static unsigned long elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+}
 
-    pid = fork();
+// 启动一个子进程执行命令（内置或外部），返回子进程 pid，失败返回 -1
+// 启用了 spawn 辅助进程时外部命令交给辅助进程启动，需要用 lsh_waitpid 等待
+pid_t lsh_spawn(char **args, int in_fd, int out_fd) {
+    // 子进程直接写标准输出，先把 shell 缓冲中的输出写出去，否则顺序会错乱
+    fflush(stdout);
+    if (LSH_OUT != stdout) {
+        fflush(LSH_OUT);
+    }
+    // shell 函数和内置命令一样在 fork 出的子进程中执行
+    bool function = vm_is_function(args[0]);
+    bool builtin = function || is_builtin(args[0]);
+    const char *path = builtin ? NULL : path_cache_lookup(args[0]);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!builtin && spawn_helper_enabled() && !lsh_expand_has_proc_subst()) {
+        bool exec_ok;
+        pid_t pid = spawn_helper_spawn(args, path, var_envp(), in_fd, out_fd, &exec_ok);
+        if (pid > 0) {
+            STAT_INC(helper_spawns);
+            if (exec_ok) {
+                STAT_INC(execs);
+            }
+            STAT_ADD(spawn_ns, elapsed_ns(&start));
+            return pid;
+        }
+    }
+
+    int err_pipe[2] = {-1, -1};
+    if (!builtin && pipe2(err_pipe, O_CLOEXEC) == -1) {
+        err_pipe[0] = err_pipe[1] = -1;
+    }
+    pid_t pid = fork();
+    STAT_INC(forks);
     if (pid == 0) {
-        // 子进程
+        // 子进程，不继承父进程临时阻塞的信号
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
         if (in_fd != 0) {
             dup2(in_fd, 0);
             close(in_fd);
@@ -174,58 +452,151 @@ int lsh_launch_single(char **args, int in_fd, int out_fd, bool is_background) {
             dup2(out_fd, 1);
             close(out_fd);
         }
-
-        if (execvp(args[0], args) == -1) {
-            perror("execvp");
-            exit(EXIT_FAILURE);
+        // 内置命令在子进程中读写重定向好的标准输入输出，而不是父进程当时的输入输出流
+        lsh_in_stream = NULL;
+        lsh_out_stream = NULL;
+
+        if (function) {
+            vm_call_function(args);
+            fflush(stdout);
+            exit(lsh_last_status);
+        } else if (builtin) {
+            lsh_last_status = 0;
+            (*builtin_func[find_builtin_index(args[0])])(args);
+            fflush(stdout);
+            exit(lsh_last_status);
         }
-    } else if (pid < 0) {
+        exec_external(args, path, err_pipe[1]);
+    }
+    if (err_pipe[1] != -1) {
+        close(err_pipe[1]);
+    }
+    if (pid < 0) {
         // Fork出错
         perror("fork");
+        if (err_pipe[0] != -1) {
+            close(err_pipe[0]);
+        }
     } else {
+        if (err_pipe[0] != -1 && exec_succeeded(err_pipe[0])) {
+            STAT_INC(execs);
+        }
+        STAT_ADD(spawn_ns, elapsed_ns(&start));
+    }
+    return pid;
+}
+
+// 命令前的 NAME=value 只对这一条命令生效，执行前导出，执行后恢复原来的值
+typedef struct SavedVar {
+    char *name;
+    char *value;
+    bool exported;
+} SavedVar;
+
+static SavedVar *export_temporarily(char **args, int num_assign) {
+    SavedVar *saved = malloc(num_assign * sizeof(SavedVar));
+    for (int i = 0; i < num_assign; i++) {
+        size_t len = assignment_name_len(args[i]);
+        saved[i].name = strndup(args[i], len);
+        const char *value = var_get(saved[i].name);
+        saved[i].value = (value != NULL) ? strdup(value) : NULL;
+        saved[i].exported = var_is_exported(saved[i].name);
+        var_set(saved[i].name, args[i] + len + 1);
+        var_set_exported(saved[i].name, true);
+    }
+    return saved;
+}
+
+static void restore_variables(SavedVar *saved, int num_assign) {
+    for (int i = num_assign - 1; i >= 0; i--) {
+        if (saved[i].value != NULL) {
+            var_set(saved[i].name, saved[i].value);
+            var_set_exported(saved[i].name, saved[i].exported);
+        } else {
+            var_unset(saved[i].name);
+        }
+        free(saved[i].name);
+        free(saved[i].value);
+    }
+    free(saved);
+}
+
+// 把 waitpid 得到的状态转换成 $? 的值
+static int exit_status(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+}
+
+// 执行单个命令
+int lsh_launch_single(char **args, int in_fd, int out_fd, bool is_background) {
+    pid_t pid;
+    int status;
+
+    pid = lsh_spawn(args, in_fd, out_fd);
+    close_redirection(in_fd, out_fd); // 子进程已经持有重定向的描述符
+    if (pid > 0) {
         // 父进程
         if (is_background) {
-            printf("[%d] %d\n", ++background_counter, pid);
+            printf("[%d] %d\n", background_add(pid), pid);
+            spawn_helper_mark_background(pid);
+            lsh_last_status = 0;
         } else {
-            waitpid(pid, &status, WUNTRACED); // 等待子进程结束
+            lsh_waitpid(pid, &status, WUNTRACED); // 等待子进程结束
+            lsh_last_status = exit_status(status);
         }
+    } else {
+        lsh_last_status = 1;
     }
     return 1;
 }
 
-// 执行管道命令
+// 执行管道命令，先启动所有阶段再统一等待，避免前一阶段写满管道后无人读取
+// 每个阶段可以有自己的重定向，重定向优先于管道
 int lsh_launch_pipeline(char ***commands, int num_commands, bool is_background) {
     int in_fd = 0, fd[2];
     pid_t pid;
     int status;
+    pid_t *pids = malloc(num_commands * sizeof(pid_t));
+    int num_pids = 0;
 
     for (int i = 0; i < num_commands; i++) {
+        int redir_in = 0, redir_out = 1;
+        if (parse_redirection(commands[i], &redir_in, &redir_out) == -1) {
+            close_redirection(redir_in, redir_out);
+            if (in_fd != 0) {
+                close(in_fd);
+            }
+            break;
+        }
         if (i != num_commands - 1) {
-            pipe(fd);
+            // 读端不能留在写这个管道的阶段里，否则下游提前退出（如 head）时上游收不到 SIGPIPE
+            pipe2(fd, O_CLOEXEC);
         }
 
-        pid = fork();
-        if (pid == 0) {
-            // 子进程
+        int stage_in = (redir_in != 0) ? redir_in : in_fd;
+        int stage_out = (redir_out != 1) ? redir_out : ((i != num_commands - 1) ? fd[1] : 1);
+        // 阶段开头的 NAME=value 只在启动这个阶段时导出
+        int num_assign = 0;
+        while (commands[i][num_assign] != NULL && assignment_name_len(commands[i][num_assign]) > 0) {
+            num_assign++;
+        }
+        SavedVar *saved = (num_assign > 0) ? export_temporarily(commands[i], num_assign) : NULL;
+        pid = (commands[i][num_assign] != NULL) ? lsh_spawn(commands[i] + num_assign, stage_in, stage_out) : -1;
+        if (saved != NULL) {
+            restore_variables(saved, num_assign);
+        }
+        close_redirection(redir_in, redir_out);
+        if (pid < 0) {
             if (in_fd != 0) {
-                dup2(in_fd, 0);
                 close(in_fd);
             }
             if (i != num_commands - 1) {
-                dup2(fd[1], 1);
+                close(fd[0]);
                 close(fd[1]);
             }
-            if (is_builtin(commands[i][0])) {
-                exit((*builtin_func[find_builtin_index(commands[i][0])])(commands[i]));
-            } else {
-                if (execvp(commands[i][0], commands[i]) == -1) {
-                    perror("execvp");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        } else if (pid < 0) {
-            perror("fork");
-            return 1;
+            break;
         } else {
             // 父进程
             if (in_fd != 0) {
@@ -236,12 +607,20 @@ int lsh_launch_pipeline(char ***commands, int num_commands, bool is_background)
                 in_fd = fd[0];
             }
             if (!is_background) {
-                waitpid(pid, &status, WUNTRACED);
+                pids[num_pids++] = pid;
             } else {
-                printf("[%d] %d\n", ++background_counter, pid);
+                printf("[%d] %d\n", background_add(pid), pid);
+                spawn_helper_mark_background(pid);
             }
         }
     }
+    // 管道的退出状态是最后一个阶段的退出状态
+    lsh_last_status = 0;
+    for (int i = 0; i < num_pids; i++) {
+        lsh_waitpid(pids[i], &status, WUNTRACED);
+        lsh_last_status = exit_status(status);
+    }
+    free(pids);
     return 1;
 }
 
@@ -250,7 +629,8 @@ int lsh_execute(char **args) {
     bool is_background = false;
     int in_fd = 0, out_fd = 1;
     char ***pipe_commands = NULL;
-    int num_commands = 0, cmd_index = 0;
+    char **command_args = NULL;
+    int num_commands = 0, num_args = 0, cmd_index = 0;
 
     // 用户输入了一个空命令
     if (args[0] == NULL) {
@@ -259,7 +639,7 @@ int lsh_execute(char **args) {
 
     // 检查是否有后台运行标记
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "&") == 0) {
+        if (lsh_is_operator(args[i], "&")) {
             args[i] = NULL; // 将"&"从参数中删除
             is_background = true;
             if (args[0] == NULL) {
@@ -270,46 +650,77 @@ int lsh_execute(char **args) {
         }
     }
 
-    // 计算命令的数量
+    // 计算命令和参数的数量
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
+        if (lsh_is_operator(args[i], "|")) {
             num_commands++;
         }
+        num_args++;
     }
     num_commands++; // 最后一个命令
 
-    // 分配内存
+    // 分配内存，所有子命令的参数放在同一块按参数个数分配的数组中，
+    // 通配符展开出大量参数时也不会越界
     pipe_commands = malloc(num_commands * sizeof(char **));
-    for (int i = 0; i < num_commands; i++) {
-        pipe_commands[i] = malloc(PIPE_BUF_SIZE * sizeof(char *));
-    }
+    command_args = malloc((num_args + num_commands) * sizeof(char *));
 
     // 解析管道命令
     num_commands = 0;
+    pipe_commands[0] = command_args;
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
-            pipe_commands[num_commands][cmd_index] = NULL;
-            num_commands++;
-            cmd_index = 0;
+        if (lsh_is_operator(args[i], "|")) {
+            command_args[cmd_index++] = NULL;
+            pipe_commands[++num_commands] = &command_args[cmd_index];
         } else {
-            pipe_commands[num_commands][cmd_index] = args[i];
-            cmd_index++;
+            command_args[cmd_index++] = args[i];
         }
     }
-    pipe_commands[num_commands][cmd_index] = NULL;
+    command_args[cmd_index] = NULL;
     num_commands++;
 
-    // 解析重定向
-    if (parse_redirection(args, &in_fd, &out_fd) == -1) {
+    // 解析重定向，管道命令的重定向在启动各阶段时分别解析
+    if (num_commands == 1 && parse_redirection(args, &in_fd, &out_fd) == -1) {
+        close_redirection(in_fd, out_fd);
+        free(command_args);
+        free(pipe_commands);
         return 1;
     }
 
-    // 解析别名
+    // 单个命令开头的 NAME=value 赋值
+    int num_assign = 0;
+    if (num_commands == 1) {
+        while (args[num_assign] != NULL && assignment_name_len(args[num_assign]) > 0) {
+            num_assign++;
+        }
+        if (num_assign > 0 && args[num_assign] == NULL) {
+            // 只有赋值，设置 shell 变量
+            for (int i = 0; i < num_assign; i++) {
+                size_t len = assignment_name_len(args[i]);
+                char *name = strndup(args[i], len);
+                var_set(name, args[i] + len + 1);
+                free(name);
+            }
+            close_redirection(in_fd, out_fd);
+            lsh_last_status = 0;
+            free(command_args);
+            free(pipe_commands);
+            return 1;
+        }
+    }
+    SavedVar *saved = (num_assign > 0) ? export_temporarily(args, num_assign) : NULL;
+    args += num_assign;
+
+    // 解析别名，单个命令直接作用在 args 上
+    // 别名命令存放在全局表中，直接引用即可，不需要复制和释放
     for (int i = 0; i < num_commands; i++) {
+        char **command = (num_commands > 1) ? pipe_commands[i] : args;
+        if (command[0] == NULL) {
+            continue;
+        }
         for (int j = 0; j < num_aliases; j++) {
-            if (strcmp(pipe_commands[i][0], aliases[j].name) == 0) {
-                free(pipe_commands[i][0]);
-                pipe_commands[i][0] = strdup(aliases[j].cmd);
+            if (strcmp(command[0], aliases[j].name) == 0) {
+                command[0] = aliases[j].cmd;
+                STAT_INC(alias_expansions);
                 break;
             }
         }
@@ -318,6 +729,9 @@ int lsh_execute(char **args) {
     int result;
     if (num_commands > 1) {
         result = lsh_launch_pipeline(pipe_commands, num_commands, is_background);
+    } else if (args[0] == NULL) {
+        close_redirection(in_fd, out_fd); // 只有重定向，没有命令
+        result = 1;
     } else {
         if (is_builtin(args[0])) {
             result = execute_internal_command(find_builtin_index(args[0]), args, in_fd, out_fd, is_background);
@@ -325,11 +739,12 @@ int lsh_execute(char **args) {
             result = lsh_launch_single(args, in_fd, out_fd, is_background);
         }
     }
+    if (saved != NULL) {
+        restore_variables(saved, num_assign);
+    }
 
     // 释放内存
-    for (int i = 0; i < num_commands; i++) {
-        free(pipe_commands[i]);
-    }
+    free(command_args);
     free(pipe_commands);
 
     return result;
@@ -337,6 +752,12 @@ int lsh_execute(char **args) {
 
 
 int main() {
+    vars_init();
+    // 在 shell 还很小的时候预先 fork 出 spawn 辅助进程
+    if (getenv("LSH_SPAWN_HELPER") != NULL) {
+        spawn_helper_start();
+    }
+
     char* history_file = ".lsh_history";
     char history_path[PATH_MAX];
     snprintf(history_path, sizeof(history_path), "%s/%s", getenv("HOME"), history_file);
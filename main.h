@@ -4,8 +4,16 @@
 #endif //OS_C_MAIN_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 
 char **lsh_split_line(char *line);
+const char *lsh_skip_group(const char *p);
+const char *lsh_skip_word(const char *p, bool stop_at_ops);
 void lsh_loop(const char *history_file);
 int lsh_execute(char **args);
+int lsh_run_line(char *line);
+int lsh_run_source(const char *source, char *(*read_more)(void));
+int lsh_run_tokens(char **tokens);
+pid_t lsh_spawn(char **args, int in_fd, int out_fd);
+int parse_redirection(char **args, int *in_fd, int *out_fd);
@@ -0,0 +1,559 @@
+//
+// Created by ysh on 24-6-19.
+//
+
+#define _GNU_SOURCE
+#include "parallel.h"
+#include "main.h"
+#include "bg.h"
+#include "spawn_helper.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+#define ARG_SLACK 4096          // 给内核和辅助向量预留的空间
+#define JOB_READ_SIZE 65536
+
+extern char **environ;
+
+typedef enum HaltPolicy {
+    HALT_NEVER, // 失败的任务不影响其他任务
+    HALT_SOON,  // 有任务失败后不再启动新任务，等待正在运行的任务
+    HALT_NOW,   // 有任务失败后立即终止所有正在运行的任务
+} HaltPolicy;
+
+typedef struct ParallelJob {
+    int seq;        // 任务序号，-k 模式下按序号输出
+    pid_t pid;
+    int out_fd;     // 子进程标准输出的管道读端，读到 EOF 后为 -1
+    bool exited;
+    int status;
+    char *buf;      // 缓存的输出，任务结束后整体输出，保证同一任务的输出不被打散
+    size_t len;
+    size_t cap;
+} ParallelJob;
+
+typedef struct ParallelOptions {
+    int slots;          // 同时运行的任务数
+    bool keep_order;    // 按输入顺序输出
+    bool multi;         // 每个任务带多个参数
+    bool group_output;  // 收集每个任务的输出，任务结束后整体输出
+    bool stdin_null;    // 任务的标准输入接到 /dev/null
+    HaltPolicy halt;
+} ParallelOptions;
+
+typedef struct ParallelOutput {
+    char *buf;
+    size_t len;
+    bool done;
+} ParallelOutput;
+
+// 计算除去环境变量和固定参数后，还能留给可变参数的字节数
+long arg_budget(char **fixed_args) {
+    long budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0) {
+        budget = 128 * 1024;
+    }
+    budget -= ARG_SLACK;
+    for (char **env = environ; env != NULL && *env != NULL; env++) {
+        budget -= ARG_COST(*env);
+    }
+    for (int i = 0; fixed_args[i] != NULL; i++) {
+        budget -= ARG_COST(fixed_args[i]);
+    }
+    return budget;
+}
+
+// 任务的输出经过 shell 的输出流写出，命令替换中的内存流也能收到
+static void write_output(FILE *out, const char *buf, size_t len) {
+    fwrite(buf, 1, len, out);
+    fflush(out);
+}
+
+// 把 s 中的所有 "{}" 替换成 item
+static char *replace_placeholder(const char *s, const char *item) {
+    size_t count = 0;
+    for (const char *p = strstr(s, "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+        count++;
+    }
+    size_t item_len = strlen(item);
+    char *result = malloc(strlen(s) + count * item_len + 1);
+    char *out = result;
+    while (*s) {
+        if (s[0] == '{' && s[1] == '}') {
+            memcpy(out, item, item_len);
+            out += item_len;
+            s += 2;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+// 根据命令模板和一批参数生成任务的 argv，所有字符串都是新分配的
+static char **build_job_args(char **tmpl, char **items, int num_items, bool multi) {
+    int num_tmpl = 0;
+    while (tmpl[num_tmpl] != NULL) {
+        num_tmpl++;
+    }
+    char **job_args = malloc((num_tmpl + num_items + 1) * sizeof(char *));
+    int pos = 0;
+    bool placed = false;
+
+    for (int i = 0; i < num_tmpl; i++) {
+        if (strstr(tmpl[i], "{}") == NULL || num_items == 0) {
+            job_args[pos++] = strdup(tmpl[i]);
+        } else if (multi && strcmp(tmpl[i], "{}") == 0) {
+            for (int j = 0; j < num_items; j++) {
+                job_args[pos++] = strdup(items[j]);
+            }
+            placed = true;
+        } else {
+            job_args[pos++] = replace_placeholder(tmpl[i], items[0]);
+            placed = true;
+        }
+    }
+    // 模板中没有 {} 时把参数追加到末尾
+    if (!placed) {
+        for (int j = 0; j < num_items; j++) {
+            job_args[pos++] = strdup(items[j]);
+        }
+    }
+    job_args[pos] = NULL;
+    return job_args;
+}
+
+static void free_job_args(char **job_args) {
+    for (int i = 0; job_args[i] != NULL; i++) {
+        free(job_args[i]);
+    }
+    free(job_args);
+}
+
+// 从标准输入读取参数，每行一个
+static char **read_stdin_items(int *num_items) {
+    int cap = 64, n = 0;
+    char **items = malloc(cap * sizeof(char *));
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+
+    while ((read = getline(&line, &len, LSH_IN)) != -1) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[--read] = '\0';
+        }
+        if (read == 0) {
+            continue;
+        }
+        if (n >= cap) {
+            cap *= 2;
+            items = realloc(items, cap * sizeof(char *));
+        }
+        items[n++] = strdup(line);
+    }
+    free(line);
+    *num_items = n;
+    return items;
+}
+
+// 把参数切分成批次，batch_start[i] 为第 i 批的起始下标，返回批次数
+// multi 为 false 时每个参数一批；否则在 ARG_MAX 限制内尽量装满，
+// max_per_batch 大于 0 时每批最多这么多个参数
+static int split_batches(char **tmpl, char **items, int num_items, bool multi, int max_per_batch, int *batch_start) {
+    if (!multi) {
+        for (int i = 0; i <= num_items; i++) {
+            batch_start[i] = i;
+        }
+        return num_items;
+    }
+
+    long budget = arg_budget(tmpl);
+    int num_batches = 0, count = 0;
+    long used = 0;
+    for (int i = 0; i < num_items; i++) {
+        long cost = (long) ARG_COST(items[i]);
+        if (count == 0 || used + cost > budget || (max_per_batch > 0 && count >= max_per_batch)) {
+            batch_start[num_batches++] = i;
+            used = 0;
+            count = 0;
+        }
+        used += cost;
+        count++;
+    }
+    batch_start[num_batches] = num_items;
+    return num_batches;
+}
+
+static void flush_ordered(FILE *out, ParallelOutput *outputs, int num_batches, int *next_print) {
+    while (*next_print < num_batches && outputs[*next_print].done) {
+        write_output(out, outputs[*next_print].buf, outputs[*next_print].len);
+        free(outputs[*next_print].buf);
+        outputs[*next_print].buf = NULL;
+        (*next_print)++;
+    }
+}
+
+static void read_job_output(ParallelJob *job) {
+    if (job->cap - job->len < JOB_READ_SIZE) {
+        job->cap = job->cap * 2 + JOB_READ_SIZE;
+        job->buf = realloc(job->buf, job->cap);
+    }
+    ssize_t n = read(job->out_fd, job->buf + job->len, job->cap - job->len);
+    if (n > 0) {
+        job->len += n;
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        close(job->out_fd);
+        job->out_fd = -1;
+    }
+}
+
+// 把第一个失败任务的 waitpid 状态转换成退出状态
+static int failure_status(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// 用固定数量的任务槽运行所有批次，返回失败的任务数，first_failure 为第一个失败任务的退出状态
+static int run_batches(char **tmpl, char **items, int *batch_start, int num_batches, ParallelOptions *opts,
+                       int *first_failure) {
+    int slots = opts->slots;
+    ParallelOutput *outputs = calloc(num_batches + 1, sizeof(ParallelOutput));
+    ParallelJob *jobs = calloc(slots, sizeof(ParallelJob));
+    struct pollfd *fds = malloc((slots + 2) * sizeof(struct pollfd));
+    int *poll_job = malloc((slots + 2) * sizeof(int));
+    for (int j = 0; j < slots; j++) {
+        jobs[j].pid = -1;
+    }
+
+    // 阻塞 SIGCHLD，通过 signalfd 事件驱动地回收子进程
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+    int sig_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) {
+        perror("signalfd");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        free(outputs);
+        free(jobs);
+        free(fds);
+        free(poll_job);
+        *first_failure = 1;
+        return num_batches;
+    }
+
+    int null_fd = opts->stdin_null ? open("/dev/null", O_RDONLY | O_CLOEXEC) : 0;
+    int next_batch = 0, running = 0, failed = 0, next_print = 0;
+    bool stop_launching = false;
+    FILE *out = LSH_OUT;
+    fflush(out);
+    // 输出流没有描述符（例如命令替换的内存流）时，任务不能直接写输出，只能经过管道收集
+    int out_fd = fileno(out);
+    bool group_output = opts->group_output || out_fd == -1;
+
+    while ((!stop_launching && next_batch < num_batches) || running > 0) {
+        // 填满空闲的任务槽
+        for (int j = 0; j < slots && !stop_launching && next_batch < num_batches; j++) {
+            if (jobs[j].pid != -1) {
+                continue;
+            }
+            // 需要分组输出时每个任务的标准输出接到一个管道上，否则直接写到输出
+            int fd[2] = {-1, out_fd};
+            if (group_output && pipe2(fd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                stop_launching = true;
+                break;
+            }
+            int seq = next_batch++;
+            char **job_args = build_job_args(tmpl, &items[batch_start[seq]],
+                                             batch_start[seq + 1] - batch_start[seq], opts->multi);
+            pid_t pid = lsh_spawn(job_args, null_fd, fd[1]);
+            free_job_args(job_args);
+            if (group_output) {
+                close(fd[1]);
+            }
+            if (pid < 0) {
+                if (fd[0] != -1) {
+                    close(fd[0]);
+                }
+                // 没能启动的任务和之后不再启动的任务都算失败
+                if (failed == 0) {
+                    *first_failure = 1;
+                }
+                failed += num_batches - seq;
+                stop_launching = true;
+                break;
+            }
+            jobs[j] = (ParallelJob) {.seq = seq, .pid = pid, .out_fd = fd[0]};
+            running++;
+        }
+
+        int nfds = 0;
+        fds[nfds].fd = sig_fd;
+        fds[nfds].events = POLLIN;
+        poll_job[nfds++] = -1;
+        // 由 spawn 辅助进程启动的任务没有 SIGCHLD，退出消息从辅助进程的套接字到达
+        if (spawn_helper_enabled()) {
+            fds[nfds].fd = spawn_helper_fd();
+            fds[nfds].events = POLLIN;
+            poll_job[nfds++] = -1;
+        }
+        for (int j = 0; j < slots; j++) {
+            if (jobs[j].pid != -1 && jobs[j].out_fd != -1) {
+                fds[nfds].fd = jobs[j].out_fd;
+                fds[nfds].events = POLLIN;
+                poll_job[nfds++] = j;
+            }
+        }
+        if (poll(fds, nfds, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        for (int k = 0; k < nfds; k++) {
+            if (fds[k].revents == 0) {
+                continue;
+            }
+            if (poll_job[k] == -1) {
+                struct signalfd_siginfo info;
+                while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+                }
+                for (int j = 0; j < slots; j++) {
+                    if (jobs[j].pid != -1 && !jobs[j].exited &&
+                        lsh_waitpid(jobs[j].pid, &jobs[j].status, WNOHANG) == jobs[j].pid) {
+                        jobs[j].exited = true;
+                    }
+                }
+            } else {
+                read_job_output(&jobs[poll_job[k]]);
+            }
+        }
+
+        // 输出已经完成的任务
+        for (int j = 0; j < slots; j++) {
+            ParallelJob *job = &jobs[j];
+            if (job->pid == -1 || !job->exited || job->out_fd != -1) {
+                continue;
+            }
+            if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+                if (failed++ == 0) {
+                    *first_failure = failure_status(job->status);
+                }
+                if (opts->halt == HALT_NOW) {
+                    for (int k = 0; k < slots; k++) {
+                        if (jobs[k].pid != -1 && !jobs[k].exited) {
+                            kill(jobs[k].pid, SIGTERM);
+                        }
+                    }
+                }
+                if (opts->halt != HALT_NEVER) {
+                    stop_launching = true;
+                }
+            }
+            if (opts->keep_order) {
+                outputs[job->seq] = (ParallelOutput) {.buf = job->buf, .len = job->len, .done = true};
+                flush_ordered(out, outputs, num_batches, &next_print);
+            } else {
+                write_output(out, job->buf, job->len);
+                free(job->buf);
+            }
+            *job = (ParallelJob) {.pid = -1};
+            running--;
+        }
+    }
+
+    // 被 halt 提前终止时，-k 模式下的输出停在第一个没有完成的任务之前，之后完成的任务不再输出
+    for (int j = next_print; j < num_batches; j++) {
+        free(outputs[j].buf);
+    }
+
+    close(sig_fd);
+    if (null_fd > 0) {
+        close(null_fd);
+    }
+    // signalfd 可能吞掉了后台任务的 SIGCHLD，这里补一次回收
+    sigchld_handler(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    free(outputs);
+    free(jobs);
+    free(fds);
+    free(poll_job);
+    return failed;
+}
+
+// 和 GNU parallel 一样设置 $?：halt 时为触发 halt 的任务的退出状态，否则为失败的任务数，最多 101
+static void set_parallel_status(int failed, int first_failure, HaltPolicy halt) {
+    if (failed == 0) {
+        lsh_last_status = 0;
+    } else if (halt != HALT_NEVER) {
+        lsh_last_status = first_failure;
+    } else {
+        lsh_last_status = failed > 101 ? 101 : failed;
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: parallel [-j N] [-k] [-X] [--halt now|soon|never] cmd [args...] [::: items...]\n");
+    lsh_last_status = 1;
+}
+
+// 在 shell 内部调度子进程的 parallel，使用固定数量的任务槽
+// 参数来自 ::: 之后的参数或者标准输入（每行一个），命令中的 {} 会被替换为参数
+int lsh_parallel(char **args) {
+    ParallelOptions opts = {.slots = (int) sysconf(_SC_NPROCESSORS_ONLN), .group_output = true};
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            opts.slots = atoi(args[++i]);
+        } else if (strcmp(args[i], "-k") == 0) {
+            opts.keep_order = true;
+        } else if (strcmp(args[i], "-X") == 0) {
+            opts.multi = true;
+        } else if (strcmp(args[i], "--halt") == 0 && args[i + 1] != NULL) {
+            i++;
+            if (strcmp(args[i], "now") == 0) {
+                opts.halt = HALT_NOW;
+            } else if (strcmp(args[i], "soon") == 0) {
+                opts.halt = HALT_SOON;
+            } else if (strcmp(args[i], "never") == 0) {
+                opts.halt = HALT_NEVER;
+            } else {
+                usage();
+                return 1;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (opts.slots < 1) {
+        opts.slots = 1;
+    }
+
+    // 拆分命令模板和参数
+    char **tmpl = &args[i];
+    char **items = NULL;
+    int num_items = 0;
+    bool items_from_stdin = true;
+    for (int j = i; args[j] != NULL; j++) {
+        if (strcmp(args[j], ":::") == 0) {
+            args[j] = NULL;
+            items = &args[j + 1];
+            while (items[num_items] != NULL) {
+                num_items++;
+            }
+            items_from_stdin = false;
+            break;
+        }
+    }
+    if (tmpl[0] == NULL) {
+        usage();
+        return 1;
+    }
+    if (items_from_stdin) {
+        items = read_stdin_items(&num_items);
+        opts.stdin_null = true;
+    }
+
+    // -X 模式下让每个任务槽都分到任务
+    int *batch_start = malloc((num_items + 1) * sizeof(int));
+    int num_batches = split_batches(tmpl, items, num_items, opts.multi,
+                                    (num_items + opts.slots - 1) / opts.slots, batch_start);
+    int first_failure = 0;
+    int failed = run_batches(tmpl, items, batch_start, num_batches, &opts, &first_failure);
+    if (failed > 0) {
+        fprintf(stderr, "parallel: %d 个任务失败\n", failed);
+    }
+    set_parallel_status(failed, first_failure, opts.halt);
+
+    if (items_from_stdin) {
+        for (int j = 0; j < num_items; j++) {
+            free(items[j]);
+        }
+        free(items);
+    }
+    free(batch_start);
+    return 1;
+}
+
+// batch [-P N] cmd [options...] [--] args...
+// 按 ARG_MAX 把参数切分成尽可能少的批次执行，避免 execvp 因参数过长返回 E2BIG。
+// 命令后面以 '-' 开头的参数（或 -- 之前的所有参数）每批都带上，其余参数分批；-P 指定并行运行的批次数
+int lsh_batch(char **args) {
+    ParallelOptions opts = {.slots = 1, .multi = true, .halt = HALT_NEVER};
+    int i = 1;
+
+    if (args[i] != NULL && strcmp(args[i], "-P") == 0 && args[i + 1] != NULL) {
+        opts.slots = atoi(args[i + 1]);
+        i += 2;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "Usage: batch [-P N] cmd [options...] [--] args...\n");
+        lsh_last_status = 1;
+        return 1;
+    }
+    if (opts.slots < 1) {
+        opts.slots = 1;
+    }
+
+    int num_args = 0;
+    while (args[num_args] != NULL) {
+        num_args++;
+    }
+    // 找出每批都要带上的固定参数
+    int items_start = i + 1;
+    bool has_separator = false;
+    for (int j = i + 1; args[j] != NULL; j++) {
+        if (strcmp(args[j], "--") == 0) {
+            items_start = j;
+            has_separator = true;
+            break;
+        }
+    }
+    if (!has_separator) {
+        while (args[items_start] != NULL && args[items_start][0] == '-') {
+            items_start++;
+        }
+    }
+
+    int num_fixed = items_start - i;
+    char **tmpl = malloc((num_fixed + 1) * sizeof(char *));
+    memcpy(tmpl, &args[i], num_fixed * sizeof(char *));
+    tmpl[num_fixed] = NULL;
+    if (args[items_start] != NULL && strcmp(args[items_start], "--") == 0) {
+        items_start++;
+    }
+    char **items = &args[items_start];
+    int num_items = num_args - items_start;
+
+    int *batch_start = malloc((num_items + 1) * sizeof(int));
+    int num_batches = split_batches(tmpl, items, num_items, true, 0, batch_start);
+    if (num_batches == 0) {
+        // 没有可变参数时直接运行一次
+        batch_start[num_batches++] = 0;
+        batch_start[num_batches] = 0;
+    }
+    int first_failure = 0;
+    int failed = run_batches(tmpl, items, batch_start, num_batches, &opts, &first_failure);
+    if (failed > 0) {
+        fprintf(stderr, "batch: %d/%d 个批次失败\n", failed, num_batches);
+    }
+    set_parallel_status(failed, first_failure, opts.halt);
+
+    free(tmpl);
+    free(batch_start);
+    return 1;
+}
@@ -0,0 +1,17 @@
+//
+// Created by ysh on 24-6-19.
+//
+
+#ifndef OS_C_PARALLEL_H
+#define OS_C_PARALLEL_H
+
+#include <string.h>
+
+// 单个参数在 execve 中占用的字节数（字符串本身加上指针）
+#define ARG_COST(s) (strlen(s) + 1 + sizeof(char *))
+
+long arg_budget(char **fixed_args);
+int lsh_parallel(char **args);
+int lsh_batch(char **args);
+
+#endif //OS_C_PARALLEL_H
@@ -0,0 +1,124 @@
+//
+// Created by ysh on 24-6-18.
+//
+
+#include "path_cache.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define PATH_CACHE_INIT_SIZE 64
+
+// 命令名 -> 可执行文件绝对路径的缓存，开放寻址哈希表
+typedef struct PathEntry {
+    char *name;
+    char *path;
+} PathEntry;
+
+static PathEntry *path_table = NULL;
+static size_t path_table_size = 0;
+static size_t path_table_used = 0;
+
+static size_t hash_name(const char *s) {
+    size_t h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char) *s++;
+    }
+    return h;
+}
+
+static PathEntry *find_slot(PathEntry *table, size_t size, const char *name) {
+    size_t i = hash_name(name) & (size - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static void grow_table() {
+    size_t new_size = path_table_size ? path_table_size * 2 : PATH_CACHE_INIT_SIZE;
+    PathEntry *new_table = calloc(new_size, sizeof(PathEntry));
+    if (new_table == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < path_table_size; i++) {
+        if (path_table[i].name != NULL) {
+            *find_slot(new_table, new_size, path_table[i].name) = path_table[i];
+        }
+    }
+    free(path_table);
+    path_table = new_table;
+    path_table_size = new_size;
+}
+
+// 在 $PATH 中搜索命令，返回 malloc 出来的绝对路径
+static char *search_path(const char *command) {
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        return NULL;
+    }
+
+    char cmd_path[PATH_MAX];
+    const char *dir = path;
+    while (*dir) {
+        const char *end = strchr(dir, ':');
+        size_t len = end ? (size_t) (end - dir) : strlen(dir);
+        // 空的目录项表示当前目录
+        snprintf(cmd_path, sizeof(cmd_path), "%.*s/%s", (int) (len ? len : 1), len ? dir : ".", command);
+        if (access(cmd_path, X_OK) == 0) {
+            return strdup(cmd_path);
+        }
+        if (end == NULL) {
+            break;
+        }
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+// 查找命令对应的可执行文件，命中缓存时不再遍历 $PATH
+// 命令中含有 '/' 时不做查找，返回 NULL
+const char *path_cache_lookup(const char *command) {
+    if (command == NULL || *command == '\0' || strchr(command, '/') != NULL) {
+        return NULL;
+    }
+
+    if (path_table_size > 0) {
+        PathEntry *entry = find_slot(path_table, path_table_size, command);
+        if (entry->name != NULL) {
+            STAT_INC(path_hits);
+            return entry->path;
+        }
+    }
+
+    STAT_INC(path_misses);
+    char *found = search_path(command);
+    if (found == NULL) {
+        return NULL; // 未找到的命令不缓存，之后安装的程序仍能被找到
+    }
+
+    if ((path_table_used + 1) * 2 > path_table_size) {
+        grow_table();
+    }
+    PathEntry *entry = find_slot(path_table, path_table_size, command);
+    entry->name = strdup(command);
+    entry->path = found;
+    path_table_used++;
+    return found;
+}
+
+// PATH 变化后清空缓存
+void path_cache_clear() {
+    for (size_t i = 0; i < path_table_size; i++) {
+        free(path_table[i].name);
+        free(path_table[i].path);
+    }
+    free(path_table);
+    path_table = NULL;
+    path_table_size = 0;
+    path_table_used = 0;
+}
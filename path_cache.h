@@ -0,0 +1,11 @@
+//
+// Created by ysh on 24-6-18.
+//
+
+#ifndef OS_C_PATH_CACHE_H
+#define OS_C_PATH_CACHE_H
+
+const char *path_cache_lookup(const char *command);
+void path_cache_clear();
+
+#endif //OS_C_PATH_CACHE_H
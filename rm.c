@@ -0,0 +1,176 @@
+//
+// Created by ysh on 24-7-6.
+//
+// rm 内置命令。-r 时用 walk.c 的多线程遍历，不同的子目录分给不同的线程；
+// 文件在访问目录项时相对于所在目录的 fd 用 unlinkat 删除，目录在里面的内容都删完后相对于父目录的 fd 删除。
+// 删除失败的目录项数沿着目录向上汇总，里面有删不掉的内容的目录不再尝试删除，也不重复报错。
+// 错误先收集起来，全部删除结束后再统一输出，不会和多个线程的进度混在一起。
+//
+
+#define _GNU_SOURCE
+#include "rm.h"
+#include "walk.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define MAX_RM_ERRORS 100
+
+typedef struct RmContext {
+    bool recursive;
+    bool force;
+    int threads;
+    pthread_mutex_t lock;
+    char *errors[MAX_RM_ERRORS];   // 超出的部分只计数
+    int num_errors;
+    atomic_ulong removed;
+} RmContext;
+
+static void rm_report(RmContext *c, const char *path, const char *reason) {
+    char *msg;
+    if (asprintf(&msg, "rm: 无法删除 %s: %s", path, reason) < 0) {
+        msg = NULL;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (c->num_errors < MAX_RM_ERRORS && msg != NULL) {
+        c->errors[c->num_errors] = msg;
+        msg = NULL;
+    }
+    c->num_errors++;
+    pthread_mutex_unlock(&c->lock);
+    free(msg);
+}
+
+// 返回删除失败的项数，-f 时不存在的文件不算失败
+static int remove_entry(RmContext *c, const WalkEntry *e, int flags) {
+    if (unlinkat(e->dir_fd, e->name, flags) == 0) {
+        atomic_fetch_add(&c->removed, 1);
+        return 0;
+    }
+    if (errno == ENOENT && c->force) {
+        return 0;
+    }
+    // 目录打不开时已经报过错，删除它失败只是结果
+    if (errno == ENOTEMPTY && (flags & AT_REMOVEDIR) && c->num_errors > 0) {
+        return 1;
+    }
+    rm_report(c, e->path, strerror(errno));
+    return 1;
+}
+
+static bool rm_visit(void *ctx, int worker, WalkEntry *e) {
+    RmContext *c = ctx;
+    if (e->type != DT_DIR) {
+        e->value = remove_entry(c, e, 0);
+        return false;
+    }
+    if (!c->recursive) {
+        rm_report(c, e->path, "是一个目录");
+        e->value = 1;
+        return false;
+    }
+    return true;
+}
+
+static void rm_dir_done(void *ctx, int worker, const WalkEntry *dir, unsigned long long failures) {
+    RmContext *c = ctx;
+    if (dir->type == DT_DIR && failures == 0) {
+        remove_entry(c, dir, AT_REMOVEDIR);
+    }
+}
+
+static void rm_error(void *ctx, const char *path, int err) {
+    RmContext *c = ctx;
+    if (!(err == ENOENT && c->force)) {
+        rm_report(c, path, strerror(err));
+    }
+}
+
+// 和 GNU rm 一样拒绝删除 /、. 和 ..
+static bool is_protected(const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len == 1 && path[0] == '/') {
+        return true;
+    }
+    const char *base = path + len;
+    while (base > path && base[-1] != '/') {
+        base--;
+    }
+    size_t n = path + len - base;
+    return (n == 1 && base[0] == '.') || (n == 2 && base[0] == '.' && base[1] == '.');
+}
+
+// rm [-r] [-f] [--parallel=N] 文件...
+int lsh_rm(char **args) {
+    RmContext c = {.threads = walk_default_threads()};
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(args[i], "--parallel=", 11) == 0) {
+            c.threads = atoi(args[i] + 11);
+            continue;
+        }
+        for (const char *opt = args[i] + 1; *opt != '\0'; opt++) {
+            if (*opt == 'r' || *opt == 'R') {
+                c.recursive = true;
+            } else if (*opt == 'f') {
+                c.force = true;
+            } else {
+                fprintf(stderr, "rm: 无效的选项 -%c\n", *opt);
+                fprintf(stderr, "Usage: rm [-r] [-f] [--parallel=N] 文件...\n");
+                lsh_last_status = 1;
+                return 1;
+            }
+        }
+    }
+    if (c.threads < 1 || (args[i] == NULL && !c.force)) {
+        fprintf(stderr, "Usage: rm [-r] [-f] [--parallel=N] 文件...\n");
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    pthread_mutex_init(&c.lock, NULL);
+    int num_args = 0;
+    while (args[i + num_args] != NULL) {
+        num_args++;
+    }
+    char **roots = malloc(sizeof(char *) * (num_args + 1));
+    int num_roots = 0;
+    for (int k = i; args[k] != NULL; k++) {
+        if (is_protected(args[k])) {
+            rm_report(&c, args[k], "拒绝删除 /、. 或 ..");
+        } else {
+            roots[num_roots++] = args[k];
+        }
+    }
+    WalkOps ops = {.ctx = &c, .threads = c.threads, .visit = rm_visit, .dir_done = rm_dir_done, .error = rm_error};
+    walk_tree(roots, num_roots, &ops);
+    free(roots);
+    STAT_ADD(rm_entries, atomic_load(&c.removed));
+
+    for (int k = 0; k < c.num_errors && k < MAX_RM_ERRORS; k++) {
+        fprintf(stderr, "%s\n", c.errors[k]);
+        free(c.errors[k]);
+    }
+    if (c.num_errors > MAX_RM_ERRORS) {
+        fprintf(stderr, "rm: 还有 %d 个错误没有显示\n", c.num_errors - MAX_RM_ERRORS);
+    }
+    pthread_mutex_destroy(&c.lock);
+    lsh_last_status = c.num_errors > 0 ? 1 : 0;
+    return 1;
+}
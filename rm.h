@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-6.
+//
+
+#ifndef OS_C_RM_H
+#define OS_C_RM_H
+
+int lsh_rm(char **args);
+
+#endif //OS_C_RM_H
@@ -0,0 +1,86 @@
+//
+// Created by ysh on 24-6-25.
+//
+// 控制结构 (if/for/while/until/case/函数) 编译成的字节码。
+// 程序由定长指令数组、命令表、单词表和字符串表组成，全部是偏移量而不是指针，
+// 可以原样写入文件再映射回来执行。
+//
+
+#ifndef OS_C_SCRIPT_H
+#define OS_C_SCRIPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 指令集、程序布局或编译出的代码变化时加一，旧的脚本缓存随之失效
+#define SCRIPT_FORMAT_VERSION 3
+
+typedef enum OpCode {
+    OP_EXEC,          // a: 命令，展开后执行一条简单命令（可以含管道、重定向和 &）
+    OP_JUMP,          // a: 目标
+    OP_JUMP_IF_FALSE, // a: 目标，$? 不为 0 时跳转
+    OP_JUMP_IF_TRUE,  // a: 目标，$? 为 0 时跳转
+    OP_NOT,           // ! 取反 $?
+    OP_SET_STATUS,    // a: 状态值
+    OP_FOR_INIT,      // a: 命令（单词列表），b: 为 1 时遍历位置参数
+    OP_FOR_NEXT,      // a: 变量名，b: 遍历结束时的目标
+    OP_FOR_POP,       // 结束最内层的 for 循环
+    OP_CASE_WORD,     // a: 字符串，展开后作为 case 的匹配对象
+    OP_CASE_MATCH,    // a: 模式字符串，b: 匹配时的目标
+    OP_DEFUN,         // a: 函数名，b: 函数体入口
+    OP_RETURN,        // a: 命令（返回值参数），从函数返回
+    OP_SUBSHELL,      // a: 子 shell 结束后的目标，子进程从下一条指令开始执行
+    OP_EXIT,          // 子 shell 执行结束，退出子进程
+    OP_REDIRECT,      // a: 命令（重定向单词），对复合命令的标准输入输出做重定向
+    OP_UNREDIRECT,    // 恢复最近一次 OP_REDIRECT 之前的标准输入输出
+    OP_PIPE_STAGE,    // a: 这一阶段之后的目标，b: 为 1 时是最后一个阶段。含有复合命令的管道，
+                      // 每个阶段在子进程中从下一条指令执行到 OP_EXIT
+    OP_PIPE_WAIT,     // 等待管道的所有阶段结束
+    OP_BACKGROUND,    // a: 后台命令之后的目标。以 & 结尾的复合命令，子进程从下一条指令执行到 OP_EXIT，
+                      // shell 不等待它结束
+    OP_END,           // 程序或函数体结束
+} OpCode;
+
+#define NO_OPERAND UINT32_MAX
+
+typedef struct Instr {
+    uint32_t op;
+    uint32_t a;
+    uint32_t b;
+} Instr;
+
+// 命令表项：words 中从 first 开始的 count 个单词
+typedef struct CommandRef {
+    uint32_t first;
+    uint32_t count;
+} CommandRef;
+
+typedef struct Program {
+    Instr *code;
+    uint32_t code_len;
+    CommandRef *cmds;
+    uint32_t num_cmds;
+    uint32_t *words; // 字符串表中的偏移量
+    uint32_t num_words;
+    char *strings;   // 以 '\0' 结尾的字符串依次存放
+    uint32_t strings_len;
+    int refs;        // 定义在其中的函数也持有引用
+    void *mapping;   // 非 NULL 时各个表指向映射的文件，释放时 munmap
+    uint32_t mapping_len;
+} Program;
+
+// 逐行提供更多源代码，返回 malloc 出来的一行，没有更多输入时返回 NULL
+typedef char *(*LineReader)(void);
+
+Program *compile_source(const char *source, LineReader read_more);
+void program_retain(Program *prog);
+void program_release(Program *prog);
+
+Program *script_load(const char *path);
+
+int vm_run(Program *prog);
+int vm_run_sourced(Program *prog);
+bool vm_is_function(const char *name);
+int vm_call_function(char **args);
+
+#endif //OS_C_SCRIPT_H
@@ -0,0 +1,660 @@
+//
+// Created by ysh on 24-6-27.
+//
+// test/[、true、false、printf、read。条件判断和格式化输出在脚本的循环里出现得最多，
+// 每次都 fork 一个 /usr/bin/test 或 printf 比命令本身的工作量大得多。
+//
+
+#include "script_builtins.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+  test 和 [
+*/
+
+typedef struct TestParser {
+    char **argv;
+    int pos;
+    int end;
+    const char *name;
+    bool error;
+} TestParser;
+
+static const char *unary_ops = "bcdefghkLnprsStuwxz";
+
+static bool is_unary_op(const char *arg) {
+    return arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && strchr(unary_ops, arg[1]) != NULL;
+}
+
+static bool is_binary_op(const char *arg) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(arg, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 整数比较的操作数，允许前后有空白
+static long long test_integer(TestParser *tp, const char *arg) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (end == arg || *end != '\0' || errno == ERANGE) {
+        if (!tp->error) {
+            fprintf(stderr, "%s: %s: 需要整数表达式\n", tp->name, arg);
+        }
+        tp->error = true;
+    }
+    return value;
+}
+
+static bool test_unary(TestParser *tp, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+        case 'z':
+            return arg[0] == '\0';
+        case 'n':
+            return arg[0] != '\0';
+        case 't':
+            return isatty((int) test_integer(tp, arg));
+        case 'r':
+            return access(arg, R_OK) == 0;
+        case 'w':
+            return access(arg, W_OK) == 0;
+        case 'x':
+            return access(arg, X_OK) == 0;
+        case 'h':
+        case 'L':
+            return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        default:
+            break;
+    }
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op) {
+        case 'e':
+            return true;
+        case 'f':
+            return S_ISREG(st.st_mode);
+        case 'd':
+            return S_ISDIR(st.st_mode);
+        case 'b':
+            return S_ISBLK(st.st_mode);
+        case 'c':
+            return S_ISCHR(st.st_mode);
+        case 'p':
+            return S_ISFIFO(st.st_mode);
+        case 'S':
+            return S_ISSOCK(st.st_mode);
+        case 's':
+            return st.st_size > 0;
+        case 'u':
+            return (st.st_mode & S_ISUID) != 0;
+        case 'g':
+            return (st.st_mode & S_ISGID) != 0;
+        case 'k':
+            return (st.st_mode & S_ISVTX) != 0;
+        default:
+            return false;
+    }
+}
+
+// 比较两个文件的修改时间，不存在的文件比任何存在的文件都旧
+static int compare_mtime(const char *a, const char *b) {
+    struct stat sa, sb;
+    bool has_a = stat(a, &sa) == 0, has_b = stat(b, &sb) == 0;
+    if (!has_a || !has_b) {
+        return has_a - has_b;
+    }
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec) {
+        return sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ? -1 : 1;
+    }
+    return (sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) - (sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+}
+
+static bool test_binary(TestParser *tp, const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    } else if (strcmp(op, "-nt") == 0) {
+        return compare_mtime(left, right) > 0;
+    } else if (strcmp(op, "-ot") == 0) {
+        return compare_mtime(left, right) < 0;
+    } else if (strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        return stat(left, &sa) == 0 && stat(right, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    long long a = test_integer(tp, left), b = test_integer(tp, right);
+    if (strcmp(op, "-eq") == 0) {
+        return a == b;
+    } else if (strcmp(op, "-ne") == 0) {
+        return a != b;
+    } else if (strcmp(op, "-lt") == 0) {
+        return a < b;
+    } else if (strcmp(op, "-le") == 0) {
+        return a <= b;
+    } else if (strcmp(op, "-gt") == 0) {
+        return a > b;
+    }
+    return a >= b;
+}
+
+static bool test_or(TestParser *tp);
+
+// 基本表达式。和 POSIX 的规定一致，第二个参数是二元运算符时优先按二元运算处理
+static bool test_primary(TestParser *tp) {
+    int remaining = tp->end - tp->pos;
+    char **argv = tp->argv + tp->pos;
+    if (remaining <= 0) {
+        if (!tp->error) {
+            fprintf(stderr, "%s: 缺少参数\n", tp->name);
+        }
+        tp->error = true;
+        return false;
+    }
+    if (remaining >= 3 && is_binary_op(argv[1])) {
+        tp->pos += 3;
+        return test_binary(tp, argv[0], argv[1], argv[2]);
+    }
+    if (strcmp(argv[0], "(") == 0 && remaining >= 2) {
+        tp->pos++;
+        bool value = test_or(tp);
+        if (tp->pos >= tp->end || strcmp(tp->argv[tp->pos], ")") != 0) {
+            if (!tp->error) {
+                fprintf(stderr, "%s: 缺少 \")\"\n", tp->name);
+            }
+            tp->error = true;
+            return false;
+        }
+        tp->pos++;
+        return value;
+    }
+    if (remaining >= 2 && is_unary_op(argv[0])) {
+        tp->pos += 2;
+        return test_unary(tp, argv[0][1], argv[1]);
+    }
+    tp->pos++;
+    return argv[0][0] != '\0';
+}
+
+static bool test_not(TestParser *tp) {
+    int remaining = tp->end - tp->pos;
+    char **argv = tp->argv + tp->pos;
+    if (remaining >= 2 && strcmp(argv[0], "!") == 0 && !(remaining >= 3 && is_binary_op(argv[1]))) {
+        tp->pos++;
+        return !test_not(tp);
+    }
+    return test_primary(tp);
+}
+
+static bool test_and(TestParser *tp) {
+    bool value = test_not(tp);
+    while (tp->pos < tp->end && strcmp(tp->argv[tp->pos], "-a") == 0) {
+        tp->pos++;
+        value = test_not(tp) && value;
+    }
+    return value;
+}
+
+static bool test_or(TestParser *tp) {
+    bool value = test_and(tp);
+    while (tp->pos < tp->end && strcmp(tp->argv[tp->pos], "-o") == 0) {
+        tp->pos++;
+        value = test_and(tp) || value;
+    }
+    return value;
+}
+
+// test 表达式 / [ 表达式 ]：为真时 $? 为 0，为假时为 1，表达式有误时为 2
+int lsh_test(char **args) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    TestParser tp = {.argv = args, .pos = 1, .end = argc, .name = args[0]};
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: 缺少 \"]\"\n");
+            lsh_last_status = 2;
+            return 1;
+        }
+        tp.end--;
+    }
+    if (tp.end <= 1) {
+        lsh_last_status = 1; // 没有表达式时为假
+        return 1;
+    }
+    bool value = test_or(&tp);
+    if (!tp.error && tp.pos < tp.end) {
+        fprintf(stderr, "%s: %s: 参数太多\n", tp.name, args[tp.pos]);
+        tp.error = true;
+    }
+    lsh_last_status = tp.error ? 2 : !value;
+    return 1;
+}
+
+int lsh_true(char **args) {
+    return 1;
+}
+
+int lsh_false(char **args) {
+    lsh_last_status = 1;
+    return 1;
+}
+
+/*
+  printf
+*/
+
+// 解析 p 处的反斜杠转义，结果写入 *c，返回转义之后的位置。
+// in_arg 为 true 时是 %b 的参数：\0NNN 表示八进制，\c 表示停止输出（*c 设为 EOF）
+static const char *parse_escape(const char *p, int *c, bool in_arg) {
+    static const char *from = "abefnrtv\\\"'", *to = "\a\b\033\f\n\r\t\v\\\"'";
+    const char *found = strchr(from, *p);
+    if (*p != '\0' && found != NULL) {
+        *c = (unsigned char) to[found - from];
+        return p + 1;
+    }
+    if (*p == 'c' && in_arg) {
+        *c = EOF;
+        return p + 1;
+    }
+    if (*p >= '0' && *p <= '7') {
+        int max_digits = 3;
+        if (in_arg && *p == '0') {
+            p++; // %b 中 \0 之后最多再跟三位
+        }
+        int value = 0;
+        for (int i = 0; i < max_digits && *p >= '0' && *p <= '7'; i++) {
+            value = value * 8 + (*p++ - '0');
+        }
+        *c = value & 0xff;
+        return p;
+    }
+    if (*p == 'x' && isxdigit((unsigned char) p[1])) {
+        int value = 0;
+        p++;
+        for (int i = 0; i < 2 && isxdigit((unsigned char) *p); i++, p++) {
+            value = value * 16 + (isdigit((unsigned char) *p) ? *p - '0' : tolower((unsigned char) *p) - 'a' + 10);
+        }
+        *c = value;
+        return p;
+    }
+    // 不认识的转义原样输出
+    *c = '\\';
+    return p;
+}
+
+// 数字参数：可以是 C 风格的整数，也可以是 'c 或 "c 表示字符的编码
+static bool printf_number(const char *arg, long long *value, bool *is_unsigned) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char) arg[1];
+        return true;
+    }
+    char *end;
+    errno = 0;
+    if (arg[0] != '-' && *is_unsigned) {
+        *value = (long long) strtoull(arg, &end, 0);
+    } else {
+        *value = strtoll(arg, &end, 0);
+        *is_unsigned = false;
+    }
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (arg[0] != '\0' && (end == arg || *end != '\0' || errno == ERANGE)) {
+        fprintf(stderr, "printf: %s: 无效的数字\n", arg);
+        lsh_last_status = 1;
+        return false;
+    }
+    return true;
+}
+
+// %b 的参数：展开转义后输出，遇到 \c 返回 false
+static bool print_escaped_arg(FILE *out, const char *spec, const char *arg) {
+    size_t len = strlen(arg);
+    char *text = malloc(len + 1);
+    size_t n = 0;
+    bool stop = false;
+    for (const char *p = arg; *p;) {
+        if (*p == '\\' && p[1] != '\0') {
+            int c;
+            p = parse_escape(p + 1, &c, true);
+            if (c == EOF) {
+                stop = true;
+                break;
+            }
+            text[n++] = (char) c;
+        } else {
+            text[n++] = *p++;
+        }
+    }
+    text[n] = '\0';
+    fprintf(out, spec, text);
+    free(text);
+    return !stop;
+}
+
+// 按格式输出一遍，参数从 *argv 中依次取用。遇到 \c 或格式错误时把 *stop 设为 true
+static void printf_once(FILE *out, const char *format, char ***argv, bool *stop) {
+    for (const char *p = format; *p && !*stop;) {
+        if (*p == '\\' && p[1] != '\0') {
+            int c;
+            p = parse_escape(p + 1, &c, false);
+            fputc(c, out);
+            continue;
+        }
+        if (*p != '%') {
+            fputc(*p++, out);
+            continue;
+        }
+        if (p[1] == '%') {
+            fputc('%', out);
+            p += 2;
+            continue;
+        }
+
+        // 转换说明：%[标志][宽度][.精度]转换字符，* 从参数中取值。
+        // 宽度和精度各自最多 20 位，spec 不会溢出
+        char spec[64];
+        size_t n = 0;
+        spec[n++] = *p++;
+        while (*p && strchr("-+ #0", *p) != NULL && n < 8) {
+            spec[n++] = *p++;
+        }
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                spec[n++] = *p++;
+            }
+            if (*p == '*') {
+                long long value = 0;
+                bool is_unsigned = false;
+                if (**argv != NULL) {
+                    printf_number(*(*argv)++, &value, &is_unsigned);
+                }
+                n += snprintf(spec + n, 20, "%d", (int) value);
+                p++;
+            } else {
+                for (int digits = 0; isdigit((unsigned char) *p) && digits < 20; digits++) {
+                    spec[n++] = *p++;
+                }
+            }
+        }
+
+        char conv = *p;
+        if (conv == '\0' || strchr("sbcdiouxXeEfFgGaA", conv) == NULL) {
+            fprintf(stderr, "printf: %%%c: 无效的格式字符\n", conv ? conv : ' ');
+            lsh_last_status = 1;
+            *stop = true;
+            return;
+        }
+        p++;
+        const char *arg = **argv;
+        if (arg != NULL) {
+            (*argv)++;
+        }
+
+        if (conv == 's' || conv == 'b' || conv == 'c') {
+            char text[2] = {arg ? arg[0] : '\0', '\0'};
+            spec[n++] = 's';
+            spec[n] = '\0';
+            if (conv == 'b') {
+                *stop = !print_escaped_arg(out, spec, arg ? arg : "");
+            } else {
+                fprintf(out, spec, conv == 'c' ? text : (arg ? arg : ""));
+            }
+        } else if (strchr("diouxX", conv) != NULL) {
+            long long value = 0;
+            bool is_unsigned = conv != 'd' && conv != 'i';
+            if (arg != NULL) {
+                printf_number(arg, &value, &is_unsigned);
+            }
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = conv;
+            spec[n] = '\0';
+            fprintf(out, spec, value);
+        } else {
+            double value = 0;
+            if (arg != NULL) {
+                char *end;
+                value = strtod(arg, &end);
+                if (end == arg || *end != '\0') {
+                    fprintf(stderr, "printf: %s: 无效的数字\n", arg);
+                    lsh_last_status = 1;
+                }
+            }
+            spec[n++] = conv;
+            spec[n] = '\0';
+            fprintf(out, spec, value);
+        }
+    }
+}
+
+// printf 格式 [参数...]：参数比格式中的转换说明多时重复使用格式
+int lsh_printf(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "printf: 用法: printf 格式 [参数...]\n");
+        lsh_last_status = 2;
+        return 1;
+    }
+    FILE *out = LSH_OUT;
+    char **argv = args + 2;
+    bool stop = false;
+    do {
+        char **before = argv;
+        printf_once(out, args[1], &argv, &stop);
+        if (argv == before) {
+            break; // 格式中没有用到参数
+        }
+    } while (*argv != NULL && !stop);
+    fflush(out);
+    return 1;
+}
+
+/*
+  read
+*/
+
+typedef struct ReadLine {
+    char *text;
+    bool *literal; // 被反斜杠转义的字符，不作为分隔符
+    size_t len;
+    size_t cap;
+} ReadLine;
+
+static void read_line_putc(ReadLine *line, char c, bool literal) {
+    if (line->len + 1 >= line->cap) {
+        line->cap = line->cap ? line->cap * 2 : 128;
+        line->text = realloc(line->text, line->cap);
+        line->literal = realloc(line->literal, line->cap * sizeof(bool));
+    }
+    line->literal[line->len] = literal;
+    line->text[line->len++] = c;
+    line->text[line->len] = '\0';
+}
+
+// read 只能取走它返回的那一行，同一个输入后面的命令（{ read a; cat; } < file）要接着读，
+// 所以绕过 stdio 直接读描述符。可以定位的输入整块读，结束时把多读的部分 lseek 退回去；
+// 管道和终端一次读一个字节。没有描述符的流（内存流）只能用 stdio 读
+typedef struct ReadSource {
+    FILE *file;
+    int fd;
+    bool seekable;
+    char buf[4096];
+    size_t pos;
+    size_t len;
+} ReadSource;
+
+static void read_source_init(ReadSource *src, FILE *file) {
+    src->file = file;
+    src->fd = fileno(file);
+    src->seekable = src->fd >= 0 && lseek(src->fd, 0, SEEK_CUR) != -1;
+    src->pos = src->len = 0;
+    if (src->seekable) {
+        // 可以定位的输入流 fflush 后（POSIX）缓冲区被丢弃，描述符回到流实际读到的位置
+        fflush(file);
+    }
+}
+
+static int read_source_getc(ReadSource *src) {
+    if (src->fd < 0) {
+        return getc(src->file);
+    }
+    if (src->pos == src->len) {
+        ssize_t n;
+        do {
+            n = read(src->fd, src->buf, src->seekable ? sizeof(src->buf) : 1);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return EOF;
+        }
+        src->pos = 0;
+        src->len = (size_t) n;
+    }
+    return (unsigned char) src->buf[src->pos++];
+}
+
+static void read_source_finish(ReadSource *src) {
+    if (src->pos < src->len) {
+        lseek(src->fd, -(off_t) (src->len - src->pos), SEEK_CUR);
+    }
+}
+
+static bool is_ifs(const ReadLine *line, size_t i, const char *ifs) {
+    return !line->literal[i] && line->text[i] != '\0' && strchr(ifs, line->text[i]) != NULL;
+}
+
+static bool is_ifs_space(const ReadLine *line, size_t i, const char *ifs) {
+    return is_ifs(line, i, ifs) && isspace((unsigned char) line->text[i]);
+}
+
+// read [-r] [-p 提示] [变量名...]：从标准输入读一行，按 IFS 拆分后依次赋给各个变量，
+// 最后一个变量得到剩余的部分。没有变量名时整行赋给 REPLY。读到文件结尾时 $? 为 1
+int lsh_read(char **args) {
+    bool raw = false;
+    const char *prompt = NULL;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'r') {
+                raw = true;
+            } else if (*opt == 'p' && (opt[1] != '\0' || args[i + 1] != NULL)) {
+                prompt = opt[1] != '\0' ? opt + 1 : args[++i];
+                break;
+            } else {
+                fprintf(stderr, "read: -%c: 无效的选项\n", *opt);
+                lsh_last_status = 2;
+                return 1;
+            }
+        }
+    }
+    char **names = args + i;
+    for (int j = 0; names[j] != NULL; j++) {
+        if (!is_var_name(names[j], strlen(names[j]))) {
+            fprintf(stderr, "read: '%s' 不是有效的标识符\n", names[j]);
+            lsh_last_status = 2;
+            return 1;
+        }
+    }
+
+    FILE *in = LSH_IN;
+    if (prompt != NULL && isatty(fileno(in))) {
+        fputs(prompt, stderr);
+    }
+    ReadLine line = {0};
+    read_line_putc(&line, '\0', false); // 保证读到空行时 text 也不为 NULL
+    line.len = 0;
+    ReadSource src;
+    read_source_init(&src, in);
+    int c;
+    while ((c = read_source_getc(&src)) != EOF && c != '\n') {
+        if (c == '\\' && !raw) {
+            c = read_source_getc(&src);
+            if (c == '\n') {
+                continue; // 续行
+            }
+            if (c == EOF) {
+                break;
+            }
+            read_line_putc(&line, (char) c, true);
+        } else {
+            read_line_putc(&line, (char) c, false);
+        }
+    }
+    read_source_finish(&src);
+    lsh_last_status = (c == EOF) ? 1 : 0;
+
+    if (names[0] == NULL) {
+        var_set("REPLY", line.text);
+    } else {
+        const char *ifs = var_get("IFS");
+        if (ifs == NULL) {
+            ifs = " \t\n";
+        }
+        size_t pos = 0;
+        while (pos < line.len && is_ifs_space(&line, pos, ifs)) {
+            pos++;
+        }
+        for (int j = 0; names[j] != NULL; j++) {
+            size_t start = pos, end;
+            if (names[j + 1] == NULL) {
+                // 最后一个变量得到剩余部分，去掉末尾的 IFS 空白
+                end = line.len;
+                while (end > start && is_ifs_space(&line, end - 1, ifs)) {
+                    end--;
+                }
+                pos = line.len;
+            } else {
+                while (pos < line.len && !is_ifs(&line, pos, ifs)) {
+                    pos++;
+                }
+                end = pos;
+                while (pos < line.len && is_ifs_space(&line, pos, ifs)) {
+                    pos++;
+                }
+                if (pos < line.len && is_ifs(&line, pos, ifs)) {
+                    pos++; // 一个非空白的分隔符
+                    while (pos < line.len && is_ifs_space(&line, pos, ifs)) {
+                        pos++;
+                    }
+                }
+            }
+            char saved = line.text[end];
+            line.text[end] = '\0';
+            var_set(names[j], line.text + start);
+            line.text[end] = saved;
+        }
+    }
+    free(line.text);
+    free(line.literal);
+    return 1;
+}
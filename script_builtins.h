@@ -0,0 +1,15 @@
+//
+// Created by ysh on 24-6-27.
+//
+
+#ifndef OS_C_SCRIPT_BUILTINS_H
+#define OS_C_SCRIPT_BUILTINS_H
+
+// 脚本中频繁使用的命令，在进程内执行以免每次都 fork 外部程序
+int lsh_test(char **args);
+int lsh_true(char **args);
+int lsh_false(char **args);
+int lsh_printf(char **args);
+int lsh_read(char **args);
+
+#endif //OS_C_SCRIPT_BUILTINS_H
@@ -0,0 +1,301 @@
+//
+// Created by ysh on 24-6-26.
+//
+// 脚本编译结果的磁盘缓存。source 一个脚本时先按 (路径, mtime, 大小, 格式版本) 查找
+// ~/.cache/lsh 中的缓存文件，命中时直接 mmap 进来作为 Program 执行，完全跳过分词和编译；
+// 未命中时编译源文件并写入缓存。Program 中只有偏移量，文件内容就是各个表依次排列。
+//
+
+#define _GNU_SOURCE
+#include "script.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC 0x4348534cU // "LSHC"
+
+typedef struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;       // SCRIPT_FORMAT_VERSION
+    uint32_t instr_size;    // sizeof(Instr)，防止不同构建之间误用
+    uint32_t path_len;      // 源文件绝对路径长度，路径紧跟在文件头之后
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t code_len;
+    uint32_t num_cmds;
+    uint32_t num_words;
+    uint32_t strings_len;
+} CacheHeader;
+
+// 文件头本身按 8 字节对齐，之后每一部分都补齐到 8 字节
+_Static_assert(sizeof(CacheHeader) % 8 == 0, "CacheHeader must be 8-byte aligned");
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+// 缓存目录：$XDG_CACHE_HOME/lsh 或 $HOME/.cache/lsh，create 为 true 时逐级创建
+static bool cache_dir(char *buf, size_t size, bool create) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+    if (xdg != NULL && xdg[0] == '/') {
+        n = snprintf(buf, size, "%s/lsh", xdg);
+    } else if (home != NULL) {
+        n = snprintf(buf, size, "%s/.cache/lsh", home);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t) n >= size) {
+        return false;
+    }
+    if (create) {
+        for (char *p = buf + 1; *p != '\0'; p++) {
+            if (*p == '/') {
+                *p = '\0';
+                mkdir(buf, 0700);
+                *p = '/';
+            }
+        }
+        if (mkdir(buf, 0700) == -1 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 缓存文件名为源文件绝对路径的 FNV-1a 哈希，冲突时由文件头中的路径区分
+static bool cache_path(char *buf, size_t size, const char *real_path, bool create) {
+    char dir[PATH_MAX];
+    if (!cache_dir(dir, sizeof(dir), create)) {
+        return false;
+    }
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *s = real_path; *s; s++) {
+        h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+    }
+    int n = snprintf(buf, size, "%s/%016llx.lshc", dir, (unsigned long long) h);
+    return n > 0 && (size_t) n < size;
+}
+
+static bool header_matches(const CacheHeader *header, const struct stat *st, const char *real_path) {
+    return header->magic == CACHE_MAGIC
+           && header->version == SCRIPT_FORMAT_VERSION
+           && header->instr_size == sizeof(Instr)
+           && header->mtime_sec == st->st_mtim.tv_sec
+           && header->mtime_nsec == st->st_mtim.tv_nsec
+           && header->size == st->st_size
+           && header->path_len == strlen(real_path)
+           && memcmp(header + 1, real_path, header->path_len) == 0;
+}
+
+// 检查一条指令的操作数：命令下标、跳转目标和字符串偏移量都要落在对应的表内
+static bool instr_valid(const Program *prog, const Instr *ins) {
+    bool cmd_a = ins->a < prog->num_cmds;
+    bool target_a = ins->a < prog->code_len, target_b = ins->b < prog->code_len;
+    bool string_a = ins->a < prog->strings_len;
+    switch (ins->op) {
+        case OP_EXEC:
+        case OP_RETURN:
+            return cmd_a;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_SUBSHELL:
+        case OP_PIPE_STAGE:
+        case OP_BACKGROUND:
+            return target_a;
+        case OP_FOR_INIT:
+            return ins->b == 1 || cmd_a;
+        case OP_FOR_NEXT:
+        case OP_CASE_MATCH:
+        case OP_DEFUN:
+            return string_a && target_b;
+        case OP_CASE_WORD:
+            return string_a;
+        case OP_REDIRECT:
+            return cmd_a && target_b;
+        case OP_NOT:
+        case OP_SET_STATUS:
+        case OP_FOR_POP:
+        case OP_EXIT:
+        case OP_UNREDIRECT:
+        case OP_PIPE_WAIT:
+        case OP_END:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 检查映射进来的各个表互相引用时不会越界，缓存文件损坏时当作未命中
+static bool program_valid(const Program *prog) {
+    if ((prog->strings_len > 0 && prog->strings[prog->strings_len - 1] != '\0')
+        || prog->code_len == 0 || prog->code[prog->code_len - 1].op != OP_END) {
+        return false;
+    }
+    for (uint32_t i = 0; i < prog->num_words; i++) {
+        if (prog->words[i] >= prog->strings_len) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < prog->num_cmds; i++) {
+        if (prog->cmds[i].first > prog->num_words || prog->cmds[i].count > prog->num_words - prog->cmds[i].first) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < prog->code_len; i++) {
+        if (!instr_valid(prog, &prog->code[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 映射缓存文件，文件不存在或与源文件不一致时返回 NULL
+static Program *cache_load(const char *file, const struct stat *st, const char *real_path) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) == -1 || (size_t) cache_st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t len = cache_st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const CacheHeader *header = map;
+    size_t code_off = align8(sizeof(CacheHeader) + header->path_len);
+    size_t cmds_off = code_off + align8((size_t) header->code_len * sizeof(Instr));
+    size_t words_off = cmds_off + align8((size_t) header->num_cmds * sizeof(CommandRef));
+    size_t strings_off = words_off + align8((size_t) header->num_words * sizeof(uint32_t));
+    if (header->path_len >= PATH_MAX || strings_off + header->strings_len != len
+        || !header_matches(header, st, real_path)) {
+        munmap(map, len);
+        return NULL;
+    }
+
+    Program *prog = calloc(1, sizeof(Program));
+    prog->code = (Instr *) ((char *) map + code_off);
+    prog->code_len = header->code_len;
+    prog->cmds = (CommandRef *) ((char *) map + cmds_off);
+    prog->num_cmds = header->num_cmds;
+    prog->words = (uint32_t *) ((char *) map + words_off);
+    prog->num_words = header->num_words;
+    prog->strings = (char *) map + strings_off;
+    prog->strings_len = header->strings_len;
+    prog->refs = 1;
+    prog->mapping = map;
+    prog->mapping_len = len;
+    if (!program_valid(prog)) {
+        program_release(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+static bool write_part(FILE *out, const void *data, size_t len) {
+    static const char zeros[8];
+    return fwrite(data, 1, len, out) == len && fwrite(zeros, 1, align8(len) - len, out) == align8(len) - len;
+}
+
+// 先写到临时文件再 rename，其他 shell 不会映射到写了一半的缓存
+static void cache_store(const char *file, const Program *prog, const struct stat *st, const char *real_path) {
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int) getpid());
+    FILE *out = fopen(tmp, "we");
+    if (out == NULL) {
+        return;
+    }
+    CacheHeader header = {
+            .magic = CACHE_MAGIC,
+            .version = SCRIPT_FORMAT_VERSION,
+            .instr_size = sizeof(Instr),
+            .path_len = strlen(real_path),
+            .mtime_sec = st->st_mtim.tv_sec,
+            .mtime_nsec = st->st_mtim.tv_nsec,
+            .size = st->st_size,
+            .code_len = prog->code_len,
+            .num_cmds = prog->num_cmds,
+            .num_words = prog->num_words,
+            .strings_len = prog->strings_len,
+    };
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+              && write_part(out, real_path, header.path_len)
+              && write_part(out, prog->code, prog->code_len * sizeof(Instr))
+              && write_part(out, prog->cmds, prog->num_cmds * sizeof(CommandRef))
+              && write_part(out, prog->words, prog->num_words * sizeof(uint32_t))
+              && fwrite(prog->strings, 1, prog->strings_len, out) == prog->strings_len;
+    if (fclose(out) != 0 || !ok || rename(tmp, file) == -1) {
+        unlink(tmp);
+        return;
+    }
+    STAT_INC(script_stores);
+}
+
+static char *read_file(int fd, size_t size) {
+    char *text = malloc(size + 1);
+    size_t len = 0;
+    ssize_t n;
+    while (len < size && (n = read(fd, text + len, size - len)) > 0) {
+        len += n;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+// 加载脚本：缓存有效时映射缓存文件，否则编译源文件并更新缓存。出错时返回 NULL
+Program *script_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "lsh: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    char real_path[PATH_MAX];
+    if (fstat(fd, &st) == -1 || realpath(path, real_path) == NULL) {
+        fprintf(stderr, "lsh: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "lsh: %s: 不是普通文件\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    char file[PATH_MAX];
+    bool cacheable = cache_path(file, sizeof(file), real_path, false);
+    if (cacheable) {
+        Program *prog = cache_load(file, &st, real_path);
+        if (prog != NULL) {
+            close(fd);
+            STAT_INC(script_hits);
+            return prog;
+        }
+    }
+
+    STAT_INC(script_misses);
+    char *source = read_file(fd, st.st_size);
+    close(fd);
+    Program *prog = compile_source(source, NULL);
+    free(source);
+    if (prog != NULL && cache_path(file, sizeof(file), real_path, true)) {
+        cache_store(file, prog, &st, real_path);
+    }
+    return prog;
+}
@@ -0,0 +1,1068 @@
+//
+// Created by ysh on 24-6-28.
+//
+// sort 内置命令。每一行只记录指向数据的指针和长度：普通文件整个 mmap 进来，
+// 管道和终端的输入读到大块的 arena 中，行内容从不单独复制。记录里缓存第一个键的
+// 前 8 个字节（或整数值），大部分比较不需要访问行本身。
+// 内存中的记录用多线程归并排序；超过 -S 指定的内存预算时把排好序的一段写到临时文件，
+// 最后对所有段做 k 路归并。比较按字节序进行（相当于 LC_ALL=C）。
+//
+
+#define _GNU_SOURCE
+#include "sort.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SORT_DEFAULT_BUFFER (256UL << 20) // 默认内存预算
+#define SORT_MIN_BUFFER (1UL << 20)
+#define ARENA_BLOCK_SIZE (4UL << 20)      // 流式输入每次读入的块大小
+#define MAPPED_WINDOW (4UL << 20)         // 映射的文件每处理这么多字节检查一次内存预算
+#define MAX_MERGE_FANIN 64                // 一次归并最多同时打开的段数
+#define PARALLEL_MIN_RECORDS 32768        // 每个线程至少分到这么多条记录才值得并行
+#define MAX_SORT_THREADS 16
+#define MAX_SORT_KEYS 16
+#define SORT_OUT_BUF (256 * 1024)
+
+typedef struct SortKey {
+    int start_field, start_char; // 从 1 开始
+    int end_field, end_char;     // end_field 为 0 表示到行尾，end_char 为 0 表示到字段末尾
+    bool numeric;
+    bool reverse;
+    bool skip_blanks;
+    bool has_opts;               // 键自己带有 n r b，不继承全局选项
+} SortKey;
+
+typedef struct SortOptions {
+    SortKey keys[MAX_SORT_KEYS];
+    int num_keys;
+    bool numeric;
+    bool reverse;
+    bool unique;
+    int separator;      // -t 指定的分隔符，-1 表示空白和非空白的交界处
+    size_t buffer_size; // -S
+    const char *tmp_dir;
+    int threads;
+} SortOptions;
+
+typedef struct SortRecord {
+    const char *line;
+    uint32_t len;
+    uint32_t key_off;   // 第一个键在行中的位置
+    uint32_t key_len;
+    uint32_t num_exact; // -n 时第一个键是不超过 18 位的整数，num 就是它的精确值
+    union {
+        uint64_t prefix; // 第一个键的前 8 个字节，按大端拼成整数
+        int64_t num;
+    };
+} SortRecord;
+
+// 记录指向的内存：arena 块或映射的文件
+typedef struct OwnedRegion {
+    void *ptr;
+    size_t len;
+    bool mapped;
+} OwnedRegion;
+
+typedef struct SortState {
+    const SortOptions *opts;
+    SortRecord *recs;
+    size_t num_recs;
+    size_t cap_recs;
+    OwnedRegion *regions;
+    int num_regions;
+    int cap_regions;
+    size_t used;        // 计入内存预算的字节数
+    int *runs;          // 已经写到临时文件的有序段
+    int num_runs;
+    int cap_runs;
+    unsigned long total_lines;
+    bool failed;
+} SortState;
+
+/*
+  键的提取和比较
+*/
+
+// 第 field 个字段（从 1 开始）的开始位置。没有 -t 时字段包括它前面的空白
+static const char *field_start(const char *p, const char *end, int field, int sep) {
+    for (int f = 1; f < field && p < end; f++) {
+        if (sep >= 0) {
+            const char *q = memchr(p, sep, end - p);
+            if (q == NULL) {
+                return end;
+            }
+            p = q + 1;
+        } else {
+            while (p < end && isblank((unsigned char) *p)) {
+                p++;
+            }
+            while (p < end && !isblank((unsigned char) *p)) {
+                p++;
+            }
+        }
+    }
+    return p;
+}
+
+static const char *field_end(const char *p, const char *end, int sep) {
+    if (sep >= 0) {
+        const char *q = memchr(p, sep, end - p);
+        return q != NULL ? q : end;
+    }
+    while (p < end && isblank((unsigned char) *p)) {
+        p++;
+    }
+    while (p < end && !isblank((unsigned char) *p)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && isblank((unsigned char) *p)) {
+        p++;
+    }
+    return p;
+}
+
+static void extract_key(const SortKey *key, const char *line, size_t len, int sep, const char **key_start,
+                        size_t *key_len) {
+    const char *end = line + len;
+    const char *field = field_start(line, end, key->start_field, sep);
+    const char *fend = field_end(field, end, sep);
+    const char *s = key->skip_blanks ? skip_blanks(field, fend) : field;
+    s = (fend - s > key->start_char - 1) ? s + key->start_char - 1 : fend;
+
+    const char *e = end;
+    if (key->end_field > 0) {
+        field = field_start(line, end, key->end_field, sep);
+        fend = field_end(field, end, sep);
+        if (key->end_char == 0) {
+            e = fend;
+        } else {
+            field = key->skip_blanks ? skip_blanks(field, fend) : field;
+            e = (fend - field > key->end_char) ? field + key->end_char : fend;
+        }
+    }
+    *key_start = s;
+    *key_len = e > s ? (size_t) (e - s) : 0;
+}
+
+// 数字的各个部分：去掉前导零的整数部分和去掉末尾零的小数部分
+typedef struct NumView {
+    bool negative;
+    const char *int_digits;
+    size_t int_len;
+    const char *frac;
+    size_t frac_len;
+} NumView;
+
+// 和 sort -n 一样只认开头的空白、负号、数字和小数点，后面的内容忽略
+static void parse_number(const char *s, size_t len, NumView *v) {
+    const char *end = s + len;
+    s = skip_blanks(s, end);
+    v->negative = s < end && *s == '-';
+    if (v->negative) {
+        s++;
+    }
+    while (s < end && *s == '0') {
+        s++;
+    }
+    v->int_digits = s;
+    while (s < end && isdigit((unsigned char) *s)) {
+        s++;
+    }
+    v->int_len = s - v->int_digits;
+    v->frac = s;
+    v->frac_len = 0;
+    if (s < end && *s == '.') {
+        v->frac = ++s;
+        while (s < end && isdigit((unsigned char) *s)) {
+            s++;
+        }
+        v->frac_len = s - v->frac;
+        while (v->frac_len > 0 && v->frac[v->frac_len - 1] == '0') {
+            v->frac_len--;
+        }
+    }
+    if (v->int_len == 0 && v->frac_len == 0) {
+        v->negative = false; // -0 和 0 相等
+    }
+}
+
+// 按十进制字符串精确比较，不经过浮点数
+static int compare_numbers(const char *a, size_t alen, const char *b, size_t blen) {
+    NumView x, y;
+    parse_number(a, alen, &x);
+    parse_number(b, blen, &y);
+    if (x.negative != y.negative) {
+        return x.negative ? -1 : 1;
+    }
+    int c;
+    if (x.int_len != y.int_len) {
+        c = x.int_len < y.int_len ? -1 : 1;
+    } else if ((c = memcmp(x.int_digits, y.int_digits, x.int_len)) == 0) {
+        size_t m = x.frac_len < y.frac_len ? x.frac_len : y.frac_len;
+        c = memcmp(x.frac, y.frac, m);
+        if (c == 0) {
+            c = (x.frac_len > y.frac_len) - (x.frac_len < y.frac_len);
+        }
+    }
+    return x.negative ? -c : c;
+}
+
+static int compare_bytes(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c != 0 ? c : (alen > blen) - (alen < blen);
+}
+
+static void fill_record(SortRecord *r, const char *line, size_t len, const SortOptions *o) {
+    const SortKey *key = &o->keys[0];
+    const char *ks;
+    size_t kl;
+    extract_key(key, line, len, o->separator, &ks, &kl);
+    r->line = line;
+    r->len = (uint32_t) len;
+    r->key_off = (uint32_t) (ks - line);
+    r->key_len = (uint32_t) kl;
+    if (key->numeric) {
+        NumView v;
+        parse_number(ks, kl, &v);
+        r->num_exact = v.frac_len == 0 && v.int_len <= 18;
+        r->num = 0;
+        for (size_t i = 0; r->num_exact && i < v.int_len; i++) {
+            r->num = r->num * 10 + (v.int_digits[i] - '0');
+        }
+        if (v.negative) {
+            r->num = -r->num;
+        }
+    } else {
+        r->num_exact = 0;
+        r->prefix = 0;
+        for (size_t i = 0; i < 8; i++) {
+            r->prefix = (r->prefix << 8) | (i < kl ? (unsigned char) ks[i] : 0);
+        }
+    }
+}
+
+static int compare_records(const SortRecord *a, const SortRecord *b, const SortOptions *o) {
+    const SortKey *key = &o->keys[0];
+    const char *ka = a->line + a->key_off, *kb = b->line + b->key_off;
+    int c;
+    if (key->numeric) {
+        if (a->num_exact && b->num_exact) {
+            c = (a->num > b->num) - (a->num < b->num);
+        } else {
+            c = compare_numbers(ka, a->key_len, kb, b->key_len);
+        }
+    } else if (a->prefix != b->prefix) {
+        c = a->prefix < b->prefix ? -1 : 1;
+    } else if (a->key_len <= 8 || b->key_len <= 8) {
+        c = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+    } else {
+        c = compare_bytes(ka + 8, a->key_len - 8, kb + 8, b->key_len - 8);
+    }
+    if (c != 0) {
+        return key->reverse ? -c : c;
+    }
+
+    for (int i = 1; i < o->num_keys; i++) {
+        key = &o->keys[i];
+        size_t la, lb;
+        extract_key(key, a->line, a->len, o->separator, &ka, &la);
+        extract_key(key, b->line, b->len, o->separator, &kb, &lb);
+        c = key->numeric ? compare_numbers(ka, la, kb, lb) : compare_bytes(ka, la, kb, lb);
+        if (c != 0) {
+            return key->reverse ? -c : c;
+        }
+    }
+    if (o->unique) {
+        return 0; // -u 时所有键相等的行就是重复的行
+    }
+    // 所有键都相等时按整行的字节序比较
+    c = compare_bytes(a->line, a->len, b->line, b->len);
+    return o->reverse ? -c : c;
+}
+
+/*
+  内存中的排序
+*/
+
+// 合并两个有序序列，相等时左边的在前，保持稳定
+static void merge(const SortRecord *a, size_t na, const SortRecord *b, size_t nb, SortRecord *out,
+                  const SortOptions *o) {
+    while (na > 0 && nb > 0) {
+        if (compare_records(b, a, o) < 0) {
+            *out++ = *b++;
+            nb--;
+        } else {
+            *out++ = *a++;
+            na--;
+        }
+    }
+    memcpy(out, a, na * sizeof(SortRecord));
+    memcpy(out + na, b, nb * sizeof(SortRecord));
+}
+
+static void merge_sort(SortRecord *recs, SortRecord *tmp, size_t n, const SortOptions *o) {
+    if (n <= 16) {
+        for (size_t i = 1; i < n; i++) {
+            SortRecord r = recs[i];
+            size_t j = i;
+            while (j > 0 && compare_records(&r, &recs[j - 1], o) < 0) {
+                recs[j] = recs[j - 1];
+                j--;
+            }
+            recs[j] = r;
+        }
+        return;
+    }
+    size_t mid = n / 2;
+    merge_sort(recs, tmp, mid, o);
+    merge_sort(recs + mid, tmp + mid, n - mid, o);
+    if (compare_records(&recs[mid - 1], &recs[mid], o) <= 0) {
+        return; // 两半已经整体有序，常见于基本有序的输入
+    }
+    merge(recs, mid, recs + mid, n - mid, tmp, o);
+    memcpy(recs, tmp, n * sizeof(SortRecord));
+}
+
+typedef struct SortTask {
+    SortRecord *src;
+    SortRecord *dst;
+    size_t lo, mid, hi;
+    const SortOptions *opts;
+} SortTask;
+
+static void *sort_task(void *arg) {
+    SortTask *t = arg;
+    merge_sort(t->src + t->lo, t->dst + t->lo, t->hi - t->lo, t->opts);
+    return NULL;
+}
+
+static void *merge_task(void *arg) {
+    SortTask *t = arg;
+    merge(t->src + t->lo, t->mid - t->lo, t->src + t->mid, t->hi - t->mid, t->dst + t->lo, t->opts);
+    return NULL;
+}
+
+// 每个任务一个线程，最后一个任务在当前线程执行。工作线程屏蔽所有信号，信号仍由主线程处理
+static void run_tasks(void *(*func)(void *), SortTask *tasks, int num_tasks) {
+    pthread_t threads[MAX_SORT_THREADS];
+    bool started[MAX_SORT_THREADS] = {false};
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < num_tasks - 1; i++) {
+        started[i] = pthread_create(&threads[i], NULL, func, &tasks[i]) == 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (int i = 0; i < num_tasks - 1; i++) {
+        if (!started[i]) {
+            func(&tasks[i]); // 创建线程失败时就地执行
+        }
+    }
+    func(&tasks[num_tasks - 1]);
+    for (int i = 0; i < num_tasks - 1; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+// 排序 recs，tmp 是同样大小的临时空间。结果可能在 recs 或 tmp 中，返回所在的那一个。
+// 记录较多时分成若干份由多个线程分别排序，再逐轮两两合并，每一轮的合并也是并行的
+static SortRecord *sort_records(SortRecord *recs, SortRecord *tmp, size_t n, const SortOptions *o) {
+    int parts = 1;
+    while (parts * 2 <= o->threads && n / (parts * 2) >= PARALLEL_MIN_RECORDS) {
+        parts *= 2;
+    }
+    if (parts == 1) {
+        merge_sort(recs, tmp, n, o);
+        return recs;
+    }
+
+    size_t bounds[MAX_SORT_THREADS + 1];
+    for (int i = 0; i <= parts; i++) {
+        bounds[i] = n * i / parts;
+    }
+    SortTask tasks[MAX_SORT_THREADS];
+    for (int i = 0; i < parts; i++) {
+        tasks[i] = (SortTask) {.src = recs, .dst = tmp, .lo = bounds[i], .hi = bounds[i + 1], .opts = o};
+    }
+    run_tasks(sort_task, tasks, parts);
+
+    SortRecord *src = recs, *dst = tmp;
+    for (int width = 1; width < parts; width *= 2) {
+        int num_tasks = 0;
+        for (int i = 0; i < parts; i += 2 * width) {
+            tasks[num_tasks++] = (SortTask) {
+                    .src = src, .dst = dst, .lo = bounds[i], .mid = bounds[i + width], .hi = bounds[i + 2 * width],
+                    .opts = o,
+            };
+        }
+        run_tasks(merge_task, tasks, num_tasks);
+        SortRecord *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    return src;
+}
+
+/*
+  输出
+*/
+
+typedef struct SortWriter {
+    FILE *file; // 写到 file，为 NULL 时写到 fd
+    int fd;
+    char *buf;
+    size_t len;
+    bool error;
+} SortWriter;
+
+static void writer_flush(SortWriter *w) {
+    if (w->len == 0 || w->error) {
+        w->len = 0;
+        return;
+    }
+    if (w->file != NULL) {
+        w->error = fwrite(w->buf, 1, w->len, w->file) != w->len;
+    } else {
+        for (size_t off = 0; off < w->len;) {
+            ssize_t n = write(w->fd, w->buf + off, w->len - off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                w->error = true;
+                break;
+            }
+            off += n;
+        }
+    }
+    w->len = 0;
+}
+
+// 写出一行并补上换行符
+static void writer_put(SortWriter *w, const char *line, size_t len) {
+    if (w->len + len + 1 > SORT_OUT_BUF) {
+        writer_flush(w);
+        if (len + 1 > SORT_OUT_BUF) {
+            // 超长的行直接写出
+            w->buf[0] = '\n';
+            if (w->file != NULL) {
+                w->error = w->error || fwrite(line, 1, len, w->file) != len;
+            } else {
+                SortWriter direct = {.fd = w->fd, .buf = (char *) line, .len = len};
+                writer_flush(&direct);
+                w->error = w->error || direct.error;
+            }
+            w->len = 1;
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, line, len);
+    w->len += len;
+    w->buf[w->len++] = '\n';
+}
+
+static void output_records(const SortRecord *recs, size_t n, const SortOptions *o, SortWriter *w) {
+    const SortRecord *prev = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (o->unique && prev != NULL && compare_records(prev, &recs[i], o) == 0) {
+            continue;
+        }
+        writer_put(w, recs[i].line, recs[i].len);
+        prev = &recs[i];
+    }
+}
+
+/*
+  读入和溢出到临时文件
+*/
+
+static void own_region(SortState *st, void *ptr, size_t len, bool mapped) {
+    if (st->num_regions >= st->cap_regions) {
+        st->cap_regions = st->cap_regions ? st->cap_regions * 2 : 16;
+        st->regions = realloc(st->regions, st->cap_regions * sizeof(OwnedRegion));
+    }
+    st->regions[st->num_regions++] = (OwnedRegion) {.ptr = ptr, .len = len, .mapped = mapped};
+}
+
+static void release_regions(SortState *st) {
+    for (int i = 0; i < st->num_regions; i++) {
+        if (st->regions[i].mapped) {
+            munmap(st->regions[i].ptr, st->regions[i].len);
+        } else {
+            free(st->regions[i].ptr);
+        }
+    }
+    st->num_regions = 0;
+}
+
+static void add_lines(SortState *st, const char *p, size_t len) {
+    const char *end = p + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl != NULL ? nl : end;
+        if ((size_t) (line_end - p) > UINT32_MAX) {
+            fprintf(stderr, "sort: 行太长\n");
+            st->failed = true;
+            return;
+        }
+        if (st->num_recs >= st->cap_recs) {
+            st->cap_recs = st->cap_recs ? st->cap_recs * 2 : 4096;
+            st->recs = realloc(st->recs, st->cap_recs * sizeof(SortRecord));
+            if (st->recs == NULL) {
+                fprintf(stderr, "sort: 内存不足\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        fill_record(&st->recs[st->num_recs++], p, line_end - p, st->opts);
+        st->used += 2 * sizeof(SortRecord); // 记录本身和排序时的临时空间
+        st->total_lines++;
+        p = nl != NULL ? nl + 1 : end;
+    }
+}
+
+static int make_temp(const SortOptions *o) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/lsh-sort-XXXXXX", o->tmp_dir);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "sort: 无法创建临时文件 %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    unlink(path); // 只通过描述符访问，sort 结束或被中断时自动删除
+    return fd;
+}
+
+static void add_run(SortState *st, int fd) {
+    if (st->num_runs >= st->cap_runs) {
+        st->cap_runs = st->cap_runs ? st->cap_runs * 2 : 16;
+        st->runs = realloc(st->runs, st->cap_runs * sizeof(int));
+    }
+    st->runs[st->num_runs++] = fd;
+}
+
+// 排序内存中的记录，写成一个有序段，然后释放它们占用的内存
+static void spill(SortState *st) {
+    if (st->num_recs == 0) {
+        return;
+    }
+    int fd = make_temp(st->opts);
+    if (fd == -1) {
+        st->failed = true;
+        return;
+    }
+    SortRecord *tmp = malloc(st->num_recs * sizeof(SortRecord));
+    SortRecord *sorted = sort_records(st->recs, tmp, st->num_recs, st->opts);
+    SortWriter w = {.fd = fd, .buf = malloc(SORT_OUT_BUF)};
+    output_records(sorted, st->num_recs, st->opts, &w);
+    writer_flush(&w);
+    free(w.buf);
+    free(tmp);
+    if (w.error) {
+        fprintf(stderr, "sort: 写临时文件失败: %s\n", strerror(errno));
+        close(fd);
+        st->failed = true;
+        return;
+    }
+    add_run(st, fd);
+    STAT_INC(sort_runs);
+    release_regions(st);
+    st->num_recs = 0;
+    st->used = 0;
+}
+
+// 普通文件整个映射进来，分段加入记录，每段之后检查内存预算
+static void read_mapped(SortState *st, int fd, off_t offset, size_t size) {
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "sort: mmap: %s\n", strerror(errno));
+        st->failed = true;
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char *p = map + offset, *end = map + size;
+    while (p < end && !st->failed) {
+        const char *wend = end;
+        if ((size_t) (end - p) > MAPPED_WINDOW) {
+            const char *nl = memchr(p + MAPPED_WINDOW - 1, '\n', end - (p + MAPPED_WINDOW - 1));
+            wend = nl != NULL ? nl + 1 : end;
+        }
+        add_lines(st, p, wend - p);
+        st->used += wend - p;
+        p = wend;
+        if (st->used >= st->opts->buffer_size && p < end) {
+            // 正在读的文件还要继续使用，先不释放它的映射
+            spill(st);
+        }
+    }
+    own_region(st, map, size, true);
+}
+
+// 管道等不能映射的输入读到 arena 块中，每块末尾不完整的一行移到下一块开头
+static void read_stream(SortState *st, FILE *in) {
+    size_t cap = ARENA_BLOCK_SIZE, len = 0;
+    char *block = malloc(cap);
+    for (;;) {
+        size_t n = fread(block + len, 1, cap - len, in);
+        len += n;
+        bool eof = n == 0 || len < cap;
+        char *last_nl = eof ? NULL : memrchr(block, '\n', len);
+        if (eof) {
+            if (len > 0) {
+                add_lines(st, block, len);
+                st->used += cap;
+                own_region(st, block, cap, false);
+            } else {
+                free(block);
+            }
+            break;
+        }
+        if (last_nl == NULL) {
+            // 一行比整块还长，扩大块继续读
+            cap *= 2;
+            block = realloc(block, cap);
+            continue;
+        }
+        size_t complete = last_nl + 1 - block;
+        add_lines(st, block, complete);
+        st->used += cap;
+        size_t tail = len - complete;
+        size_t next_cap = ARENA_BLOCK_SIZE > tail * 2 ? ARENA_BLOCK_SIZE : tail * 2;
+        char *next = malloc(next_cap);
+        memcpy(next, block + complete, tail);
+        own_region(st, block, cap, false);
+        block = next;
+        cap = next_cap;
+        len = tail;
+        if (st->used >= st->opts->buffer_size) {
+            spill(st);
+        }
+        if (st->failed) {
+            free(block);
+            break;
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "sort: 读取失败: %s\n", strerror(errno));
+        st->failed = true;
+    }
+}
+
+// 输入是普通文件且 FILE 中没有缓冲的数据时直接映射，否则按流读取
+static void read_input(SortState *st, FILE *in) {
+    int fd = fileno(in);
+    struct stat sb;
+    off_t pos = ftello(in);
+    if (fd >= 0 && pos >= 0 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > pos
+        && lseek(fd, 0, SEEK_CUR) == pos) {
+        read_mapped(st, fd, pos, sb.st_size);
+        fseeko(in, 0, SEEK_END);
+    } else {
+        read_stream(st, in);
+    }
+}
+
+/*
+  k 路归并
+*/
+
+typedef struct RunCursor {
+    char *data;
+    size_t size;
+    const char *pos;
+    SortRecord rec;
+    int index;  // 段的顺序，键相等时先输出前面的段
+} RunCursor;
+
+static bool cursor_next(RunCursor *c, const SortOptions *o) {
+    const char *end = c->data + c->size;
+    if (c->pos >= end) {
+        return false;
+    }
+    const char *nl = memchr(c->pos, '\n', end - c->pos);
+    const char *line_end = nl != NULL ? nl : end;
+    fill_record(&c->rec, c->pos, line_end - c->pos, o);
+    c->pos = nl != NULL ? nl + 1 : end;
+    return true;
+}
+
+static bool cursor_less(const RunCursor *a, const RunCursor *b, const SortOptions *o) {
+    int c = compare_records(&a->rec, &b->rec, o);
+    return c < 0 || (c == 0 && a->index < b->index);
+}
+
+static void sift_down(RunCursor **heap, int n, int i, const SortOptions *o) {
+    for (;;) {
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && cursor_less(heap[l], heap[smallest], o)) {
+            smallest = l;
+        }
+        if (r < n && cursor_less(heap[r], heap[smallest], o)) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            return;
+        }
+        RunCursor *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// 归并 fds 中的有序段写到 w，用完的段关闭
+static void merge_runs(const int *fds, int n, const SortOptions *o, SortWriter *w) {
+    RunCursor *cursors = calloc(n, sizeof(RunCursor));
+    RunCursor **heap = malloc(n * sizeof(RunCursor *));
+    int heap_len = 0;
+    for (int i = 0; i < n; i++) {
+        struct stat sb;
+        cursors[i].index = i;
+        if (fstat(fds[i], &sb) == 0 && sb.st_size > 0) {
+            cursors[i].size = sb.st_size;
+            cursors[i].data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fds[i], 0);
+            if (cursors[i].data == MAP_FAILED) {
+                cursors[i].data = NULL;
+                w->error = true;
+                continue;
+            }
+            madvise(cursors[i].data, sb.st_size, MADV_SEQUENTIAL);
+            cursors[i].pos = cursors[i].data;
+            if (cursor_next(&cursors[i], o)) {
+                heap[heap_len++] = &cursors[i];
+            }
+        }
+    }
+    for (int i = heap_len / 2 - 1; i >= 0; i--) {
+        sift_down(heap, heap_len, i, o);
+    }
+
+    SortRecord prev;
+    bool has_prev = false;
+    while (heap_len > 0) {
+        RunCursor *top = heap[0];
+        if (!o->unique || !has_prev || compare_records(&prev, &top->rec, o) != 0) {
+            writer_put(w, top->rec.line, top->rec.len);
+            prev = top->rec; // 指向的映射在归并结束前一直有效
+            has_prev = true;
+        }
+        if (!cursor_next(top, o)) {
+            heap[0] = heap[--heap_len];
+        }
+        sift_down(heap, heap_len, 0, o);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (cursors[i].data != NULL) {
+            munmap(cursors[i].data, cursors[i].size);
+        }
+        close(fds[i]);
+    }
+    free(heap);
+    free(cursors);
+}
+
+// 段太多时先把前面的段归并成一个，放回原来的位置，保持段的先后顺序
+static void merge_all(SortState *st, SortWriter *out) {
+    while (st->num_runs > MAX_MERGE_FANIN && !st->failed) {
+        int fd = make_temp(st->opts);
+        if (fd == -1) {
+            st->failed = true;
+            return;
+        }
+        SortWriter w = {.fd = fd, .buf = malloc(SORT_OUT_BUF)};
+        merge_runs(st->runs, MAX_MERGE_FANIN, st->opts, &w);
+        writer_flush(&w);
+        free(w.buf);
+        if (w.error) {
+            fprintf(stderr, "sort: 写临时文件失败\n");
+            st->failed = true;
+        }
+        st->runs[0] = fd;
+        memmove(&st->runs[1], &st->runs[MAX_MERGE_FANIN], (st->num_runs - MAX_MERGE_FANIN) * sizeof(int));
+        st->num_runs -= MAX_MERGE_FANIN - 1;
+    }
+    if (!st->failed) {
+        merge_runs(st->runs, st->num_runs, st->opts, out);
+        st->num_runs = 0;
+    }
+}
+
+/*
+  命令行参数
+*/
+
+static void usage() {
+    fprintf(stderr, "Usage: sort [-nru] [-t 分隔符] [-k 字段[.字符][nrb][,字段[.字符][nrb]]] [-S 大小] [-T 目录] "
+                    "[--parallel=N] [文件...]\n");
+}
+
+// F[.C][nrb]，返回解析结束的位置，出错时返回 NULL
+static const char *parse_key_pos(const char *s, int *field, int *chr, SortKey *key) {
+    char *end;
+    long f = strtol(s, &end, 10);
+    if (end == s || f < 0) {
+        return NULL;
+    }
+    *field = (int) f;
+    *chr = 0;
+    if (*end == '.') {
+        s = end + 1;
+        long c = strtol(s, &end, 10);
+        if (end == s || c < 0) {
+            return NULL;
+        }
+        *chr = (int) c;
+    }
+    for (; *end && strchr("nrb", *end) != NULL; end++) {
+        key->has_opts = true;
+        if (*end == 'n') {
+            key->numeric = true;
+        } else if (*end == 'r') {
+            key->reverse = true;
+        } else {
+            key->skip_blanks = true;
+        }
+    }
+    return end;
+}
+
+static bool parse_key(const char *spec, SortKey *key) {
+    *key = (SortKey) {0};
+    const char *p = parse_key_pos(spec, &key->start_field, &key->start_char, key);
+    if (p == NULL || key->start_field == 0) {
+        return false;
+    }
+    if (key->start_char == 0) {
+        key->start_char = 1;
+    }
+    if (*p == ',') {
+        p = parse_key_pos(p + 1, &key->end_field, &key->end_char, key);
+        if (p == NULL || key->end_field == 0) {
+            return false;
+        }
+    }
+    return *p == '\0';
+}
+
+// -S 的大小：默认单位 KiB，可以带 b K M G T 后缀，或者是物理内存的百分比
+static bool parse_size(const char *s, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 10);
+    if (end == s || errno == ERANGE) {
+        return false;
+    }
+    unsigned long long unit = 1024;
+    switch (*end) {
+        case 'b':
+            unit = 1;
+            break;
+        case 'k':
+        case 'K':
+            break;
+        case 'M':
+            unit = 1ULL << 20;
+            break;
+        case 'G':
+            unit = 1ULL << 30;
+            break;
+        case 'T':
+            unit = 1ULL << 40;
+            break;
+        case '%':
+            unit = (unsigned long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 100;
+            break;
+        case '\0':
+            end--;
+            break;
+        default:
+            return false;
+    }
+    if (end[1] != '\0') {
+        return false;
+    }
+    *size = value * unit;
+    return true;
+}
+
+// 选项的参数可以紧跟在选项字母之后，也可以是下一个参数
+static const char *option_arg(char **args, int *i, const char *rest) {
+    if (*rest != '\0') {
+        return rest;
+    }
+    return args[*i + 1] != NULL ? args[++*i] : NULL;
+}
+
+static bool parse_options(char **args, SortOptions *o, int *first_file) {
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(args[i], "--parallel=", 11) == 0) {
+            o->threads = atoi(args[i] + 11);
+            continue;
+        }
+        for (const char *opt = args[i] + 1; *opt; opt++) {
+            const char *value;
+            switch (*opt) {
+                case 'n':
+                    o->numeric = true;
+                    continue;
+                case 'r':
+                    o->reverse = true;
+                    continue;
+                case 'u':
+                    o->unique = true;
+                    continue;
+                case 't':
+                    value = option_arg(args, &i, opt + 1);
+                    if (value == NULL || strlen(value) != 1) {
+                        fprintf(stderr, "sort: 分隔符必须是单个字符\n");
+                        return false;
+                    }
+                    o->separator = (unsigned char) value[0];
+                    break;
+                case 'k':
+                    value = option_arg(args, &i, opt + 1);
+                    if (value == NULL || o->num_keys >= MAX_SORT_KEYS || !parse_key(value, &o->keys[o->num_keys])) {
+                        fprintf(stderr, "sort: 无效的键 %s\n", value ? value : "");
+                        return false;
+                    }
+                    o->num_keys++;
+                    break;
+                case 'S':
+                    value = option_arg(args, &i, opt + 1);
+                    if (value == NULL || !parse_size(value, &o->buffer_size)) {
+                        fprintf(stderr, "sort: 无效的缓冲区大小 %s\n", value ? value : "");
+                        return false;
+                    }
+                    break;
+                case 'T':
+                    value = option_arg(args, &i, opt + 1);
+                    if (value == NULL) {
+                        usage();
+                        return false;
+                    }
+                    o->tmp_dir = value;
+                    break;
+                default:
+                    fprintf(stderr, "sort: 无效的选项 -%c\n", *opt);
+                    usage();
+                    return false;
+            }
+            break; // 带参数的选项用掉了这个参数的剩余部分
+        }
+    }
+    *first_file = i;
+    return true;
+}
+
+/*
+  内置命令入口
+*/
+
+int lsh_sort(char **args) {
+    SortOptions opts = {.separator = -1, .buffer_size = SORT_DEFAULT_BUFFER};
+    int first_file;
+    if (!parse_options(args, &opts, &first_file)) {
+        lsh_last_status = 2;
+        return 1;
+    }
+    // 没有 -k 时整行是唯一的键；键没有自己的 n r b 时使用全局选项
+    if (opts.num_keys == 0) {
+        opts.keys[0] = (SortKey) {.start_field = 1, .start_char = 1};
+        opts.num_keys = 1;
+    }
+    for (int i = 0; i < opts.num_keys; i++) {
+        if (!opts.keys[i].has_opts) {
+            opts.keys[i].numeric = opts.numeric;
+            opts.keys[i].reverse = opts.reverse;
+        }
+    }
+    if (opts.buffer_size < SORT_MIN_BUFFER) {
+        opts.buffer_size = SORT_MIN_BUFFER;
+    }
+    if (opts.tmp_dir == NULL) {
+        opts.tmp_dir = var_tmp_dir();
+    }
+    // 默认每个 CPU 一个线程，--parallel=N 可以指定线程数
+    if (opts.threads <= 0) {
+        opts.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (opts.threads < 1) {
+        opts.threads = 1;
+    } else if (opts.threads > MAX_SORT_THREADS) {
+        opts.threads = MAX_SORT_THREADS;
+    }
+
+    SortState st = {.opts = &opts};
+    if (args[first_file] == NULL) {
+        read_input(&st, LSH_IN);
+    }
+    for (int i = first_file; args[i] != NULL && !st.failed; i++) {
+        if (strcmp(args[i], "-") == 0) {
+            read_input(&st, LSH_IN);
+            continue;
+        }
+        FILE *in = fopen(args[i], "re");
+        if (in == NULL) {
+            fprintf(stderr, "sort: 无法打开 %s: %s\n", args[i], strerror(errno));
+            st.failed = true;
+            break;
+        }
+        read_input(&st, in);
+        fclose(in);
+    }
+
+    SortWriter w = {.file = LSH_OUT, .buf = malloc(SORT_OUT_BUF)};
+    if (!st.failed && st.num_runs == 0) {
+        SortRecord *tmp = malloc((st.num_recs + 1) * sizeof(SortRecord));
+        SortRecord *sorted = sort_records(st.recs, tmp, st.num_recs, &opts);
+        output_records(sorted, st.num_recs, &opts, &w);
+        free(tmp);
+    } else if (!st.failed) {
+        spill(&st);
+        merge_all(&st, &w);
+    }
+    writer_flush(&w);
+    fflush(LSH_OUT);
+    if (w.error && !st.failed) {
+        fprintf(stderr, "sort: 写入失败: %s\n", strerror(errno));
+        st.failed = true;
+    }
+    STAT_ADD(sort_lines, st.total_lines);
+
+    for (int i = 0; i < st.num_runs; i++) {
+        close(st.runs[i]);
+    }
+    release_regions(&st);
+    free(st.regions);
+    free(st.runs);
+    free(st.recs);
+    free(w.buf);
+    lsh_last_status = st.failed ? 2 : 0;
+    return 1;
+}
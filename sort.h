@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-6-28.
+//
+
+#ifndef OS_C_SORT_H
+#define OS_C_SORT_H
+
+int lsh_sort(char **args);
+
+#endif //OS_C_SORT_H
@@ -0,0 +1,456 @@
+//
+// Created by ysh on 24-6-20.
+//
+// 可选的预派生 spawn 辅助进程。
+// shell 启动时（堆还很小、readline 尚未初始化）先 fork 出一个辅助进程，
+// 之后外部命令的 argv、环境变量和文件描述符通过 Unix 套接字 (SCM_RIGHTS) 交给它，
+// 由它代为 fork + exec，这样启动外部命令的开销与 shell 自身的内存大小无关。
+// 辅助进程的子进程不是 shell 的子进程，退出状态通过套接字回传，用 lsh_waitpid 等待。
+//
+
+#define _GNU_SOURCE
+#include "spawn_helper.h"
+#include "bg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+#define HELPER_NUM_FDS 4 // 标准输入、标准输出、标准错误、当前工作目录
+
+typedef struct HelperRequest {
+    uint32_t payload_len; // 之后紧跟的字符串数据长度
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t has_path;    // 为 1 时第一个字符串是可执行文件的绝对路径
+} HelperRequest;
+
+typedef enum HelperReplyType {
+    REPLY_SPAWNED,
+    REPLY_EXIT,
+} HelperReplyType;
+
+typedef struct HelperReply {
+    int type;
+    pid_t pid;
+    int status;           // REPLY_SPAWNED 时 pid 为 -1 表示 fork 失败，否则为 exec 的 errno，0 表示成功
+} HelperReply;
+
+// shell 侧记录由辅助进程启动的子进程
+typedef struct HelperChild {
+    pid_t pid;
+    bool exited;
+    bool background;
+    int status;
+} HelperChild;
+
+static int helper_sock = -1;
+static pid_t helper_owner = -1; // 启动辅助进程的 shell 进程，只有它能使用套接字
+static HelperChild *helper_children = NULL;
+static int num_helper_children = 0;
+static int cap_helper_children = 0;
+
+static bool read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+  辅助进程
+*/
+static void helper_exec_child(char *payload, HelperRequest *req, int *fds, int err_fd) {
+    char **argv = malloc((req->argc + 1) * sizeof(char *));
+    char **envp = malloc((req->envc + 1) * sizeof(char *));
+    char *p = payload;
+    char *path = NULL;
+
+    if (req->has_path) {
+        path = p;
+        p += strlen(p) + 1;
+    }
+    for (uint32_t i = 0; i < req->argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[req->argc] = NULL;
+    for (uint32_t i = 0; i < req->envc; i++) {
+        envp[i] = p;
+        p += strlen(p) + 1;
+    }
+    envp[req->envc] = NULL;
+
+    // 恢复默认的信号处理，被忽略的信号会跨 exec 继承
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != i) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+    }
+    if (fchdir(fds[3]) == -1) {
+        perror("lsh: fchdir");
+    }
+    close(fds[3]);
+
+    if (path != NULL) {
+        execve(path, argv, envp);
+    }
+    execvpe(argv[0], argv, envp);
+    int err = errno;
+    perror("execvp");
+    write(err_fd, &err, sizeof(err));
+    _exit(127);
+}
+
+static void helper_handle_request(int sock) {
+    HelperRequest req;
+    int fds[HELPER_NUM_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+
+    ssize_t n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (n != sizeof(req)) {
+        _exit(EXIT_SUCCESS); // shell 已经退出
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        _exit(EXIT_FAILURE);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    char *payload = malloc(req.payload_len);
+    if (payload == NULL || !read_full(sock, payload, req.payload_len)) {
+        _exit(EXIT_FAILURE);
+    }
+
+    // exec 成功时写端随 O_CLOEXEC 关闭，失败时子进程写回 errno
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        err_pipe[0] = err_pipe[1] = -1;
+    }
+    HelperReply reply = {.type = REPLY_SPAWNED};
+    reply.pid = fork();
+    if (reply.pid == 0) {
+        close(sock);
+        helper_exec_child(payload, &req, fds, err_pipe[1]);
+    }
+    if (err_pipe[1] != -1) {
+        close(err_pipe[1]);
+    }
+    if (reply.pid < 0) {
+        reply.status = errno;
+    } else if (err_pipe[0] != -1) {
+        int err;
+        ssize_t n;
+        while ((n = read(err_pipe[0], &err, sizeof(err))) == -1 && errno == EINTR) {
+        }
+        reply.status = n == sizeof(err) ? err : 0;
+    }
+    if (err_pipe[0] != -1) {
+        close(err_pipe[0]);
+    }
+    for (int i = 0; i < HELPER_NUM_FDS; i++) {
+        close(fds[i]);
+    }
+    free(payload);
+    write_full(sock, &reply, sizeof(reply));
+}
+
+static void helper_main(int sock) {
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+    int sig_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    struct pollfd fds[2] = {
+            {.fd = sock, .events = POLLIN},
+            {.fd = sig_fd, .events = POLLIN},
+    };
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[0].revents) {
+            helper_handle_request(sock);
+        }
+        if (fds[1].revents) {
+            struct signalfd_siginfo info;
+            while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            HelperReply reply = {.type = REPLY_EXIT};
+            while ((reply.pid = waitpid(-1, &reply.status, WNOHANG)) > 0) {
+                write_full(sock, &reply, sizeof(reply));
+            }
+        }
+    }
+}
+
+/*
+  shell 侧
+*/
+
+// 在 shell 初始化早期调用，fork 出辅助进程
+bool spawn_helper_start() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        helper_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        return false;
+    }
+    helper_sock = sv[0];
+    helper_owner = getpid();
+    return true;
+}
+
+// fork 出的子进程（管道中的内置命令、子 shell、进程替换等）继承了套接字，
+// 但辅助进程的回复属于 shell 进程。子进程用到时关闭继承来的套接字，改为直接 fork
+static bool helper_owned() {
+    if (helper_sock != -1 && getpid() != helper_owner) {
+        close(helper_sock);
+        helper_sock = -1;
+        num_helper_children = 0;
+    }
+    return helper_sock != -1;
+}
+
+bool spawn_helper_enabled() {
+    return helper_owned();
+}
+
+int spawn_helper_fd() {
+    return helper_owned() ? helper_sock : -1;
+}
+
+static HelperChild *find_child(pid_t pid) {
+    for (int i = 0; i < num_helper_children; i++) {
+        if (helper_children[i].pid == pid) {
+            return &helper_children[i];
+        }
+    }
+    return NULL;
+}
+
+static void remove_child(HelperChild *child) {
+    *child = helper_children[--num_helper_children];
+}
+
+static void disable_helper() {
+    fprintf(stderr, "lsh: spawn 辅助进程已退出，改为直接 fork\n");
+    close(helper_sock);
+    helper_sock = -1;
+}
+
+// 处理辅助进程发来的一条消息，返回 false 表示辅助进程已不可用
+static bool handle_reply(HelperReply *reply) {
+    if (!read_full(helper_sock, reply, sizeof(*reply))) {
+        disable_helper();
+        return false;
+    }
+    if (reply->type == REPLY_EXIT) {
+        HelperChild *child = find_child(reply->pid);
+        if (child == NULL) {
+            return true;
+        }
+        if (child->background) {
+            remove_child(child);
+            background_task_done(reply->pid);
+        } else {
+            child->exited = true;
+            child->status = reply->status;
+        }
+    }
+    return true;
+}
+
+static void append_string(char **buf, size_t *len, size_t *cap, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (*len + n > *cap) {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+}
+
+// 通过辅助进程启动外部命令，返回子进程 pid，失败返回 -1。exec_ok 返回 exec 是否成功
+pid_t spawn_helper_spawn(char **args, const char *path, char **envp, int in_fd, int out_fd, bool *exec_ok) {
+    if (!helper_owned()) {
+        return -1;
+    }
+
+    HelperRequest req = {.has_path = path != NULL};
+    char *payload = NULL;
+    size_t len = 0, cap = 0;
+    if (path != NULL) {
+        append_string(&payload, &len, &cap, path);
+    }
+    for (; args[req.argc] != NULL; req.argc++) {
+        append_string(&payload, &len, &cap, args[req.argc]);
+    }
+    for (; envp != NULL && envp[req.envc] != NULL; req.envc++) {
+        append_string(&payload, &len, &cap, envp[req.envc]);
+    }
+    req.payload_len = len;
+
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fds[HELPER_NUM_FDS] = {in_fd, out_fd, STDERR_FILENO, cwd_fd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    bool sent = cwd_fd != -1 && sendmsg(helper_sock, &msg, MSG_NOSIGNAL) == sizeof(req) &&
+                write_full(helper_sock, payload, len);
+    if (cwd_fd != -1) {
+        close(cwd_fd);
+    }
+    free(payload);
+    if (!sent) {
+        disable_helper();
+        return -1;
+    }
+
+    // 等待 SPAWNED 回复，期间到达的退出消息照常处理
+    HelperReply reply;
+    do {
+        if (!handle_reply(&reply)) {
+            return -1;
+        }
+    } while (reply.type != REPLY_SPAWNED);
+
+    if (reply.pid < 0) {
+        errno = reply.status;
+        perror("fork");
+        return -1;
+    }
+    *exec_ok = reply.status == 0;
+    if (num_helper_children >= cap_helper_children) {
+        cap_helper_children = cap_helper_children ? cap_helper_children * 2 : 16;
+        helper_children = realloc(helper_children, cap_helper_children * sizeof(HelperChild));
+    }
+    helper_children[num_helper_children++] = (HelperChild) {.pid = reply.pid};
+    return reply.pid;
+}
+
+// 后台任务结束时由辅助进程消息触发完成通知，不再需要 lsh_waitpid
+void spawn_helper_mark_background(pid_t pid) {
+    if (!helper_owned()) {
+        return;
+    }
+    HelperChild *child = find_child(pid);
+    if (child == NULL) {
+        return;
+    }
+    if (child->exited) {
+        remove_child(child);
+        background_task_done(pid);
+    } else {
+        child->background = true;
+    }
+}
+
+// 非阻塞地处理辅助进程已经发来的消息
+void spawn_helper_poll() {
+    struct pollfd pfd = {.fd = helper_sock, .events = POLLIN};
+    HelperReply reply;
+    while (helper_owned() && poll(&pfd, 1, 0) > 0) {
+        if (!handle_reply(&reply)) {
+            return;
+        }
+    }
+}
+
+// 与 waitpid 相同，但也能等待由辅助进程启动的子进程
+pid_t lsh_waitpid(pid_t pid, int *status, int options) {
+    helper_owned();
+    HelperChild *child = find_child(pid);
+    if (child == NULL) {
+        return waitpid(pid, status, options);
+    }
+
+    HelperReply reply;
+    if (options & WNOHANG) {
+        spawn_helper_poll();
+    }
+    while ((child = find_child(pid)) != NULL && !child->exited) {
+        if (options & WNOHANG) {
+            return 0;
+        }
+        if (!handle_reply(&reply)) {
+            errno = ECHILD;
+            return -1;
+        }
+    }
+    if (child == NULL) {
+        errno = ECHILD;
+        return -1;
+    }
+    if (status != NULL) {
+        *status = child->status;
+    }
+    remove_child(child);
+    return pid;
+}
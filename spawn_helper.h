@@ -0,0 +1,19 @@
+//
+// Created by ysh on 24-6-20.
+//
+
+#ifndef OS_C_SPAWN_HELPER_H
+#define OS_C_SPAWN_HELPER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool spawn_helper_start();
+bool spawn_helper_enabled();
+int spawn_helper_fd();
+pid_t spawn_helper_spawn(char **args, const char *path, char **envp, int in_fd, int out_fd, bool *exec_ok);
+void spawn_helper_mark_background(pid_t pid);
+void spawn_helper_poll();
+pid_t lsh_waitpid(pid_t pid, int *status, int options);
+
+#endif //OS_C_SPAWN_HELPER_H
@@ -0,0 +1,87 @@
+//
+// Created by ysh on 24-6-18.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "stats.h"
+
+LshStats lsh_stats;
+
+typedef struct StatField {
+    const char *name;
+    unsigned long *value;
+} StatField;
+
+static StatField stat_fields[] = {
+        {"forks",            &lsh_stats.forks},
+        {"helper_spawns",    &lsh_stats.helper_spawns},
+        {"spawn_ns",         &lsh_stats.spawn_ns},
+        {"execs",            &lsh_stats.execs},
+        {"builtin_runs",     &lsh_stats.builtin_runs},
+        {"path_hits",        &lsh_stats.path_hits},
+        {"path_misses",      &lsh_stats.path_misses},
+        {"alias_expansions", &lsh_stats.alias_expansions},
+        {"cat_bytes",        &lsh_stats.cat_bytes},
+        {"grep_bytes",       &lsh_stats.grep_bytes},
+        {"bg_reaped",        &lsh_stats.bg_reaped},
+        {"history_bytes",    &lsh_stats.history_bytes},
+        {"command_substs",   &lsh_stats.command_substs},
+        {"subst_inproc",     &lsh_stats.subst_inproc},
+        {"vm_compiles",      &lsh_stats.vm_compiles},
+        {"vm_commands",      &lsh_stats.vm_commands},
+        {"script_hits",      &lsh_stats.script_hits},
+        {"script_misses",    &lsh_stats.script_misses},
+        {"script_stores",    &lsh_stats.script_stores},
+        {"sort_lines",       &lsh_stats.sort_lines},
+        {"sort_runs",        &lsh_stats.sort_runs},
+        {"wc_bytes",         &lsh_stats.wc_bytes},
+        {"tail_unread",      &lsh_stats.tail_unread},
+        {"tail_wakes",       &lsh_stats.tail_wakes},
+        {"count_lines",      &lsh_stats.count_lines},
+        {"cut_bytes",        &lsh_stats.cut_bytes},
+        {"walk_dirs",        &lsh_stats.walk_dirs},
+        {"walk_entries",     &lsh_stats.walk_entries},
+        {"walk_statx",       &lsh_stats.walk_statx},
+        {"du_hardlinks",     &lsh_stats.du_hardlinks},
+        {"cp_bytes",         &lsh_stats.cp_bytes},
+        {"cp_clones",        &lsh_stats.cp_clones},
+        {"rm_entries",       &lsh_stats.rm_entries},
+        {"sum_bytes",        &lsh_stats.sum_bytes},
+};
+
+#define NUM_STAT_FIELDS (sizeof(stat_fields) / sizeof(stat_fields[0]))
+
+void stats_print(FILE *out, bool json) {
+    if (json) {
+        fprintf(out, "{");
+        for (size_t i = 0; i < NUM_STAT_FIELDS; i++) {
+            fprintf(out, "%s\"%s\": %lu", i > 0 ? ", " : "", stat_fields[i].name,
+                    __atomic_load_n(stat_fields[i].value, __ATOMIC_RELAXED));
+        }
+        fprintf(out, "}\n");
+    } else {
+        for (size_t i = 0; i < NUM_STAT_FIELDS; i++) {
+            fprintf(out, "%-18s %lu\n", stat_fields[i].name,
+                    __atomic_load_n(stat_fields[i].value, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+void stats_reset() {
+    for (size_t i = 0; i < NUM_STAT_FIELDS; i++) {
+        __atomic_store_n(stat_fields[i].value, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// 设置了 LSH_STATS 环境变量时，在退出前把计数器输出到标准错误
+// LSH_STATS=json 输出 JSON，其他非空值输出可读格式
+void stats_dump_at_exit() {
+    char *mode = getenv("LSH_STATS");
+    if (mode == NULL || *mode == '\0') {
+        return;
+    }
+    stats_print(stderr, strcmp(mode, "json") == 0);
+}
@@ -0,0 +1,59 @@
+//
+// Created by ysh on 24-6-18.
+//
+
+#ifndef OS_C_STATS_H
+#define OS_C_STATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// shell 内部计数器，用于确认快速路径是否真的被走到
+typedef struct LshStats {
+    unsigned long forks;            // fork 次数
+    unsigned long helper_spawns;    // 通过 spawn 辅助进程启动的命令数
+    unsigned long spawn_ns;         // 父进程启动子进程花费的总时间（纳秒）
+    unsigned long execs;            // 外部命令 exec 成功的次数
+    unsigned long builtin_runs;     // 进程内执行的内置命令次数
+    unsigned long path_hits;        // PATH 缓存命中
+    unsigned long path_misses;      // PATH 缓存未命中
+    unsigned long alias_expansions; // 别名展开次数
+    unsigned long cat_bytes;        // cat 内置命令搬运的字节数
+    unsigned long grep_bytes;       // grep 内置命令扫描的字节数
+    unsigned long bg_reaped;        // 回收的后台任务数
+    unsigned long history_bytes;    // 写入历史文件的字节数
+    unsigned long command_substs;   // 命令替换次数
+    unsigned long subst_inproc;     // 在进程内执行的命令替换次数
+    unsigned long vm_compiles;      // 编译成字节码的源代码段数
+    unsigned long vm_commands;      // 字节码执行的简单命令数
+    unsigned long script_hits;      // 直接映射缓存执行的脚本数
+    unsigned long script_misses;    // 需要重新编译的脚本数
+    unsigned long script_stores;    // 写入的脚本缓存文件数
+    unsigned long sort_lines;       // sort 内置命令排序的行数
+    unsigned long sort_runs;        // sort 超出内存预算后写到临时文件的有序段数
+    unsigned long wc_bytes;         // wc 内置命令统计过的字节数
+    unsigned long tail_unread;      // tail 从末尾向前扫描时没有读取的字节数
+    unsigned long tail_wakes;       // tail -f 被 inotify 唤醒的次数
+    unsigned long count_lines;      // count 内置命令统计的行数
+    unsigned long cut_bytes;        // cut 和 fields 内置命令扫描的字节数
+    unsigned long walk_dirs;        // 并行遍历读取的目录数
+    unsigned long walk_entries;     // 并行遍历访问的目录项数
+    unsigned long walk_statx;       // 并行遍历调用 statx 的次数
+    unsigned long du_hardlinks;     // du 跳过的已统计过的硬链接和重复起点数
+    unsigned long cp_bytes;         // cp 内置命令复制的字节数
+    unsigned long cp_clones;        // cp 用 FICLONE 共享数据块的文件数
+    unsigned long rm_entries;       // rm 内置命令删除的文件和目录数
+    unsigned long sum_bytes;        // sum 内置命令计算过校验和的字节数
+} LshStats;
+
+extern LshStats lsh_stats;
+
+// 计数器可能在信号处理函数中被修改，统一使用原子操作
+#define STAT_INC(field) __atomic_add_fetch(&lsh_stats.field, 1, __ATOMIC_RELAXED)
+#define STAT_ADD(field, n) __atomic_add_fetch(&lsh_stats.field, (n), __ATOMIC_RELAXED)
+
+void stats_print(FILE *out, bool json);
+void stats_reset();
+void stats_dump_at_exit();
+
+#endif //OS_C_STATS_H
@@ -0,0 +1,332 @@
+//
+// Created by ysh on 24-7-7.
+//
+// sum 内置命令，计算或校验 crc32c、xxh64、sha256 校验和，输出格式和 sha256sum 相同。
+// 多个文件分给多个线程同时计算（普通文件整个 mmap 进来，其他的用对齐的 1MiB 缓冲区读），
+// 调用线程按参数的顺序等待每个文件的结果并输出，先算完的文件不会打乱顺序。
+// --check 读取清单逐个校验，没有用 -a 指定算法时按每行校验和的长度判断。
+//
+
+#define _GNU_SOURCE
+#include "sum.h"
+#include "checksum.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SUM_BUF_SIZE (1024 * 1024)
+#define MAX_SUM_THREADS 16
+
+typedef struct SumJob {
+    char *name;
+    ChecksumKind kind;
+    char expected[CHECKSUM_MAX_HEX + 1];    // --check：清单中的校验和
+    char hex[CHECKSUM_MAX_HEX + 1];
+    int err;
+    bool done;
+} SumJob;
+
+typedef struct SumContext {
+    SumJob *jobs;
+    size_t num_jobs;
+    size_t cap_jobs;
+    atomic_size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE *in;
+} SumContext;
+
+// fd 为 -1 时从 c->in 读，FILE 里可能已经缓冲了数据
+static int hash_stream(SumContext *c, Checksum *ck, int fd) {
+    void *buf;
+    if (posix_memalign(&buf, 4096, SUM_BUF_SIZE) != 0) {
+        return ENOMEM;
+    }
+    int err = 0;
+    unsigned long bytes = 0;
+    while (1) {
+        ssize_t n = fd == -1 ? (ssize_t) fread(buf, 1, SUM_BUF_SIZE, c->in) : read(fd, buf, SUM_BUF_SIZE);
+        if (n > 0) {
+            checksum_update(ck, buf, n);
+            bytes += n;
+        } else if (n == 0 && fd == -1 && ferror(c->in)) {
+            err = EIO;
+            break;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            err = errno;
+            break;
+        }
+    }
+    STAT_ADD(sum_bytes, bytes);
+    free(buf);
+    return err;
+}
+
+// 计算一个文件的校验和，"-" 表示标准输入。返回 errno，成功时为 0
+static int hash_file(SumContext *c, SumJob *job) {
+    Checksum ck;
+    checksum_init(&ck, job->kind);
+    int err;
+    if (strcmp(job->name, "-") == 0) {
+        err = hash_stream(c, &ck, -1);
+    } else {
+        int fd = open(job->name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return errno;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            checksum_update(&ck, map, st.st_size);
+            munmap(map, st.st_size);
+            STAT_ADD(sum_bytes, st.st_size);
+            err = 0;
+        } else {
+            err = hash_stream(c, &ck, fd);
+        }
+        close(fd);
+    }
+    if (err == 0) {
+        checksum_final(&ck, job->hex);
+    }
+    return err;
+}
+
+static void *sum_worker(void *arg) {
+    SumContext *c = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&c->next, 1)) < c->num_jobs) {
+        int err = hash_file(c, &c->jobs[i]);
+        pthread_mutex_lock(&c->lock);
+        c->jobs[i].err = err;
+        c->jobs[i].done = true;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+    return NULL;
+}
+
+static SumJob *add_job(SumContext *c, const char *name, ChecksumKind kind) {
+    if (c->num_jobs == c->cap_jobs) {
+        c->cap_jobs = c->cap_jobs == 0 ? 16 : c->cap_jobs * 2;
+        c->jobs = realloc(c->jobs, c->cap_jobs * sizeof(SumJob));
+    }
+    SumJob *job = &c->jobs[c->num_jobs++];
+    *job = (SumJob) {.name = strdup(name), .kind = kind};
+    return job;
+}
+
+/*
+  --check
+*/
+
+// 清单的一行："校验和  文件名" 或 "校验和 *文件名"
+static bool parse_manifest_line(SumContext *c, char *line, bool have_kind, ChecksumKind kind) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = '\0';
+    }
+    size_t hex_len = 0;
+    while (isxdigit((unsigned char) line[hex_len])) {
+        hex_len++;
+    }
+    if (line[hex_len] != ' ' || (line[hex_len + 1] != ' ' && line[hex_len + 1] != '*') || line[hex_len + 2] == '\0') {
+        return false;
+    }
+    if (!have_kind) {
+        bool found = false;
+        for (int k = CHECKSUM_CRC32C; k <= CHECKSUM_SHA256 && !found; k++) {
+            if (checksum_hex_len(k) == hex_len) {
+                kind = k;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    } else if (checksum_hex_len(kind) != hex_len) {
+        return false;
+    }
+    SumJob *job = add_job(c, line + hex_len + 2, kind);
+    for (size_t i = 0; i < hex_len; i++) {
+        job->expected[i] = (char) tolower((unsigned char) line[i]);
+    }
+    job->expected[hex_len] = '\0';
+    return true;
+}
+
+static bool read_manifest(SumContext *c, const char *name, bool have_kind, ChecksumKind kind, int *bad_lines) {
+    FILE *f = name == NULL || strcmp(name, "-") == 0 ? c->in : fopen(name, "re");
+    if (f == NULL) {
+        fprintf(stderr, "sum: 无法打开清单 %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int line_no = 0;
+    while (getline(&line, &cap, f) != -1) {
+        line_no++;
+        if (line[0] == '\n' || line[0] == '#') {
+            continue;
+        }
+        if (!parse_manifest_line(c, line, have_kind, kind)) {
+            fprintf(stderr, "sum: %s: 第 %d 行格式不正确\n", name ? name : "标准输入", line_no);
+            (*bad_lines)++;
+        }
+    }
+    free(line);
+    if (f != c->in) {
+        fclose(f);
+    }
+    return true;
+}
+
+/*
+  入口
+*/
+
+static void usage() {
+    fprintf(stderr, "Usage: sum [-a crc32c|xxh64|sha256] [--parallel=N] [文件...]\n"
+                    "       sum [-a 算法] [--parallel=N] --check [清单...]\n");
+}
+
+int lsh_sum(char **args) {
+    SumContext c = {.in = LSH_IN};
+    ChecksumKind kind = CHECKSUM_SHA256;
+    bool have_kind = false, check = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "--check") == 0 || strcmp(args[i], "-c") == 0) {
+            check = true;
+        } else if (strncmp(args[i], "--parallel=", 11) == 0) {
+            threads = atol(args[i] + 11);
+        } else if (strncmp(args[i], "-a", 2) == 0) {
+            const char *name = args[i][2] != '\0' ? args[i] + 2 : args[i + 1] != NULL ? args[++i] : "";
+            if (!checksum_parse_kind(name, &kind)) {
+                fprintf(stderr, "sum: 未知的算法 %s\n", name);
+                usage();
+                lsh_last_status = 1;
+                return 1;
+            }
+            have_kind = true;
+        } else {
+            fprintf(stderr, "sum: 无效的选项 %s\n", args[i]);
+            usage();
+            lsh_last_status = 1;
+            return 1;
+        }
+    }
+    if (threads < 1) {
+        usage();
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    bool failed = false;
+    int bad_lines = 0;
+    if (check) {
+        if (args[i] == NULL) {
+            failed |= !read_manifest(&c, NULL, have_kind, kind, &bad_lines);
+        }
+        for (; args[i] != NULL; i++) {
+            failed |= !read_manifest(&c, args[i], have_kind, kind, &bad_lines);
+        }
+    } else if (args[i] == NULL) {
+        add_job(&c, "-", kind);
+    } else {
+        for (; args[i] != NULL; i++) {
+            add_job(&c, args[i], kind);
+        }
+    }
+
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.cond, NULL);
+    pthread_t workers[MAX_SUM_THREADS];
+    int num_workers = 0;
+    if (c.num_jobs > 1 && threads > 1) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        while (num_workers < threads && num_workers < MAX_SUM_THREADS && (size_t) num_workers < c.num_jobs &&
+               pthread_create(&workers[num_workers], NULL, sum_worker, &c) == 0) {
+            num_workers++;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if (num_workers == 0) {
+        sum_worker(&c);
+    }
+
+    // 按顺序输出，还没算完的就等待
+    LshWriter out;
+    lsh_writer_init(&out, LSH_OUT);
+    int mismatches = 0, unreadable = 0;
+    for (size_t k = 0; k < c.num_jobs; k++) {
+        SumJob *job = &c.jobs[k];
+        pthread_mutex_lock(&c.lock);
+        while (!job->done) {
+            pthread_cond_wait(&c.cond, &c.lock);
+        }
+        pthread_mutex_unlock(&c.lock);
+        const char *name = job->name;
+        if (job->err != 0) {
+            lsh_writer_flush(&out);
+            fprintf(stderr, "sum: %s: %s\n", name, strerror(job->err));
+            if (check) {
+                lsh_writer_put(&out, name, strlen(name));
+                lsh_writer_put(&out, ": FAILED open or read\n", 22);
+            }
+            unreadable++;
+        } else if (check) {
+            bool ok = strcmp(job->hex, job->expected) == 0;
+            lsh_writer_put(&out, name, strlen(name));
+            lsh_writer_put(&out, ok ? ": OK\n" : ": FAILED\n", ok ? 5 : 9);
+            mismatches += !ok;
+        } else {
+            lsh_writer_put(&out, job->hex, strlen(job->hex));
+            lsh_writer_put(&out, "  ", 2);
+            lsh_writer_put(&out, name, strlen(name));
+            lsh_writer_putc(&out, '\n');
+        }
+        free(job->name);
+    }
+    lsh_writer_free(&out);
+    for (int k = 0; k < num_workers; k++) {
+        pthread_join(workers[k], NULL);
+    }
+    pthread_mutex_destroy(&c.lock);
+    pthread_cond_destroy(&c.cond);
+    free(c.jobs);
+
+    if (check && mismatches > 0) {
+        fprintf(stderr, "sum: 警告: %d 个校验和不匹配\n", mismatches);
+    }
+    if (check && bad_lines > 0 && c.num_jobs == 0) {
+        fprintf(stderr, "sum: 清单中没有格式正确的行\n");
+    }
+    lsh_last_status = failed || mismatches > 0 || unreadable > 0 || (check && c.num_jobs == 0) ? 1 : 0;
+    return 1;
+}
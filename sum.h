@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-7-7.
+//
+
+#ifndef OS_C_SUM_H
+#define OS_C_SUM_H
+
+int lsh_sum(char **args);
+
+#endif //OS_C_SUM_H
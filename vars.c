@@ -0,0 +1,296 @@
+//
+// Created by ysh on 24-6-24.
+//
+// shell 变量，开放寻址哈希表。导出变量的 envp 数组在导出变量变化时才重新生成，
+// 每次 exec 直接使用，同时让 environ 指向它，getenv 看到的也是 shell 中的值。
+//
+
+#include "vars.h"
+#include "path_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define VARS_INIT_SIZE 64
+
+typedef struct VarEntry {
+    char *name;
+    char *value;    // NULL 表示已 unset 或只导出未赋值
+    char *env_str;  // 导出且有值时为 "NAME=value"
+    bool exported;
+} VarEntry;
+
+__thread int lsh_last_status = 0;
+__thread const char *lsh_tmp_dir = NULL;
+extern char **environ;
+
+static VarEntry *var_table = NULL;
+static size_t var_table_size = 0;
+static size_t var_table_used = 0;
+static char **envp = NULL;
+
+static size_t hash_name(const char *s) {
+    size_t h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char) *s++;
+    }
+    return h;
+}
+
+static VarEntry *find_slot(VarEntry *table, size_t size, const char *name) {
+    size_t i = hash_name(name) & (size - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static void grow_table() {
+    size_t new_size = var_table_size ? var_table_size * 2 : VARS_INIT_SIZE;
+    VarEntry *new_table = calloc(new_size, sizeof(VarEntry));
+    if (new_table == NULL) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < var_table_size; i++) {
+        if (var_table[i].name != NULL) {
+            *find_slot(new_table, new_size, var_table[i].name) = var_table[i];
+        }
+    }
+    free(var_table);
+    var_table = new_table;
+    var_table_size = new_size;
+}
+
+static VarEntry *lookup(const char *name) {
+    if (var_table_size == 0) {
+        return NULL;
+    }
+    VarEntry *entry = find_slot(var_table, var_table_size, name);
+    return entry->name != NULL ? entry : NULL;
+}
+
+// 找到变量的表项，不存在时创建。unset 的变量保留表项，之后再赋值时复用
+static VarEntry *lookup_or_insert(const char *name) {
+    VarEntry *entry = lookup(name);
+    if (entry != NULL) {
+        return entry;
+    }
+    if ((var_table_used + 1) * 2 > var_table_size) {
+        grow_table();
+    }
+    entry = find_slot(var_table, var_table_size, name);
+    entry->name = strdup(name);
+    var_table_used++;
+    return entry;
+}
+
+// 重新生成导出变量的 envp 数组，只在导出变量发生变化时调用
+static void rebuild_envp() {
+    size_t count = 0;
+    for (size_t i = 0; i < var_table_size; i++) {
+        if (var_table[i].env_str != NULL) {
+            count++;
+        }
+    }
+    char **new_envp = malloc((count + 1) * sizeof(char *));
+    count = 0;
+    for (size_t i = 0; i < var_table_size; i++) {
+        if (var_table[i].env_str != NULL) {
+            new_envp[count++] = var_table[i].env_str;
+        }
+    }
+    new_envp[count] = NULL;
+    environ = new_envp;
+    free(envp);
+    envp = new_envp;
+}
+
+// 更新表项的 "NAME=value"，导出状态或值有变化时重新生成 envp
+static void update_env(VarEntry *entry) {
+    char *old = entry->env_str;
+    entry->env_str = NULL;
+    if (entry->exported && entry->value != NULL) {
+        size_t name_len = strlen(entry->name), value_len = strlen(entry->value);
+        entry->env_str = malloc(name_len + value_len + 2);
+        memcpy(entry->env_str, entry->name, name_len);
+        entry->env_str[name_len] = '=';
+        memcpy(entry->env_str + name_len + 1, entry->value, value_len + 1);
+    }
+    if (old != NULL || entry->env_str != NULL) {
+        rebuild_envp();
+    }
+    free(old);
+    if (strcmp(entry->name, "PATH") == 0) {
+        path_cache_clear();
+    }
+}
+
+// 从启动时的环境变量导入，全部标记为导出
+void vars_init() {
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq == NULL || !is_var_name(*env, eq - *env)) {
+            continue;
+        }
+        char *name = strndup(*env, eq - *env);
+        VarEntry *entry = lookup_or_insert(name);
+        free(name);
+        free(entry->value);
+        free(entry->env_str);
+        entry->value = strdup(eq + 1);
+        entry->env_str = strdup(*env);
+        entry->exported = true;
+    }
+    rebuild_envp();
+}
+
+const char *var_get(const char *name) {
+    VarEntry *entry = lookup(name);
+    return entry != NULL ? entry->value : NULL;
+}
+
+// 临时文件目录：工作线程中用提交任务时的 TMPDIR，主线程中直接读环境变量
+const char *var_tmp_dir() {
+    if (lsh_tmp_dir != NULL) {
+        return lsh_tmp_dir;
+    }
+    const char *dir = getenv("TMPDIR");
+    return dir != NULL ? dir : "/tmp";
+}
+
+bool var_is_exported(const char *name) {
+    VarEntry *entry = lookup(name);
+    return entry != NULL && entry->exported;
+}
+
+void var_set(const char *name, const char *value) {
+    VarEntry *entry = lookup_or_insert(name);
+    char *old = entry->value;
+    entry->value = strdup(value);
+    if (entry->exported || strcmp(name, "PATH") == 0) {
+        update_env(entry);
+    }
+    free(old);
+}
+
+void var_set_exported(const char *name, bool exported) {
+    VarEntry *entry = lookup_or_insert(name);
+    if (entry->exported != exported) {
+        entry->exported = exported;
+        update_env(entry);
+    }
+}
+
+void var_unset(const char *name) {
+    VarEntry *entry = lookup(name);
+    if (entry == NULL) {
+        return;
+    }
+    free(entry->value);
+    entry->value = NULL;
+    entry->exported = false;
+    update_env(entry);
+}
+
+// 当前导出变量的 envp，供 exec 使用
+char **var_envp() {
+    return envp;
+}
+
+static int compare_env(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+void vars_print_exported(FILE *out) {
+    size_t count = 0;
+    while (envp[count] != NULL) {
+        count++;
+    }
+    char **sorted = malloc((count + 1) * sizeof(char *));
+    memcpy(sorted, envp, (count + 1) * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), compare_env);
+    for (size_t i = 0; i < count; i++) {
+        const char *eq = strchr(sorted[i], '=');
+        fprintf(out, "export %.*s=\"%s\"\n", (int) (eq - sorted[i]), sorted[i], eq + 1);
+    }
+    free(sorted);
+}
+
+/*
+  位置参数 $1 $2 ...，每次调用函数压入一层
+*/
+
+typedef struct ArgFrame {
+    char **args;
+    int count;
+    struct ArgFrame *prev;
+} ArgFrame;
+
+static ArgFrame *arg_frames = NULL;
+
+// args 以 NULL 结尾，复制一份作为新的位置参数
+void vars_push_args(char **args) {
+    ArgFrame *frame = malloc(sizeof(ArgFrame));
+    frame->count = 0;
+    while (args[frame->count] != NULL) {
+        frame->count++;
+    }
+    frame->args = malloc((frame->count + 1) * sizeof(char *));
+    for (int i = 0; i <= frame->count; i++) {
+        frame->args[i] = args[i] ? strdup(args[i]) : NULL;
+    }
+    frame->prev = arg_frames;
+    arg_frames = frame;
+}
+
+void vars_pop_args() {
+    ArgFrame *frame = arg_frames;
+    if (frame == NULL) {
+        return;
+    }
+    arg_frames = frame->prev;
+    for (int i = 0; i < frame->count; i++) {
+        free(frame->args[i]);
+    }
+    free(frame->args);
+    free(frame);
+}
+
+// $0 是 shell 的名字，超出范围的参数为 NULL
+const char *var_arg(int n) {
+    if (n == 0) {
+        return "lsh";
+    }
+    if (arg_frames == NULL || n > arg_frames->count) {
+        return NULL;
+    }
+    return arg_frames->args[n - 1];
+}
+
+int var_arg_count() {
+    return arg_frames ? arg_frames->count : 0;
+}
+
+// name 的前 len 个字符是否为合法的变量名
+bool is_var_name(const char *name, size_t len) {
+    if (len == 0 || (!isalpha((unsigned char) name[0]) && name[0] != '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// word 是 NAME=value 形式的赋值时返回变量名长度，否则返回 0
+size_t assignment_name_len(const char *word) {
+    const char *eq = strchr(word, '=');
+    if (eq == NULL || !is_var_name(word, eq - word)) {
+        return 0;
+    }
+    return eq - word;
+}
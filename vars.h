@@ -0,0 +1,33 @@
+//
+// Created by ysh on 24-6-24.
+//
+
+#ifndef OS_C_VARS_H
+#define OS_C_VARS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// 上一条前台命令的退出状态 ($?)。每个线程一份，工作线程中的内置命令不会影响 shell 的 $?
+extern __thread int lsh_last_status;
+// 工作线程中的临时文件目录。shell 在主线程中 export 时会释放 environ，工作线程不能调用 getenv，
+// 提交任务时取好 TMPDIR 放在这里
+extern __thread const char *lsh_tmp_dir;
+
+void vars_init();
+const char *var_get(const char *name);
+const char *var_tmp_dir();
+bool var_is_exported(const char *name);
+void var_set(const char *name, const char *value);
+void var_set_exported(const char *name, bool exported);
+void var_unset(const char *name);
+char **var_envp();
+void vars_print_exported(FILE *out);
+void vars_push_args(char **args);
+void vars_pop_args();
+const char *var_arg(int n);
+int var_arg_count();
+bool is_var_name(const char *name, size_t len);
+size_t assignment_name_len(const char *word);
+
+#endif //OS_C_VARS_H
@@ -0,0 +1,511 @@
+//
+// Created by ysh on 24-6-25.
+//
+// 执行 compile.c 生成的字节码。循环体只在编译时分词一次，每次执行只对单词做展开。
+// 函数调用在 C 栈上递归执行函数体，for 循环的单词列表、复合命令的重定向
+// 都记录在当前这一层调用中，返回时统一清理。
+//
+
+#define _GNU_SOURCE
+#include "script.h"
+#include "main.h"
+#include "expand.h"
+#include "vars.h"
+#include "stats.h"
+#include "spawn_helper.h"
+#include "bg.h"
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define MAX_CALL_DEPTH 1000
+
+typedef struct Function {
+    char *name;
+    Program *prog;
+    uint32_t entry;
+} Function;
+
+// 函数表，开放寻址哈希表。每条命令执行前都会查询一次，rc 脚本中可能定义成千上万个函数
+static Function *functions = NULL;
+static size_t function_table_size = 0;
+static size_t num_functions = 0;
+static int call_depth = 0;
+static int return_depth = 0;      // 正在执行的函数和 source 脚本的层数，大于 0 时才能 return
+static int fork_return_depth = 0; // fork 出子 shell 时的 return_depth，不超过它的 return 结束子进程
+static bool in_subshell = false; // 当前进程是 ( ... ) 创建的子 shell
+
+// for 循环正在遍历的单词
+typedef struct ForIter {
+    char **words;
+    int count;
+    int pos;
+} ForIter;
+
+// 复合命令重定向前保存的标准输入输出，-1 表示没有重定向。
+// [start, end) 是复合命令的代码范围，跳出这个范围（break、continue）时要先恢复
+typedef struct SavedFds {
+    int in;
+    int out;
+    uint32_t start;
+    uint32_t end;
+} SavedFds;
+
+// 一层 vm_exec 调用的状态
+typedef struct Frame {
+    ForIter *iters;
+    int num_iters;
+    int cap_iters;
+    SavedFds *redirects;
+    int num_redirects;
+    int cap_redirects;
+    char *case_word;
+    pid_t *pipe_pids;  // 正在执行的管道中已启动的阶段
+    int num_pipe_pids;
+    int cap_pipe_pids;
+    int pipe_in;       // 下一个阶段的标准输入，-1 表示第一个阶段
+} Frame;
+
+static Function *function_slot(Function *table, size_t size, const char *name) {
+    size_t h = 5381;
+    for (const char *s = name; *s; s++) {
+        h = h * 33 + (unsigned char) *s;
+    }
+    size_t i = h & (size - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static Function *find_function(const char *name) {
+    if (num_functions == 0) {
+        return NULL;
+    }
+    Function *func = function_slot(functions, function_table_size, name);
+    return func->name != NULL ? func : NULL;
+}
+
+bool vm_is_function(const char *name) {
+    return find_function(name) != NULL;
+}
+
+static void grow_functions() {
+    size_t new_size = function_table_size ? function_table_size * 2 : 64;
+    Function *new_table = calloc(new_size, sizeof(Function));
+    for (size_t i = 0; i < function_table_size; i++) {
+        if (functions[i].name != NULL) {
+            *function_slot(new_table, new_size, functions[i].name) = functions[i];
+        }
+    }
+    free(functions);
+    functions = new_table;
+    function_table_size = new_size;
+}
+
+// 定义函数，函数所在的程序在函数被重新定义之前一直保留
+static void define_function(const char *name, Program *prog, uint32_t entry) {
+    Function *func = find_function(name);
+    if (func == NULL) {
+        if ((num_functions + 1) * 2 > function_table_size) {
+            grow_functions();
+        }
+        func = function_slot(functions, function_table_size, name);
+        func->name = strdup(name);
+        num_functions++;
+    } else {
+        program_release(func->prog);
+    }
+    program_retain(prog);
+    func->prog = prog;
+    func->entry = entry;
+}
+
+// 把命令表项转换成以 NULL 结尾的单词数组，单词直接指向字符串表
+static char **command_tokens(Program *prog, uint32_t cmd) {
+    CommandRef *ref = &prog->cmds[cmd];
+    char **tokens = malloc((ref->count + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < ref->count; i++) {
+        tokens[i] = prog->strings + prog->words[ref->first + i];
+    }
+    tokens[ref->count] = NULL;
+    return tokens;
+}
+
+static void apply_redirect(Frame *frame, Program *prog, uint32_t cmd, uint32_t start, uint32_t end) {
+    char **tokens = command_tokens(prog, cmd);
+    char **words = lsh_expand(tokens);
+    free(tokens);
+    int count = 0;
+    while (words[count] != NULL) {
+        count++;
+    }
+    char **args = malloc((count + 1) * sizeof(char *));
+    memcpy(args, words, (count + 1) * sizeof(char *));
+
+    int in_fd = 0, out_fd = 1;
+    SavedFds saved = {.in = -1, .out = -1, .start = start, .end = end};
+    if (parse_redirection(args, &in_fd, &out_fd) == -1) {
+        lsh_last_status = 1;
+    }
+    fflush(stdout);
+    if (in_fd != 0) {
+        saved.in = dup(0);
+        dup2(in_fd, 0);
+        close(in_fd);
+        __fpurge(stdin); // 丢掉 stdin 缓冲区里原来输入的内容
+    }
+    if (out_fd != 1) {
+        saved.out = dup(1);
+        dup2(out_fd, 1);
+        close(out_fd);
+    }
+    if (frame->num_redirects >= frame->cap_redirects) {
+        frame->cap_redirects = frame->cap_redirects ? frame->cap_redirects * 2 : 4;
+        frame->redirects = realloc(frame->redirects, frame->cap_redirects * sizeof(SavedFds));
+    }
+    frame->redirects[frame->num_redirects++] = saved;
+    free(args);
+    lsh_free_words(words);
+}
+
+static void undo_redirect(Frame *frame) {
+    SavedFds saved = frame->redirects[--frame->num_redirects];
+    fflush(stdout);
+    if (saved.in != -1) {
+        dup2(saved.in, 0);
+        close(saved.in);
+        __fpurge(stdin);
+    }
+    if (saved.out != -1) {
+        dup2(saved.out, 1);
+        close(saved.out);
+    }
+}
+
+// 跳转到 target 之前，恢复所有被跳出的复合命令的重定向
+static void unwind_redirects(Frame *frame, uint32_t target) {
+    while (frame->num_redirects > 0) {
+        SavedFds *top = &frame->redirects[frame->num_redirects - 1];
+        if (target >= top->start && target < top->end) {
+            break;
+        }
+        undo_redirect(frame);
+    }
+}
+
+static void pop_iter(Frame *frame) {
+    ForIter *iter = &frame->iters[--frame->num_iters];
+    lsh_free_words(iter->words);
+}
+
+static void push_iter(Frame *frame, Program *prog, Instr *ins) {
+    if (frame->num_iters >= frame->cap_iters) {
+        frame->cap_iters = frame->cap_iters ? frame->cap_iters * 2 : 4;
+        frame->iters = realloc(frame->iters, frame->cap_iters * sizeof(ForIter));
+    }
+    ForIter *iter = &frame->iters[frame->num_iters++];
+    if (ins->b == 1) {
+        // 遍历位置参数
+        int count = var_arg_count();
+        iter->words = malloc((count + 1) * sizeof(char *));
+        for (int i = 0; i < count; i++) {
+            iter->words[i] = strdup(var_arg(i + 1));
+        }
+        iter->words[count] = NULL;
+    } else {
+        char **tokens = command_tokens(prog, ins->a);
+        iter->words = lsh_expand(tokens);
+        free(tokens);
+    }
+    iter->count = 0;
+    while (iter->words[iter->count] != NULL) {
+        iter->count++;
+    }
+    iter->pos = 0;
+}
+
+static void free_frame(Frame *frame) {
+    while (frame->num_iters > 0) {
+        pop_iter(frame);
+    }
+    while (frame->num_redirects > 0) {
+        undo_redirect(frame);
+    }
+    free(frame->iters);
+    free(frame->redirects);
+    free(frame->case_word);
+    free(frame->pipe_pids);
+}
+
+// 启动管道的一个阶段。子进程返回 true，从下一条指令继续执行这一阶段的命令
+static bool start_pipe_stage(Frame *frame, bool last) {
+    int fds[2] = {-1, -1};
+    if (!last && pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    STAT_INC(forks);
+    if (pid == 0) {
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        in_subshell = true;
+        fork_return_depth = return_depth;
+        if (frame->pipe_in != -1) {
+            dup2(frame->pipe_in, 0);
+            close(frame->pipe_in);
+            __fpurge(stdin);
+        }
+        if (fds[1] != -1) {
+            dup2(fds[1], 1);
+            close(fds[1]);
+            close(fds[0]);
+        }
+        frame->num_pipe_pids = 0;
+        frame->pipe_in = -1;
+        return true;
+    }
+    if (frame->pipe_in != -1) {
+        close(frame->pipe_in);
+    }
+    if (fds[1] != -1) {
+        close(fds[1]);
+    }
+    frame->pipe_in = fds[0];
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (frame->num_pipe_pids >= frame->cap_pipe_pids) {
+        frame->cap_pipe_pids = frame->cap_pipe_pids ? frame->cap_pipe_pids * 2 : 4;
+        frame->pipe_pids = realloc(frame->pipe_pids, frame->cap_pipe_pids * sizeof(pid_t));
+    }
+    frame->pipe_pids[frame->num_pipe_pids++] = pid;
+    return false;
+}
+
+// 等待管道的所有阶段，$? 为最后一个阶段的退出状态
+static void wait_pipeline(Frame *frame) {
+    if (frame->pipe_in != -1) {
+        close(frame->pipe_in);
+        frame->pipe_in = -1;
+    }
+    lsh_last_status = 1;
+    for (int i = 0; i < frame->num_pipe_pids; i++) {
+        int status;
+        lsh_waitpid(frame->pipe_pids[i], &status, 0);
+        lsh_last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    frame->num_pipe_pids = 0;
+}
+
+// 从 pc 开始执行，直到 OP_END 或 return。返回 0 表示执行了 exit，shell 应该退出
+static int vm_exec(Program *prog, uint32_t pc) {
+    Frame frame = {.pipe_in = -1};
+    int result = 1;
+
+    for (;;) {
+        Instr *ins = &prog->code[pc++];
+        switch (ins->op) {
+            case OP_EXEC: {
+                STAT_INC(vm_commands);
+                char **tokens = command_tokens(prog, ins->a);
+                result = lsh_run_tokens(tokens);
+                free(tokens);
+                if (result == 0) {
+                    if (in_subshell) {
+                        fflush(stdout);
+                        exit(lsh_last_status); // 子 shell 中的 exit 只结束子 shell
+                    }
+                    goto done;
+                }
+                break;
+            }
+            case OP_JUMP:
+                unwind_redirects(&frame, ins->a);
+                pc = ins->a;
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (lsh_last_status != 0) {
+                    pc = ins->a;
+                }
+                break;
+            case OP_JUMP_IF_TRUE:
+                if (lsh_last_status == 0) {
+                    pc = ins->a;
+                }
+                break;
+            case OP_NOT:
+                lsh_last_status = !lsh_last_status;
+                break;
+            case OP_SET_STATUS:
+                lsh_last_status = (int) ins->a;
+                break;
+            case OP_FOR_INIT:
+                push_iter(&frame, prog, ins);
+                break;
+            case OP_FOR_NEXT: {
+                ForIter *iter = &frame.iters[frame.num_iters - 1];
+                if (iter->pos < iter->count) {
+                    var_set(prog->strings + ins->a, iter->words[iter->pos++]);
+                } else {
+                    pc = ins->b;
+                }
+                break;
+            }
+            case OP_FOR_POP:
+                pop_iter(&frame);
+                break;
+            case OP_CASE_WORD:
+                free(frame.case_word);
+                frame.case_word = lsh_expand_word(prog->strings + ins->a);
+                break;
+            case OP_CASE_MATCH: {
+                char *pattern = lsh_expand_pattern(prog->strings + ins->a);
+                if (glob_match(pattern, frame.case_word)) {
+                    pc = ins->b;
+                }
+                free(pattern);
+                break;
+            }
+            case OP_DEFUN:
+                define_function(prog->strings + ins->a, prog, ins->b);
+                break;
+            case OP_RETURN: {
+                if (return_depth == 0) {
+                    fprintf(stderr, "lsh: return: 只能从函数或者被 source 的脚本中返回\n");
+                    lsh_last_status = 2;
+                    break;
+                }
+                CommandRef *ref = &prog->cmds[ins->a];
+                if (ref->count > 0) {
+                    char *value = lsh_expand_word(prog->strings + prog->words[ref->first]);
+                    lsh_last_status = atoi(value) & 0xff;
+                    free(value);
+                }
+                if (in_subshell && return_depth == fork_return_depth) {
+                    // 子 shell 或管道阶段中的 return 不能回到父进程的函数里继续执行，带着返回值结束子进程
+                    fflush(stdout);
+                    exit(lsh_last_status);
+                }
+                goto done;
+            }
+            case OP_SUBSHELL: {
+                fflush(stdout);
+                pid_t pid = fork();
+                STAT_INC(forks);
+                if (pid == 0) {
+                    sigset_t empty_mask;
+                    sigemptyset(&empty_mask);
+                    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+                    in_subshell = true;
+                    fork_return_depth = return_depth;
+                    break; // 子进程继续执行括号中的命令
+                }
+                if (pid < 0) {
+                    perror("fork");
+                    lsh_last_status = 1;
+                } else {
+                    int status;
+                    lsh_waitpid(pid, &status, 0);
+                    lsh_last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                }
+                pc = ins->a;
+                break;
+            }
+            case OP_EXIT:
+                fflush(stdout);
+                exit(lsh_last_status);
+            case OP_REDIRECT:
+                apply_redirect(&frame, prog, ins->a, pc, ins->b);
+                break;
+            case OP_UNREDIRECT:
+                undo_redirect(&frame);
+                break;
+            case OP_PIPE_STAGE:
+                if (!start_pipe_stage(&frame, ins->b == 1)) {
+                    pc = ins->a;
+                }
+                break;
+            case OP_PIPE_WAIT:
+                wait_pipeline(&frame);
+                break;
+            case OP_BACKGROUND: {
+                fflush(stdout);
+                pid_t pid = fork();
+                STAT_INC(forks);
+                if (pid == 0) {
+                    sigset_t empty_mask;
+                    sigemptyset(&empty_mask);
+                    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+                    in_subshell = true;
+                    fork_return_depth = return_depth;
+                    break; // 子进程执行后台的复合命令
+                }
+                if (pid < 0) {
+                    perror("fork");
+                    lsh_last_status = 1;
+                } else {
+                    printf("[%d] %d\n", background_add(pid), pid);
+                    lsh_last_status = 0;
+                }
+                pc = ins->a;
+                break;
+            }
+            case OP_END:
+            default:
+                goto done;
+        }
+    }
+
+done:
+    free_frame(&frame);
+    return result;
+}
+
+// 执行编译好的程序，返回 0 表示 shell 应该退出
+int vm_run(Program *prog) {
+    return vm_exec(prog, 0);
+}
+
+// 执行 source 的脚本，脚本顶层的 return 结束这个脚本
+int vm_run_sourced(Program *prog) {
+    return_depth++;
+    int result = vm_exec(prog, 0);
+    return_depth--;
+    return result;
+}
+
+// 调用 shell 函数，args[0] 是函数名，其余是位置参数
+int vm_call_function(char **args) {
+    Function *func = find_function(args[0]);
+    if (func == NULL) {
+        return 1;
+    }
+    if (call_depth >= MAX_CALL_DEPTH) {
+        fprintf(stderr, "lsh: %s: 超出最大函数嵌套层数 (%d)\n", args[0], MAX_CALL_DEPTH);
+        lsh_last_status = 1;
+        return 1;
+    }
+    // 执行期间函数可能被重新定义，先持有程序的引用
+    Program *prog = func->prog;
+    program_retain(prog);
+    vars_push_args(args + 1);
+    call_depth++;
+    return_depth++;
+    lsh_last_status = 0;
+    int result = vm_exec(prog, func->entry);
+    return_depth--;
+    call_depth--;
+    vars_pop_args();
+    program_release(prog);
+    return result;
+}
@@ -0,0 +1,370 @@
+//
+// Created by ysh on 24-7-3.
+//
+// 并行目录遍历，find 和 du 共用。每个工作线程有自己的任务队列，新发现的子目录放进自己队列的尾部，
+// 自己从尾部取（深度优先，目录项还在缓存里），空闲的线程从别的队列头部偷（通常是更大的子树）。
+// 子目录用 openat 相对于父目录的 fd 打开，不用每次从头解析路径；父目录的 fd 在所有子目录都完成后关闭。
+// 每个目录记着还没完成的子目录数，最后一个子目录完成时由那个线程把总和加到父目录上，自底向上汇总不需要全局锁。
+//
+
+#define _GNU_SOURCE
+#include "walk.h"
+#include "dir_reader.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAX_WALK_THREADS 64
+
+struct WalkDir {
+    WalkDir *parent;
+    char *name;                     // 相对于父目录的名字，起点是给出的路径
+    char *path;                     // 开始处理时生成
+    int depth;
+    int fd;
+    atomic_int fd_refs;             // 自己读完之前加上还没完成的子目录数，减到 0 时关闭 fd
+    atomic_long pending;            // 自己读完之前加上还没完成的子目录数，减到 0 时这个目录完成
+    atomic_ullong total;
+};
+
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    WalkDir **items;                // 环形队列，容量是 2 的幂
+    size_t head;
+    size_t tail;
+    size_t cap;
+} WorkQueue;
+
+typedef struct Walker {
+    const WalkOps *ops;
+    WorkQueue queues[MAX_WALK_THREADS];
+    int num_workers;
+    atomic_long active;             // 已放入队列但还没处理完的目录数
+    atomic_long queued;             // 所有队列中的目录数
+    atomic_int sleepers;
+    bool closed;                    // 所有起点都已遍历完，工作线程退出
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond;
+} Walker;
+
+typedef struct Worker {
+    Walker *walker;
+    int id;
+    char *path;                     // 拼接目录项路径的缓冲区
+    size_t cap_path;
+} Worker;
+
+int walk_default_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (n < 2) {
+        n = 2;
+    }
+    return n > 32 ? 32 : (int) n;
+}
+
+static unsigned char mode_to_type(unsigned int mode) {
+    switch (mode & S_IFMT) {
+        case S_IFDIR: return DT_DIR;
+        case S_IFREG: return DT_REG;
+        case S_IFLNK: return DT_LNK;
+        case S_IFIFO: return DT_FIFO;
+        case S_IFSOCK: return DT_SOCK;
+        case S_IFBLK: return DT_BLK;
+        case S_IFCHR: return DT_CHR;
+        default: return DT_UNKNOWN;
+    }
+}
+
+// 文件系统没有在目录项里给出类型时只取类型
+static unsigned char lookup_type(int dir_fd, const char *name) {
+    struct statx stx;
+    STAT_INC(walk_statx);
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) != 0) {
+        return DT_UNKNOWN;
+    }
+    return mode_to_type(stx.stx_mode);
+}
+
+/*
+  任务队列
+*/
+
+static void queue_push(Walker *w, int id, WalkDir *dir) {
+    WorkQueue *q = &w->queues[id];
+    atomic_fetch_add(&w->active, 1);
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == q->cap) {
+        size_t cap = q->cap == 0 ? 256 : q->cap * 2;
+        WalkDir **items = malloc(cap * sizeof(WalkDir *));
+        for (size_t i = q->head; i < q->tail; i++) {
+            items[i - q->head] = q->items[i & (q->cap - 1)];
+        }
+        free(q->items);
+        q->items = items;
+        q->tail -= q->head;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->items[q->tail++ & (q->cap - 1)] = dir;
+    pthread_mutex_unlock(&q->lock);
+    atomic_fetch_add(&w->queued, 1);
+    // 先增加 queued 再看 sleepers，和等待的一方正好相反，两边至少有一边能看到对方
+    if (atomic_load(&w->sleepers) > 0) {
+        pthread_mutex_lock(&w->sleep_lock);
+        pthread_cond_signal(&w->sleep_cond);
+        pthread_mutex_unlock(&w->sleep_lock);
+    }
+}
+
+// 自己的队列从尾部取，别人的从头部偷
+static WalkDir *queue_take(Walker *w, int id, bool steal) {
+    WorkQueue *q = &w->queues[id];
+    WalkDir *dir = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        dir = steal ? q->items[q->head++ & (q->cap - 1)] : q->items[--q->tail & (q->cap - 1)];
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (dir != NULL) {
+        atomic_fetch_sub(&w->queued, 1);
+    }
+    return dir;
+}
+
+static WalkDir *find_work(Walker *w, int id) {
+    WalkDir *dir = queue_take(w, id, false);
+    for (int i = 1; dir == NULL && i < w->num_workers && atomic_load(&w->queued) > 0; i++) {
+        dir = queue_take(w, (id + i) % w->num_workers, true);
+    }
+    return dir;
+}
+
+/*
+  遍历
+*/
+
+static WalkDir *new_dir(WalkDir *parent, const char *name, int depth, unsigned long long value) {
+    WalkDir *dir = malloc(sizeof(WalkDir));
+    dir->parent = parent;
+    dir->name = strdup(name);
+    dir->path = NULL;
+    dir->depth = depth;
+    dir->fd = -1;
+    atomic_init(&dir->fd_refs, 1);
+    atomic_init(&dir->pending, 1);
+    atomic_init(&dir->total, value);
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->fd_refs, 1);
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    return dir;
+}
+
+static void release_fd(WalkDir *dir) {
+    if (atomic_fetch_sub(&dir->fd_refs, 1) == 1 && dir->fd != -1) {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+}
+
+// 目录自己或者一个子目录完成；全部完成时报告总和并沿着父目录向上传递
+static void finish_dir(Worker *self, WalkDir *dir) {
+    const WalkOps *ops = self->walker->ops;
+    while (dir != NULL && atomic_fetch_sub(&dir->pending, 1) == 1) {
+        WalkDir *parent = dir->parent;
+        unsigned long long total = atomic_load(&dir->total);
+        if (ops->dir_done != NULL) {
+            WalkEntry entry = {
+                    .path = dir->path, .name = dir->name, .dir_fd = parent != NULL ? parent->fd : AT_FDCWD,
+                    .type = DT_DIR, .depth = dir->depth,
+            };
+            ops->dir_done(ops->ctx, self->id, &entry, total);
+        }
+        if (parent != NULL) {
+            atomic_fetch_add(&parent->total, total);
+            release_fd(parent);
+        }
+        free(dir->name);
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static const char *join_path(Worker *self, const char *dir, size_t dir_len, const char *name) {
+    size_t name_len = strlen(name);
+    if (dir_len + name_len + 2 > self->cap_path) {
+        self->cap_path = (dir_len + name_len + 2) * 2;
+        self->path = realloc(self->path, self->cap_path);
+    }
+    memcpy(self->path, dir, dir_len);
+    size_t n = dir_len;
+    if (n > 0 && self->path[n - 1] != '/') {
+        self->path[n++] = '/';
+    }
+    memcpy(self->path + n, name, name_len + 1);
+    return self->path;
+}
+
+static void process_dir(Worker *self, WalkDir *dir) {
+    Walker *w = self->walker;
+    const WalkOps *ops = w->ops;
+    WalkDir *parent = dir->parent;
+    DirReader reader;
+    bool opened = dir_reader_open(&reader, parent != NULL ? parent->fd : AT_FDCWD, dir->name);
+    int err = errno;
+    if (parent != NULL) {
+        dir->path = strdup(join_path(self, parent->path, strlen(parent->path), dir->name));
+    } else {
+        dir->path = strdup(dir->name);
+    }
+    if (!opened) {
+        ops->error(ops->ctx, dir->path, err);
+    } else {
+        STAT_INC(walk_dirs);
+        dir->fd = reader.fd;
+        size_t dir_len = strlen(dir->path);
+        unsigned long entries = 0;
+        unsigned long long sum = 0;
+        DirEntry e;
+        while (dir_reader_next(&reader, &e)) {
+            entries++;
+            WalkEntry entry = {
+                    .path = join_path(self, dir->path, dir_len, e.name), .name = e.name, .dir_fd = dir->fd,
+                    .type = e.type, .depth = dir->depth + 1,
+            };
+            if (entry.type == DT_UNKNOWN) {
+                entry.type = lookup_type(dir->fd, e.name);
+            }
+            if (ops->visit(ops->ctx, self->id, &entry) && entry.type == DT_DIR) {
+                queue_push(w, self->id, new_dir(dir, e.name, entry.depth, entry.value));
+            } else {
+                sum += entry.value;
+            }
+        }
+        STAT_ADD(walk_entries, entries);
+        atomic_fetch_add(&dir->total, sum);
+        reader.fd = -1; // fd 留给子目录打开时使用
+        dir_reader_close(&reader);
+    }
+    release_fd(dir);
+    finish_dir(self, dir);
+}
+
+// 调用线程作为 0 号线程参与，当前起点遍历完（until_idle）就返回；其他线程一直运行到 walk_tree 结束
+static void run_worker(Worker *self, bool until_idle) {
+    Walker *w = self->walker;
+    while (1) {
+        WalkDir *dir = find_work(w, self->id);
+        if (dir != NULL) {
+            process_dir(self, dir);
+            if (atomic_fetch_sub(&w->active, 1) == 1) {
+                pthread_mutex_lock(&w->sleep_lock);
+                pthread_cond_broadcast(&w->sleep_cond);
+                pthread_mutex_unlock(&w->sleep_lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&w->sleep_lock);
+        atomic_fetch_add(&w->sleepers, 1);
+        bool done = until_idle ? atomic_load(&w->active) == 0 : w->closed;
+        if (!done && atomic_load(&w->queued) == 0) {
+            pthread_cond_wait(&w->sleep_cond, &w->sleep_lock);
+        }
+        atomic_fetch_sub(&w->sleepers, 1);
+        pthread_mutex_unlock(&w->sleep_lock);
+        if (done) {
+            break;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    run_worker(arg, false);
+    return NULL;
+}
+
+// 起点本身在调用线程中访问，是目录时放进 0 号线程的队列
+static void visit_root(Worker *self, const char *root) {
+    Walker *w = self->walker;
+    const WalkOps *ops = w->ops;
+    struct statx stx;
+    STAT_INC(walk_statx);
+    if (statx(AT_FDCWD, root, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) != 0) {
+        ops->error(ops->ctx, root, errno);
+        return;
+    }
+    WalkEntry entry = {.path = root, .name = root, .dir_fd = AT_FDCWD, .type = mode_to_type(stx.stx_mode)};
+    if (!ops->visit(ops->ctx, self->id, &entry)) {
+        return;
+    }
+    if (entry.type == DT_DIR) {
+        queue_push(w, self->id, new_dir(NULL, root, 0, entry.value));
+    } else if (ops->dir_done != NULL) {
+        // 起点是文件时也报告一次，du 需要输出它的大小
+        ops->dir_done(ops->ctx, self->id, &entry, entry.value);
+    }
+}
+
+void walk_tree(char **roots, int num_roots, const WalkOps *ops) {
+    Walker *w = calloc(1, sizeof(Walker));
+    w->ops = ops;
+    w->num_workers = ops->threads < 1 ? 1 : ops->threads > MAX_WALK_THREADS ? MAX_WALK_THREADS : ops->threads;
+    pthread_mutex_init(&w->sleep_lock, NULL);
+    pthread_cond_init(&w->sleep_cond, NULL);
+    Worker workers[MAX_WALK_THREADS];
+    for (int i = 0; i < w->num_workers; i++) {
+        pthread_mutex_init(&w->queues[i].lock, NULL);
+        workers[i] = (Worker) {.walker = w, .id = i};
+    }
+
+    // 起点逐个遍历完再开始下一个，du 的硬链接和 GNU du 一样算在前面的起点里。
+    // 线程在遇到第一个目录时才创建，之后一直复用
+    pthread_t threads[MAX_WALK_THREADS];
+    bool started[MAX_WALK_THREADS] = {false};
+    bool pool_running = false;
+    for (int r = 0; r < num_roots; r++) {
+        visit_root(&workers[0], roots[r]);
+        if (atomic_load(&w->active) == 0) {
+            continue;
+        }
+        if (!pool_running) {
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            for (int i = 1; i < w->num_workers; i++) {
+                started[i] = pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0;
+            }
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            pool_running = true;
+        }
+        run_worker(&workers[0], true); // 创建失败的线程不影响结果，它的编号只是不再使用
+    }
+    pthread_mutex_lock(&w->sleep_lock);
+    w->closed = true;
+    pthread_cond_broadcast(&w->sleep_cond);
+    pthread_mutex_unlock(&w->sleep_lock);
+    for (int i = 1; i < w->num_workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (int i = 0; i < w->num_workers; i++) {
+        pthread_mutex_destroy(&w->queues[i].lock);
+        free(w->queues[i].items);
+        free(workers[i].path);
+    }
+    pthread_mutex_destroy(&w->sleep_lock);
+    pthread_cond_destroy(&w->sleep_cond);
+    free(w);
+}
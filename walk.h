@@ -0,0 +1,39 @@
+//
+// Created by ysh on 24-7-3.
+//
+
+#ifndef OS_C_WALK_H
+#define OS_C_WALK_H
+
+#include <stdbool.h>
+
+typedef struct WalkDir WalkDir;
+
+typedef struct WalkEntry {
+    const char *path;           // 从起点开始的完整路径
+    const char *name;           // 相对于 dir_fd 的名字
+    int dir_fd;                 // 所在目录，起点本身为 AT_FDCWD
+    unsigned char type;         // DT_DIR、DT_REG 等，不会是 DT_UNKNOWN
+    int depth;                  // 起点为 0
+    unsigned long long value;   // visit 填写：进入的目录以它为初值，其他目录项累加到所在目录
+} WalkEntry;
+
+typedef struct WalkOps {
+    void *ctx;
+    int threads;
+    // 每个目录项（包括起点）调用一次，返回 true 时进入这个目录。在工作线程中并发调用，
+    // worker 是 0 到 threads - 1 的线程编号
+    bool (*visit)(void *ctx, int worker, WalkEntry *entry);
+    // 目录连同所有子目录都处理完后调用，total 是这个目录下所有 value 之和，之后会累加到上一级目录。
+    // 这时 dir->dir_fd 仍然是打开的，可以相对于它删除这个目录。起点不是目录时，visit 返回 true 后也调用一次。可以为 NULL
+    void (*dir_done)(void *ctx, int worker, const WalkEntry *dir, unsigned long long total);
+    // 起点不存在或者目录打不开
+    void (*error)(void *ctx, const char *path, int err);
+} WalkOps;
+
+// 并行遍历 roots 中的每个起点（不跟随符号链接），返回时所有回调都已结束
+void walk_tree(char **roots, int num_roots, const WalkOps *ops);
+// 默认的工作线程数，遍历主要在等待 I/O，比 CPU 数多一些
+int walk_default_threads();
+
+#endif //OS_C_WALK_H
@@ -0,0 +1,451 @@
+//
+// Created by ysh on 24-6-29.
+//
+// wc 内置命令。普通文件 mmap 进来，按块交给多个线程统计，每块的结果再按顺序合并；
+// 管道等输入用大缓冲区读取。换行、单词开头和 UTF-8 字符都用 SSE2 一次比较 16 个字节，
+// 只统计 -l 时走单独的换行计数循环。没有 SSE2 的平台使用逐字节的实现。
+//
+
+#define _GNU_SOURCE
+#include "wc.h"
+#include "lsh_io.h"
+#include "vars.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WC_CHUNK_SIZE (64UL << 20) // 大文件按这个大小切块并行统计
+#define WC_READ_SIZE (1 << 20)
+#define MAX_WC_THREADS 16
+
+typedef struct WcCounts {
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long chars;
+    unsigned long long bytes;
+} WcCounts;
+
+typedef struct WcFlags {
+    bool lines;
+    bool words;
+    bool chars;
+    bool bytes;
+} WcFlags;
+
+// 一段数据的统计结果。单词可能跨越两段，合并时根据边界两侧的状态修正
+typedef struct WcResult {
+    WcCounts counts;
+    bool starts_in_word; // 第一个字节不是空白
+    bool ends_in_word;   // 最后一个字节不是空白
+} WcResult;
+
+static bool is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// 逐字节统计，用于没有 SSE2 的平台和块末尾不足 16 字节的部分
+static void count_scalar(const unsigned char *p, size_t n, bool *in_word, WcCounts *c) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char b = p[i];
+        c->lines += b == '\n';
+        c->chars += (b & 0xC0) != 0x80; // 不是 UTF-8 的后续字节
+        bool space = is_space(b);
+        c->words += !space && !*in_word;
+        *in_word = !space;
+    }
+}
+
+#ifdef __SSE2__
+
+// 只数换行。每个字节的比较结果 (0 或 -1) 累加到字节计数器里，溢出之前用 sad 归约
+static unsigned long long count_newlines(const unsigned char *p, size_t n) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long long count = 0;
+    size_t i = 0;
+    while (n - i >= 64) {
+        __m128i acc = zero;
+        // 每轮每个字节计数器最多加 4，63 轮之后必须归约
+        for (int round = 0; round < 63 && n - i >= 64; round++, i += 64) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), newline));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 16)), newline));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 32)), newline));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 48)), newline));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += (unsigned) _mm_cvtsi128_si32(sums) + (unsigned) _mm_extract_epi16(sums, 4);
+    }
+    for (; i < n; i++) {
+        count += p[i] == '\n';
+    }
+    return count;
+}
+
+// 同时统计换行、单词开头和字符。空白的位掩码左移一位就是“前一个字节是空白”
+static void count_block(const unsigned char *p, size_t n, const WcFlags *f, bool *in_word, WcCounts *c) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i cont_limit = _mm_set1_epi8((char) 0xC0);
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        if (f->lines) {
+            c->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+        }
+        if (f->words) {
+            // \t..\r：减去 '\t' 之后无符号不大于 4
+            __m128i t = _mm_sub_epi8(v, tab);
+            __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(t, four), t);
+            unsigned spaces = _mm_movemask_epi8(_mm_or_si128(ctrl, _mm_cmpeq_epi8(v, space)));
+            unsigned prev_space = ((spaces << 1) | !*in_word) & 0xFFFF;
+            c->words += __builtin_popcount(~spaces & prev_space & 0xFFFF);
+            *in_word = !(spaces & 0x8000);
+        }
+        if (f->chars) {
+            // 0x80..0xBF 作为有符号数小于 (char) 0xC0，是 UTF-8 的后续字节
+            c->chars += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, cont_limit)));
+        }
+    }
+    count_scalar(p + i, n - i, in_word, c);
+}
+
+#else
+
+static unsigned long long count_newlines(const unsigned char *p, size_t n) {
+    unsigned long long count = 0;
+    for (const unsigned char *end = p + n; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        count++;
+    }
+    return count;
+}
+
+static void count_block(const unsigned char *p, size_t n, const WcFlags *f, bool *in_word, WcCounts *c) {
+    count_scalar(p, n, in_word, c);
+}
+
+#endif
+
+static void count_data(const unsigned char *p, size_t n, const WcFlags *f, bool *in_word, WcCounts *c) {
+    if (f->words || f->chars) {
+        count_block(p, n, f, in_word, c);
+    } else if (f->lines) {
+        c->lines += count_newlines(p, n);
+    }
+    c->bytes += n;
+}
+
+static void count_chunk(const unsigned char *p, size_t n, const WcFlags *f, WcResult *r) {
+    bool in_word = false;
+    memset(r, 0, sizeof(*r));
+    count_data(p, n, f, &in_word, &r->counts);
+    r->starts_in_word = n > 0 && !is_space(p[0]);
+    r->ends_in_word = in_word;
+}
+
+// 把紧跟在 acc 之后的一段结果合并进来
+static void merge_result(WcResult *acc, const WcResult *next, bool first) {
+    if (!first && acc->ends_in_word && next->starts_in_word) {
+        acc->counts.words--; // 同一个单词被两段各算了一次
+    }
+    if (first) {
+        acc->starts_in_word = next->starts_in_word;
+    }
+    acc->counts.lines += next->counts.lines;
+    acc->counts.words += next->counts.words;
+    acc->counts.chars += next->counts.chars;
+    acc->counts.bytes += next->counts.bytes;
+    acc->ends_in_word = next->counts.bytes > 0 ? next->ends_in_word : acc->ends_in_word;
+}
+
+/*
+  输入
+*/
+
+typedef struct WcInput {
+    const char *name;    // NULL 表示标准输入
+    unsigned char *map;  // 映射的普通文件，从统计开始的位置算起
+    void *map_base;
+    size_t map_len;
+    size_t size;
+    WcCounts counts;
+    bool failed;
+    bool is_regular;
+} WcInput;
+
+typedef struct WcTask {
+    WcInput *input;
+    size_t offset;
+    size_t len;
+    WcResult result;
+} WcTask;
+
+typedef struct WcPool {
+    WcTask *tasks;
+    int num_tasks;
+    int next;       // 下一个待领取的任务，原子递增
+    const WcFlags *flags;
+} WcPool;
+
+static void *wc_worker(void *arg) {
+    WcPool *pool = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_tasks) {
+        WcTask *t = &pool->tasks[i];
+        count_chunk(t->input->map + t->offset, t->len, pool->flags, &t->result);
+    }
+    return NULL;
+}
+
+// 读取不能映射的输入
+static void count_stream(WcInput *in, FILE *file, const WcFlags *f) {
+    unsigned char *buf = malloc(WC_READ_SIZE);
+    bool in_word = false;
+    size_t n;
+    while ((n = fread(buf, 1, WC_READ_SIZE, file)) > 0) {
+        count_data(buf, n, f, &in_word, &in->counts);
+    }
+    if (ferror(file)) {
+        fprintf(stderr, "wc: %s: %s\n", in->name ? in->name : "标准输入", strerror(errno));
+        in->failed = true;
+    }
+    free(buf);
+}
+
+// 准备一个输入：普通文件映射进来留给线程统计，只要字节数时直接用文件大小，其他输入当场读完
+static void open_input(WcInput *in, const WcFlags *f) {
+    FILE *file = in->name == NULL ? LSH_IN : fopen(in->name, "re");
+    if (file == NULL) {
+        fprintf(stderr, "wc: %s: %s\n", in->name, strerror(errno));
+        in->failed = true;
+        return;
+    }
+    struct stat sb;
+    int fd = fileno(file);
+    off_t pos = ftello(file);
+    // FILE 中没有缓冲的数据时才能绕过它直接映射
+    bool mapped = false;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && pos >= 0 && sb.st_size >= pos && lseek(fd, 0, SEEK_CUR) == pos) {
+        in->is_regular = true;
+        in->size = sb.st_size - pos;
+        if (f->bytes && !f->lines && !f->words && !f->chars && in->size > 0) {
+            in->counts.bytes = in->size;
+            mapped = true;
+        } else if (in->size > 0) {
+            void *base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base != MAP_FAILED) {
+                madvise(base, sb.st_size, MADV_SEQUENTIAL);
+                in->map_base = base;
+                in->map_len = sb.st_size;
+                in->map = (unsigned char *) base + pos; // 统计从当前位置开始
+                mapped = true;
+            }
+        }
+        if (mapped) {
+            fseeko(file, 0, SEEK_END);
+        }
+    } else if (S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "wc: %s: 是一个目录\n", in->name ? in->name : "标准输入");
+        in->failed = true;
+    }
+    // 长度为 0 的普通文件（比如 /proc 下的文件）也要真的读一遍
+    if (!mapped && !in->failed) {
+        count_stream(in, file, f);
+    }
+    if (in->name != NULL) {
+        fclose(file);
+    }
+}
+
+// 所有映射的文件切块后交给线程池，各文件的结果按块的顺序合并
+static void count_mapped(WcInput *inputs, int num_inputs, const WcFlags *f) {
+    int num_tasks = 0, cap_tasks = 16;
+    WcTask *tasks = malloc(cap_tasks * sizeof(WcTask));
+    for (int i = 0; i < num_inputs; i++) {
+        for (size_t off = 0; inputs[i].map != NULL && off < inputs[i].size; off += WC_CHUNK_SIZE) {
+            if (num_tasks >= cap_tasks) {
+                cap_tasks *= 2;
+                tasks = realloc(tasks, cap_tasks * sizeof(WcTask));
+            }
+            size_t len = inputs[i].size - off < WC_CHUNK_SIZE ? inputs[i].size - off : WC_CHUNK_SIZE;
+            tasks[num_tasks++] = (WcTask) {.input = &inputs[i], .offset = off, .len = len};
+        }
+    }
+
+    WcPool pool = {.tasks = tasks, .num_tasks = num_tasks, .flags = f};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (int) (cpus < num_tasks ? cpus : num_tasks);
+    if (num_threads > MAX_WC_THREADS) {
+        num_threads = MAX_WC_THREADS;
+    }
+    pthread_t threads[MAX_WC_THREADS];
+    int started = 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, wc_worker, &pool) == 0) {
+            started++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    wc_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    WcResult acc = {0};
+    for (int i = 0; i < num_tasks; i++) {
+        bool first = i == 0 || tasks[i - 1].input != tasks[i].input;
+        if (first) {
+            acc = (WcResult) {0};
+        }
+        merge_result(&acc, &tasks[i].result, first);
+        if (i == num_tasks - 1 || tasks[i + 1].input != tasks[i].input) {
+            tasks[i].input->counts = acc.counts;
+        }
+    }
+    free(tasks);
+}
+
+/*
+  输出
+*/
+
+static int num_digits(unsigned long long n) {
+    int digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+static void print_counts(FILE *out, const WcCounts *c, const WcFlags *f, int width, const char *name) {
+    const char *sep = "";
+    if (f->lines) {
+        fprintf(out, "%*llu", width, c->lines);
+        sep = " ";
+    }
+    if (f->words) {
+        fprintf(out, "%s%*llu", sep, width, c->words);
+        sep = " ";
+    }
+    if (f->chars) {
+        fprintf(out, "%s%*llu", sep, width, c->chars);
+        sep = " ";
+    }
+    if (f->bytes) {
+        fprintf(out, "%s%*llu", sep, width, c->bytes);
+    }
+    if (name != NULL) {
+        fprintf(out, " %s", name);
+    }
+    fputc('\n', out);
+}
+
+// wc [-lwcm] [文件...]：没有选项时相当于 -lwc，-m 按 UTF-8 统计字符
+int lsh_wc(char **args) {
+    WcFlags f = {0};
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'l') {
+                f.lines = true;
+            } else if (*opt == 'w') {
+                f.words = true;
+            } else if (*opt == 'c') {
+                f.bytes = true;
+            } else if (*opt == 'm') {
+                f.chars = true;
+            } else {
+                fprintf(stderr, "wc: 无效的选项 -%c\n", *opt);
+                fprintf(stderr, "Usage: wc [-lwcm] [文件...]\n");
+                lsh_last_status = 1;
+                return 1;
+            }
+        }
+    }
+    if (!f.lines && !f.words && !f.chars && !f.bytes) {
+        f.lines = f.words = f.bytes = true;
+    }
+
+    int num_inputs = 0;
+    while (args[i + num_inputs] != NULL) {
+        num_inputs++;
+    }
+    bool from_stdin = num_inputs == 0;
+    WcInput *inputs = calloc(from_stdin ? 1 : num_inputs, sizeof(WcInput));
+    for (int j = 0; j < num_inputs; j++) {
+        inputs[j].name = args[i + j];
+    }
+    if (from_stdin) {
+        num_inputs = 1;
+    }
+    for (int j = 0; j < num_inputs; j++) {
+        if (inputs[j].name != NULL && strcmp(inputs[j].name, "-") == 0) {
+            inputs[j].name = NULL;
+            open_input(&inputs[j], &f);
+            inputs[j].name = "-";
+        } else {
+            open_input(&inputs[j], &f);
+        }
+    }
+    count_mapped(inputs, num_inputs, &f);
+
+    // 和 GNU wc 一样：只输出一个数字时不对齐；输入都是普通文件时宽度取决于总字节数，否则为 7
+    WcCounts total = {0};
+    bool all_regular = true;
+    unsigned long long total_size = 0;
+    for (int j = 0; j < num_inputs; j++) {
+        total.lines += inputs[j].counts.lines;
+        total.words += inputs[j].counts.words;
+        total.chars += inputs[j].counts.chars;
+        total.bytes += inputs[j].counts.bytes;
+        total_size += inputs[j].size;
+        all_regular = all_regular && (inputs[j].is_regular || inputs[j].failed);
+    }
+    int num_fields = f.lines + f.words + f.chars + f.bytes;
+    int width = (num_fields == 1 && num_inputs == 1) ? 1 : all_regular ? num_digits(total_size) : 7;
+
+    FILE *out = LSH_OUT;
+    bool failed = false;
+    for (int j = 0; j < num_inputs; j++) {
+        if (inputs[j].failed) {
+            failed = true;
+        } else {
+            print_counts(out, &inputs[j].counts, &f, width, inputs[j].name);
+        }
+    }
+    if (num_inputs > 1) {
+        print_counts(out, &total, &f, width, "total");
+    }
+    STAT_ADD(wc_bytes, total.bytes);
+
+    for (int j = 0; j < num_inputs; j++) {
+        if (inputs[j].map_base != NULL) {
+            munmap(inputs[j].map_base, inputs[j].map_len);
+        }
+    }
+    free(inputs);
+    lsh_last_status = failed ? 1 : 0;
+    return 1;
+}
@@ -0,0 +1,10 @@
+//
+// Created by ysh on 24-6-29.
+//
+
+#ifndef OS_C_WC_H
+#define OS_C_WC_H
+
+int lsh_wc(char **args);
+
+#endif //OS_C_WC_H